@@ -0,0 +1,332 @@
+/*
+ * bench.c
+ *
+ *  Host throughput benchmark for the SLCAN codec, line parser (fed from RAM
+ *  and straight from a USB packet), byte rings, the CAN filter bank
+ *  allocator and the change-only cache lookup.
+ *
+ *  Build and run with:  pio run -e native -t exec
+ */
+#define _POSIX_C_SOURCE 199309L
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "slcan.h"
+#include "ring.h"
+#include "spsc.h"
+#include "filter.h"
+#include "binary.h"
+#include "busload.h"
+#include "change.h"
+
+#define BENCH_ITERATIONS 2000000UL
+#define BENCH_MIX_MAX 32U
+#define BENCH_LINE_MAX 32U
+
+typedef struct
+{
+    const char *name;
+    uint8_t count;
+    slcan_message_t message[BENCH_MIX_MAX];
+    uint8_t line[BENCH_MIX_MAX][BENCH_LINE_MAX];
+    uint8_t length[BENCH_MIX_MAX];
+} bench_mix_t;
+
+/* keeps the optimiser from discarding the measured work */
+volatile uint32_t bench_sink;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void mix_add(bench_mix_t *mix, uint32_t flags, uint8_t dlc)
+{
+    slcan_message_t *message = &mix->message[mix->count];
+
+    message->can_id = flags | (((flags & CAN_XTD_FRAME) ? 0x1ABCDEF0U : 0x5A5U) + mix->count);
+    message->can_dlc = dlc;
+    for (uint8_t i = 0; i < CAN_LEN_MAX; i++)
+        message->data[i] = (uint8_t)(0x11U * (i + 1U) + mix->count);
+
+    encode_message(message, mix->line[mix->count], &mix->length[mix->count]);
+    mix->count++;
+}
+
+static void mix_build(bench_mix_t *mix, const char *name, const uint32_t *flags, uint8_t nflags,
+                      uint8_t dlc_min, uint8_t dlc_max)
+{
+    memset(mix, 0, sizeof(*mix));
+    mix->name = name;
+    for (uint8_t f = 0; f < nflags; f++)
+        for (uint8_t dlc = dlc_min; dlc <= dlc_max; dlc++)
+            mix_add(mix, flags[f], dlc);
+}
+
+static void report(const char *bench, const char *mix, unsigned long frames, uint64_t ns)
+{
+    double per_frame = (double)ns / (double)frames;
+
+    printf("%-14s %-10s %10lu %10.1f %12.0f\n", bench, mix, frames, per_frame, 1e9 / per_frame);
+}
+
+static void bench_encode(const bench_mix_t *mix)
+{
+    uint8_t buffer[BENCH_LINE_MAX];
+    uint8_t nbytes;
+    uint64_t start = now_ns();
+
+    for (unsigned long n = 0; n < BENCH_ITERATIONS; n++)
+    {
+        encode_message(&mix->message[n % mix->count], buffer, &nbytes);
+        bench_sink += nbytes;
+    }
+    report("encode_message", mix->name, BENCH_ITERATIONS, now_ns() - start);
+}
+
+/* binary record + COBS, the B1 alternative to encode_message */
+static void bench_binary(const bench_mix_t *mix)
+{
+    uint8_t record[SLCAN_BIN_RECORD_MAX];
+    uint8_t buffer[SLCAN_BIN_FRAME_MAX];
+    uint64_t start = now_ns();
+
+    for (unsigned long n = 0; n < BENCH_ITERATIONS; n++)
+    {
+        uint8_t size = binary_pack(&mix->message[n % mix->count], NULL, record);
+        bench_sink += cobs_encode(record, size, buffer);
+    }
+    report("binary_pack", mix->name, BENCH_ITERATIONS, now_ns() - start);
+}
+
+/* exact frame length for the bus load, run by the CAN interrupt per frame */
+static void bench_frame_bits(const bench_mix_t *mix)
+{
+    uint64_t start = now_ns();
+
+    for (unsigned long n = 0; n < BENCH_ITERATIONS; n++)
+    {
+        const slcan_message_t *message = &mix->message[n % mix->count];
+
+        bench_sink += can_frame_bits(message->can_id, message->can_dlc, message->data);
+    }
+    report("frame_bits", mix->name, BENCH_ITERATIONS, now_ns() - start);
+}
+
+static void bench_decode(const bench_mix_t *mix)
+{
+    slcan_message_t message;
+    uint64_t start = now_ns();
+
+    for (unsigned long n = 0; n < BENCH_ITERATIONS; n++)
+    {
+        uint8_t k = (uint8_t)(n % mix->count);
+
+        message.can_id = 0;
+        bench_sink += decode_message(&message, mix->line[k], mix->length[k]);
+        bench_sink += message.can_id;
+    }
+    report("decode_message", mix->name, BENCH_ITERATIONS, now_ns() - start);
+}
+
+static void bench_slcan_decode(const bench_mix_t *mix)
+{
+    uint8_t line[BENCH_LINE_MAX];
+    uint8_t out[64];
+    uint64_t start = now_ns();
+
+    for (unsigned long n = 0; n < BENCH_ITERATIONS; n++)
+    {
+        uint8_t k = (uint8_t)(n % mix->count);
+        uint8_t size = mix->length[k];
+        uint8_t outSize = 0;
+
+        /* slcan_decode works in place on the USB packet buffer */
+        memcpy(line, mix->line[k], size);
+        slcan_decode(line, &size, out, &outSize);
+        bench_sink += outSize;
+    }
+    report("slcan_decode", mix->name, BENCH_ITERATIONS, now_ns() - start);
+}
+
+static void bench_slcan_receive(const bench_mix_t *mix)
+{
+    static uint8_t stream[BENCH_MIX_MAX * BENCH_LINE_MAX];
+    uint16_t size = 0;
+    unsigned long frames = 0;
+    uint64_t start;
+
+    /* back-to-back commands, cut into 64-byte USB packets regardless of line ends */
+    for (uint8_t k = 0; k < mix->count; k++)
+    {
+        memcpy(&stream[size], mix->line[k], mix->length[k]);
+        size += mix->length[k];
+    }
+
+    start = now_ns();
+    while (frames < BENCH_ITERATIONS)
+    {
+        for (uint16_t offset = 0; offset < size; offset += 64u)
+        {
+            uint16_t chunk = (uint16_t)(size - offset);
+            slcan_receive(&stream[offset], (chunk < 64u) ? chunk : 64u);
+        }
+        frames += mix->count;
+    }
+    report("slcan_receive", mix->name, frames, now_ns() - start);
+}
+
+static void bench_slcan_packet(const bench_mix_t *mix)
+{
+    /* the USB packet memory is read in 16-bit words */
+    static uint16_t stream[(BENCH_MIX_MAX * BENCH_LINE_MAX) / 2U];
+    uint16_t size = 0;
+    unsigned long frames = 0;
+    uint64_t start;
+
+    /* the same packets as bench_slcan_receive, parsed where they are */
+    for (uint8_t k = 0; k < mix->count; k++)
+    {
+        memcpy((uint8_t *)stream + size, mix->line[k], mix->length[k]);
+        size += mix->length[k];
+    }
+
+    start = now_ns();
+    while (frames < BENCH_ITERATIONS)
+    {
+        for (uint16_t offset = 0; offset < size; offset += 64u)
+        {
+            uint16_t chunk = (uint16_t)(size - offset);
+            slcan_receive_packet(&stream[offset / 2U], (chunk < 64u) ? chunk : 64u);
+        }
+        frames += mix->count;
+    }
+    report("slcan_packet", mix->name, frames, now_ns() - start);
+}
+
+static void bench_ring(const bench_mix_t *mix)
+{
+    static uint8_t storage[256];
+    struct ring ring;
+    uint8_t buffer[BENCH_LINE_MAX];
+    uint64_t start;
+
+    ring_init(&ring, storage, sizeof(storage));
+    start = now_ns();
+    for (unsigned long n = 0; n < BENCH_ITERATIONS; n++)
+    {
+        uint8_t k = (uint8_t)(n % mix->count);
+
+        bench_sink += (uint32_t)ring_write(&ring, (uint8_t *)mix->line[k], mix->length[k]);
+        bench_sink += (uint32_t)ring_read(&ring, buffer, mix->length[k]);
+    }
+    report("ring_wr+rd", mix->name, BENCH_ITERATIONS, now_ns() - start);
+}
+
+static void bench_spsc(const bench_mix_t *mix)
+{
+    static uint8_t storage[256];
+    struct spsc spsc;
+    uint8_t buffer[BENCH_LINE_MAX];
+    uint64_t start;
+
+    spsc_init(&spsc, storage, sizeof(storage));
+    start = now_ns();
+    for (unsigned long n = 0; n < BENCH_ITERATIONS; n++)
+    {
+        uint8_t k = (uint8_t)(n % mix->count);
+
+        bench_sink += spsc_write(&spsc, mix->line[k], mix->length[k]);
+        bench_sink += spsc_read(&spsc, buffer, mix->length[k]);
+    }
+    report("spsc_wr+rd", mix->name, BENCH_ITERATIONS, now_ns() - start);
+}
+
+/* ID lists of growing size, the longer ones only fit after merging */
+static void bench_filter(const char *name, uint32_t flags, uint32_t mask, uint8_t count)
+{
+    can_filter_entry_t list[CAN_FILTER_LIST_MAX];
+    can_filter_bank_t banks[CAN_FILTER_BANKS];
+    unsigned long runs = BENCH_ITERATIONS / 100u;
+    uint64_t start;
+
+    for (uint8_t i = 0; i < count; i++)
+    {
+        list[i].id = flags | (0x100u + 7u * i);
+        list[i].mask = mask;
+    }
+
+    start = now_ns();
+    for (unsigned long n = 0; n < runs; n++)
+        bench_sink += can_filter_allocate(list, count, banks, CAN_FILTER_BANKS);
+    report("filter_alloc", name, runs, now_ns() - start);
+}
+
+/* one frame per identifier in turn, the payload changing every 'every'
+ * rounds; more identifiers than the cache holds cost evictions */
+static void bench_change(const char *name, uint16_t ids, uint8_t every)
+{
+    uint8_t data[CAN_LEN_MAX] = {0x55, 0xAA, 0x55, 0xAA, 0x55, 0xAA, 0x55, 0xAA};
+    can_change_stats_t stats;
+    uint64_t start;
+
+    can_change_setup(true, 0);
+    start = now_ns();
+    for (unsigned long n = 0; n < BENCH_ITERATIONS; n++)
+    {
+        uint32_t round = (uint32_t)(n / ids);
+
+        data[0] = (uint8_t)(round / every);
+        bench_sink += can_change_pass(0x100u + (uint32_t)(n % ids), 8, data, (uint32_t)n);
+    }
+    report("change_pass", name, BENCH_ITERATIONS, now_ns() - start);
+    can_change_stats(&stats);
+    bench_sink += stats.evictions;
+}
+
+int main(void)
+{
+    static const uint32_t std[] = {CAN_STD_FRAME};
+    static const uint32_t xtd[] = {CAN_XTD_FRAME};
+    static const uint32_t rtr[] = {CAN_RTR_FRAME, CAN_RTR_FRAME | CAN_XTD_FRAME};
+    static const uint32_t all[] = {CAN_STD_FRAME, CAN_XTD_FRAME, CAN_RTR_FRAME, CAN_RTR_FRAME | CAN_XTD_FRAME};
+    static const uint32_t data[] = {CAN_STD_FRAME, CAN_XTD_FRAME};
+    static const char *dlc_names[CAN_DLC_MAX + 1] = {
+        "dlc0", "dlc1", "dlc2", "dlc3", "dlc4", "dlc5", "dlc6", "dlc7", "dlc8"};
+    static bench_mix_t mixes[4 + CAN_DLC_MAX + 1];
+
+    mix_build(&mixes[0], "std", std, 1, 0, CAN_DLC_MAX);
+    mix_build(&mixes[1], "ext", xtd, 1, 0, CAN_DLC_MAX);
+    mix_build(&mixes[2], "rtr", rtr, 2, 0, CAN_DLC_MAX);
+    mix_build(&mixes[3], "mixed", all, 4, 0, CAN_DLC_MAX);
+    for (uint8_t dlc = 0; dlc <= CAN_DLC_MAX; dlc++)
+        mix_build(&mixes[4 + dlc], dlc_names[dlc], data, 2, dlc, dlc);
+
+    printf("%-14s %-10s %10s %10s %12s\n", "benchmark", "mix", "frames", "ns/frame", "frames/s");
+    for (unsigned i = 0; i < sizeof(mixes) / sizeof(mixes[0]); i++)
+    {
+        bench_encode(&mixes[i]);
+        bench_binary(&mixes[i]);
+        bench_frame_bits(&mixes[i]);
+        bench_decode(&mixes[i]);
+        bench_slcan_decode(&mixes[i]);
+        bench_slcan_receive(&mixes[i]);
+        bench_slcan_packet(&mixes[i]);
+        bench_ring(&mixes[i]);
+        bench_spsc(&mixes[i]);
+    }
+    bench_filter("std8", CAN_STD_FRAME, CAN_STD_MASK, 8);
+    bench_filter("std32", CAN_STD_FRAME, CAN_STD_MASK, 32);
+    bench_filter("ext32", CAN_XTD_FRAME, CAN_XTD_MASK, 32);
+    bench_filter("mask32", CAN_XTD_FRAME, 0x1FFFFF00u, 32);
+    bench_change("ids32", 32, 10);
+    bench_change("ids64", 64, 10);
+    bench_change("ids128", 128, 10);
+    return EXIT_SUCCESS;
+}
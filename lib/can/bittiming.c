@@ -0,0 +1,167 @@
+/*
+ * bittiming.c
+ *
+ * Bit timing of the bxCAN peripheral: the BTR values of the standard SLCAN
+ * rates, worked out by the compiler, and a search for arbitrary rates. Like
+ * filter.c it only computes register values, can.c programs them.
+ */
+#include "slcan.h"
+#include "bittiming.h"
+
+/* TS1 + TS2 + the sync segment, in time quanta */
+#define TQ_MIN 8u
+#define TQ_MAX 25u
+#define TS1_MAX 16u
+#define TS2_MAX 8u
+
+/* time quanta before the sample point (sync segment included) */
+#define BT_SAMPLE(ntq, sp) ((((ntq) * (sp)) + 500u) / 1000u)
+#define BT_TS1(ntq, sp) (BT_SAMPLE(ntq, sp) - 1u)
+#define BT_TS2(ntq, sp) ((ntq) - BT_SAMPLE(ntq, sp))
+
+#define BT_BTR(brp, ntq, sp) ((((BT_TS2(ntq, sp)) - 1u) << 20) | \
+							  (((BT_TS1(ntq, sp)) - 1u) << 16) | \
+							  ((brp) - 1u))
+
+#define BT_VALID(brp, ntq, sp) ((BT_TS1(ntq, sp) >= 1u) && (BT_TS1(ntq, sp) <= TS1_MAX) && \
+								(BT_TS2(ntq, sp) >= 1u) && (BT_TS2(ntq, sp) <= TS2_MAX))
+
+/* sample point per rate, all CAN_SAMPLE_POINT unless overridden */
+#ifndef CAN_SAMPLE_POINT_10K
+#define CAN_SAMPLE_POINT_10K CAN_SAMPLE_POINT
+#endif
+#ifndef CAN_SAMPLE_POINT_20K
+#define CAN_SAMPLE_POINT_20K CAN_SAMPLE_POINT
+#endif
+#ifndef CAN_SAMPLE_POINT_50K
+#define CAN_SAMPLE_POINT_50K CAN_SAMPLE_POINT
+#endif
+#ifndef CAN_SAMPLE_POINT_100K
+#define CAN_SAMPLE_POINT_100K CAN_SAMPLE_POINT
+#endif
+#ifndef CAN_SAMPLE_POINT_125K
+#define CAN_SAMPLE_POINT_125K CAN_SAMPLE_POINT
+#endif
+#ifndef CAN_SAMPLE_POINT_250K
+#define CAN_SAMPLE_POINT_250K CAN_SAMPLE_POINT
+#endif
+#ifndef CAN_SAMPLE_POINT_500K
+#define CAN_SAMPLE_POINT_500K CAN_SAMPLE_POINT
+#endif
+#ifndef CAN_SAMPLE_POINT_800K
+#define CAN_SAMPLE_POINT_800K CAN_SAMPLE_POINT
+#endif
+#ifndef CAN_SAMPLE_POINT_1000K
+#define CAN_SAMPLE_POINT_1000K CAN_SAMPLE_POINT
+#endif
+
+/* prescaler x time quanta = CAN_CLOCK_HZ / bitrate, 16 quanta where possible */
+#define BT_10K 300u, 16u, CAN_SAMPLE_POINT_10K
+#define BT_20K 150u, 16u, CAN_SAMPLE_POINT_20K
+#define BT_50K 60u, 16u, CAN_SAMPLE_POINT_50K
+#define BT_100K 30u, 16u, CAN_SAMPLE_POINT_100K
+#define BT_125K 24u, 16u, CAN_SAMPLE_POINT_125K
+#define BT_250K 12u, 16u, CAN_SAMPLE_POINT_250K
+#define BT_500K 6u, 16u, CAN_SAMPLE_POINT_500K
+#define BT_800K 4u, 15u, CAN_SAMPLE_POINT_800K
+#define BT_1000K 3u, 16u, CAN_SAMPLE_POINT_1000K
+
+#define BT_EXPAND(x) x
+#define BT_CHECK(rate) _Static_assert(BT_EXPAND(BT_VALID(rate)), "sample point out of range for " #rate)
+BT_CHECK(BT_10K);
+BT_CHECK(BT_20K);
+BT_CHECK(BT_50K);
+BT_CHECK(BT_100K);
+BT_CHECK(BT_125K);
+BT_CHECK(BT_250K);
+BT_CHECK(BT_500K);
+BT_CHECK(BT_800K);
+BT_CHECK(BT_1000K);
+
+#define BT_TABLE_ENTRY(rate) BT_EXPAND(BT_BTR(rate))
+
+const uint32_t can_btr_table[CAN_1000K + 1u] = {
+	[CAN_10K] = BT_TABLE_ENTRY(BT_10K),
+	[CAN_20K] = BT_TABLE_ENTRY(BT_20K),
+	[CAN_50K] = BT_TABLE_ENTRY(BT_50K),
+	[CAN_100K] = BT_TABLE_ENTRY(BT_100K),
+	[CAN_125K] = BT_TABLE_ENTRY(BT_125K),
+	[CAN_250K] = BT_TABLE_ENTRY(BT_250K),
+	[CAN_500K] = BT_TABLE_ENTRY(BT_500K),
+	[CAN_800K] = BT_TABLE_ENTRY(BT_800K),
+	[CAN_1000K] = BT_TABLE_ENTRY(BT_1000K),
+};
+
+// SJA1000 BTR0/BTR1 as used by the 'sxxyy' command, based on the 16 MHz
+// clock of the Lawicel adapters: a quantum of 2 * (BRP + 1) / 16 MHz takes
+// 6 * (BRP + 1) cycles at 48 MHz, the segment fields have the same encoding.
+// The triple sampling bit has no bxCAN equivalent.
+uint32_t can_btr_from_sja1000(uint8_t btr0, uint8_t btr1)
+{
+	uint32_t sjw = (btr0 >> 6) & 0x3u;
+	uint32_t brp = 6u * ((btr0 & 0x3Fu) + 1u);
+	uint32_t ts2 = (btr1 >> 4) & 0x7u;
+	uint32_t ts1 = btr1 & 0xFu;
+
+	return (sjw << 24) | (ts2 << 20) | (ts1 << 16) | (brp - 1u);
+}
+
+// Search for the prescaler/quanta split closest to the requested rate, then
+// to the requested sample point (per mille). Longer bits are preferred when
+// both match equally, they give a finer sample point and more SJW headroom.
+bool can_btr_calc(uint32_t bitrate, uint16_t sample_point, uint32_t *btr)
+{
+	uint32_t best_rate_err = UINT32_MAX;
+	uint32_t best_sp_err = UINT32_MAX;
+	bool found = false;
+
+	if ((bitrate == 0u) || (sample_point == 0u) || (sample_point >= 1000u))
+		return false;
+
+	for (uint32_t ntq = TQ_MAX; ntq >= TQ_MIN; ntq--)
+	{
+		uint32_t brp = (CAN_CLOCK_HZ + (bitrate * ntq) / 2u) / (bitrate * ntq);
+		uint32_t sample = BT_SAMPLE(ntq, sample_point);
+
+		// at the ends of the prescaler range the nearest one may still be
+		// within 1%, the check below decides
+		if (brp == 0u)
+			brp = 1u;
+		if (brp > 1024u)
+			brp = 1024u;
+
+		// keep both segments in range, moving the sample point if needed
+		if (sample < 2u)
+			sample = 2u;
+		if (sample > TS1_MAX + 1u)
+			sample = TS1_MAX + 1u;
+		if (ntq - sample > TS2_MAX)
+			sample = ntq - TS2_MAX;
+		if (sample >= ntq)
+			sample = ntq - 1u;
+
+		uint32_t actual = CAN_CLOCK_HZ / (brp * ntq);
+		uint32_t rate_err = (actual > bitrate) ? (actual - bitrate) : (bitrate - actual);
+		uint32_t sp = (1000u * sample) / ntq;
+		uint32_t sp_err = (sp > sample_point) ? (sp - sample_point) : (sample_point - sp);
+
+		if ((rate_err < best_rate_err) || ((rate_err == best_rate_err) && (sp_err < best_sp_err)))
+		{
+			best_rate_err = rate_err;
+			best_sp_err = sp_err;
+			*btr = ((ntq - sample - 1u) << 20) | ((sample - 2u) << 16) | (brp - 1u);
+			found = true;
+		}
+	}
+
+	// more than 1% off is no use on a real bus
+	return found && (best_rate_err * 100u <= bitrate);
+}
+
+// Bit rate a BTR value gives, inverse of the above
+uint32_t can_btr_bitrate(uint32_t btr)
+{
+	uint32_t ntq = 3u + CAN_BTR_FIELD_TS1(btr) + CAN_BTR_FIELD_TS2(btr);
+
+	return CAN_CLOCK_HZ / ((CAN_BTR_FIELD_BRP(btr) + 1u) * ntq);
+}
@@ -0,0 +1,26 @@
+#ifndef BITTIMING_H
+#define BITTIMING_H
+#include "stdint.h"
+#include "stdbool.h"
+
+#define CAN_CLOCK_HZ 48000000u /* bxCAN kernel clock (APB) */
+
+#ifndef CAN_SAMPLE_POINT
+#define CAN_SAMPLE_POINT 875u /* per mille, used by the S0..S8 table */
+#endif
+
+/* bxCAN CAN_BTR fields */
+#define CAN_BTR_FIELD_SJW(btr) (((btr) >> 24) & 0x3u)
+#define CAN_BTR_FIELD_TS2(btr) (((btr) >> 20) & 0x7u)
+#define CAN_BTR_FIELD_TS1(btr) (((btr) >> 16) & 0xFu)
+#define CAN_BTR_FIELD_BRP(btr) ((btr) & 0x3FFu)
+
+/** @brief  BTR value of the standard SLCAN rate S0..S8, index CAN_10K..CAN_1000K
+ */
+extern const uint32_t can_btr_table[];
+
+uint32_t can_btr_from_sja1000(uint8_t btr0, uint8_t btr1);
+bool can_btr_calc(uint32_t bitrate, uint16_t sample_point, uint32_t *btr);
+uint32_t can_btr_bitrate(uint32_t btr);
+
+#endif /* BITTIMING_H */
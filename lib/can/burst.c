@@ -0,0 +1,280 @@
+/*
+ * burst.c
+ *
+ * Replay of the burst buffer. cec_can_isr takes the records one by one into
+ * the TX mailboxes as they empty, the second timestamp alarm wakes it for
+ * records with a delay. The mailboxes are always served in request order
+ * (TXFP, set by can_setup), so frames waiting together go out in the order
+ * of the sequence, not by identifier.
+ */
+#include <stddef.h>
+#include <string.h>
+#include <libopencm3/cm3/nvic.h>
+#include "slcan.h"
+#include "timestamp.h"
+#include "burst.h"
+
+#define BURST_ALARM 1u
+
+static uint8_t storage[CAN_BURST_SIZE];
+static uint16_t used;
+
+static bool running;
+static uint16_t repeat;	 /* passes to replay, 0 for no end */
+static uint16_t passes;	 /* passes completed */
+static uint16_t pos;	 /* next record */
+static uint32_t prev_id; /* identifier of the record before it */
+static uint8_t in_flight; /* frames of the replay in the mailboxes */
+
+// The next record, decoded by can_burst_peek() and taken by
+// can_burst_release()
+static bool parsed;
+static bool delayed;	/* it has to wait until due */
+static uint32_t due;
+static uint16_t next_pos;
+static uint32_t next_id;
+static can_frame_t frame;
+
+static uint32_t last_load; /* the previous frame went into a mailbox */
+static bool started;
+static uint32_t first_time, last_time;
+static uint32_t sent, failed, arb_lost;
+
+// Decode the record at offset at, with id holding the previous identifier
+// and taking the record's one. Returns the offset of the next record, 0 if
+// the record is cut off or invalid.
+static uint16_t burst_parse(uint16_t at, uint32_t *id, can_frame_t *f, uint32_t *delay)
+{
+	uint8_t head, dlc;
+	uint32_t value;
+
+	if (at >= used)
+		return 0;
+	head = storage[at++];
+	dlc = head & CAN_BURST_DLC_MASK;
+	if (dlc > CAN_DLC_MAX)
+		return 0;
+
+	switch (head & CAN_BURST_ID_MASK)
+	{
+	case CAN_BURST_ID_NEXT:
+		value = (*id & CAN_XTD_FRAME) ? CAN_XTD_MASK : CAN_STD_MASK;
+		*id = (*id & CAN_XTD_FRAME) | ((*id + 1u) & value);
+		break;
+	case CAN_BURST_ID_STD:
+		if ((at + 2u) > used)
+			return 0;
+		value = (uint32_t)storage[at] | ((uint32_t)storage[at + 1u] << 8);
+		if (value > CAN_STD_MASK)
+			return 0;
+		*id = value;
+		at += 2u;
+		break;
+	case CAN_BURST_ID_XTD:
+		if ((at + 4u) > used)
+			return 0;
+		value = (uint32_t)storage[at] | ((uint32_t)storage[at + 1u] << 8) |
+				((uint32_t)storage[at + 2u] << 16) | ((uint32_t)storage[at + 3u] << 24);
+		if (value > CAN_XTD_MASK)
+			return 0;
+		*id = value | CAN_XTD_FRAME;
+		at += 4u;
+		break;
+	default:
+		break;
+	}
+
+	*delay = 0;
+	if (head & CAN_BURST_DELAY)
+	{
+		uint8_t shift = 0;
+		uint8_t byte;
+
+		// up to 28 bits, 4.5 minutes
+		do
+		{
+			if ((at >= used) || (shift > 21u))
+				return 0;
+			byte = storage[at++];
+			*delay |= (uint32_t)(byte & 0x7Fu) << shift;
+			shift += 7u;
+		} while (byte & 0x80u);
+	}
+
+	f->id = *id | ((head & CAN_BURST_RTR) ? CAN_RTR_FRAME : 0u);
+	f->dlc = dlc;
+	f->fmi = 0;
+	f->tag = 0;
+	if (!(head & CAN_BURST_RTR))
+	{
+		if ((at + dlc) > used)
+			return 0;
+		memcpy(f->data, &storage[at], dlc);
+		at += dlc;
+	}
+	return at;
+}
+
+// Add bytes to the sequence, not while it is replayed
+bool can_burst_append(const uint8_t *data, uint16_t len)
+{
+	if (running || (len > (CAN_BURST_SIZE - used)))
+		return false;
+	memcpy(&storage[used], data, len);
+	used = (uint16_t)(used + len);
+	return true;
+}
+
+void can_burst_clear(void)
+{
+	can_burst_stop();
+	used = 0;
+}
+
+// Replay the sequence count times, 0 until can_burst_stop(). Fails if it
+// is empty, ends in the middle of a record or a replay is still going on.
+bool can_burst_start(uint16_t count)
+{
+	uint16_t at = 0;
+	uint32_t id = 0, delay;
+	can_frame_t f;
+
+	if (!used || can_burst_busy())
+		return false;
+	while (at < used)
+	{
+		at = burst_parse(at, &id, &f, &delay);
+		if (at == 0)
+			return false;
+	}
+
+	nvic_disable_irq(NVIC_CEC_CAN_IRQ);
+	repeat = count;
+	passes = 0;
+	pos = 0;
+	prev_id = 0;
+	parsed = false;
+	started = false;
+	sent = failed = arb_lost = 0;
+	first_time = last_time = 0;
+	last_load = timestamp_now();
+	running = true;
+	nvic_enable_irq(NVIC_CEC_CAN_IRQ);
+
+	// the TIM2 interrupt wakes cec_can_isr after a delay, the CAN
+	// interrupt has to look at the mailboxes once to begin with
+	nvic_enable_irq(NVIC_TIM2_IRQ);
+	nvic_set_pending_irq(NVIC_CEC_CAN_IRQ);
+	return true;
+}
+
+// Stop taking records, frames already in a mailbox still go out
+void can_burst_stop(void)
+{
+	nvic_disable_irq(NVIC_CEC_CAN_IRQ);
+	running = false;
+	parsed = false;
+	timestamp_alarm_stop(BURST_ALARM);
+	nvic_enable_irq(NVIC_CEC_CAN_IRQ);
+}
+
+// With the CAN interrupt off, before can_init()
+void can_burst_reset(void)
+{
+	running = false;
+	parsed = false;
+	in_flight = 0;
+	timestamp_alarm_stop(BURST_ALARM);
+}
+
+void can_burst_stats(can_burst_stats_t *stats)
+{
+	nvic_disable_irq(NVIC_CEC_CAN_IRQ);
+	stats->running = running;
+	stats->used = used;
+	stats->sent = sent;
+	stats->failed = failed;
+	stats->arb_lost = arb_lost;
+	stats->fps = (sent && (last_time != first_time))
+					 ? (uint32_t)(((uint64_t)sent * TIMESTAMP_CLOCK_HZ) / (uint32_t)(last_time - first_time))
+					 : 0u;
+	nvic_enable_irq(NVIC_CEC_CAN_IRQ);
+}
+
+bool can_burst_busy(void)
+{
+	return running || in_flight;
+}
+
+// The next frame of the replay if it is due, NULL if it isn't or the
+// replay is over
+const can_frame_t *can_burst_peek(void)
+{
+	if (!running)
+		return NULL;
+	if (!parsed)
+	{
+		uint32_t delay;
+
+		// the sequence was checked by can_burst_start()
+		next_id = prev_id;
+		next_pos = burst_parse(pos, &next_id, &frame, &delay);
+		due = last_load + delay;
+		delayed = delay != 0u;
+		parsed = true;
+	}
+	if (delayed && ((int32_t)(due - timestamp_now()) > 0))
+	{
+		timestamp_alarm(BURST_ALARM, due);
+		// the alarm would miss a time that passed while it was set
+		if ((int32_t)(due - timestamp_now()) > 0)
+			return NULL;
+	}
+	delayed = false;
+	return &frame;
+}
+
+void can_burst_release(void)
+{
+	last_load = timestamp_now();
+	if (!started)
+	{
+		first_time = last_load;
+		started = true;
+	}
+	in_flight++;
+	parsed = false;
+	prev_id = next_id;
+	pos = next_pos;
+	if (pos >= used)
+	{
+		pos = 0;
+		prev_id = 0;
+		passes++;
+		if (repeat && (passes >= repeat))
+			running = false;
+	}
+}
+
+// A frame of the replay left its mailbox
+void can_burst_done(bool ok, bool lost, uint32_t now)
+{
+	if (!in_flight)
+		return;
+	in_flight--;
+	if (ok)
+		sent++;
+	else
+		failed++;
+	if (lost)
+		arb_lost++;
+	last_time = now;
+}
+
+void can_burst_alarm(void)
+{
+	if (!timestamp_alarm_ack(BURST_ALARM))
+		return;
+	timestamp_alarm_stop(BURST_ALARM);
+	nvic_set_pending_irq(NVIC_CEC_CAN_IRQ);
+}
@@ -0,0 +1,64 @@
+#ifndef BURST_H
+#define BURST_H
+#include "stdint.h"
+#include "stdbool.h"
+#include "can.h"
+
+#define CAN_BURST_SIZE 1024u /* bytes of RAM for the frame sequence */
+
+/*
+ * Burst buffer: the host uploads a sequence of frames once, the adapter
+ * replays it back to back at line rate, once, n times or until stopped.
+ *
+ * A record is a header byte, then the identifier, the delay and the payload
+ * as far as the header asks for them:
+ *   bits 0-3  DLC (0..8)
+ *   bit 4     remote frame, no payload follows
+ *   bits 5-6  identifier: 0 the previous record's, 1 the previous one + 1,
+ *             2 an 11-bit one in 2 bytes, 3 a 29-bit one in 4 bytes, both
+ *             little endian
+ *   bit 7     a delay follows: microseconds since the previous frame went
+ *             into a mailbox, 7 bits per byte in up to 4 bytes, low bits
+ *             first, bit 7 set in every byte but the last
+ * A run of frames with one identifier costs one byte plus the payload per
+ * frame. The previous identifier is 0 (11-bit) at the start of every pass.
+ */
+#define CAN_BURST_DLC_MASK 0x0Fu
+#define CAN_BURST_RTR 0x10u
+#define CAN_BURST_ID_SAME 0x00u
+#define CAN_BURST_ID_NEXT 0x20u
+#define CAN_BURST_ID_STD 0x40u
+#define CAN_BURST_ID_XTD 0x60u
+#define CAN_BURST_ID_MASK 0x60u
+#define CAN_BURST_DELAY 0x80u
+
+/** @brief  Outcome of the current or last replay
+ */
+typedef struct
+{
+	bool running;	   /**< records are still being replayed */
+	uint16_t used;	   /**< bytes of the buffer in use */
+	uint32_t sent;	   /**< frames acknowledged on the bus */
+	uint32_t failed;   /**< transmissions ended without success */
+	uint32_t arb_lost; /**< frames that lost arbitration at least once */
+	uint32_t fps;	   /**< frames per second from the first frame to the last */
+} can_burst_stats_t;
+
+bool can_burst_append(const uint8_t *data, uint16_t len);
+void can_burst_clear(void);
+bool can_burst_start(uint16_t count);
+void can_burst_stop(void);
+void can_burst_stats(can_burst_stats_t *stats);
+// Called by can_setup_btr(), which empties the mailboxes
+void can_burst_reset(void);
+
+// Used by cec_can_isr, which sends nothing of the host's while a replay has
+// frames left or in the mailboxes
+bool can_burst_busy(void);
+const can_frame_t *can_burst_peek(void);
+void can_burst_release(void);
+void can_burst_done(bool ok, bool arb_lost, uint32_t now);
+// Called by tim2_isr
+void can_burst_alarm(void);
+
+#endif /* BURST_H */
@@ -0,0 +1,239 @@
+/*
+ * busload.c
+ *
+ * Bus load estimate from the exact length of every frame seen. The CAN
+ * interrupt adds frame lengths to a running bit count, SysTick turns it into
+ * the load of the last 10 ms and of the last second, sliding in 100 ms
+ * steps. Like filter.c it doesn't touch the hardware.
+ */
+#include "slcan.h"
+#include "busload.h"
+
+/*
+ * Stuff bit state after a nibble, MSB first: [state][nibble], the state is
+ * the level of the last bit (bit 2) and the length of its run minus one
+ * (bits 0-1); bit 3 of an entry is set when the nibble needed a stuff bit.
+ * A nibble never needs two, five equal bits take at least one more.
+ */
+static const uint8_t stuff_table[8][16] = {
+	{0x0C, 0x04, 0x00, 0x05, 0x01, 0x04, 0x00, 0x06, 0x02, 0x04, 0x00, 0x05, 0x01, 0x04, 0x00, 0x07},
+	{0x08, 0x0D, 0x00, 0x05, 0x01, 0x04, 0x00, 0x06, 0x02, 0x04, 0x00, 0x05, 0x01, 0x04, 0x00, 0x07},
+	{0x09, 0x0C, 0x08, 0x0E, 0x01, 0x04, 0x00, 0x06, 0x02, 0x04, 0x00, 0x05, 0x01, 0x04, 0x00, 0x07},
+	{0x0A, 0x0C, 0x08, 0x0D, 0x09, 0x0C, 0x08, 0x0F, 0x02, 0x04, 0x00, 0x05, 0x01, 0x04, 0x00, 0x07},
+	{0x03, 0x04, 0x00, 0x05, 0x01, 0x04, 0x00, 0x06, 0x02, 0x04, 0x00, 0x05, 0x01, 0x04, 0x00, 0x08},
+	{0x03, 0x04, 0x00, 0x05, 0x01, 0x04, 0x00, 0x06, 0x02, 0x04, 0x00, 0x05, 0x01, 0x04, 0x09, 0x0C},
+	{0x03, 0x04, 0x00, 0x05, 0x01, 0x04, 0x00, 0x06, 0x02, 0x04, 0x00, 0x05, 0x0A, 0x0C, 0x08, 0x0D},
+	{0x03, 0x04, 0x00, 0x05, 0x01, 0x04, 0x00, 0x06, 0x0B, 0x0C, 0x08, 0x0D, 0x09, 0x0C, 0x08, 0x0E},
+};
+
+/* CRC-15/CAN (polynomial 0x4599) of a nibble shifted out of the register */
+static const uint16_t crc15_table[16] = {
+	0x0000, 0x4599, 0x4EAB, 0x0B32, 0x58CF, 0x1D56, 0x1664, 0x53FD,
+	0x7407, 0x319E, 0x3AAC, 0x7F35, 0x2CC8, 0x6951, 0x6263, 0x27FA};
+
+#define STUFF_START 0x4u /* recessive idle bus: SOF starts a new run */
+
+/* frame bits after the CRC: delimiter, ACK slot and delimiter, EOF, intermission */
+#define FRAME_TAIL_BITS (1u + 2u + 7u + 3u)
+
+typedef struct
+{
+	uint32_t acc;	/* bits not processed yet, right aligned */
+	uint8_t count;	/* number of them */
+	uint8_t state;	/* stuff state, as in stuff_table */
+	uint8_t stuff;	/* stuff bits so far */
+	uint16_t crc;
+} frame_bits_t;
+
+static inline void stuff_nibble(frame_bits_t *f, uint8_t nibble)
+{
+	uint8_t entry = stuff_table[f->state][nibble];
+
+	f->stuff += entry >> 3;
+	f->state = entry & 0x7u;
+}
+
+static inline void stuff_bit(frame_bits_t *f, uint8_t bit)
+{
+	uint8_t last = f->state >> 2;
+	uint8_t run = (bit == last) ? (uint8_t)((f->state & 0x3u) + 2u) : 1u;
+
+	if (run == 5u)
+	{
+		f->stuff++;
+		f->state = (uint8_t)((bit ^ 1u) << 2);
+	}
+	else
+	{
+		f->state = (uint8_t)((bit << 2) | (run - 1u));
+	}
+}
+
+// Append bits covered by the CRC, processing whole nibbles as they fill up
+static void frame_push(frame_bits_t *f, uint32_t value, uint8_t width)
+{
+	f->acc = (f->acc << width) | (value & ((1u << width) - 1u));
+	f->count += width;
+	while (f->count >= 4u)
+	{
+		uint8_t nibble;
+
+		f->count -= 4u;
+		nibble = (uint8_t)((f->acc >> f->count) & 0xFu);
+		stuff_nibble(f, nibble);
+		f->crc = (uint16_t)(((f->crc << 4) & 0x7FFFu) ^ crc15_table[((f->crc >> 11) ^ nibble) & 0xFu]);
+	}
+}
+
+uint16_t can_frame_bits(uint32_t id, uint8_t dlc, const uint8_t *data)
+{
+	frame_bits_t f = {.acc = 0, .count = 0, .state = STUFF_START, .stuff = 0, .crc = 0};
+	bool rtr = (id & CAN_RTR_FRAME) != 0;
+	uint8_t len = (dlc > CAN_LEN_MAX) ? CAN_LEN_MAX : dlc;
+	uint16_t bits;
+
+	if (id & CAN_XTD_FRAME)
+	{
+		// SOF, base ID, SRR, IDE, extended ID, RTR, r1, r0, DLC
+		frame_push(&f, (id >> 18) & 0x7FFu, 12);
+		frame_push(&f, 0x3u, 2);
+		frame_push(&f, id & 0x3FFFFu, 18);
+		frame_push(&f, rtr ? 0x40u | dlc : dlc, 7);
+		bits = 39u;
+	}
+	else
+	{
+		// SOF, ID, RTR, IDE, r0, DLC
+		frame_push(&f, id & 0x7FFu, 12);
+		frame_push(&f, rtr ? 0x40u | dlc : dlc, 7);
+		bits = 19u;
+	}
+	if (!rtr)
+	{
+		for (uint8_t i = 0; i < len; i++)
+			frame_push(&f, data[i], 8);
+		bits += 8u * len;
+	}
+
+	// the bits left over from the last nibble, one at a time
+	while (f.count)
+	{
+		uint8_t bit = (uint8_t)((f.acc >> --f.count) & 1u);
+
+		stuff_bit(&f, bit);
+		f.crc = (uint16_t)((f.crc << 1) & 0x7FFFu) ^ ((((f.crc >> 14) ^ bit) & 1u) ? 0x4599u : 0u);
+	}
+
+	// the CRC is stuffed too but not part of its own input
+	stuff_nibble(&f, (uint8_t)((f.crc >> 11) & 0xFu));
+	stuff_nibble(&f, (uint8_t)((f.crc >> 7) & 0xFu));
+	stuff_nibble(&f, (uint8_t)((f.crc >> 3) & 0xFu));
+	for (uint8_t i = 3; i-- > 0;)
+		stuff_bit(&f, (uint8_t)((f.crc >> i) & 1u));
+
+	return (uint16_t)(bits + 15u + f.stuff + FRAME_TAIL_BITS);
+}
+
+/* bit count of all frames so far, written by the CAN interrupt only */
+static volatile uint32_t load_bits;
+
+/* SysTick state */
+static uint32_t load_seen;	  /* load_bits at the previous tick */
+static uint32_t instant_bits; /* current 10 ms window */
+static uint8_t instant_ms;
+static uint32_t slot_bits; /* current 100 ms step */
+static uint8_t slot_ms;
+static uint16_t slot_load[CAN_LOAD_SLOTS]; /* per mille of the last steps */
+static uint8_t slot_index;
+
+/* per mille per bit, 16.16 fixed point, for both window lengths */
+static uint32_t instant_scale;
+static uint32_t slot_scale;
+
+static volatile uint16_t load_instant;
+static volatile uint16_t load_second;
+static volatile uint16_t load_peak;
+
+static uint32_t load_scale(uint32_t bits_per_window)
+{
+	if (bits_per_window == 0u)
+		return 0u;
+	return ((1000u << 16) + (bits_per_window / 2u)) / bits_per_window;
+}
+
+static uint16_t load_permille(uint32_t bits, uint32_t scale)
+{
+	// the product stays below 2^32 for windows of up to twice the capacity
+	uint32_t load = (bits * scale + 0x8000u) >> 16;
+
+	return (uint16_t)((load > 1000u) ? 1000u : load);
+}
+
+void can_load_setup(uint32_t bitrate)
+{
+	instant_scale = load_scale((bitrate / 1000u) * CAN_LOAD_INSTANT_MS);
+	slot_scale = load_scale((bitrate / 1000u) * CAN_LOAD_SLOT_MS);
+	load_seen = load_bits;
+	instant_bits = 0;
+	instant_ms = 0;
+	slot_bits = 0;
+	slot_ms = 0;
+	slot_index = 0;
+	for (uint8_t i = 0; i < CAN_LOAD_SLOTS; i++)
+		slot_load[i] = 0;
+	load_instant = 0;
+	load_second = 0;
+	load_peak = 0;
+}
+
+void can_load_add(uint16_t bits)
+{
+	load_bits += bits;
+}
+
+void can_load_tick(void)
+{
+	uint32_t total = load_bits;
+	uint32_t bits = total - load_seen;
+
+	load_seen = total;
+	instant_bits += bits;
+	slot_bits += bits;
+
+	if (++instant_ms == CAN_LOAD_INSTANT_MS)
+	{
+		uint16_t load = load_permille(instant_bits, instant_scale);
+
+		load_instant = load;
+		if (load > load_peak)
+			load_peak = load;
+		instant_bits = 0;
+		instant_ms = 0;
+	}
+
+	if (++slot_ms == CAN_LOAD_SLOT_MS)
+	{
+		uint16_t sum = 0;
+
+		slot_load[slot_index] = load_permille(slot_bits, slot_scale);
+		if (++slot_index == CAN_LOAD_SLOTS)
+			slot_index = 0;
+		for (uint8_t i = 0; i < CAN_LOAD_SLOTS; i++)
+			sum += slot_load[i];
+		load_second = (uint16_t)((sum + (CAN_LOAD_SLOTS / 2u)) / CAN_LOAD_SLOTS);
+		slot_bits = 0;
+		slot_ms = 0;
+	}
+}
+
+void can_load_get(uint16_t *instant, uint16_t *second, uint16_t *peak)
+{
+	*instant = load_instant;
+	*second = load_second;
+	*peak = load_peak;
+}
+
+void can_load_reset_peak(void)
+{
+	load_peak = load_instant;
+}
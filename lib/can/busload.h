@@ -0,0 +1,27 @@
+#ifndef BUSLOAD_H
+#define BUSLOAD_H
+#include "stdint.h"
+
+#define CAN_LOAD_INSTANT_MS 10u /* window of the instantaneous load */
+#define CAN_LOAD_SLOT_MS 100u	/* step the 1 s window slides by */
+#define CAN_LOAD_SLOTS 10u		/* steps in the 1 s window */
+#define CAN_FRAME_BITS_MAX 160u /* extended, 8 bytes, a stuff bit after every 4 */
+
+/** @brief  Bit times a frame occupies on the bus: SOF to CRC with the stuff
+ *          bits the actual identifier and payload need, CRC and ACK
+ *          delimiters, EOF and the 3-bit intermission
+ *  @param  id      identifier | CAN_XTD_FRAME | CAN_RTR_FRAME
+ *  @param  dlc     data length code (0..8)
+ *  @param  data    payload, not read for remote frames
+ */
+uint16_t can_frame_bits(uint32_t id, uint8_t dlc, const uint8_t *data);
+
+// Bus load in per mille of the bit rate, over the frames the adapter sends
+// and the ones its filters accept
+void can_load_setup(uint32_t bitrate);
+void can_load_add(uint16_t bits);
+void can_load_tick(void);
+void can_load_get(uint16_t *instant, uint16_t *second, uint16_t *peak);
+void can_load_reset_peak(void);
+
+#endif /* BUSLOAD_H */
@@ -18,6 +18,7 @@
  */
 
 #include <stddef.h>
+#include <string.h>
 #include <libopencm3/cm3/nvic.h>
 #include <libopencm3/cm3/systick.h>
 #include <libopencm3/stm32/can.h>
@@ -25,6 +26,17 @@
 #include <libopencm3/stm32/flash.h>
 #include <libopencm3/stm32/rcc.h>
 #include "led.h"
+#include "spsc.h"
+#include "timestamp.h"
+#include "slcan.h"
+#include "filter.h"
+#include "bittiming.h"
+#include "busload.h"
+#include "periodic.h"
+#include "burst.h"
+#include "change.h"
+#include "limit.h"
+#include "can.h"
 
 struct can_tx_msg
 {
@@ -50,6 +62,56 @@ struct can_rx_msg
 struct can_tx_msg can_tx_msg;
 struct can_rx_msg can_rx_msg;
 
+// Frames received by cec_can_isr, encoded and sent to the host by main()
+static can_frame_t rx_queue_storage[CAN_RX_QUEUE_LEN];
+static struct spsc rx_queue;
+// Reception time of each RX queue slot in microseconds, kept next to the
+// queue so the frame records stay 16 bytes
+static uint32_t rx_stamp[CAN_RX_QUEUE_LEN];
+// Length on the bus of the frame in each TX mailbox, counted into the bus
+// load once it is acknowledged
+static uint16_t tx_bits[3];
+// Tag of the frame in each TX mailbox
+static uint16_t tx_tag[3];
+// Bit n: mailbox n holds a frame of the burst replay
+static uint8_t tx_burst;
+// Bit n: mailbox n holds a frame of the periodic table
+static uint8_t tx_periodic;
+// Bit time in 1/1024 us, and the longest frame plus CAN_TX_GUARD_US in us
+static uint32_t tx_bit_time;
+static uint32_t tx_guard_max;
+// The host's frame at the head is held back for the periodic entry due then
+static bool tx_held;
+static uint32_t tx_held_for;
+
+#ifdef USB_GS_USB
+// Completions of tagged frames, for the echoes gs_usb expects
+static can_tx_done_t tx_done_storage[CAN_TX_DONE_LEN];
+static struct spsc tx_done;
+#endif
+volatile can_rx_stats_t can_rx_stats;
+
+// Frames from the host, moved into the TX mailboxes by cec_can_isr
+static can_frame_t tx_queue_storage[CAN_TX_QUEUE_LEN];
+static struct spsc tx_queue;
+volatile can_tx_stats_t can_tx_stats;
+
+volatile can_err_stats_t can_err_stats;
+
+// Error events the interrupt has seen since the last report. Protocol errors
+// can come with every frame on a broken bus, so after the first one LECIE
+// stays off until the main loop has taken the report.
+static volatile struct
+{
+	bool pending;
+	bool overflow;	/* frames lost to FOVR or a full RX queue */
+	uint8_t lec;	/* LEC codes seen, bit n for code n */
+	uint8_t count;	/* events folded into the report, saturating */
+	uint32_t time;	/* time stamp of the first of them */
+} err_latch;
+static bool err_reporting;
+static uint32_t err_state; /* EWGF, EPVF and BOFF as last reported */
+
 static void can_gpio_setup(void)
 {
 	/* Enable GPIOB clock. */
@@ -58,12 +120,36 @@ static void can_gpio_setup(void)
 
 void can_setup(uint8_t i)
 {
+	if (i > CAN_1000K)
+		i = CAN_500K;
+	can_setup_btr(can_btr_table[i]);
+}
+
+void can_setup_btr(uint32_t btr)
+{
+	// Keep the interrupt off while the queues and the peripheral are reset
+	nvic_disable_irq(NVIC_CEC_CAN_IRQ);
+
 	// Enable GPIOB clock
 	rcc_periph_clock_enable(RCC_GPIOB);
 
 	// Enable CAN1 clock
 	rcc_periph_clock_enable(RCC_CAN1);
 
+	// Start with an empty RX queue
+	spsc_init(&rx_queue, (uint8_t *)rx_queue_storage, sizeof(rx_queue_storage));
+	tx_burst = 0;
+	tx_periodic = 0;
+	can_burst_reset();
+	spsc_init(&tx_queue, (uint8_t *)tx_queue_storage, sizeof(tx_queue_storage));
+#ifdef USB_GS_USB
+	spsc_init(&tx_done, (uint8_t *)tx_done_storage, sizeof(tx_done_storage));
+#endif
+	can_load_setup(can_btr_bitrate(btr));
+	tx_bit_time = ((1024u * 1000000u) + (can_btr_bitrate(btr) / 2u)) / can_btr_bitrate(btr);
+	tx_guard_max = ((CAN_FRAME_BITS_MAX * tx_bit_time) >> 10) + CAN_TX_GUARD_US;
+	tx_held = false;
+
 	// Reset the can peripheral
 	can_reset(CAN1);
 
@@ -106,44 +192,44 @@ void can_setup(uint8_t i)
 		// pending at the same time.
 		// 0: Priority driven by the identifier of the message
 		// 1: Priority driven by the request order (chronologically)
-		false, // TX priority based on identifier
+		// By identifier, mailboxes holding the same one go lowest number
+		// first: a frame of the host's left in mailbox 2 waits as long as
+		// the other two keep being refilled, and the ones behind it overtake
+		// it. can_tx_order() only clears it for the periodic table.
+		true, // TX priority based on request order
 
-		//// Bit timing settings
-		//// Assuming 48MHz base clock, 87.5% sample point, 500 kBit/s data rate
-		//// http://www.bittiming.can-wiki.info/
+		//// Bit timing settings, from can_btr_table, can_btr_calc or sxxyy
 		// Resync time quanta jump width
-		CAN_BTR_SJW_1TQ, // 16,
+		btr & CAN_BTR_SJW_MASK,
 		// Time segment 1 time quanta width
-		CAN_BTR_TS1_13TQ, // 13,
+		btr & CAN_BTR_TS1_MASK,
 		// Time segment 2 time quanta width
-		CAN_BTR_TS2_1TQ, // 2,
+		btr & CAN_BTR_TS2_MASK,
 		// Baudrate prescaler
-		6,
+		CAN_BTR_FIELD_BRP(btr) + 1u,
 
 		// Loopback mode
 		// If set, CAN can transmit but not receive
-		true,
+		false,
 
 		// Silent mode
 		// If set, CAN can receive but not transmit
 		false);
 
-	can_filter_id_mask_16bit_init(0,	 /* Filter ID */
-								  0x777, /* CAN ID */
-								  0x7FF, /* CAN ID mask */
-								  0x0,	 /* CAN ID */
-								  0x0,	 /* CAN ID mask */
-								  0,	 /* FIFO assignment (here: FIFO0) */
-								  true);
-	can_filter_id_mask_16bit_init(2,	 /* Filter ID */
-								  0x777, /* CAN ID */
-								  0x7FF, /* CAN ID mask */
-								  0x0,	 /* CAN ID */
-								  0x0,	 /* CAN ID mask */
-								  1,	 /* FIFO assignment (here: FIFO0) */
-								  true);
-	// Enable CAN interrupts for FIFO message pending (FMPIE)
-	can_enable_irq(CAN1, CAN_IER_FMPIE0);
+	// Program the acceptance filter banks, accept everything until the host
+	// sets a filter
+	can_filter_apply();
+
+	// Enable CAN interrupts for message pending (FMPIE), FIFO full (FFIE)
+	// and overrun (FOVIE) on both FIFOs, transmit mailbox empty (TMEIE) and,
+	// through ERRIE, error warning (EWGIE), error passive (EPVIE), bus-off
+	// (BOFIE) and, while errors are reported, protocol errors (LECIE)
+	memset((void *)&err_latch, 0, sizeof(err_latch));
+	err_state = 0;
+	can_enable_irq(CAN1, CAN_IER_FMPIE0 | CAN_IER_FFIE0 | CAN_IER_FOVIE0 |
+							 CAN_IER_FMPIE1 | CAN_IER_FFIE1 | CAN_IER_FOVIE1 |
+							 CAN_IER_TMEIE | CAN_IER_EWGIE | CAN_IER_EPVIE | CAN_IER_BOFIE |
+							 (err_reporting ? CAN_IER_LECIE : 0u) | CAN_IER_ERRIE);
 	nvic_enable_irq(NVIC_CEC_CAN_IRQ);
 
 	// Route the can to the relevant pins
@@ -152,17 +238,578 @@ void can_setup(uint8_t i)
 	gpio_set_af(GPIOB, GPIO_AF4, pins);
 }
 
-void cec_can_isr(void)
+void can_filter_apply(void)
+{
+	can_filter_bank_t banks[CAN_FILTER_BANKS];
+	uint8_t used = can_filter_build(banks, CAN_FILTER_BANKS);
+
+	for (uint8_t nr = 0; nr < CAN_FILTER_BANKS; nr++)
+	{
+		if (nr < used)
+			can_filter_init(nr, banks[nr].scale_32bit, banks[nr].id_list_mode,
+							banks[nr].fr1, banks[nr].fr2, banks[nr].fifo, true);
+		else
+			can_filter_init(nr, false, false, 0, 0, 0, false);
+	}
+}
+
+// Put one frame into a free TX mailbox, returns the mailbox or -1 if none
+// took it
+static int can_tx_mailbox(const can_frame_t *frame)
+{
+	bool ext = (frame->id & CAN_XTD_FRAME) != 0;
+	bool rtr = (frame->id & CAN_RTR_FRAME) != 0;
+	int mailbox = can_transmit(CAN1, frame->id & (ext ? CAN_XTD_MASK : CAN_STD_MASK), ext, rtr,
+							   frame->dlc, (uint8_t *)frame->data);
+
+	if (mailbox < 0)
+		return -1;
+	tx_bits[mailbox] = can_frame_bits(frame->id, frame->dlc, frame->data);
+	tx_tag[mailbox] = frame->tag;
+	return mailbox;
+}
+
+// Number of empty TX mailboxes
+static inline uint8_t can_tx_empty(uint32_t tsr)
+{
+	return (uint8_t)(((tsr & CAN_TSR_TME0) != 0) + ((tsr & CAN_TSR_TME1) != 0) + ((tsr & CAN_TSR_TME2) != 0));
+}
+
+// Mailboxes the burst replay and the host's frames leave empty: while the
+// periodic table is in use they take one at a time
+static inline uint8_t can_tx_reserve(void)
+{
+	return can_periodic_active() ? 2u : 0u;
+}
+
+// The host's frames and a burst have to reach the bus in the order they
+// were sent, so the mailboxes go out in request order (TXFP). Then a due
+// periodic frame would queue behind one of theirs that keeps losing the
+// arbitration on a busy bus; while the table is in use the order is by
+// identifier instead, which can't swap anything once at most one of their
+// frames is left in the mailboxes.
+static void can_tx_order(uint32_t tsr)
+{
+	bool fifo = (CAN_MCR(CAN1) & CAN_MCR_TXFP) != 0;
+	uint8_t others = (uint8_t)(3u - can_tx_empty(tsr) - ((tx_periodic & 1u) + ((tx_periodic >> 1) & 1u) +
+														 ((tx_periodic >> 2) & 1u)));
+
+	if (!can_periodic_active())
+	{
+		if (!fifo)
+			CAN_MCR(CAN1) |= CAN_MCR_TXFP;
+	}
+	else if (fifo && (others <= 1u))
+	{
+		CAN_MCR(CAN1) &= ~CAN_MCR_TXFP;
+	}
+}
+
+// A frame of the host's or the replay that would still be on the bus when
+// the next periodic frame falls due is held back, so the periodic frame
+// finds the bus free of the adapter's own traffic and only a frame of
+// another node can delay it. A frame is held for one due time at most,
+// otherwise a table whose gaps are shorter than the frame would keep it
+// out for good.
+static bool can_tx_guard(const can_frame_t *frame, uint32_t now)
+{
+	if (!can_periodic_active())
+		return false;
+
+	uint32_t due = can_periodic_next();
+	int32_t wait = (int32_t)(due - now);
+
+	if ((wait < 0) || ((uint32_t)wait >= tx_guard_max) ||
+		((uint32_t)wait >= ((can_frame_bits(frame->id, frame->dlc, frame->data) * tx_bit_time) >> 10) +
+							   CAN_TX_GUARD_US) ||
+		(tx_held && (tx_held_for != due)))
+	{
+		tx_held = false;
+		return false;
+	}
+	tx_held = true;
+	tx_held_for = due;
+	return true;
+}
+
+// Move due periodic frames, then the burst replay or queued frames into the
+// free TX mailboxes, called from cec_can_isr only. The alarm that makes the
+// next periodic frame due pends it again for a frame held back meanwhile.
+static void can_tx_drain(uint32_t now)
+{
+	uint32_t tsr = CAN_TSR(CAN1);
+	uint8_t free = can_tx_empty(tsr);
+	uint8_t reserve = can_tx_reserve();
+	const can_frame_t *next;
+	uint8_t *span;
+
+	can_tx_order(tsr);
+	while (free && ((next = can_periodic_peek()) != NULL))
+	{
+		int mailbox = can_tx_mailbox(next);
+
+		if (mailbox < 0)
+			return;
+		tx_periodic |= (uint8_t)(1u << mailbox);
+		can_periodic_release();
+		free--;
+	}
+
+	// a replay keeps the host's frames out until its last one is sent
+	if (can_burst_busy())
+	{
+		while ((free > reserve) && ((next = can_burst_peek()) != NULL) && !can_tx_guard(next, now))
+		{
+			int mailbox = can_tx_mailbox(next);
+
+			if (mailbox < 0)
+				return;
+			tx_burst |= (uint8_t)(1u << mailbox);
+			can_burst_release();
+			free--;
+		}
+		return;
+	}
+
+	while ((free > reserve) && (spsc_read_peek(&tx_queue, &span) >= sizeof(can_frame_t)) &&
+		   !can_tx_guard((const can_frame_t *)span, now))
+	{
+		if (can_tx_mailbox((const can_frame_t *)span) < 0)
+			return;
+		spsc_read_commit(&tx_queue, sizeof(can_frame_t));
+		free--;
+	}
+}
+
+bool can_tx_enqueue(const can_frame_t *frame)
+{
+	if (spsc_free(&tx_queue) < sizeof(*frame))
+	{
+		can_tx_stats.rejected++;
+		return false;
+	}
+	spsc_write(&tx_queue, (const uint8_t *)frame, sizeof(*frame));
+	can_tx_stats.queued++;
+
+	uint16_t depth = (uint16_t)(spsc_used(&tx_queue) / sizeof(can_frame_t));
+	if (depth > can_tx_stats.high_water)
+		can_tx_stats.high_water = depth;
+
+	// TMEIE only fires when a transmission completes, so kick the interrupt
+	// in case all mailboxes are idle
+	nvic_set_pending_irq(NVIC_CEC_CAN_IRQ);
+	return true;
+}
+
+uint16_t can_tx_free(void)
+{
+	return (uint16_t)(spsc_free(&tx_queue) / sizeof(can_frame_t));
+}
+
+// Send a frame given as the images of the TX mailbox registers, which the
+// host's command was parsed into. With nothing queued, replayed or due ahead
+// of it the USB interrupt, which runs the command, writes them into a free
+// mailbox itself, saving the trip through the TX queue and cec_can_isr;
+// otherwise, or when can_tx_guard() holds it back, the frame is queued like
+// by can_tx_enqueue(), so it can't overtake anything. So is a frame while a
+// mailbox has finished and cec_can_isr hasn't counted it yet: setting TXRQ
+// would clear its RQCP and overwrite its tx_bits[] and tx_tag[]. TIM2
+// preempts the USB interrupt and may mark periodic frames due, so it is held
+// off along with the CAN interrupt until the mailbox is written.
+bool can_tx_direct(uint32_t tir, uint32_t tdtr, uint32_t tdlr, uint32_t tdhr)
+{
+	static const uint32_t mbox[3] = {CAN_MBOX0, CAN_MBOX1, CAN_MBOX2};
+	// the Cortex-M0 is little endian, payload byte n is byte n of TDLR:TDHR
+	const uint32_t data[2] = {tdlr, tdhr};
+	uint32_t id = (tir & CAN_TIR_IDE) ? ((tir >> CAN_TIR_EXID_SHIFT) | CAN_XTD_FRAME) : (tir >> CAN_TIR_STID_SHIFT);
+	uint8_t dlc = (uint8_t)(tdtr & CAN_TDTxR_DLC_MASK);
+	bool direct = false;
+
+	if (tir & CAN_TIR_RTR)
+		id |= CAN_RTR_FRAME;
+
+	can_frame_t frame = {.id = id, .dlc = dlc};
+
+	memcpy(frame.data, data, sizeof(frame.data));
+
+	nvic_disable_irq(NVIC_TIM2_IRQ);
+	nvic_disable_irq(NVIC_CEC_CAN_IRQ);
+	uint32_t tsr = CAN_TSR(CAN1);
+	uint8_t free = can_tx_empty(tsr);
+
+	if ((free > can_tx_reserve()) && ((tsr & (CAN_TSR_RQCP0 | CAN_TSR_RQCP1 | CAN_TSR_RQCP2)) == 0) &&
+		(spsc_used(&tx_queue) == 0) && !can_burst_busy() && (can_periodic_peek() == NULL) &&
+		!can_tx_guard(&frame, timestamp_now()))
+	{
+		uint8_t mailbox = (uint8_t)((tsr & CAN_TSR_CODE_MASK) >> CAN_TSR_CODE_SHIFT);
+
+		CAN_TDTxR(CAN1, mbox[mailbox]) = tdtr;
+		CAN_TDLxR(CAN1, mbox[mailbox]) = tdlr;
+		CAN_TDHxR(CAN1, mbox[mailbox]) = tdhr;
+		CAN_TIxR(CAN1, mbox[mailbox]) = tir | CAN_TIxR_TXRQ;
+		tx_bits[mailbox] = can_frame_bits(id, dlc, (const uint8_t *)data);
+		tx_tag[mailbox] = 0;
+		can_tx_stats.queued++;
+		can_tx_stats.direct++;
+		direct = true;
+	}
+	nvic_enable_irq(NVIC_CEC_CAN_IRQ);
+	nvic_enable_irq(NVIC_TIM2_IRQ);
+	if (direct)
+		return true;
+	return can_tx_enqueue(&frame);
+}
+
+// Count the outcome of one finished TX mailbox
+static inline void can_tx_count(uint32_t tsr, uint32_t rqcp, uint32_t txok, uint8_t mailbox, uint32_t now)
+{
+	if (!(tsr & rqcp))
+		return;
+	tx_periodic &= (uint8_t)~(1u << mailbox);
+	if (tsr & txok)
+	{
+		can_tx_stats.sent++;
+		can_tx_stats.mailbox[mailbox]++;
+		can_load_add(tx_bits[mailbox]);
+	}
+	else
+	{
+		can_tx_stats.failed++;
+	}
+	if (tx_burst & (1u << mailbox))
+	{
+		// ALST stays set once the frame lost arbitration, until RQCP is
+		// cleared
+		tx_burst &= (uint8_t)~(1u << mailbox);
+		can_burst_done((tsr & txok) != 0, (tsr & (CAN_TSR_ALST0 << (8u * mailbox))) != 0, now);
+	}
+#ifdef USB_GS_USB
+	if (tx_tag[mailbox])
+	{
+		can_tx_done_t done = {.tag = tx_tag[mailbox], .ok = (tsr & txok) != 0, .time = now};
+
+		// the host has few frames in flight, the ring can only fill up if
+		// it stopped reading
+		spsc_write(&tx_done, (const uint8_t *)&done, sizeof(done));
+	}
+#endif
+}
+
+// Add the duration of this interrupt, measured on the SysTick down counter
+// which reloads every millisecond
+static inline void can_isr_account(uint32_t entry)
+{
+	uint32_t exit = systick_get_value();
+	uint32_t cycles = (entry >= exit) ? (entry - exit) : (entry + (STK_RVR + 1u) - exit);
+
+	can_err_stats.isr_count++;
+	can_err_stats.isr_total += cycles;
+	if (cycles > can_err_stats.isr_max)
+		can_err_stats.isr_max = cycles;
+}
+
+// Note an error event for the next report, called from cec_can_isr only
+static inline void can_err_latch(uint32_t now)
 {
-	led_toggle(LED_ACT);
+	if (!err_latch.pending)
+	{
+		err_latch.pending = true;
+		err_latch.time = now;
+	}
+	if (err_latch.count < UINT8_MAX)
+		err_latch.count++;
+}
+
+// Copy every pending message of one FIFO into the RX queue, called from
+// cec_can_isr only. The main loop encodes them into IN packets, which the
+// USB interrupt hands to the host.
+static void can_rx_fifo(uint8_t fifo, uint32_t now)
+{
+	// RF0R and RF1R share the same bit layout
+	volatile uint32_t *rfr = fifo ? &CAN_RF1R(CAN1) : &CAN_RF0R(CAN1);
+	uint32_t status;
+
+	while (1)
+	{
+		// FULL and FOVR are cleared by writing them back; releasing the output
+		// mailbox writes them back too, so look at them before every release
+		status = *rfr;
+		if (status & (CAN_RF0R_FULL0 | CAN_RF0R_FOVR0))
+		{
+			*rfr = status & (CAN_RF0R_FULL0 | CAN_RF0R_FOVR0);
+			if (status & CAN_RF0R_FOVR0)
+			{
+				can_rx_stats.overrun[fifo]++;
+				err_latch.overflow = true;
+				can_err_latch(now);
+			}
+		}
+		if ((status & CAN_RF0R_FMP0_MASK) == 0)
+			break;
+
+		uint8_t *span;
+
+		if (spsc_write_peek(&rx_queue, &span) < sizeof(can_frame_t))
+		{
+			// read it anyway, it still counts into the bus load
+			can_frame_t lost;
+			bool ext, rtr;
 
+			can_receive(CAN1, fifo, true, &lost.id, &ext, &rtr, &lost.fmi, &lost.dlc, lost.data, NULL);
+			can_load_add(can_frame_bits(lost.id | (ext ? CAN_XTD_FRAME : 0u) | (rtr ? CAN_RTR_FRAME : 0u),
+										lost.dlc, lost.data));
+			can_rx_stats.dropped++;
+			err_latch.overflow = true;
+			can_err_latch(now);
+		}
+		else
+		{
+			can_frame_t *frame = (can_frame_t *)span;
+			bool ext, rtr;
+
+			can_receive(CAN1, fifo, true, &frame->id, &ext, &rtr, &frame->fmi, &frame->dlc, frame->data, NULL);
+			if (ext)
+				frame->id |= CAN_XTD_FRAME;
+			if (rtr)
+				frame->id |= CAN_RTR_FRAME;
+			can_load_add(can_frame_bits(frame->id, frame->dlc, frame->data));
+			can_rx_stats.fifo[fifo]++;
+			led_toggle(LED_ACT);
+			// an unchanged or rate limited frame is left in the span, the next
+			// one overwrites it. Unchanged frames are taken out first so they
+			// don't use up the rate or move the decimation on; one the limit
+			// drops is taken back from the cache, which then never holds a
+			// payload the host didn't get.
+			if (can_change_pass(frame->id, frame->dlc, frame->data, now))
+			{
+				if (can_limit_pass(frame->id, now))
+				{
+					rx_stamp[frame - rx_queue_storage] = now;
+					spsc_write_commit(&rx_queue, sizeof(can_frame_t));
+					can_rx_stats.queued++;
+				}
+				else
+					can_change_unsent();
+			}
+		}
+
+		// FMP only counts down once the hardware has released the mailbox
+		while (*rfr & CAN_RF0R_RFOM0)
+			;
+	}
+
+	uint16_t depth = can_rx_depth();
+	if (depth > can_rx_stats.high_water)
+		can_rx_stats.high_water = depth;
+}
+
+void cec_can_isr(void)
+{
 	// Handle the CAN interrupt
+	uint32_t entry = systick_get_value();
+	uint32_t now = timestamp_now();
+
+	// Handle transmit interrupt: acknowledge finished mailboxes and refill them
+	uint32_t tsr = CAN_TSR(CAN1);
+	uint32_t done = tsr & (CAN_TSR_RQCP0 | CAN_TSR_RQCP1 | CAN_TSR_RQCP2);
+	if (done)
+	{
+		CAN_TSR(CAN1) = done;
+		can_tx_count(tsr, CAN_TSR_RQCP0, CAN_TSR_TXOK0, 0, now);
+		can_tx_count(tsr, CAN_TSR_RQCP1, CAN_TSR_TXOK1, 1, now);
+		can_tx_count(tsr, CAN_TSR_RQCP2, CAN_TSR_TXOK2, 2, now);
+	}
+	can_tx_drain(now);
 
-	// Handle receive interrupt
-	uint32_t id;
-	bool ext, rtr;
-	uint8_t fmi, length, data[64];
+	// Handle receive interrupts, FIFO1 first as it takes the high priority
+	// IDs in balanced filter mode
+	can_rx_fifo(1, now);
+	can_rx_fifo(0, now);
+
+	// Handle error interrupt: count the entries into bus-off and latch the
+	// state change or protocol error for can_err_take()
+	if (CAN_MSR(CAN1) & CAN_MSR_ERRI)
+	{
+		uint32_t esr = CAN_ESR(CAN1);
+		uint8_t lec = (uint8_t)CAN_STATUS_LEC(esr);
+
+		CAN_MSR(CAN1) = CAN_MSR_ERRI;
+		if (esr & CAN_ESR_BOFF)
+			can_err_stats.bus_off++;
+		// codes 1..6 come from the hardware, 7 is written back below so the
+		// same error isn't taken twice
+		if ((lec != 0u) && (lec != 7u))
+		{
+			CAN_ESR(CAN1) = CAN_ESR_LEC_MASK;
+			err_latch.lec |= (uint8_t)(1u << lec);
+			if (err_reporting)
+				can_disable_irq(CAN1, CAN_IER_LECIE);
+		}
+		can_err_latch(now);
+	}
+
+	can_isr_account(entry);
+}
+
+// TIM2 compare interrupt: the first alarm times the periodic table, the
+// second the delays of a burst replay
+void tim2_isr(void)
+{
+	can_periodic_alarm();
+	can_burst_alarm();
+}
+
+void can_err_reporting(bool enable)
+{
+	nvic_disable_irq(NVIC_CEC_CAN_IRQ);
+	err_reporting = enable;
+	memset((void *)&err_latch, 0, sizeof(err_latch));
+	// report the current state first if it isn't error active
+	err_state = 0;
+	if (enable)
+		can_enable_irq(CAN1, CAN_IER_LECIE);
+	else
+		can_disable_irq(CAN1, CAN_IER_LECIE);
+	nvic_enable_irq(NVIC_CEC_CAN_IRQ);
+}
+
+void can_rx_change_only(bool enable, uint16_t keepalive_ms)
+{
+	nvic_disable_irq(NVIC_CEC_CAN_IRQ);
+	can_change_setup(enable, keepalive_ms);
+	nvic_enable_irq(NVIC_CEC_CAN_IRQ);
+}
+
+// Build a SocketCAN error frame from what the interrupt latched and from
+// state changes since the last report; leaving error passive or bus-off
+// raises no interrupt, so the state is compared here. Called from the main
+// loop, at most once per CAN_ERR_REPORT_MS.
+bool can_err_take(can_frame_t *frame, uint32_t *timestamp)
+{
+	uint32_t esr = CAN_ESR(CAN1);
+	uint32_t state = esr & (CAN_ESR_EWGF | CAN_ESR_EPVF | CAN_ESR_BOFF);
+	uint8_t tec = (uint8_t)CAN_STATUS_TEC(esr);
+	uint8_t rec = (uint8_t)CAN_STATUS_REC(esr);
+	uint8_t lec, count;
+	bool overflow;
 
-	can_receive(CAN1, 0, true, &id, &ext, &rtr, &fmi, &length, data, NULL);
-	slcan_encode(id, length, data);
+	if (!err_reporting || (!err_latch.pending && (state == err_state)))
+		return false;
+
+	nvic_disable_irq(NVIC_CEC_CAN_IRQ);
+	*timestamp = err_latch.pending ? err_latch.time : timestamp_now();
+	lec = err_latch.lec;
+	count = err_latch.count;
+	overflow = err_latch.overflow;
+	memset((void *)&err_latch, 0, sizeof(err_latch));
+	can_enable_irq(CAN1, CAN_IER_LECIE);
+	nvic_enable_irq(NVIC_CEC_CAN_IRQ);
+
+	memset(frame, 0, sizeof(*frame));
+	frame->id = CAN_ERR_FRAME | CAN_ERR_CNT;
+	frame->dlc = CAN_ERR_DLC;
+	if (state != err_state)
+	{
+		if (state & CAN_ESR_BOFF)
+			frame->id |= CAN_ERR_BUSOFF;
+		else if (err_state & CAN_ESR_BOFF)
+			frame->id |= CAN_ERR_RESTARTED;
+		else
+			frame->id |= CAN_ERR_CRTL;
+		if (state & CAN_ESR_EPVF)
+			frame->data[1] = (uint8_t)(((tec > 127u) ? CAN_ERR_CRTL_TX_PASSIVE : 0u) |
+									   ((rec > 127u) ? CAN_ERR_CRTL_RX_PASSIVE : 0u));
+		else if (state & CAN_ESR_EWGF)
+			frame->data[1] = (uint8_t)(((tec >= 96u) ? CAN_ERR_CRTL_TX_WARNING : 0u) |
+									   ((rec >= 96u) ? CAN_ERR_CRTL_RX_WARNING : 0u));
+		else if (!(state & CAN_ESR_BOFF))
+			frame->data[1] = CAN_ERR_CRTL_ACTIVE;
+		err_state = state;
+	}
+	if (overflow)
+	{
+		frame->id |= CAN_ERR_CRTL;
+		frame->data[1] |= CAN_ERR_CRTL_RX_OVERFLOW;
+	}
+
+	// bxCAN LEC codes: 1 stuff, 2 form, 3 acknowledgment, 4 bit recessive,
+	// 5 bit dominant, 6 CRC error
+	if (lec & (1u << 3))
+		frame->id |= CAN_ERR_ACK;
+	if (lec & ((1u << 1) | (1u << 2) | (1u << 4) | (1u << 5) | (1u << 6)))
+		frame->id |= CAN_ERR_PROT;
+	if (lec & (1u << 1))
+		frame->data[2] |= CAN_ERR_PROT_STUFF;
+	if (lec & (1u << 2))
+		frame->data[2] |= CAN_ERR_PROT_FORM;
+	if (lec & (1u << 4))
+		frame->data[2] |= CAN_ERR_PROT_BIT1;
+	if (lec & (1u << 5))
+		frame->data[2] |= CAN_ERR_PROT_BIT0;
+	if (lec & (1u << 6))
+		frame->data[3] = CAN_ERR_PROT_LOC_CRC_SEQ;
+
+	// data[5] is controller specific in SocketCAN, here the number of error
+	// interrupts and RX losses folded into this report
+	frame->data[5] = count;
+	frame->data[6] = tec;
+	frame->data[7] = rec;
+	return true;
+}
+
+#ifdef USB_GS_USB
+const can_tx_done_t *can_tx_done_peek(void)
+{
+	uint8_t *span;
+
+	if (spsc_read_peek(&tx_done, &span) < sizeof(can_tx_done_t))
+		return NULL;
+	return (const can_tx_done_t *)span;
+}
+
+void can_tx_done_release(void)
+{
+	spsc_read_commit(&tx_done, sizeof(can_tx_done_t));
+}
+#endif
+
+uint32_t can_status(void)
+{
+	return CAN_ESR(CAN1);
+}
+
+void can_stats_reset(void)
+{
+	// the interrupt updates the counters, keep it out while they are cleared
+	nvic_disable_irq(NVIC_CEC_CAN_IRQ);
+	memset((void *)&can_rx_stats, 0, sizeof(can_rx_stats));
+	memset((void *)&can_tx_stats, 0, sizeof(can_tx_stats));
+	memset((void *)&can_err_stats, 0, sizeof(can_err_stats));
+	nvic_enable_irq(NVIC_CEC_CAN_IRQ);
+}
+
+const can_frame_t *can_rx_peek(void)
+{
+	uint8_t *span;
+
+	// frames never straddle the end of the ring, the size is a multiple of them
+	if (spsc_read_peek(&rx_queue, &span) < sizeof(can_frame_t))
+		return NULL;
+
+	return (const can_frame_t *)span;
+}
+
+uint32_t can_rx_timestamp(const can_frame_t *frame)
+{
+	return rx_stamp[frame - rx_queue_storage];
+}
+
+void can_rx_release(void)
+{
+	spsc_read_commit(&rx_queue, sizeof(can_frame_t));
+}
+
+uint16_t can_rx_depth(void)
+{
+	return (uint16_t)(spsc_used(&rx_queue) / sizeof(can_frame_t));
 }
@@ -1,8 +1,113 @@
 #ifndef CAN_H
 #define CAN_H
 #include "stdint.h"
+#include "stdbool.h"
+
+#define CAN_RX_QUEUE_LEN 32u /* frames, must be a power of two */
+#define CAN_TX_QUEUE_LEN 32u /* frames, must be a power of two */
+#define CAN_ERR_REPORT_MS 10u /* shortest interval between two error reports */
+#define CAN_TX_GUARD_US 20u /* from a periodic frame falling due to its mailbox write */
+
+/** @brief  Received frame as copied out of the bxCAN FIFO
+ */
+typedef struct
+{
+	uint32_t id;	  /**< identifier | CAN_XTD_FRAME | CAN_RTR_FRAME */
+	uint8_t dlc;	  /**< data length code (0..8) */
+	uint8_t fmi;	  /**< index of the filter that matched */
+	uint16_t tag;	  /**< TX: reported through can_tx_done once sent, 0 for none */
+	uint8_t data[8];  /**< payload */
+} can_frame_t;
+
+/** @brief  RX queue counters, written by the CAN interrupt only
+ */
+typedef struct
+{
+	uint32_t queued;	 /**< frames put into the RX queue */
+	uint32_t dropped;	 /**< frames lost because the RX queue was full */
+	uint32_t overrun[2]; /**< frames lost by a full hardware FIFO (FOVR) */
+	uint32_t fifo[2];	 /**< frames read from FIFO0 / FIFO1 */
+	uint16_t high_water; /**< deepest RX queue fill seen, in frames */
+} can_rx_stats_t;
+
+/** @brief  TX queue counters
+ */
+typedef struct
+{
+	uint32_t queued;	 /**< frames accepted into the TX queue */
+	uint32_t direct;	 /**< of them, frames written straight into a mailbox */
+	uint32_t rejected;	 /**< frames refused because the TX queue was full */
+	uint32_t sent;		 /**< frames acknowledged on the bus */
+	uint32_t failed;	 /**< transmissions ended without success */
+	uint32_t mailbox[3]; /**< frames sent from each TX mailbox */
+	uint16_t high_water; /**< deepest TX queue fill seen, in frames */
+} can_tx_stats_t;
+
+/** @brief  Completed transmission of a tagged frame
+ */
+typedef struct
+{
+	uint16_t tag;	/**< can_frame_t.tag of the frame */
+	bool ok;		/**< acknowledged on the bus, false if aborted */
+	uint8_t __pad;	/**< (padding) */
+	uint32_t time;	/**< time stamp of the completion in microseconds */
+} can_tx_done_t;
+
+#define CAN_TX_DONE_LEN 16u /* completions, must be a power of two */
+
+/* Fields of the TIxR image taken by can_tx_direct(), as in the bxCAN TX
+ * mailbox identifier register; TDTxR only holds the DLC */
+#define CAN_TIR_STID_SHIFT 21u /* 11-bit identifier */
+#define CAN_TIR_EXID_SHIFT 3u  /* 29-bit identifier */
+#define CAN_TIR_IDE 0x4u	   /* extended identifier */
+#define CAN_TIR_RTR 0x2u	   /* remote frame */
+
+/** @brief  Bus error and CAN interrupt counters
+ */
+typedef struct
+{
+	uint32_t bus_off;	 /**< transitions into bus-off */
+	uint32_t isr_count;	 /**< CAN interrupts served */
+	uint32_t isr_max;	 /**< longest CAN interrupt, in CPU cycles */
+	uint32_t isr_total;	 /**< sum of all CAN interrupt durations, in CPU cycles */
+} can_err_stats_t;
+
+extern volatile can_rx_stats_t can_rx_stats;
+extern volatile can_tx_stats_t can_tx_stats;
+extern volatile can_err_stats_t can_err_stats;
+
+/* fields of the can_status() word (bxCAN ESR) */
+#define CAN_STATUS_EWG(s) (((s) >> 0) & 0x1u)  /* error warning, a counter >= 96 */
+#define CAN_STATUS_EPV(s) (((s) >> 1) & 0x1u)  /* error passive, a counter > 127 */
+#define CAN_STATUS_BOFF(s) (((s) >> 2) & 0x1u) /* bus-off */
+#define CAN_STATUS_LEC(s) (((s) >> 4) & 0x7u)  /* last error code */
+#define CAN_STATUS_TEC(s) (((s) >> 16) & 0xFFu)
+#define CAN_STATUS_REC(s) (((s) >> 24) & 0xFFu)
 
 void can_setup(uint8_t i);
+void can_setup_btr(uint32_t btr);
 void can_send_message(uint32_t id, uint8_t *data, uint8_t len);
+void can_filter_apply(void);
+uint32_t can_status(void);
+void can_stats_reset(void);
+
+const can_frame_t *can_rx_peek(void);
+uint32_t can_rx_timestamp(const can_frame_t *frame);
+void can_rx_release(void);
+uint16_t can_rx_depth(void);
+
+bool can_tx_enqueue(const can_frame_t *frame);
+bool can_tx_direct(uint32_t tir, uint32_t tdtr, uint32_t tdlr, uint32_t tdhr);
+uint16_t can_tx_free(void);
+#ifdef USB_GS_USB
+const can_tx_done_t *can_tx_done_peek(void);
+void can_tx_done_release(void);
+#endif
+
+// Forward only received frames whose payload changed, see change.h
+void can_rx_change_only(bool enable, uint16_t keepalive_ms);
+
+void can_err_reporting(bool enable);
+bool can_err_take(can_frame_t *frame, uint32_t *timestamp);
 
 #endif /* CAN_H */
\ No newline at end of file
@@ -0,0 +1,128 @@
+/*
+ * change.c
+ *
+ * Last-payload cache of the change-only forwarding mode. It is consulted by
+ * the CAN interrupt for every received frame, so a lookup is a multiply, a
+ * shift and at most CAN_CHANGE_PROBE slot compares; nothing in here touches
+ * the hardware and can.c keeps the interrupt out while the table is set up.
+ */
+#include <string.h>
+#include "slcan.h"
+#include "change.h"
+
+/* no received frame is extended, error and remote at once */
+#define CHANGE_EMPTY 0xFFFFFFFFu
+
+/* a DLC no frame has, so a slot holding it never matches a payload */
+#define CHANGE_NO_DLC 0xFFu
+
+/* time stamps are kept in units of 1024 us, the shift is cheaper than a
+ * division by 1000 on the Cortex-M0 */
+#define CHANGE_TICK_SHIFT 10u
+
+typedef struct
+{
+	uint32_t id;	 /* identifier | CAN_XTD_FRAME, CHANGE_EMPTY when free */
+	uint8_t data[8]; /* payload last forwarded */
+	uint16_t sent;	 /* tick it was forwarded at */
+	uint8_t dlc;
+	uint8_t __pad;
+} change_slot_t;
+
+static change_slot_t table[CAN_CHANGE_SLOTS];
+static bool enabled;
+static uint16_t keepalive_ms;
+static uint16_t keepalive; /* ticks, 0 for none */
+static uint8_t used;
+static uint32_t suppressed;
+static uint32_t evictions;
+static change_slot_t *last_stored; /* slot of the frame last let through */
+
+void can_change_setup(bool enable, uint16_t keepalive_period_ms)
+{
+	for (uint8_t i = 0; i < CAN_CHANGE_SLOTS; i++)
+		table[i].id = CHANGE_EMPTY;
+	enabled = enable;
+	keepalive_ms = keepalive_period_ms;
+	// round up, 65535 ms are 64000 ticks
+	keepalive = (uint16_t)(((uint32_t)keepalive_period_ms * 1000u + (1u << CHANGE_TICK_SHIFT) - 1u) >> CHANGE_TICK_SHIFT);
+	used = 0;
+	last_stored = NULL;
+	suppressed = 0;
+	evictions = 0;
+}
+
+void can_change_stats(can_change_stats_t *stats)
+{
+	stats->enabled = enabled;
+	stats->keepalive_ms = keepalive_ms;
+	stats->used = used;
+	stats->suppressed = suppressed;
+	stats->evictions = evictions;
+}
+
+static void change_store(change_slot_t *slot, uint32_t id, uint8_t dlc, const uint8_t *data, uint16_t tick)
+{
+	slot->id = id;
+	slot->dlc = dlc;
+	slot->sent = tick;
+	memcpy(slot->data, data, CAN_LEN_MAX);
+	last_stored = slot;
+}
+
+// Ages are differences of 16-bit ticks, right for 67 s. A cyclic identifier
+// with a keep-alive is forwarded well within that, one that has been silent
+// for longer may find its keep-alive taken as not due yet.
+bool can_change_pass(uint32_t id, uint8_t dlc, const uint8_t *data, uint32_t now)
+{
+	last_stored = NULL;
+	if (!enabled || (id & CAN_RTR_FRAME))
+		return true;
+
+	uint16_t tick = (uint16_t)(now >> CHANGE_TICK_SHIFT);
+	uint8_t len = (dlc < CAN_LEN_MAX) ? dlc : CAN_LEN_MAX;
+	// Fibonacci hashing: the top bits of the product mix all bits of the
+	// identifier, so runs of consecutive identifiers spread over the table
+	uint32_t home = (id * 0x9E3779B1u) >> (32u - CAN_CHANGE_BITS);
+	change_slot_t *victim = NULL;
+
+	for (uint8_t i = 0; i < CAN_CHANGE_PROBE; i++)
+	{
+		change_slot_t *slot = &table[(home + i) & (CAN_CHANGE_SLOTS - 1u)];
+
+		if (slot->id == id)
+		{
+			if ((slot->dlc == dlc) && (memcmp(slot->data, data, len) == 0) &&
+				((keepalive == 0u) || ((uint16_t)(tick - slot->sent) < keepalive)))
+			{
+				suppressed++;
+				return false;
+			}
+			change_store(slot, id, dlc, data, tick);
+			return true;
+		}
+		// slots are only emptied all at once, so an identifier is never
+		// placed behind a free slot of its window
+		if (slot->id == CHANGE_EMPTY)
+		{
+			used++;
+			change_store(slot, id, dlc, data, tick);
+			return true;
+		}
+		if ((victim == NULL) || ((uint16_t)(tick - slot->sent) > (uint16_t)(tick - victim->sent)))
+			victim = slot;
+	}
+
+	evictions++;
+	change_store(victim, id, dlc, data, tick);
+	return true;
+}
+
+// The identifier keeps its slot and its age for eviction, only the payload
+// is forgotten
+void can_change_unsent(void)
+{
+	if (last_stored != NULL)
+		last_stored->dlc = CHANGE_NO_DLC;
+	last_stored = NULL;
+}
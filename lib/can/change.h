@@ -0,0 +1,48 @@
+#ifndef CHANGE_H
+#define CHANGE_H
+#include "stdint.h"
+#include "stdbool.h"
+
+#define CAN_CHANGE_BITS 6u /* log2 of the cache slots */
+#define CAN_CHANGE_SLOTS (1u << CAN_CHANGE_BITS) /* 16 bytes of RAM each */
+#define CAN_CHANGE_PROBE 8u /* slots an identifier may be placed in */
+
+/*
+ * Change-only forwarding: a cache of the last payload forwarded for each
+ * identifier, in an open addressing hash table. A received frame is only
+ * forwarded if its DLC or payload differ from that, or if the identifier's
+ * keep-alive period has passed since it was last forwarded. Remote frames
+ * always pass.
+ *
+ * An identifier lives in one of the CAN_CHANGE_PROBE slots from its hash
+ * on. When all of them are taken by others, the one forwarded longest ago
+ * is evicted; an evicted identifier's next frame passes again, so a table
+ * too small for the bus costs bandwidth, never a change.
+ */
+
+/** @brief  Change-only counters
+ */
+typedef struct
+{
+	bool enabled;		   /**< forwarding changes only */
+	uint16_t keepalive_ms; /**< keep-alive period, 0 for none */
+	uint8_t used;		   /**< slots holding an identifier */
+	uint32_t suppressed;   /**< frames not forwarded */
+	uint32_t evictions;	   /**< identifiers dropped from a full probe window */
+} can_change_stats_t;
+
+// Empties the table and clears the counters; a keep-alive of 0 forwards an
+// unchanged payload never again
+void can_change_setup(bool enable, uint16_t keepalive_ms);
+void can_change_stats(can_change_stats_t *stats);
+
+// Used by cec_can_isr: true if the frame is to be forwarded, which is then
+// taken as the identifier's last payload. now is the receive time stamp.
+bool can_change_pass(uint32_t id, uint8_t dlc, const uint8_t *data, uint32_t now);
+
+// Used by cec_can_isr when the frame can_change_pass() just let through is
+// dropped after all (by the rate limiter): its payload is not the host's,
+// so the identifier's next frame passes whatever it holds
+void can_change_unsent(void);
+
+#endif /* CHANGE_H */
@@ -0,0 +1,368 @@
+/*
+ * filter.c
+ *
+ * Acceptance filter state and the packing of filter entries into bxCAN
+ * filter banks. Nothing in here touches the hardware, so the allocator can
+ * be exercised on the host; can.c programs the resulting bank images.
+ */
+#include <stddef.h>
+#include "slcan.h"
+#include "filter.h"
+
+/* SJA1000 acceptance code/mask, mask bits set are "don't care" */
+static uint32_t acceptance_code = 0x00000000u;
+static uint32_t acceptance_mask = 0xFFFFFFFFu;
+static bool acceptance_dual = false;
+
+static can_filter_entry_t filter_list[CAN_FILTER_LIST_MAX];
+static uint8_t filter_count = 0;
+
+/* split the entries by ID priority over FIFO1 (high) and FIFO0 (low) */
+static bool filter_balance = false;
+
+void can_filter_set_code(uint32_t code)
+{
+	acceptance_code = code;
+}
+
+void can_filter_set_mask(uint32_t mask)
+{
+	acceptance_mask = mask;
+}
+
+void can_filter_set_dual(bool dual)
+{
+	acceptance_dual = dual;
+}
+
+void can_filter_set_balance(bool balance)
+{
+	filter_balance = balance;
+}
+
+bool can_filter_list_add(uint32_t id, uint32_t mask)
+{
+	if (filter_count >= CAN_FILTER_LIST_MAX)
+		return false;
+
+	filter_list[filter_count].id = id;
+	filter_list[filter_count].mask = mask;
+	filter_count++;
+	return true;
+}
+
+void can_filter_list_clear(void)
+{
+	filter_count = 0;
+}
+
+// Translate the SJA1000 registers into filter entries. Data byte matching of
+// the single filter mode has no bxCAN equivalent and is left out.
+static uint8_t acceptance_entries(can_filter_entry_t *list)
+{
+	uint32_t code = acceptance_code;
+	uint32_t care = ~acceptance_mask;
+
+	if (!acceptance_dual)
+	{
+		// single filter: ACR0..ACR1 hold ID.10-0, ACR0..ACR3 hold ID.28-0
+		list[0].id = (code >> 21) & CAN_STD_MASK;
+		list[0].mask = (care >> 21) & CAN_STD_MASK;
+		list[1].id = CAN_XTD_FRAME | ((code >> 3) & CAN_XTD_MASK);
+		list[1].mask = (care >> 3) & CAN_XTD_MASK;
+		return 2;
+	}
+
+	// dual filter: ACR0/ACR1 and ACR2/ACR3 each hold ID.10-0 of a standard
+	// frame or ID.28-13 of an extended one
+	for (uint8_t i = 0; i < 2u; i++)
+	{
+		uint32_t half_code = (i == 0u) ? (code >> 16) : (code & 0xFFFFu);
+		uint32_t half_care = (i == 0u) ? (care >> 16) : (care & 0xFFFFu);
+
+		list[2u * i].id = (half_code >> 5) & CAN_STD_MASK;
+		list[2u * i].mask = (half_care >> 5) & CAN_STD_MASK;
+		list[2u * i + 1u].id = CAN_XTD_FRAME | ((half_code << 13) & CAN_XTD_MASK);
+		list[2u * i + 1u].mask = (half_care << 13) & CAN_XTD_MASK;
+	}
+	return 4;
+}
+
+static bool entry_xtd(const can_filter_entry_t *entry);
+
+// Arbitration order of the lowest ID an entry accepts, smaller wins the bus.
+// A standard frame beats an extended one with the same base ID.
+static uint32_t entry_priority(const can_filter_entry_t *entry)
+{
+	if (entry_xtd(entry))
+		return ((entry->id & entry->mask & CAN_XTD_MASK) << 1) | 1u;
+	return (entry->id & entry->mask & CAN_STD_MASK) << 19;
+}
+
+// Give the high priority half of the entries to FIFO1 and the rest to FIFO0.
+// Entries that leave the top ID bit open are split on it first, so that even
+// the accept-all filter is shared between both FIFOs.
+static uint8_t build_balanced(can_filter_entry_t *list, uint8_t count,
+							  can_filter_bank_t *banks, uint8_t max_banks)
+{
+	uint8_t high, n;
+
+	for (uint8_t i = 0, end = count; (i < end) && (count < CAN_FILTER_LIST_MAX); i++)
+	{
+		uint32_t top = entry_xtd(&list[i]) ? 0x10000000u : 0x400u;
+
+		if (list[i].mask & top)
+			continue;
+		list[i].mask |= top;
+		list[i].id &= ~top;
+		list[count] = list[i];
+		list[count].id |= top;
+		count++;
+	}
+
+	for (uint8_t i = 1; i < count; i++)
+	{
+		can_filter_entry_t entry = list[i];
+		uint8_t j = i;
+
+		for (; (j > 0u) && (entry_priority(&list[j - 1u]) > entry_priority(&entry)); j--)
+			list[j] = list[j - 1u];
+		list[j] = entry;
+	}
+
+	high = (uint8_t)((count + 1u) / 2u);
+	n = can_filter_allocate(list, high, banks, (uint8_t)(max_banks / 2u));
+	for (uint8_t i = 0; i < n; i++)
+		banks[i].fifo = 1;
+	return (uint8_t)(n + can_filter_allocate(&list[high], (uint8_t)(count - high),
+											 &banks[n], (uint8_t)(max_banks - n)));
+}
+
+uint8_t can_filter_build(can_filter_bank_t *banks, uint8_t max_banks)
+{
+	can_filter_entry_t list[CAN_FILTER_LIST_MAX];
+	uint8_t count;
+
+	if (filter_count)
+	{
+		for (count = 0; count < filter_count; count++)
+			list[count] = filter_list[count];
+	}
+	else
+	{
+		count = acceptance_entries(list);
+	}
+
+	if (filter_balance)
+		return build_balanced(list, count, banks, max_banks);
+	return can_filter_allocate(list, count, banks, max_banks);
+}
+
+/*  -----------  allocation  ---------------------------------------------
+ *
+ *  Entries match data and remote frames alike. Mask banks leave the RTR bit
+ *  open; list banks compare it too, so each exact ID takes two slots, one
+ *  with RTR clear and one with it set. Per bank, bxCAN thus holds two exact
+ *  11-bit IDs (16-bit list), two 11-bit ID/mask pairs (16-bit mask), one
+ *  exact ID of any kind (32-bit list) or one ID/mask pair of any kind (32-bit
+ *  mask). Entries are sorted into those four classes; while they need more
+ *  banks than available, the two entries of the same frame type whose merged
+ *  mask keeps the most bits are replaced by that superset.
+ */
+
+#define STD_FILTER_ID(id) ((uint32_t)(id) << 21)
+#define XTD_FILTER_ID(id) (((uint32_t)(id) << 3) | 0x4u)
+#define STD_FILTER16(id) (((uint32_t)(id) << 5) & 0xFFE0u)
+#define FILTER_IDE32 0x4u
+#define FILTER_IDE16 0x8u
+#define FILTER_RTR32 0x2u
+#define FILTER_RTR16 0x10u
+
+static bool entry_xtd(const can_filter_entry_t *entry)
+{
+	return (entry->id & CAN_XTD_FRAME) != 0;
+}
+
+static uint32_t entry_bits(const can_filter_entry_t *entry)
+{
+	return entry_xtd(entry) ? CAN_XTD_MASK : CAN_STD_MASK;
+}
+
+static bool entry_exact(const can_filter_entry_t *entry)
+{
+	return entry->mask == entry_bits(entry);
+}
+
+static uint8_t banks_needed(const can_filter_entry_t *list, uint8_t count)
+{
+	uint8_t std_exact = 0, std_masked = 0, xtd_exact = 0, xtd_masked = 0;
+
+	for (uint8_t i = 0; i < count; i++)
+	{
+		if (entry_xtd(&list[i]))
+			entry_exact(&list[i]) ? xtd_exact++ : xtd_masked++;
+		else
+			entry_exact(&list[i]) ? std_exact++ : std_masked++;
+	}
+
+	// an odd 16-bit mask bank has room for one exact ID
+	if ((std_masked & 1u) && std_exact)
+		std_exact--;
+
+	return (uint8_t)(xtd_masked + xtd_exact + (std_masked + 1u) / 2u + (std_exact + 1u) / 2u);
+}
+
+static void merge_closest(can_filter_entry_t *list, uint8_t *count)
+{
+	uint8_t best_i = 0, best_j = 0;
+	int best_bits = -1;
+	bool best_masked = false;
+
+	for (uint8_t i = 0; i < *count; i++)
+	{
+		for (uint8_t j = (uint8_t)(i + 1u); j < *count; j++)
+		{
+			if (entry_xtd(&list[i]) != entry_xtd(&list[j]))
+				continue;
+
+			uint32_t mask = list[i].mask & list[j].mask & ~(list[i].id ^ list[j].id);
+			int bits = __builtin_popcount(mask);
+			bool masked = !entry_exact(&list[i]) && !entry_exact(&list[j]);
+
+			// keep as many bits as possible, rather give up entries that
+			// are already inexact
+			if ((bits > best_bits) || ((bits == best_bits) && masked && !best_masked))
+			{
+				best_bits = bits;
+				best_masked = masked;
+				best_i = i;
+				best_j = j;
+			}
+		}
+	}
+
+	if (best_bits < 0)
+		return;
+
+	list[best_i].mask &= list[best_j].mask & ~(list[best_i].id ^ list[best_j].id);
+	list[best_i].id = (list[best_i].id & (list[best_i].mask | CAN_XTD_FRAME));
+	list[best_j] = list[--(*count)];
+}
+
+uint8_t can_filter_allocate(const can_filter_entry_t *list, uint8_t count,
+							can_filter_bank_t *banks, uint8_t max_banks)
+{
+	can_filter_entry_t work[CAN_FILTER_LIST_MAX];
+	// work[] indexes per bank type, bytes rather than pointers to save stack
+	uint8_t std_exact[CAN_FILTER_LIST_MAX], std_masked[CAN_FILTER_LIST_MAX];
+	uint8_t xtd_exact[CAN_FILTER_LIST_MAX], xtd_masked[CAN_FILTER_LIST_MAX];
+	uint8_t nse = 0, nsm = 0, nxe = 0, nxm = 0;
+	uint8_t n = 0;
+
+	if (count > CAN_FILTER_LIST_MAX)
+		count = CAN_FILTER_LIST_MAX;
+
+	// normalise: only identifier bits, id bits outside the mask cleared
+	for (uint8_t i = 0; i < count; i++)
+	{
+		uint32_t bits = entry_bits(&list[i]);
+
+		work[i].mask = list[i].mask & bits;
+		work[i].id = (list[i].id & work[i].mask) | (list[i].id & CAN_XTD_FRAME);
+	}
+
+	while ((count > 1u) && (banks_needed(work, count) > max_banks))
+	{
+		uint8_t before = count;
+		merge_closest(work, &count);
+		if (count == before)
+			break;
+	}
+
+	for (uint8_t i = 0; i < count; i++)
+	{
+		if (entry_xtd(&work[i]))
+		{
+			if (entry_exact(&work[i]))
+				xtd_exact[nxe++] = i;
+			else
+				xtd_masked[nxm++] = i;
+		}
+		else
+		{
+			if (entry_exact(&work[i]))
+				std_exact[nse++] = i;
+			else
+				std_masked[nsm++] = i;
+		}
+	}
+
+	// 32-bit mask: one ID/mask pair of either frame type
+	for (uint8_t i = 0; (i < nxm) && (n < max_banks); i++, n++)
+	{
+		banks[n] = (can_filter_bank_t){
+			.scale_32bit = true,
+			.id_list_mode = false,
+			.fr1 = XTD_FILTER_ID(work[xtd_masked[i]].id & CAN_XTD_MASK),
+			.fr2 = XTD_FILTER_ID(work[xtd_masked[i]].mask),
+		};
+	}
+
+	// 32-bit list: an exact extended ID as data and remote frame
+	for (uint8_t i = 0; (i < nxe) && (n < max_banks); i++, n++)
+	{
+		uint32_t id = XTD_FILTER_ID(work[xtd_exact[i]].id & CAN_XTD_MASK);
+
+		banks[n] = (can_filter_bank_t){
+			.scale_32bit = true,
+			.id_list_mode = true,
+			.fr1 = id,
+			.fr2 = id | FILTER_RTR32,
+		};
+	}
+
+	// 16-bit mask: two standard ID/mask pairs, a spare slot takes an exact ID
+	for (uint8_t i = 0; (i < nsm) && (n < max_banks); i += 2u, n++)
+	{
+		uint32_t id2, mask2;
+
+		if (i + 1u < nsm)
+		{
+			id2 = work[std_masked[i + 1u]].id;
+			mask2 = work[std_masked[i + 1u]].mask;
+		}
+		else if (nse)
+		{
+			id2 = work[std_exact[--nse]].id;
+			mask2 = CAN_STD_MASK;
+		}
+		else
+		{
+			id2 = work[std_masked[i]].id;
+			mask2 = work[std_masked[i]].mask;
+		}
+
+		banks[n] = (can_filter_bank_t){
+			.scale_32bit = false,
+			.id_list_mode = false,
+			.fr1 = STD_FILTER16(work[std_masked[i]].id) | ((STD_FILTER16(work[std_masked[i]].mask) | FILTER_IDE16) << 16),
+			.fr2 = STD_FILTER16(id2) | ((STD_FILTER16(mask2) | FILTER_IDE16) << 16),
+		};
+	}
+
+	// 16-bit list: two exact standard IDs as data and remote frame
+	for (uint8_t i = 0; (i < nse) && (n < max_banks); i += 2u, n++)
+	{
+		uint32_t id1 = STD_FILTER16(work[std_exact[i]].id);
+		uint32_t id2 = STD_FILTER16(work[std_exact[(i + 1u < nse) ? (i + 1u) : i]].id);
+
+		banks[n] = (can_filter_bank_t){
+			.scale_32bit = false,
+			.id_list_mode = true,
+			.fr1 = id1 | ((id1 | FILTER_RTR16) << 16),
+			.fr2 = id2 | ((id2 | FILTER_RTR16) << 16),
+		};
+	}
+
+	return n;
+}
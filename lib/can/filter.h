@@ -0,0 +1,47 @@
+#ifndef FILTER_H
+#define FILTER_H
+#include "stdint.h"
+#include "stdbool.h"
+
+#define CAN_FILTER_BANKS 14u	 /* bxCAN filter banks on the F042 */
+#define CAN_FILTER_LIST_MAX 32u /* entries of the explicit ID list */
+
+/** @brief  Acceptance filter entry: frames whose identifier matches @p id in
+ *          every bit set in @p mask are accepted, data and remote frames
+ *          alike. CAN_XTD_FRAME in @p id selects 29-bit matching; a full
+ *          mask is an exact ID.
+ */
+typedef struct
+{
+	uint32_t id;
+	uint32_t mask;
+} can_filter_entry_t;
+
+/** @brief  Register image of one bxCAN filter bank
+ */
+typedef struct
+{
+	bool scale_32bit;  /**< one 32-bit or two 16-bit filters per register */
+	bool id_list_mode; /**< FR1/FR2 hold identifiers instead of id/mask */
+	uint8_t fifo;	   /**< FIFO the bank assigns matches to */
+	uint32_t fr1;
+	uint32_t fr2;
+} can_filter_bank_t;
+
+// SJA1000 style acceptance filter (M, m and W commands)
+void can_filter_set_code(uint32_t code);
+void can_filter_set_mask(uint32_t mask);
+void can_filter_set_dual(bool dual);
+
+// High priority IDs to FIFO1, the rest to FIFO0
+void can_filter_set_balance(bool balance);
+
+// Explicit list of IDs and ID/mask pairs, takes precedence over M/m/W
+bool can_filter_list_add(uint32_t id, uint32_t mask);
+void can_filter_list_clear(void);
+
+uint8_t can_filter_build(can_filter_bank_t *banks, uint8_t max_banks);
+uint8_t can_filter_allocate(const can_filter_entry_t *list, uint8_t count,
+							can_filter_bank_t *banks, uint8_t max_banks);
+
+#endif /* FILTER_H */
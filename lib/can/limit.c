@@ -0,0 +1,123 @@
+/*
+ * limit.c
+ *
+ * RX rate limiter. The buckets hold credit in microseconds instead of
+ * tokens: time since the last frame adds to it up to burst periods, a frame
+ * that passes takes one period. That is the same token bucket without a
+ * division in the CAN interrupt, which runs the check for every received
+ * frame; the period is worked out when the rule is set. The K command, run
+ * by the USB interrupt, turns the CAN interrupt off to change the table.
+ */
+#include <stddef.h>
+#include <string.h>
+#include <libopencm3/cm3/nvic.h>
+#include "slcan.h"
+#include "limit.h"
+
+typedef struct
+{
+	can_limit_rule_t rule;
+	uint32_t period; /* microseconds per token */
+	uint32_t depth;	 /* credit of a full bucket */
+	uint32_t credit;
+	uint32_t last;	 /* time stamp credit was added at */
+	uint8_t skipped; /* frames dropped since the last decimated one passed */
+} limit_entry_t;
+
+static limit_entry_t table[CAN_LIMIT_MAX];
+static uint8_t active; /* bit n: rule n is in use */
+static uint32_t suppressed;
+
+bool can_limit_set(uint8_t index, const can_limit_rule_t *rule)
+{
+	limit_entry_t *e;
+
+	if ((index >= CAN_LIMIT_MAX) || ((rule->rate != 0u) && (rule->burst == 0u)))
+		return false;
+
+	e = &table[index];
+	nvic_disable_irq(NVIC_CEC_CAN_IRQ);
+	active &= (uint8_t)~(1u << index);
+	if (rule->rate != 0u)
+	{
+		e->rule = *rule;
+		e->rule.passed = 0;
+		e->rule.suppressed = 0;
+		e->period = 1000000u / rule->rate;
+		e->depth = e->period * rule->burst;
+		e->credit = e->depth;
+		e->skipped = 0;
+		// the bucket is full already, the time stamp only has to be recent
+		e->last = 0;
+		active |= (uint8_t)(1u << index);
+	}
+	nvic_enable_irq(NVIC_CEC_CAN_IRQ);
+	return true;
+}
+
+void can_limit_get(uint8_t index, can_limit_rule_t *rule)
+{
+	memset(rule, 0, sizeof(*rule));
+	if ((index >= CAN_LIMIT_MAX) || !(active & (1u << index)))
+		return;
+
+	nvic_disable_irq(NVIC_CEC_CAN_IRQ);
+	*rule = table[index].rule;
+	nvic_enable_irq(NVIC_CEC_CAN_IRQ);
+}
+
+void can_limit_reset(void)
+{
+	nvic_disable_irq(NVIC_CEC_CAN_IRQ);
+	active = 0;
+	suppressed = 0;
+	nvic_enable_irq(NVIC_CEC_CAN_IRQ);
+}
+
+uint8_t can_limit_active(void)
+{
+	return active;
+}
+
+uint32_t can_limit_suppressed(void)
+{
+	return suppressed;
+}
+
+bool can_limit_pass(uint32_t id, uint32_t now)
+{
+	uint8_t pending = active;
+
+	// the remote flag takes no part in the match
+	id &= ~CAN_RTR_FRAME;
+	for (uint8_t i = 0; pending; i++, pending >>= 1)
+	{
+		limit_entry_t *e = &table[i];
+
+		if (!(pending & 1u) || (((id ^ e->rule.id) & (e->rule.mask | CAN_XTD_FRAME)) != 0u))
+			continue;
+
+		uint32_t elapsed = now - e->last;
+
+		e->last = now;
+		// a bucket left alone for longer than the time stamp wraps in looks
+		// refilled by less, but never by more than it holds
+		e->credit = ((e->depth - e->credit) > elapsed) ? (e->credit + elapsed) : e->depth;
+		if (e->credit >= e->period)
+		{
+			e->credit -= e->period;
+			e->rule.passed++;
+			return true;
+		}
+		if ((e->rule.decimate != 0u) && (++e->skipped >= e->rule.decimate))
+		{
+			e->skipped = 0;
+			e->rule.passed++;
+			return true;
+		}
+		e->rule.suppressed++;
+		suppressed++;
+		return false;
+	}
+	return true;
+}
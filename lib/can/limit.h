@@ -0,0 +1,46 @@
+#ifndef LIMIT_H
+#define LIMIT_H
+#include "stdint.h"
+#include "stdbool.h"
+
+#define CAN_LIMIT_MAX 8u /* rules of the RX rate limiter */
+
+/*
+ * Rate limits on the received frames, so one identifier flooding the bus
+ * can't take the whole USB link. A rule matches frames whose identifier
+ * agrees with its own in every bit set in the mask, extended identifiers
+ * only with rules for extended ones; the first matching rule in table order
+ * applies, frames no rule matches always pass.
+ *
+ * Each rule is a token bucket holding up to burst frames and refilled at
+ * rate frames per second. A frame that finds the bucket empty is dropped,
+ * except every decimate-th of them, so the host still sees a sample of a
+ * flood; a decimation of 0 drops them all.
+ */
+
+/** @brief  Rate limit rule and its counters
+ */
+typedef struct
+{
+	uint32_t id;		 /**< identifier | CAN_XTD_FRAME */
+	uint32_t mask;		 /**< identifier bits that must match */
+	uint16_t rate;		 /**< frames per second, 0 for an unused rule */
+	uint8_t burst;		 /**< frames passed back to back after a pause, at least 1 */
+	uint8_t decimate;	 /**< over the limit, 1 of this many frames passes, 0 for none */
+	uint32_t passed;	 /**< frames forwarded */
+	uint32_t suppressed; /**< frames dropped */
+} can_limit_rule_t;
+
+// A rate of 0 removes the rule; setting one starts it with a full bucket
+// and cleared counters
+bool can_limit_set(uint8_t index, const can_limit_rule_t *rule);
+void can_limit_get(uint8_t index, can_limit_rule_t *rule);
+void can_limit_reset(void);
+uint8_t can_limit_active(void);
+uint32_t can_limit_suppressed(void);
+
+// Used by cec_can_isr: true if the received frame is to be forwarded. now
+// is its receive time stamp.
+bool can_limit_pass(uint32_t id, uint32_t now);
+
+#endif /* LIMIT_H */
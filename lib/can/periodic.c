@@ -0,0 +1,217 @@
+/*
+ * periodic.c
+ *
+ * Periodic TX table. The first timestamp alarm fires at the earliest due
+ * time of all entries, marks the due ones pending and pends the CAN
+ * interrupt, which puts them into the TX mailboxes ahead of the host's
+ * frames. With eight entries a scan of the table is cheaper than keeping a
+ * heap or timer wheel in order. TIM2 and the CAN interrupt run at the same
+ * priority, so neither preempts the other while it works on the pending
+ * mask; the p command, run by the lower priority USB interrupt, turns both
+ * off to change the table.
+ */
+#include <stddef.h>
+#include <libopencm3/cm3/nvic.h>
+#include "timestamp.h"
+#include "periodic.h"
+
+#define PERIODIC_ALARM 0u
+
+typedef struct
+{
+	can_frame_t frame;
+	uint32_t due;	 /* next time stamp to send at */
+	uint32_t period; /* microseconds */
+	uint32_t phase;	 /* microseconds after the start of the table */
+} periodic_entry_t;
+
+static periodic_entry_t table[CAN_PERIODIC_MAX];
+static uint8_t active;	/* bit n: entry n is in use */
+static uint8_t pending; /* bit n: entry n is due and not in a mailbox yet */
+static uint8_t peek_index;
+static uint32_t late;	/* periods an entry was still pending or missed */
+static uint32_t next_due; /* earliest due time of all entries */
+
+// The time stamp extended to 64 bits, so entries can be placed on the grid
+// of a table running for longer than the 71 minutes TIM2 takes to wrap. It
+// only has to be read once per wrap, and an active table is looked at at
+// least every 65.5 s.
+static uint64_t clock_us;
+static uint32_t clock_last;
+static uint64_t start_us;
+
+static uint32_t periodic_clock(void)
+{
+	uint32_t now = timestamp_now();
+
+	clock_us += (uint32_t)(now - clock_last);
+	clock_last = now;
+	return now;
+}
+
+// First time on the entry's grid that isn't in the past
+static uint32_t periodic_first_due(const periodic_entry_t *e)
+{
+	uint64_t first = start_us + e->phase;
+
+	if (clock_us > first)
+		first += ((clock_us - first + e->period - 1u) / e->period) * e->period;
+	return (uint32_t)first;
+}
+
+// Mark the due entries pending and set the alarm to the next due time, with
+// TIM2 and the CAN interrupt off or from the alarm
+static void periodic_schedule(void)
+{
+	uint32_t now, next = 0;
+
+	do
+	{
+		bool any = false;
+
+		now = periodic_clock();
+		for (uint8_t i = 0; i < CAN_PERIODIC_MAX; i++)
+		{
+			periodic_entry_t *e = &table[i];
+			uint8_t bit = (uint8_t)(1u << i);
+			int32_t wait;
+
+			if (!(active & bit))
+				continue;
+			wait = (int32_t)(e->due - now);
+			if (wait <= 0)
+			{
+				// the previous frame still waiting for a mailbox is sent
+				// with the current payload, this period is lost
+				if (pending & bit)
+					late++;
+				pending |= bit;
+
+				// periods missed entirely, the interrupt was held off
+				uint32_t missed = (uint32_t)-wait / e->period;
+
+				late += missed;
+				e->due += (missed + 1u) * e->period;
+				wait = (int32_t)(e->due - now);
+			}
+			if (!any || (wait < (int32_t)(next - now)))
+				next = e->due;
+			any = true;
+		}
+		if (!any)
+		{
+			timestamp_alarm_stop(PERIODIC_ALARM);
+			break;
+		}
+		// an alarm set for a time that has passed meanwhile would only match
+		// after the clock wraps
+		next_due = next;
+		timestamp_alarm(PERIODIC_ALARM, next);
+	} while ((int32_t)(next - timestamp_now()) <= 0);
+
+	if (pending)
+		nvic_set_pending_irq(NVIC_CEC_CAN_IRQ);
+}
+
+void can_periodic_alarm(void)
+{
+	if (timestamp_alarm_ack(PERIODIC_ALARM))
+		periodic_schedule();
+}
+
+// Set or replace entry index. With the same period and phase only the frame
+// changes and the entry keeps its schedule; a frame already due goes out
+// with the new payload, never half of each.
+bool can_periodic_set(uint8_t index, const can_frame_t *frame, uint16_t period_ms, uint16_t phase_ms)
+{
+	periodic_entry_t *e;
+	uint8_t bit = (uint8_t)(1u << index);
+	uint32_t period = (uint32_t)period_ms * 1000u;
+	uint32_t phase = (uint32_t)phase_ms * 1000u;
+
+	if ((index >= CAN_PERIODIC_MAX) || (period == 0u))
+		return false;
+
+	nvic_disable_irq(NVIC_TIM2_IRQ);
+	nvic_disable_irq(NVIC_CEC_CAN_IRQ);
+	e = &table[index];
+	e->frame = *frame;
+	e->frame.tag = 0;
+	if (!(active & bit) || (e->period != period) || (e->phase != phase))
+	{
+		periodic_clock();
+		if (!active)
+			start_us = clock_us;
+		e->period = period;
+		e->phase = phase;
+		e->due = periodic_first_due(e);
+		active |= bit;
+		pending &= (uint8_t)~bit;
+		periodic_schedule();
+	}
+	nvic_enable_irq(NVIC_CEC_CAN_IRQ);
+	nvic_enable_irq(NVIC_TIM2_IRQ);
+	return true;
+}
+
+// Remove entry index, a frame of it already in a mailbox is still sent
+void can_periodic_clear(uint8_t index)
+{
+	uint8_t bit = (uint8_t)(1u << index);
+
+	if (index >= CAN_PERIODIC_MAX)
+		return;
+
+	nvic_disable_irq(NVIC_TIM2_IRQ);
+	nvic_disable_irq(NVIC_CEC_CAN_IRQ);
+	active &= (uint8_t)~bit;
+	pending &= (uint8_t)~bit;
+	if (!active)
+		timestamp_alarm_stop(PERIODIC_ALARM);
+	nvic_enable_irq(NVIC_CEC_CAN_IRQ);
+	nvic_enable_irq(NVIC_TIM2_IRQ);
+}
+
+void can_periodic_reset(void)
+{
+	nvic_disable_irq(NVIC_TIM2_IRQ);
+	nvic_disable_irq(NVIC_CEC_CAN_IRQ);
+	active = 0;
+	pending = 0;
+	late = 0;
+	timestamp_alarm_stop(PERIODIC_ALARM);
+	nvic_enable_irq(NVIC_CEC_CAN_IRQ);
+	nvic_enable_irq(NVIC_TIM2_IRQ);
+}
+
+uint8_t can_periodic_active(void)
+{
+	return active;
+}
+
+uint32_t can_periodic_late(void)
+{
+	return late;
+}
+
+uint32_t can_periodic_next(void)
+{
+	return next_due;
+}
+
+// Lowest numbered pending entry, NULL if none
+const can_frame_t *can_periodic_peek(void)
+{
+	uint8_t ready = pending & active;
+
+	if (!ready)
+		return NULL;
+	for (peek_index = 0; !(ready & (1u << peek_index)); peek_index++)
+		;
+	return &table[peek_index].frame;
+}
+
+void can_periodic_release(void)
+{
+	pending &= (uint8_t)~(1u << peek_index);
+}
@@ -0,0 +1,31 @@
+#ifndef PERIODIC_H
+#define PERIODIC_H
+#include "stdint.h"
+#include "stdbool.h"
+#include "can.h"
+
+#define CAN_PERIODIC_MAX 8u /* entries of the periodic TX table */
+
+/*
+ * Frames the adapter sends by itself at a fixed period, timed by a TIM2
+ * compare channel instead of the host. Due times lie on one grid: entry n
+ * is sent at start + phase + k * period, where start is the moment the table
+ * got its first entry. Periods and phases are in milliseconds, 1..65535 and
+ * 0..65535.
+ */
+bool can_periodic_set(uint8_t index, const can_frame_t *frame, uint16_t period_ms, uint16_t phase_ms);
+void can_periodic_clear(uint8_t index);
+void can_periodic_reset(void);
+uint8_t can_periodic_active(void);
+uint32_t can_periodic_late(void);
+
+// Used by cec_can_isr to take due frames before the host's, and to keep the
+// host's off the bus when the next one falls due (its time stamp, only
+// meaningful while an entry is active)
+const can_frame_t *can_periodic_peek(void);
+void can_periodic_release(void);
+uint32_t can_periodic_next(void);
+// Called by tim2_isr
+void can_periodic_alarm(void);
+
+#endif /* PERIODIC_H */
@@ -0,0 +1,116 @@
+/*
+ * spsc.c
+ *
+ * Lock-free single-producer/single-consumer byte ring.
+ *
+ * Each index is stored by exactly one side. The producer publishes its data
+ * with a release store of head, the consumer hands space back with a release
+ * store of tail; the matching acquire loads make the payload copies visible
+ * in the right order between an interrupt handler and the main loop.
+ */
+
+#include <string.h>
+#include "types.h"
+#include "spsc.h"
+
+#define SPSC_LOAD(X) __atomic_load_n(&(X), __ATOMIC_ACQUIRE)
+#define SPSC_STORE(X, V) __atomic_store_n(&(X), (V), __ATOMIC_RELEASE)
+
+s32 spsc_init(struct spsc *spsc, u8 * buf, u32 size)
+{
+	if (!SPSC_IS_POW2(size))
+		return -1;
+
+	spsc->data = buf;
+	spsc->mask = size - 1;
+	spsc->head = 0;
+	spsc->tail = 0;
+
+	return 0;
+}
+
+u32 spsc_used(const struct spsc *spsc)
+{
+	return SPSC_LOAD(spsc->head) - SPSC_LOAD(spsc->tail);
+}
+
+u32 spsc_free(const struct spsc *spsc)
+{
+	return (spsc->mask + 1) - spsc_used(spsc);
+}
+
+u32 spsc_write_peek(struct spsc *spsc, u8 ** span)
+{
+	u32 head = spsc->head;
+	u32 space = (spsc->mask + 1) - (head - SPSC_LOAD(spsc->tail));
+	u32 offset = head & spsc->mask;
+	u32 contiguous = (spsc->mask + 1) - offset;
+
+	*span = &spsc->data[offset];
+
+	return (space < contiguous) ? space : contiguous;
+}
+
+void spsc_write_commit(struct spsc *spsc, u32 size)
+{
+	SPSC_STORE(spsc->head, spsc->head + size);
+}
+
+u32 spsc_write(struct spsc *spsc, const u8 * data, u32 size)
+{
+	u32 head = spsc->head;
+	u32 space = (spsc->mask + 1) - (head - SPSC_LOAD(spsc->tail));
+	u32 offset = head & spsc->mask;
+	u32 first;
+
+	if (size > space)
+		size = space;
+
+	first = (spsc->mask + 1) - offset;
+	if (first > size)
+		first = size;
+
+	memcpy(&spsc->data[offset], data, first);
+	memcpy(spsc->data, data + first, size - first);
+	SPSC_STORE(spsc->head, head + size);
+
+	return size;
+}
+
+u32 spsc_read_peek(struct spsc *spsc, u8 ** span)
+{
+	u32 tail = spsc->tail;
+	u32 used = SPSC_LOAD(spsc->head) - tail;
+	u32 offset = tail & spsc->mask;
+	u32 contiguous = (spsc->mask + 1) - offset;
+
+	*span = &spsc->data[offset];
+
+	return (used < contiguous) ? used : contiguous;
+}
+
+void spsc_read_commit(struct spsc *spsc, u32 size)
+{
+	SPSC_STORE(spsc->tail, spsc->tail + size);
+}
+
+u32 spsc_read(struct spsc *spsc, u8 * data, u32 size)
+{
+	u32 tail = spsc->tail;
+	u32 used = SPSC_LOAD(spsc->head) - tail;
+	u32 offset = tail & spsc->mask;
+	u32 first;
+
+	if (size > used)
+		size = used;
+
+	first = (spsc->mask + 1) - offset;
+	if (first > size)
+		first = size;
+
+	memcpy(data, &spsc->data[offset], first);
+	memcpy(data + first, spsc->data, size - first);
+	SPSC_STORE(spsc->tail, tail + size);
+
+	return size;
+}
@@ -0,0 +1,39 @@
+/*
+ * spsc.h
+ *
+ * Lock-free single-producer/single-consumer byte ring.
+ *
+ * One side (e.g. an interrupt handler) only ever writes, the other (e.g. the
+ * main loop) only ever reads. The buffer size must be a power of two; the
+ * head and tail indices run freely and are masked on access, so the whole
+ * buffer is usable and no division is needed.
+ */
+
+#ifndef SPSC_H
+#define SPSC_H
+#include "types.h"
+
+struct spsc {
+	u8 *data;
+	u32 mask;
+	volatile u32 head;	/* advanced by the producer only */
+	volatile u32 tail;	/* advanced by the consumer only */
+};
+
+#define SPSC_IS_POW2(SIZE) (((SIZE) != 0) && (((SIZE) & ((SIZE) - 1)) == 0))
+
+s32 spsc_init(struct spsc *spsc, u8 * buf, u32 size);
+u32 spsc_used(const struct spsc *spsc);
+u32 spsc_free(const struct spsc *spsc);
+
+/* producer side */
+u32 spsc_write(struct spsc *spsc, const u8 * data, u32 size);
+u32 spsc_write_peek(struct spsc *spsc, u8 ** span);
+void spsc_write_commit(struct spsc *spsc, u32 size);
+
+/* consumer side */
+u32 spsc_read(struct spsc *spsc, u8 * data, u32 size);
+u32 spsc_read_peek(struct spsc *spsc, u8 ** span);
+void spsc_read_commit(struct spsc *spsc, u32 size);
+
+#endif /* SPSC_H */
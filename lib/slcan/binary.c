@@ -0,0 +1,131 @@
+/*
+ * binary.c
+ *
+ *  Compact binary framing: one record per frame, COBS encoded and terminated
+ *  by 0x00, so a receiver resynchronises at the next zero byte whatever it
+ *  lost before. An 8-byte standard frame takes 13 bytes instead of the 22
+ *  of 't' + hex + CR.
+ */
+#include <string.h>
+#include "binary.h"
+
+uint8_t cobs_encode(const uint8_t *in, uint8_t size, uint8_t *out)
+{
+    uint8_t *code = out;
+    uint8_t *p = out + 1;
+    uint8_t run = 1;
+
+    for (uint8_t i = 0; i < size; i++)
+    {
+        if (in[i] == 0u)
+        {
+            *code = run;
+            code = p++;
+            run = 1;
+        }
+        else
+        {
+            *p++ = in[i];
+            run++;
+        }
+    }
+    *code = run;
+    *p++ = 0u;
+    return (uint8_t)(p - out);
+}
+
+uint8_t cobs_decode(uint8_t *buffer, uint8_t size)
+{
+    uint8_t r = 0;
+    uint8_t w = 0;
+
+    while (r < size)
+    {
+        uint8_t run = buffer[r++];
+
+        if ((run == 0u) || ((uint16_t)(r + run - 1u) > size))
+            return 0;
+        for (uint8_t k = 1; k < run; k++)
+            buffer[w++] = buffer[r++];
+        /* a full run of 254 data bytes has no implicit zero after it */
+        if ((run != 0xFFu) && (r < size))
+            buffer[w++] = 0u;
+    }
+    return w;
+}
+
+static inline uint8_t *put_le16(uint8_t *p, uint32_t value)
+{
+    p[0] = (uint8_t)value;
+    p[1] = (uint8_t)(value >> 8);
+    return p + 2;
+}
+
+static inline uint8_t *put_le32(uint8_t *p, uint32_t value)
+{
+    p[0] = (uint8_t)value;
+    p[1] = (uint8_t)(value >> 8);
+    p[2] = (uint8_t)(value >> 16);
+    p[3] = (uint8_t)(value >> 24);
+    return p + 4;
+}
+
+static inline uint32_t get_le(const uint8_t *p, uint8_t bytes)
+{
+    uint32_t value = 0;
+
+    for (uint8_t i = 0; i < bytes; i++)
+        value |= (uint32_t)p[i] << (8u * i);
+    return value;
+}
+
+uint8_t binary_pack(const slcan_message_t *message, const uint32_t *timestamp, uint8_t *record)
+{
+    uint8_t *p = record;
+    uint32_t id = message->can_id;
+    uint8_t dlc = (message->can_dlc < CAN_DLC_MAX) ? message->can_dlc : CAN_DLC_MAX;
+    bool xtd = (id & CAN_XTD_FRAME) != 0;
+    bool rtr = (id & CAN_RTR_FRAME) != 0;
+
+    *p++ = (uint8_t)(dlc | (xtd ? SLCAN_BIN_XTD : 0u) | (rtr ? SLCAN_BIN_RTR : 0u) |
+                     ((id & CAN_ERR_FRAME) ? SLCAN_BIN_ERR : 0u) | (timestamp ? SLCAN_BIN_STAMP : 0u));
+    p = xtd ? put_le32(p, id & CAN_XTD_MASK) : put_le16(p, id & CAN_STD_MASK);
+    if (timestamp)
+        p = put_le32(p, *timestamp);
+    if (!rtr)
+    {
+        memcpy(p, message->data, dlc);
+        p += dlc;
+    }
+    return (uint8_t)(p - record);
+}
+
+// Records from the host carry no time stamp and no error flag
+bool binary_unpack(slcan_message_t *message, const uint8_t *record, uint8_t size)
+{
+    uint8_t type, dlc, idSize, dataSize;
+    uint32_t id;
+
+    if (size == 0u)
+        return false;
+
+    type = record[0];
+    dlc = type & SLCAN_BIN_DLC_MASK;
+    idSize = (type & SLCAN_BIN_XTD) ? 4u : 2u;
+    dataSize = (type & SLCAN_BIN_RTR) ? 0u : dlc;
+    if ((type & (SLCAN_BIN_ERR | SLCAN_BIN_STAMP)) || (dlc > CAN_DLC_MAX))
+        return false;
+    if (size != (uint8_t)(1u + idSize + dataSize))
+        return false;
+
+    id = get_le(&record[1], idSize);
+    if (id > ((type & SLCAN_BIN_XTD) ? CAN_XTD_MASK : CAN_STD_MASK))
+        return false;
+
+    message->can_id = id | ((type & SLCAN_BIN_XTD) ? CAN_XTD_FRAME : 0u) |
+                      ((type & SLCAN_BIN_RTR) ? CAN_RTR_FRAME : 0u);
+    message->can_dlc = dlc;
+    for (uint8_t i = 0; i < dataSize; i++)
+        message->data[i] = record[1u + idSize + i];
+    return true;
+}
@@ -0,0 +1,42 @@
+/*
+ * binary.h
+ *
+ *  Compact binary framing of CAN frames, the alternative to ASCII SLCAN
+ *  selected with the 'B' command.
+ */
+#ifndef SLCAN_BINARY_H_
+#define SLCAN_BINARY_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "slcan.h"
+
+/** @name  Record type byte
+ *  @brief First byte of every record, followed by the identifier (2 bytes
+ *         for standard, 4 for extended frames, little endian), the optional
+ *         32-bit microsecond time stamp and the payload (none for RTR).
+ *  @{ */
+#define SLCAN_BIN_DLC_MASK 0x0FU /**< data length code (0..8) */
+#define SLCAN_BIN_XTD 0x10U      /**< 29-bit identifier */
+#define SLCAN_BIN_RTR 0x20U      /**< remote frame */
+#define SLCAN_BIN_ERR 0x40U      /**< error frame */
+#define SLCAN_BIN_STAMP 0x80U    /**< time stamp present */
+#define SLCAN_BIN_ESCAPE 0xFFU   /**< control record, not a frame */
+/** @} */
+
+#define SLCAN_BIN_RECORD_MAX 17U                        /**< type + id + stamp + data */
+#define SLCAN_BIN_FRAME_MAX (SLCAN_BIN_RECORD_MAX + 2U) /**< COBS code byte + delimiter */
+
+/** @brief  COBS encodes @p size bytes (less than 254) and appends the 0x00
+ *          delimiter. Returns the number of bytes written to @p out.
+ */
+uint8_t cobs_encode(const uint8_t *in, uint8_t size, uint8_t *out);
+/** @brief  Decodes a COBS block (delimiter excluded) in place.
+ *  @return decoded size, 0 for a malformed block
+ */
+uint8_t cobs_decode(uint8_t *buffer, uint8_t size);
+
+uint8_t binary_pack(const slcan_message_t *message, const uint32_t *timestamp, uint8_t *record);
+bool binary_unpack(slcan_message_t *message, const uint8_t *record, uint8_t size);
+
+#endif /* SLCAN_BINARY_H_ */
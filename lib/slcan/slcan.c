@@ -5,12 +5,21 @@
  *      Author: Berran
  */
 #include "slcan.h"
+#include "binary.h"
 #include <stdint.h>
 #include <stdbool.h>
 #include <string.h>
+#include <stddef.h>
 #include "can.h"
-#include <libopencm3/stm32/can.h>
+#include "filter.h"
+#include "bittiming.h"
+#include "busload.h"
+#include "periodic.h"
+#include "burst.h"
+#include "change.h"
+#include "limit.h"
 #include "led.h"
+#include "usb.h"
 // #include "usbd_cdc_if.h"
 
 const uint8_t version[6] = "V1013\r";
@@ -19,71 +28,65 @@ const uint8_t serial[6] = "NA123\r";
 /*  -----------  defines  ------------------------------------------------
  */
 
-#define BCD2CHR(x) ((((x) & 0xF) < 0xA) ? ('0' + ((x) & 0xF)) : ('7' + ((x) & 0xF)))
+/* hex digit -> nibble value, 0xFF for anything that isn't a hex digit */
+#define HEX_VALUE(c) ((('0' <= (c)) && ((c) <= '9')) ? ((c) - '0') : ((('A' <= (c)) && ((c) <= 'F')) ? (10 + (c) - 'A') : ((('a' <= (c)) && ((c) <= 'f')) ? (10 + (c) - 'a') : 0xFF)))
+#define HEX_VALUE4(c) HEX_VALUE(c), HEX_VALUE((c) + 1), HEX_VALUE((c) + 2), HEX_VALUE((c) + 3)
+#define HEX_VALUE16(c) HEX_VALUE4(c), HEX_VALUE4((c) + 4), HEX_VALUE4((c) + 8), HEX_VALUE4((c) + 12)
+#define HEX_VALUE64(c) HEX_VALUE16(c), HEX_VALUE16((c) + 16), HEX_VALUE16((c) + 32), HEX_VALUE16((c) + 48)
 
-#ifdef USE_MACRO
-#define CHR2BCD(x) ((('0' <= (x)) && ((x) <= '9')) ? ((x) - '0') : ((('A' <= (x)) && ((x) <= 'F')) ? (10 + (x) - 'A') : ((('a' <= (x)) && ((x) <= 'f')) ? (10 + (x) - 'a') : 0xFF)))
-#else
-uint8_t CHR2BCD(char ch);
+/* byte -> its two upper case hex digits */
+#define HEX_DIGIT(n) (((n) < 10) ? ('0' + (n)) : ('A' - 10 + (n)))
+#define HEX_PAIR(b) {HEX_DIGIT((b) >> 4), HEX_DIGIT((b) & 0xF)}
+#define HEX_PAIR4(b) HEX_PAIR(b), HEX_PAIR((b) + 1), HEX_PAIR((b) + 2), HEX_PAIR((b) + 3)
+#define HEX_PAIR16(b) HEX_PAIR4(b), HEX_PAIR4((b) + 4), HEX_PAIR4((b) + 8), HEX_PAIR4((b) + 12)
+#define HEX_PAIR64(b) HEX_PAIR16(b), HEX_PAIR16((b) + 16), HEX_PAIR16((b) + 32), HEX_PAIR16((b) + 48)
 
-uint8_t CHR2BCD(char ch)
-{
-    uint8_t bcd = 0;
+static const uint8_t hexDecode[256] = {
+    HEX_VALUE64(0), HEX_VALUE64(64), HEX_VALUE64(128), HEX_VALUE64(192)};
 
-    // Handle digits 0-9
-    if (ch >= '0' && ch <= '9')
-    {
-        bcd = (ch - '0') & 0x0F; // Extract lower 4 bits
-    }
-    // Handle letters A-F
-    else if (ch >= 'A' && ch <= 'F')
-    {
-        bcd = (ch - 'A' + 10) & 0x0F; // Extract lower 4 bits
-    }
-    // Handle letters a-f
-    else if (ch >= 'a' && ch <= 'f')
-    {
-        bcd = (ch - 'a' + 10) & 0x0F; // Extract lower 4 bits
-    }
-    // Handle invalid input (return 0 or other error code)
-    else
-    {
-        // You can choose to return 0 for invalid input or handle it differently
-        bcd = 0;
-    }
+static const uint8_t hexEncode[256][2] = {
+    HEX_PAIR64(0), HEX_PAIR64(64), HEX_PAIR64(128), HEX_PAIR64(192)};
 
-    return bcd;
-}
-#endif /* USE_MACRO */
+#define BCD2CHR(x) (hexEncode[(x) & 0xFu][1])
+#define CHR2BCD(x) (hexDecode[(uint8_t)(x)])
 
 #define MAX_DLC(l) (((l) < CAN_LEN_MAX) ? (l) : (CAN_DLC_MAX))
 
 #define BUFFER_SIZE 128U
 #define RESPONSE_TIMEOUT 100U
 
-/** @brief  CAN message (SocketCAN compatible)
- */
-typedef struct slcan_message_t_
-{                              /* SLCAN message: */
-    uint32_t can_id;           /**< message identifier */
-    uint8_t can_dlc;           /**< data length code (0..8) */
-    uint8_t __pad;             /**< (padding) */
-    uint8_t __res1;            /**< (resvered for CAN FD) */
-    uint8_t __res2;            /**< (resvered for CAN FD) */
-    uint8_t data[CAN_LEN_MAX]; /**< payload (max. 8 data bytes) */
-} slcan_message_t;
+#define SLCAN_LINE_MAX 64U     /* longest command line accepted, CR included */
+#define SLCAN_REPLY_MAX 64U    /* one full-speed USB packet of responses */
+#define SLCAN_RESPONSE_MAX 56U /* longest response of a single command (I) */
+
+/* command line carried over between USB packets */
+static uint8_t lineBuffer[SLCAN_LINE_MAX];
+static uint8_t lineSize = 0;
+static bool lineOverflow = false;
 
-// Function pointer type for command handlers
-typedef uint8_t (*CmdHandler)(uint8_t *inData, uint8_t *inSize, uint8_t *outData, uint8_t *outSize);
+/* receive time appended to forwarded frames, set by the Z command */
+static uint8_t timestampMode = SLCAN_TIMESTAMP_OFF;
 
-// Define the struct for the command lookup table
-typedef struct
+/* millisecond count of the Z1 stamps, carried on by slcan_clock() so it
+   runs on where the 32-bit microsecond stamps wrap */
+static struct
 {
-    char cmd;
-    CmdHandler handler;
-} CmdLookupEntry;
+    uint32_t last; /* stamp of the last slcan_clock() */
+    uint16_t ms;   /* milliseconds at that stamp, modulo 60000 */
+    uint16_t us;   /* microseconds beyond them */
+} stampClock;
 
-static bool encode_message(const slcan_message_t *message, uint8_t *buffer, uint8_t *nbytes);
+/* binary framing instead of ASCII in both directions, set by the B command */
+static bool binaryMode = false;
+
+/* counters at the last F command, its flags report what happened since */
+static struct
+{
+    uint32_t dropped;
+    uint32_t rejected;
+    uint32_t overrun;
+    uint32_t failed;
+} statusSeen;
 
 uint8_t handleSn(uint8_t *inData, uint8_t *inSize, uint8_t *outData, uint8_t *outSize);
 uint8_t handlesxxyy(uint8_t *inData, uint8_t *inSize, uint8_t *outData, uint8_t *outSize);
@@ -106,143 +109,218 @@ uint8_t handleV(uint8_t *inData, uint8_t *inSize, uint8_t *outData, uint8_t *out
 uint8_t handleN(uint8_t *inData, uint8_t *inSize, uint8_t *outData, uint8_t *outSize);
 uint8_t handleZn(uint8_t *inData, uint8_t *inSize, uint8_t *outData, uint8_t *outSize);
 uint8_t handleQn(uint8_t *inData, uint8_t *inSize, uint8_t *outData, uint8_t *outSize);
+uint8_t handleDxx(uint8_t *inData, uint8_t *inSize, uint8_t *outData, uint8_t *outSize);
+uint8_t handlefiii(uint8_t *inData, uint8_t *inSize, uint8_t *outData, uint8_t *outSize);
+uint8_t handleJn(uint8_t *inData, uint8_t *inSize, uint8_t *outData, uint8_t *outSize);
+uint8_t handlekbbbbbb(uint8_t *inData, uint8_t *inSize, uint8_t *outData, uint8_t *outSize);
+uint8_t handleBn(uint8_t *inData, uint8_t *inSize, uint8_t *outData, uint8_t *outSize);
+uint8_t handleIn(uint8_t *inData, uint8_t *inSize, uint8_t *outData, uint8_t *outSize);
+uint8_t handleu(uint8_t *inData, uint8_t *inSize, uint8_t *outData, uint8_t *outSize);
+uint8_t handleEn(uint8_t *inData, uint8_t *inSize, uint8_t *outData, uint8_t *outSize);
+uint8_t handlep(uint8_t *inData, uint8_t *inSize, uint8_t *outData, uint8_t *outSize);
+uint8_t handleH(uint8_t *inData, uint8_t *inSize, uint8_t *outData, uint8_t *outSize);
+uint8_t handlec(uint8_t *inData, uint8_t *inSize, uint8_t *outData, uint8_t *outSize);
+uint8_t handleK(uint8_t *inData, uint8_t *inSize, uint8_t *outData, uint8_t *outSize);
+uint8_t handleUnknown(uint8_t *inData, uint8_t *inSize, uint8_t *outData, uint8_t *outSize);
+
+static inline uint8_t *put_hex_byte(uint8_t *buffer, uint8_t value)
+{
+    buffer[0] = hexEncode[value][0];
+    buffer[1] = hexEncode[value][1];
+    return buffer + 2;
+}
+
+/* parse the hex digits of a command argument, false on any non hex digit */
+static bool get_hex(const uint8_t *buffer, uint8_t digits, uint32_t *value)
+{
+    uint32_t result = 0;
+    uint8_t invalid = 0;
+
+    for (uint8_t i = 0; i < digits; i++)
+    {
+        uint8_t digit = CHR2BCD(buffer[i]);
+        invalid |= digit;
+        result = (result << 4) | (digit & 0xFu);
+    }
+    *value = result;
+    return invalid <= 0xFu;
+}
+
+/* parse an unsigned decimal number of up to 9 digits, false on anything else */
+static bool get_dec(const uint8_t *buffer, uint8_t digits, uint32_t *value)
+{
+    uint32_t result = 0;
+
+    if ((digits == 0u) || (digits > 9u))
+        return false;
+    for (uint8_t i = 0; i < digits; i++)
+    {
+        if ((buffer[i] < '0') || (buffer[i] > '9'))
+            return false;
+        result = (result * 10u) + (uint32_t)(buffer[i] - '0');
+    }
+    *value = result;
+    return true;
+}
+
+static inline uint8_t *put_hex_word(uint8_t *buffer, uint16_t value)
+{
+    buffer = put_hex_byte(buffer, (uint8_t)(value >> 8));
+    return put_hex_byte(buffer, (uint8_t)value);
+}
 
-static bool encode_message(const slcan_message_t *message, uint8_t *buffer, uint8_t *nbytes)
+static inline uint8_t *put_hex_long(uint8_t *buffer, uint32_t value)
 {
-    uint8_t index = 0;
+    buffer = put_hex_word(buffer, (uint16_t)(value >> 16));
+    return put_hex_word(buffer, (uint16_t)value);
+}
+
+bool encode_message(const slcan_message_t *message, uint8_t *buffer, uint8_t *nbytes)
+{
+    uint8_t *p = buffer;
+    uint32_t id = message->can_id;
+    uint8_t dlc = (uint8_t)MAX_DLC(message->can_dlc);
+    bool rtr = (id & CAN_RTR_FRAME) != 0;
 
     // assert(message);
     // assert(buffer);
     // assert(nbytes);
 
-    if (!(message->can_id & CAN_XTD_FRAME))
+    if (id & CAN_ERR_FRAME)
     {
-        if (!(message->can_id & CAN_RTR_FRAME))
-            buffer[index++] = (uint8_t)'t';
-        else
-            buffer[index++] = (uint8_t)'r';
-        buffer[index++] = (uint8_t)BCD2CHR((message->can_id & CAN_STD_MASK) >> 8);
-        buffer[index++] = (uint8_t)BCD2CHR((message->can_id & CAN_STD_MASK) >> 4);
-        buffer[index++] = (uint8_t)BCD2CHR((message->can_id & CAN_STD_MASK) >> 0);
+        /* error class in 3 digits like a standard frame, always 8 bytes */
+        *p++ = (uint8_t)'e';
+        id &= CAN_STD_MASK;
+        *p++ = BCD2CHR(id >> 8);
+        p = put_hex_byte(p, (uint8_t)id);
+        rtr = false;
     }
-    else
+    else if (!(id & CAN_XTD_FRAME))
     {
-        if (!(message->can_id & CAN_RTR_FRAME))
-            buffer[index++] = (uint8_t)'T';
-        else
-            buffer[index++] = (uint8_t)'R';
-        buffer[index++] = (uint8_t)BCD2CHR((message->can_id & CAN_XTD_MASK) >> 28);
-        buffer[index++] = (uint8_t)BCD2CHR((message->can_id & CAN_XTD_MASK) >> 24);
-        buffer[index++] = (uint8_t)BCD2CHR((message->can_id & CAN_XTD_MASK) >> 20);
-        buffer[index++] = (uint8_t)BCD2CHR((message->can_id & CAN_XTD_MASK) >> 16);
-        buffer[index++] = (uint8_t)BCD2CHR((message->can_id & CAN_XTD_MASK) >> 12);
-        buffer[index++] = (uint8_t)BCD2CHR((message->can_id & CAN_XTD_MASK) >> 8);
-        buffer[index++] = (uint8_t)BCD2CHR((message->can_id & CAN_XTD_MASK) >> 4);
-        buffer[index++] = (uint8_t)BCD2CHR((message->can_id & CAN_XTD_MASK) >> 0);
-    }
-    if (!(message->can_id & CAN_RTR_FRAME))
-    {
-        buffer[index++] = (uint8_t)BCD2CHR(MAX_DLC(message->can_dlc));
-        for (uint8_t i = 0; i < (uint8_t)MAX_DLC(message->can_dlc); i++)
-        {
-            buffer[index++] = (uint8_t)BCD2CHR(message->data[i] >> 4);
-            buffer[index++] = (uint8_t)BCD2CHR(message->data[i] >> 0);
-        }
+        /* 3 digits: one single digit, then a byte pair */
+        *p++ = rtr ? (uint8_t)'r' : (uint8_t)'t';
+        id &= CAN_STD_MASK;
+        *p++ = BCD2CHR(id >> 8);
+        p = put_hex_byte(p, (uint8_t)id);
     }
     else
     {
-        buffer[index++] = (uint8_t)BCD2CHR(MAX_DLC(message->can_dlc));
+        /* 8 digits: four byte pairs */
+        *p++ = rtr ? (uint8_t)'R' : (uint8_t)'T';
+        id &= CAN_XTD_MASK;
+        p = put_hex_byte(p, (uint8_t)(id >> 24));
+        p = put_hex_byte(p, (uint8_t)(id >> 16));
+        p = put_hex_byte(p, (uint8_t)(id >> 8));
+        p = put_hex_byte(p, (uint8_t)id);
     }
-    buffer[index++] = (uint8_t)CAN_OK;
-    *nbytes = index;
+    *p++ = BCD2CHR(dlc);
+    if (!rtr)
+    {
+        for (uint8_t i = 0; i < dlc; i++)
+            p = put_hex_byte(p, message->data[i]);
+    }
+    *p++ = (uint8_t)CAN_OK;
+    *nbytes = (uint8_t)(p - buffer);
     return true;
 }
 
-static bool decode_message(slcan_message_t *message, const uint8_t *buffer, uint8_t nbytes)
+bool decode_message(slcan_message_t *message, const uint8_t *buffer, uint8_t nbytes)
 {
-    int i = 0;
-    uint8_t index = 0;
-    uint8_t offset;
-    uint8_t digit;
+    const uint8_t *p = buffer + 1;
+    uint8_t digits;
+    uint8_t invalid;
+    uint8_t dlc;
+    uint32_t id;
     uint32_t flags;
 
     // assert(message);
     // assert(buffer);
     // assert(nbytes);
 
-    //(void)memset(message, 0x00, sizeof(slcan_message_t));
-
-    /* (1) message flags: XTD and RTR */
-    switch (buffer[index++])
+    /* (1) message flags: XTD, RTR and ERR */
+    switch (buffer[0])
     {
     case 't':
         flags = CAN_STD_FRAME;
-        offset = index + 3;
+        digits = 3;
         break;
     case 'T':
         flags = CAN_XTD_FRAME;
-        offset = index + 8;
+        digits = 8;
         break;
     case 'r':
         flags = CAN_RTR_FRAME;
-        offset = index + 3;
+        digits = 3;
         break;
     case 'R':
         flags = CAN_RTR_FRAME | CAN_XTD_FRAME;
-        offset = index + 8;
+        digits = 8;
+        break;
+    case 'e':
+        flags = CAN_ERR_FRAME;
+        digits = 3;
         break;
     default:
         return false;
     }
-    if (index >= nbytes)
+    /* command, identifier and DLC have to be followed by at least the CR */
+    if (nbytes <= (uint8_t)(1u + digits + 1u))
         return false;
-    /* (2) CAN identifier: 11-bit or 29-bit */
-    while ((index < offset) && (index < nbytes))
+
+    /* (2) CAN identifier: 11-bit or 29-bit, invalid digits (0xFF) are
+     *     collected in one mask and checked once per field */
+    if (digits == 3)
     {
-        digit = CHR2BCD(buffer[index++]);
-        if (digit != 0xFF)
-            message->can_id = (message->can_id << 4) | (uint32_t)digit;
-        else
+        uint8_t d0 = hexDecode[p[0]];
+        uint8_t d1 = hexDecode[p[1]];
+        uint8_t d2 = hexDecode[p[2]];
+
+        invalid = d0 | d1 | d2;
+        id = ((uint32_t)d0 << 8) | ((uint32_t)d1 << 4) | (uint32_t)d2;
+        if ((invalid & 0xF0u) || (id > CAN_STD_MASK))
             return false;
     }
-    if (index >= nbytes)
-        return false;
-    /* (!) ORing message flags (Linux-CAN compatible) */
-    message->can_id |= flags;
-    /* (3) Data Length Code: 0..8 */
-    digit = CHR2BCD(buffer[index++]);
-    if (digit <= CAN_DLC_MAX)
-        message->can_dlc = (uint8_t)digit;
     else
+    {
+        invalid = 0;
+        id = 0;
+        for (uint8_t i = 0; i < 8u; i++)
+        {
+            uint8_t d = hexDecode[p[i]];
+            invalid |= d;
+            id = (id << 4) | (uint32_t)d;
+        }
+        if ((invalid & 0xF0u) || (id > CAN_XTD_MASK))
+            return false;
+    }
+    p += digits;
+
+    /* (3) Data Length Code: 0..8 */
+    dlc = hexDecode[*p++];
+    if (dlc > CAN_DLC_MAX)
         return false;
-    if (index >= nbytes)
-        return false;
-    /* (4) message data: up to 8 bytes */
+
+    /* (4) message data: up to 8 bytes, note: no data in RTR frames! */
     if (!(flags & CAN_RTR_FRAME))
-        offset = index + (uint8_t)(message->can_dlc * 2);
-    else /* note: no data in RTR frames! */
-        offset = index;
-    while ((index < offset) && (index < nbytes))
-    {
-        digit = CHR2BCD(buffer[index++]);
-        if ((digit != 0xFF) && (index < nbytes))
-            message->data[i] = (uint8_t)digit;
-        else
-        {
+    {
+        if (nbytes <= (uint8_t)((p - buffer) + 2u * dlc))
             return false;
-        }
-        digit = CHR2BCD(buffer[index++]);
-        if (digit != 0xFF)
-            message->data[i] = (message->data[i] << 4) | (uint8_t)digit;
-        else
+        invalid = 0;
+        for (uint8_t i = 0; i < dlc; i++)
         {
-            return false;
+            uint8_t hi = hexDecode[p[0]];
+            uint8_t lo = hexDecode[p[1]];
+            invalid |= hi | lo;
+            message->data[i] = (uint8_t)((hi << 4) | lo);
+            p += 2;
         }
-        i++;
+        if (invalid & 0xF0u)
+            return false;
     }
 
-    if (index >= nbytes)
-        return false;
+    /* (!) ORing message flags (Linux-CAN compatible) */
+    message->can_id = id | flags;
+    message->can_dlc = dlc;
     /* (5) ignore the rest: CR or time-stamp + CR */
     return true;
 }
@@ -250,19 +328,28 @@ static bool decode_message(slcan_message_t *message, const uint8_t *buffer, uint
 // Command handler function implementations
 uint8_t handleSn(uint8_t *inData, uint8_t *inSize, uint8_t *outData, uint8_t *outSize)
 {
-    (void)inSize;
     (void)outData;
     (void)outSize;
     // Handle the 'Sn' command (Setup with standard CAN bit-rates where n is 0-8)
     uint8_t digit = CHR2BCD(inData[1]);
+    if ((*inSize != 3u) || (digit > CAN_1000K))
+        return CAN_ERROR;
     can_setup(digit);
-    return CAN_ERROR;
+    return CAN_OK;
 }
 
 uint8_t handlesxxyy(uint8_t *inData, uint8_t *inSize, uint8_t *outData, uint8_t *outSize)
 {
-    // Handle the 'sxxyy' command
-    return CAN_ERROR;
+    (void)outData;
+    (void)outSize;
+    // Handle the 'sxxyy' command (Setup with SJA1000 BTR0/BTR1 values, as
+    // for a 16 MHz SJA1000)
+    uint32_t btr;
+
+    if ((*inSize != 6u) || !get_hex(&inData[1], 4, &btr))
+        return CAN_ERROR;
+    can_setup_btr(can_btr_from_sja1000((uint8_t)(btr >> 8), (uint8_t)btr));
+    return CAN_OK;
 }
 
 uint8_t handleO(uint8_t *inData, uint8_t *inSize, uint8_t *outData, uint8_t *outSize)
@@ -284,43 +371,56 @@ uint8_t handleC(uint8_t *inData, uint8_t *inSize, uint8_t *outData, uint8_t *out
     return CAN_ERROR;
 }
 
-uint8_t handletiiiildd(uint8_t *inData, uint8_t *inSize, uint8_t *outData, uint8_t *outSize)
+/* hand a decoded message to the CAN TX queue */
+static bool queue_message(const slcan_message_t *message)
 {
-    // Handle the 'tiiildd...' command (Transmit standard CAN frame)
+    can_frame_t frame = {0};
 
+    frame.id = message->can_id;
+    frame.dlc = message->can_dlc;
+    memcpy(frame.data, message->data, CAN_LEN_MAX);
+    return can_tx_enqueue(&frame);
+}
+
+static uint8_t transmit_message(uint8_t *inData, uint8_t *inSize, uint8_t *outData, uint8_t *outSize)
+{
     slcan_message_t message = {0};
+
     /* new message received (indication) */
-    if (decode_message(&message, inData, *inSize))
-    {
-        // CAN_SendMessage(message.can_id, message.can_dlc, message.data);
-        can_transmit(CAN1, message.can_id, 0 /*ext*/, 0 /*rtr*/, message.can_dlc, message.data);
-        outData[0] = CAN_AUTOPOLL;
-        *outSize = 1;
-        return CAN_OK;
-    }
-    else
-    {
+    if (!decode_message(&message, inData, *inSize))
         return CAN_ERROR;
-    }
+
+    /* only acknowledge what the TX queue really took */
+    if (!queue_message(&message))
+        return CAN_ERROR;
+
+    outData[0] = (message.can_id & CAN_XTD_FRAME) ? CAN_AUTOPOLL_XTD : CAN_AUTOPOLL;
+    *outSize = 1;
     return CAN_OK;
 }
 
+uint8_t handletiiiildd(uint8_t *inData, uint8_t *inSize, uint8_t *outData, uint8_t *outSize)
+{
+    // Handle the 'tiiildd...' command (Transmit standard CAN frame)
+    return transmit_message(inData, inSize, outData, outSize);
+}
+
 uint8_t handleTiiiiiiiildd(uint8_t *inData, uint8_t *inSize, uint8_t *outData, uint8_t *outSize)
 {
     // Handle the 'Tiiiiiiiildd...' command (Transmit extended CAN frame)
-    return CAN_ERROR;
+    return transmit_message(inData, inSize, outData, outSize);
 }
 
 uint8_t handleriiil(uint8_t *inData, uint8_t *inSize, uint8_t *outData, uint8_t *outSize)
 {
     // Handle the 'riiil' command (Request standard CAN frame)
-    return CAN_ERROR;
+    return transmit_message(inData, inSize, outData, outSize);
 }
 
 uint8_t handleRiiiiiiiil(uint8_t *inData, uint8_t *inSize, uint8_t *outData, uint8_t *outSize)
 {
     // Handle the 'Riiiiiiiil' command (Request extended CAN frame)
-    return CAN_ERROR;
+    return transmit_message(inData, inSize, outData, outSize);
 }
 
 uint8_t handleP(uint8_t *inData, uint8_t *inSize, uint8_t *outData, uint8_t *outSize)
@@ -337,8 +437,40 @@ uint8_t handleA(uint8_t *inData, uint8_t *inSize, uint8_t *outData, uint8_t *out
 
 uint8_t handleF(uint8_t *inData, uint8_t *inSize, uint8_t *outData, uint8_t *outSize)
 {
-    // Handle the 'F' command (Read status flags)
-    return CAN_ERROR;
+    (void)inData;
+    // Handle the 'F' command (Read status flags, SJA1000 style: 'Fxx'; the
+    // queue, overrun and arbitration bits report events since the last F)
+    uint32_t status = can_status();
+    uint32_t overrun = can_rx_stats.overrun[0] + can_rx_stats.overrun[1];
+    uint8_t flags = 0;
+
+    if (*inSize != 2u)
+        return CAN_ERROR;
+
+    if (can_rx_stats.dropped != statusSeen.dropped)
+        flags |= 0x01u; /* RX queue full */
+    if (can_tx_stats.rejected != statusSeen.rejected)
+        flags |= 0x02u; /* TX queue full */
+    if (CAN_STATUS_EWG(status))
+        flags |= 0x04u; /* error warning */
+    if (overrun != statusSeen.overrun)
+        flags |= 0x08u; /* data overrun */
+    if (CAN_STATUS_EPV(status))
+        flags |= 0x20u; /* error passive */
+    if (can_tx_stats.failed != statusSeen.failed)
+        flags |= 0x40u; /* arbitration lost */
+    if (CAN_STATUS_BOFF(status) || CAN_STATUS_LEC(status))
+        flags |= 0x80u; /* bus error */
+
+    statusSeen.dropped = can_rx_stats.dropped;
+    statusSeen.rejected = can_tx_stats.rejected;
+    statusSeen.overrun = overrun;
+    statusSeen.failed = can_tx_stats.failed;
+
+    outData[0] = 'F';
+    put_hex_byte(&outData[1], flags);
+    *outSize = 3;
+    return CAN_OK;
 }
 
 uint8_t handleXn(uint8_t *inData, uint8_t *inSize, uint8_t *outData, uint8_t *outSize)
@@ -349,20 +481,43 @@ uint8_t handleXn(uint8_t *inData, uint8_t *inSize, uint8_t *outData, uint8_t *ou
 
 uint8_t handleWn(uint8_t *inData, uint8_t *inSize, uint8_t *outData, uint8_t *outSize)
 {
-    // Handle the 'Wn' command (Set acceptance mask)
-    return CAN_ERROR;
+    (void)outData;
+    (void)outSize;
+    // Handle the 'Wn' command (Filter mode: 0 dual filter, 1 single filter)
+    if ((*inSize != 3u) || ((inData[1] != '0') && (inData[1] != '1')))
+        return CAN_ERROR;
+    can_filter_set_dual(inData[1] == '0');
+    can_filter_apply();
+    return CAN_OK;
 }
 
 uint8_t handleMxxxxxxxx(uint8_t *inData, uint8_t *inSize, uint8_t *outData, uint8_t *outSize)
 {
+    (void)outData;
+    (void)outSize;
     // Handle the 'Mxxxxxxxx' command (Set acceptance code)
-    return CAN_ERROR;
+    uint32_t code;
+
+    if ((*inSize != 10u) || !get_hex(&inData[1], 8, &code))
+        return CAN_ERROR;
+    can_filter_set_code(code);
+    can_filter_apply();
+    return CAN_OK;
 }
 
 uint8_t handlemxxxxxxxx(uint8_t *inData, uint8_t *inSize, uint8_t *outData, uint8_t *outSize)
 {
-    // Handle the 'mxxxxxxxx' command (Set acceptance mask)
-    return CAN_ERROR;
+    (void)outData;
+    (void)outSize;
+    // Handle the 'mxxxxxxxx' command (Set acceptance mask, set bits are
+    // "don't care")
+    uint32_t mask;
+
+    if ((*inSize != 10u) || !get_hex(&inData[1], 8, &mask))
+        return CAN_ERROR;
+    can_filter_set_mask(mask);
+    can_filter_apply();
+    return CAN_OK;
 }
 
 uint8_t handleUn(uint8_t *inData, uint8_t *inSize, uint8_t *outData, uint8_t *outSize)
@@ -382,19 +537,23 @@ uint8_t handleN(uint8_t *inData, uint8_t *inSize, uint8_t *outData, uint8_t *out
 {
     // Handle the 'N' command (Get serial number)
     // CDC_Transmit_FS((uint8_t*)serial, sizeof(serial));
-    get_dev_unique_id(outData);
+    get_dev_unique_id((char *)outData);
     *outSize = 8;
     return CAN_OK;
 }
 
 uint8_t handleZn(uint8_t *inData, uint8_t *inSize, uint8_t *outData, uint8_t *outSize)
 {
-    (void)inData;
-    (void)inSize;
     (void)outData;
     (void)outSize;
-    // Handle the 'Zn' command (Set auto-reply mode)
-    return CAN_ERROR;
+    // Handle the 'Zn' command (Set time stamp mode: 0 off, 1 four digit
+    // milliseconds wrapping at 60000, 2 eight digit microseconds)
+    uint8_t mode = CHR2BCD(inData[1]);
+
+    if ((*inSize != 3u) || (mode > SLCAN_TIMESTAMP_US))
+        return CAN_ERROR;
+    timestampMode = mode;
+    return CAN_OK;
 }
 
 uint8_t handleQn(uint8_t *inData, uint8_t *inSize, uint8_t *outData, uint8_t *outSize)
@@ -402,31 +561,504 @@ uint8_t handleQn(uint8_t *inData, uint8_t *inSize, uint8_t *outData, uint8_t *ou
     // Handle the 'Qn' command (Set flow-control mode)
     return CAN_ERROR;
 }
-#define SLCAN_CMD_COUNT 21u
-const CmdLookupEntry cmdLookupTable[SLCAN_CMD_COUNT] = {
-    {'t', handletiiiildd},     // tiiildd...[CR] command handler
-    {'T', handleTiiiiiiiildd}, // Tiiiiiiiildd...[CR] command handler
-    {'S', handleSn},           // Sn[CR] command handler
-    {'s', handlesxxyy},        // sxxyy[CR] command handler
-    {'O', handleO},            // O[CR] command handler
-    {'L', handleL},            // L[CR] command handler
-    {'C', handleC},            // C[CR] command handler
-    {'r', handleriiil},        // riiil[CR] command handler
-    {'R', handleRiiiiiiiil},   // Riiiiiiiil[CR] command handler
-    {'P', handleP},            // P[CR] command handler
-    {'A', handleA},            // A[CR] command handler
-    {'F', handleF},            // F[CR] command handler
-    {'X', handleXn},           // Xn[CR] command handler
-    {'W', handleWn},           // Wn[CR] command handler
-    {'M', handleMxxxxxxxx},    // Mxxxxxxxx[CR] command handler
-    {'m', handlemxxxxxxxx},    // mxxxxxxxx[CR] command handler
-    {'U', handleUn},           // Un[CR] command handler
-    {'V', handleV},            // V[CR] command handler
-    {'N', handleN},            // N[CR] command handler
-    {'Z', handleZn},           // Zn[CR] command handler
-    {'Q', handleQn},           // Qn[CR] command handler
+uint8_t handleDxx(uint8_t *inData, uint8_t *inSize, uint8_t *outData, uint8_t *outSize)
+{
+    (void)outData;
+    (void)outSize;
+    // Handle the 'Dxx' command (Set USB latency: xx ms a partly filled IN
+    // packet may wait for more frames, 0 sends it once the RX queue is empty
+    // and the host has collected the previous packet)
+    uint32_t ms;
+
+    if ((*inSize < 3u) || (*inSize > 4u) || !get_hex(&inData[1], (uint8_t)(*inSize - 2u), &ms))
+        return CAN_ERROR;
+    usb_set_latency((uint8_t)ms);
+    return CAN_OK;
+}
+
+uint8_t handlefiii(uint8_t *inData, uint8_t *inSize, uint8_t *outData, uint8_t *outSize)
+{
+    (void)outData;
+    (void)outSize;
+    // Handle the 'f...' command (Hardware filter list): 'f' alone clears the
+    // list, 'fiii' / 'fiiiiiiii' add an exact standard / extended ID and
+    // 'fiiimmm' / 'fiiiiiiiimmmmmmmm' an ID with a mask of the bits that must
+    // match. A non empty list replaces the M/m acceptance filter.
+    uint8_t digits = (uint8_t)(*inSize - 2u);
+    uint32_t id, mask;
+    bool ok;
+
+    switch (digits)
+    {
+    case 0:
+        can_filter_list_clear();
+        can_filter_apply();
+        return CAN_OK;
+    case 3:
+        ok = get_hex(&inData[1], 3, &id) && (id <= CAN_STD_MASK);
+        mask = CAN_STD_MASK;
+        break;
+    case 6:
+        ok = get_hex(&inData[1], 3, &id) && get_hex(&inData[4], 3, &mask) &&
+             (id <= CAN_STD_MASK) && (mask <= CAN_STD_MASK);
+        break;
+    case 8:
+        ok = get_hex(&inData[1], 8, &id) && (id <= CAN_XTD_MASK);
+        mask = CAN_XTD_MASK;
+        id |= CAN_XTD_FRAME;
+        break;
+    case 16:
+        ok = get_hex(&inData[1], 8, &id) && get_hex(&inData[9], 8, &mask) &&
+             (id <= CAN_XTD_MASK) && (mask <= CAN_XTD_MASK);
+        id |= CAN_XTD_FRAME;
+        break;
+    default:
+        return CAN_ERROR;
+    }
+
+    if (!ok || !can_filter_list_add(id, mask))
+        return CAN_ERROR;
+    can_filter_apply();
+    return CAN_OK;
+}
+
+uint8_t handleJn(uint8_t *inData, uint8_t *inSize, uint8_t *outData, uint8_t *outSize)
+{
+    (void)outData;
+    (void)outSize;
+    // Handle the 'Jn' command (FIFO balancing: 1 queues the high priority half
+    // of the filters in FIFO1 and the rest in FIFO0, 0 uses FIFO0 only)
+    if ((*inSize != 3u) || ((inData[1] != '0') && (inData[1] != '1')))
+        return CAN_ERROR;
+    can_filter_set_balance(inData[1] == '1');
+    can_filter_apply();
+    return CAN_OK;
+}
+
+uint8_t handlekbbbbbb(uint8_t *inData, uint8_t *inSize, uint8_t *outData, uint8_t *outSize)
+{
+    (void)outData;
+    (void)outSize;
+    // Handle the 'kbbbbbb[,ppp]' command (Setup with any bit-rate: bbbbbb in
+    // bit/s and the sample point ppp in per mille, both decimal, 875 if left
+    // out)
+    uint8_t size = (uint8_t)(*inSize - 1u);
+    uint8_t comma = 1;
+    uint32_t bitrate;
+    uint32_t sample_point = CAN_SAMPLE_POINT;
+    uint32_t btr;
+
+    while ((comma < size) && (inData[comma] != ','))
+        comma++;
+    if (!get_dec(&inData[1], (uint8_t)(comma - 1u), &bitrate) || (bitrate > 1000000u))
+        return CAN_ERROR;
+    if ((comma < size) && !get_dec(&inData[comma + 1u], (uint8_t)(size - comma - 1u), &sample_point))
+        return CAN_ERROR;
+    if ((sample_point >= 1000u) || !can_btr_calc(bitrate, (uint16_t)sample_point, &btr))
+        return CAN_ERROR;
+    can_setup_btr(btr);
+    return CAN_OK;
+}
+
+uint8_t handleBn(uint8_t *inData, uint8_t *inSize, uint8_t *outData, uint8_t *outSize)
+{
+    (void)outData;
+    (void)outSize;
+    // Handle the 'Bn' command (B1 switches both directions to binary records
+    // after the CR answer, a control record 0xFF switches back)
+    if ((*inSize != 3u) || (inData[1] != '1'))
+        return CAN_ERROR;
+    binaryMode = true;
+    return CAN_OK;
+}
+
+uint8_t handleIn(uint8_t *inData, uint8_t *inSize, uint8_t *outData, uint8_t *outSize)
+{
+    // Handle the 'In' command (Statistics): 'I0'..'I3' return one group of
+    // counters as 'In' followed by fixed width hex fields, 'IR' clears them
+    //   I0  RX: queued, dropped, FOVR FIFO0, FOVR FIFO1, FIFO0, FIFO1, high water (4)
+    //   I1  TX: queued, rejected, failed, mailbox 0, 1, 2, high water (4)
+    //   I2  USB: IN packets, IN bytes, OUT packets, OUT bytes, OUT NAKs
+    //   I3  TEC (2), REC (2), bus-off, CAN ISRs, ISR max and average cycles
+    uint8_t *p = &outData[2];
+
+    if (*inSize != 3u)
+        return CAN_ERROR;
+
+    switch (inData[1])
+    {
+    case '0':
+        p = put_hex_long(p, can_rx_stats.queued);
+        p = put_hex_long(p, can_rx_stats.dropped);
+        p = put_hex_long(p, can_rx_stats.overrun[0]);
+        p = put_hex_long(p, can_rx_stats.overrun[1]);
+        p = put_hex_long(p, can_rx_stats.fifo[0]);
+        p = put_hex_long(p, can_rx_stats.fifo[1]);
+        p = put_hex_word(p, can_rx_stats.high_water);
+        break;
+    case '1':
+        p = put_hex_long(p, can_tx_stats.queued);
+        p = put_hex_long(p, can_tx_stats.rejected);
+        p = put_hex_long(p, can_tx_stats.failed);
+        p = put_hex_long(p, can_tx_stats.mailbox[0]);
+        p = put_hex_long(p, can_tx_stats.mailbox[1]);
+        p = put_hex_long(p, can_tx_stats.mailbox[2]);
+        p = put_hex_word(p, can_tx_stats.high_water);
+        break;
+    case '2':
+        p = put_hex_long(p, usb_stats.in_packets);
+        p = put_hex_long(p, usb_stats.in_bytes);
+        p = put_hex_long(p, usb_stats.out_packets);
+        p = put_hex_long(p, usb_stats.out_bytes);
+        p = put_hex_long(p, usb_stats.out_naks);
+        break;
+    case '3':
+    {
+        uint32_t status = can_status();
+        uint32_t count = can_err_stats.isr_count;
+
+        p = put_hex_byte(p, (uint8_t)CAN_STATUS_TEC(status));
+        p = put_hex_byte(p, (uint8_t)CAN_STATUS_REC(status));
+        p = put_hex_long(p, can_err_stats.bus_off);
+        p = put_hex_long(p, count);
+        p = put_hex_long(p, can_err_stats.isr_max);
+        p = put_hex_long(p, count ? (can_err_stats.isr_total / count) : 0u);
+        break;
+    }
+    case 'R':
+        can_stats_reset();
+        memset(&usb_stats, 0, sizeof(usb_stats));
+        memset(&statusSeen, 0, sizeof(statusSeen));
+        return CAN_OK;
+    default:
+        return CAN_ERROR;
+    }
+
+    outData[0] = 'I';
+    outData[1] = inData[1];
+    *outSize = (uint8_t)(p - outData);
+    return CAN_OK;
+}
+
+uint8_t handleu(uint8_t *inData, uint8_t *inSize, uint8_t *outData, uint8_t *outSize)
+{
+    // Handle the 'u' command (Bus load): returns 'u' followed by the load of
+    // the last 10 ms, of the last second and the highest 10 ms load since
+    // 'uR', each as 4 hex digits in per mille
+    uint16_t instant, second, peak;
+    uint8_t *p = &outData[1];
+
+    if ((*inSize == 3u) && (inData[1] == 'R'))
+    {
+        can_load_reset_peak();
+        return CAN_OK;
+    }
+    if (*inSize != 2u)
+        return CAN_ERROR;
+
+    can_load_get(&instant, &second, &peak);
+    outData[0] = 'u';
+    p = put_hex_word(p, instant);
+    p = put_hex_word(p, second);
+    p = put_hex_word(p, peak);
+    *outSize = (uint8_t)(p - outData);
+    return CAN_OK;
+}
+
+uint8_t handleEn(uint8_t *inData, uint8_t *inSize, uint8_t *outData, uint8_t *outSize)
+{
+    (void)outData;
+    (void)outSize;
+    // Handle the 'En' command (Error reports): E1 forwards bus errors and
+    // error state changes as error frames, E0 (the default) turns them off
+    if ((*inSize != 3u) || ((inData[1] != '0') && (inData[1] != '1')))
+        return CAN_ERROR;
+    can_err_reporting(inData[1] == '1');
+    return CAN_OK;
+}
+
+uint8_t handlep(uint8_t *inData, uint8_t *inSize, uint8_t *outData, uint8_t *outSize)
+{
+    // Handle the 'p' command (Periodic TX): 'pnPPPPOOOO' followed by a t, T,
+    // r or R frame without its CR sets entry n (0-7) to send the frame every
+    // PPPP ms, OOOO ms after the first entry started, both in hex; with the
+    // same period and phase only the payload changes. 'pn' removes entry n,
+    // 'p' returns 'p', the entries in use as a 2 hex digit mask and the
+    // number of periods sent late or skipped as 8 hex digits.
+    slcan_message_t message = {0};
+    can_frame_t frame = {0};
+    uint32_t index, period, phase;
+    uint8_t *p = &outData[1];
+
+    if (*inSize == 2u)
+    {
+        outData[0] = 'p';
+        p = put_hex_byte(p, can_periodic_active());
+        p = put_hex_long(p, can_periodic_late());
+        *outSize = (uint8_t)(p - outData);
+        return CAN_OK;
+    }
+    if ((*inSize < 3u) || !get_hex(&inData[1], 1, &index) || (index >= CAN_PERIODIC_MAX))
+        return CAN_ERROR;
+    if (*inSize == 3u)
+    {
+        can_periodic_clear((uint8_t)index);
+        return CAN_OK;
+    }
+
+    if ((*inSize < 11u) || !get_hex(&inData[2], 4, &period) || !get_hex(&inData[6], 4, &phase) ||
+        !decode_message(&message, &inData[10], (uint8_t)(*inSize - 10u)) || (message.can_id & CAN_ERR_FRAME))
+        return CAN_ERROR;
+    frame.id = message.can_id;
+    frame.dlc = message.can_dlc;
+    memcpy(frame.data, message.data, CAN_LEN_MAX);
+    if (!can_periodic_set((uint8_t)index, &frame, (uint16_t)period, (uint16_t)phase))
+        return CAN_ERROR;
+    return CAN_OK;
+}
+
+uint8_t handleH(uint8_t *inData, uint8_t *inSize, uint8_t *outData, uint8_t *outSize)
+{
+    // Handle the 'H' command (Burst buffer): 'HWdd...' appends up to 30
+    // bytes of frame records (see burst.h) in hex, 'HC' empties the buffer,
+    // 'HRnnnn' replays it nnnn times (hex, 0000 until 'HS' stops it). 'H'
+    // returns 'H', 1 while replaying, the bytes in use (4 digits), frames
+    // sent, frames per second, frames that lost arbitration and failed
+    // transmissions of the current or last replay (8 digits each).
+    can_burst_stats_t stats;
+    uint8_t bytes[(SLCAN_LINE_MAX - 3u) / 2u];
+    uint8_t count, invalid = 0;
+    uint32_t repeat;
+    uint8_t *p = &outData[1];
+
+    if (*inSize == 2u)
+    {
+        can_burst_stats(&stats);
+        outData[0] = 'H';
+        *p++ = stats.running ? '1' : '0';
+        p = put_hex_word(p, stats.used);
+        p = put_hex_long(p, stats.sent);
+        p = put_hex_long(p, stats.fps);
+        p = put_hex_long(p, stats.arb_lost);
+        p = put_hex_long(p, stats.failed);
+        *outSize = (uint8_t)(p - outData);
+        return CAN_OK;
+    }
+
+    switch (inData[1])
+    {
+    case 'W':
+        if ((*inSize < 5u) || !(*inSize & 1u))
+            return CAN_ERROR;
+        count = (uint8_t)((*inSize - 3u) / 2u);
+        for (uint8_t i = 0; i < count; i++)
+        {
+            uint8_t hi = hexDecode[inData[2u + 2u * i]];
+            uint8_t lo = hexDecode[inData[3u + 2u * i]];
+
+            invalid |= hi | lo;
+            bytes[i] = (uint8_t)((hi << 4) | lo);
+        }
+        if ((invalid & 0xF0u) || !can_burst_append(bytes, count))
+            return CAN_ERROR;
+        return CAN_OK;
+    case 'C':
+        if (*inSize != 3u)
+            return CAN_ERROR;
+        can_burst_clear();
+        return CAN_OK;
+    case 'R':
+        if ((*inSize != 7u) || !get_hex(&inData[2], 4, &repeat) || !can_burst_start((uint16_t)repeat))
+            return CAN_ERROR;
+        return CAN_OK;
+    case 'S':
+        if (*inSize != 3u)
+            return CAN_ERROR;
+        can_burst_stop();
+        return CAN_OK;
+    default:
+        return CAN_ERROR;
+    }
+}
+
+uint8_t handlec(uint8_t *inData, uint8_t *inSize, uint8_t *outData, uint8_t *outSize)
+{
+    // Handle the 'c' command (Change-only forwarding): 'c1' forwards a
+    // received frame only if its DLC or payload differ from the last one
+    // forwarded with its identifier, 'c1kkkk' also every kkkk ms (hex) while
+    // it stays the same, 'c0' forwards every frame again. Both empty the
+    // cache. 'c' returns 'c', 1 while enabled, the keep-alive period and the
+    // identifiers cached (4 and 2 hex digits), frames suppressed and
+    // identifiers evicted (8 hex digits each).
+    can_change_stats_t stats;
+    uint32_t keepalive = 0;
+    uint8_t *p = &outData[1];
+
+    if (*inSize == 2u)
+    {
+        can_change_stats(&stats);
+        outData[0] = 'c';
+        *p++ = stats.enabled ? '1' : '0';
+        p = put_hex_word(p, stats.keepalive_ms);
+        p = put_hex_byte(p, stats.used);
+        p = put_hex_long(p, stats.suppressed);
+        p = put_hex_long(p, stats.evictions);
+        *outSize = (uint8_t)(p - outData);
+        return CAN_OK;
+    }
+    if ((inData[1] != '0') && (inData[1] != '1'))
+        return CAN_ERROR;
+    if ((*inSize == 7u) && (inData[1] == '1'))
+    {
+        if (!get_hex(&inData[2], 4, &keepalive))
+            return CAN_ERROR;
+    }
+    else if (*inSize != 3u)
+    {
+        return CAN_ERROR;
+    }
+    can_rx_change_only(inData[1] == '1', (uint16_t)keepalive);
+    return CAN_OK;
+}
+
+uint8_t handleK(uint8_t *inData, uint8_t *inSize, uint8_t *outData, uint8_t *outSize)
+{
+    // Handle the 'K' command (RX rate limit): 'KnRRRRBBDD' followed by an
+    // ID as in 'f' (iii, iiiiiiii, iiimmm or iiiiiiiimmmmmmmm) sets rule n
+    // (0-7) to pass RRRR frames per second with bursts of BB frames and 1 of
+    // DD frames over that (hex, 00 drops them all); 'Kn0000' removes it. 'Kn'
+    // returns 'K', n, the rule's rate, burst and decimation, its ID (bit 31
+    // set for extended) and mask, frames passed and frames suppressed. 'K'
+    // returns 'K', the rules in use as a 2 hex digit mask and the frames all
+    // rules suppressed as 8 hex digits.
+    can_limit_rule_t rule = {0};
+    uint32_t index, rate, burst, decimate;
+    uint8_t *p = &outData[1];
+    uint8_t digits;
+    bool ok;
+
+    if (*inSize == 2u)
+    {
+        outData[0] = 'K';
+        p = put_hex_byte(p, can_limit_active());
+        p = put_hex_long(p, can_limit_suppressed());
+        *outSize = (uint8_t)(p - outData);
+        return CAN_OK;
+    }
+    if (!get_hex(&inData[1], 1, &index) || (index >= CAN_LIMIT_MAX))
+        return CAN_ERROR;
+    if (*inSize == 3u)
+    {
+        can_limit_get((uint8_t)index, &rule);
+        outData[0] = 'K';
+        *p++ = inData[1];
+        p = put_hex_word(p, rule.rate);
+        p = put_hex_byte(p, rule.burst);
+        p = put_hex_byte(p, rule.decimate);
+        p = put_hex_long(p, rule.id);
+        p = put_hex_long(p, rule.mask);
+        p = put_hex_long(p, rule.passed);
+        p = put_hex_long(p, rule.suppressed);
+        *outSize = (uint8_t)(p - outData);
+        return CAN_OK;
+    }
+    if ((*inSize < 7u) || !get_hex(&inData[2], 4, &rate))
+        return CAN_ERROR;
+    if (rate == 0u)
+        return ((*inSize == 7u) && can_limit_set((uint8_t)index, &rule)) ? CAN_OK : CAN_ERROR;
+    if ((*inSize < 11u) || !get_hex(&inData[6], 2, &burst) || !get_hex(&inData[8], 2, &decimate))
+        return CAN_ERROR;
+
+    digits = (uint8_t)(*inSize - 11u);
+    switch (digits)
+    {
+    case 3:
+        ok = get_hex(&inData[10], 3, &rule.id) && (rule.id <= CAN_STD_MASK);
+        rule.mask = CAN_STD_MASK;
+        break;
+    case 6:
+        ok = get_hex(&inData[10], 3, &rule.id) && get_hex(&inData[13], 3, &rule.mask) &&
+             (rule.id <= CAN_STD_MASK) && (rule.mask <= CAN_STD_MASK);
+        break;
+    case 8:
+        ok = get_hex(&inData[10], 8, &rule.id) && (rule.id <= CAN_XTD_MASK);
+        rule.mask = CAN_XTD_MASK;
+        rule.id |= CAN_XTD_FRAME;
+        break;
+    case 16:
+        ok = get_hex(&inData[10], 8, &rule.id) && get_hex(&inData[18], 8, &rule.mask) &&
+             (rule.id <= CAN_XTD_MASK) && (rule.mask <= CAN_XTD_MASK);
+        rule.id |= CAN_XTD_FRAME;
+        break;
+    default:
+        return CAN_ERROR;
+    }
+    rule.rate = (uint16_t)rate;
+    rule.burst = (uint8_t)burst;
+    rule.decimate = (uint8_t)decimate;
+    if (!ok || !can_limit_set((uint8_t)index, &rule))
+        return CAN_ERROR;
+    return CAN_OK;
+}
+
+uint8_t handleUnknown(uint8_t *inData, uint8_t *inSize, uint8_t *outData, uint8_t *outSize)
+{
+    (void)inData;
+    (void)inSize;
+    (void)outData;
+    (void)outSize;
+    // Any command nobody registered a handler for
+    return CAN_ERROR;
+}
+
+// Command dispatch table, indexed by command byte - SLCAN_CMD_FIRST; empty
+// slots fall back to handleUnknown
+static CmdHandler cmdTable[SLCAN_CMD_RANGE] = {
+    ['t' - SLCAN_CMD_FIRST] = handletiiiildd,     // tiiildd...[CR] command handler
+    ['T' - SLCAN_CMD_FIRST] = handleTiiiiiiiildd, // Tiiiiiiiildd...[CR] command handler
+    ['S' - SLCAN_CMD_FIRST] = handleSn,           // Sn[CR] command handler
+    ['s' - SLCAN_CMD_FIRST] = handlesxxyy,        // sxxyy[CR] command handler
+    ['O' - SLCAN_CMD_FIRST] = handleO,            // O[CR] command handler
+    ['L' - SLCAN_CMD_FIRST] = handleL,            // L[CR] command handler
+    ['C' - SLCAN_CMD_FIRST] = handleC,            // C[CR] command handler
+    ['r' - SLCAN_CMD_FIRST] = handleriiil,        // riiil[CR] command handler
+    ['R' - SLCAN_CMD_FIRST] = handleRiiiiiiiil,   // Riiiiiiiil[CR] command handler
+    ['P' - SLCAN_CMD_FIRST] = handleP,            // P[CR] command handler
+    ['A' - SLCAN_CMD_FIRST] = handleA,            // A[CR] command handler
+    ['F' - SLCAN_CMD_FIRST] = handleF,            // F[CR] command handler
+    ['X' - SLCAN_CMD_FIRST] = handleXn,           // Xn[CR] command handler
+    ['W' - SLCAN_CMD_FIRST] = handleWn,           // Wn[CR] command handler
+    ['M' - SLCAN_CMD_FIRST] = handleMxxxxxxxx,    // Mxxxxxxxx[CR] command handler
+    ['m' - SLCAN_CMD_FIRST] = handlemxxxxxxxx,    // mxxxxxxxx[CR] command handler
+    ['U' - SLCAN_CMD_FIRST] = handleUn,           // Un[CR] command handler
+    ['V' - SLCAN_CMD_FIRST] = handleV,            // V[CR] command handler
+    ['N' - SLCAN_CMD_FIRST] = handleN,            // N[CR] command handler
+    ['Z' - SLCAN_CMD_FIRST] = handleZn,           // Zn[CR] command handler
+    ['Q' - SLCAN_CMD_FIRST] = handleQn,           // Qn[CR] command handler
+    ['D' - SLCAN_CMD_FIRST] = handleDxx,          // Dxx[CR] command handler
+    ['f' - SLCAN_CMD_FIRST] = handlefiii,         // f[iii[mmm]][CR] command handler
+    ['J' - SLCAN_CMD_FIRST] = handleJn,           // Jn[CR] command handler
+    ['k' - SLCAN_CMD_FIRST] = handlekbbbbbb,      // kbbbbbb[,ppp][CR] command handler
+    ['B' - SLCAN_CMD_FIRST] = handleBn,           // Bn[CR] command handler
+    ['I' - SLCAN_CMD_FIRST] = handleIn,           // In[CR] command handler
+    ['u' - SLCAN_CMD_FIRST] = handleu,            // u[R][CR] command handler
+    ['E' - SLCAN_CMD_FIRST] = handleEn,           // En[CR] command handler
+    ['p' - SLCAN_CMD_FIRST] = handlep,            // p[n[ppppoooo<frame>]][CR] command handler
+    ['H' - SLCAN_CMD_FIRST] = handleH,            // H[C|S|Rnnnn|Wdd...][CR] command handler
+    ['c' - SLCAN_CMD_FIRST] = handlec,            // c[n[kkkk]][CR] command handler
+    ['K' - SLCAN_CMD_FIRST] = handleK,            // K[n[rrrrbbdd<id>]][CR] command handler
 };
 
+bool slcan_register_command(char cmd, CmdHandler handler)
+{
+    uint8_t index = (uint8_t)((uint8_t)cmd - SLCAN_CMD_FIRST);
+
+    if (index >= SLCAN_CMD_RANGE)
+        return false;
+    cmdTable[index] = handler;
+    return true;
+}
+
 void slcan_decode(uint8_t *inData, uint8_t *inSize, uint8_t *outData, uint8_t *outSize)
 {
     if (inData[*inSize - 1u] != CAN_OK)
@@ -435,29 +1067,297 @@ void slcan_decode(uint8_t *inData, uint8_t *inSize, uint8_t *outData, uint8_t *o
         (*outSize)++;
         return;
     }
-    char command = inData[0];
+    /* an empty line gets no answer */
+    if (*inSize == 1u)
+        return;
 
-    for (int i = 0; i < SLCAN_CMD_COUNT; i++)
-    {
-        if (cmdLookupTable[i].cmd == command)
-        {
-            uint8_t response = cmdLookupTable[i].handler(inData, inSize, outData, outSize);
-            outData[*outSize] = response;
-            (*outSize)++;
-            return;
-        }
-    }
+    uint8_t index = (uint8_t)(inData[0] - SLCAN_CMD_FIRST);
+    CmdHandler handler = (index < SLCAN_CMD_RANGE) ? cmdTable[index] : NULL;
+    if (handler == NULL)
+        handler = handleUnknown;
+    uint8_t response = handler(inData, inSize, outData, outSize);
+    outData[*outSize] = response;
+    (*outSize)++;
 }
 
-void slcan_encode(uint32_t id, uint8_t len, uint8_t *data)
+void slcan_clock(uint32_t now)
+{
+    uint32_t elapsed = now - stampClock.last;
+    uint32_t us = stampClock.us + (elapsed % 1000u);
+
+    stampClock.ms = (uint16_t)((stampClock.ms + (elapsed / 1000u) % 60000u + us / 1000u) % 60000u);
+    stampClock.us = (uint16_t)(us % 1000u);
+    stampClock.last = now;
+}
+
+/* Z1 stamp of a frame, its distance from the last slcan_clock() applied to
+   the carried count; the frame may be stamped before or after that call */
+static uint16_t stamp_ms(uint32_t timestamp)
+{
+    int32_t us = (int32_t)stampClock.us + (int32_t)(timestamp - stampClock.last);
+    int32_t ms = (int32_t)stampClock.ms + us / 1000 - ((us % 1000) < 0);
+
+    ms %= 60000;
+    return (uint16_t)((ms < 0) ? (ms + 60000) : ms);
+}
+
+bool slcan_encode(uint32_t id, uint8_t len, const uint8_t *data, uint32_t timestamp)
 {
     slcan_message_t message = {
         .can_id = id,
         .can_dlc = len,
     };
-    memcpy(message.data, data, len);
+    memcpy(message.data, data, MAX_DLC(len));
     uint8_t buff[64];
     uint8_t nBytes;
+
+    if (binaryMode)
+    {
+        uint8_t record[SLCAN_BIN_RECORD_MAX];
+        uint8_t size = binary_pack(&message, (timestampMode != SLCAN_TIMESTAMP_OFF) ? &timestamp : NULL, record);
+        return usb_send(buff, cobs_encode(record, size, buff));
+    }
+
     encode_message(&message, buff, &nBytes);
-    usb_send(buff, nBytes);
-}
\ No newline at end of file
+
+    /* the time stamp goes between the data and the CR */
+    if (timestampMode != SLCAN_TIMESTAMP_OFF)
+    {
+        uint8_t *p = &buff[nBytes - 1u];
+
+        if (timestampMode == SLCAN_TIMESTAMP_MS)
+        {
+            uint16_t ms = stamp_ms(timestamp);
+            p = put_hex_byte(p, (uint8_t)(ms >> 8));
+            p = put_hex_byte(p, (uint8_t)ms);
+        }
+        else
+        {
+            p = put_hex_byte(p, (uint8_t)(timestamp >> 24));
+            p = put_hex_byte(p, (uint8_t)(timestamp >> 16));
+            p = put_hex_byte(p, (uint8_t)(timestamp >> 8));
+            p = put_hex_byte(p, (uint8_t)timestamp);
+        }
+        *p++ = (uint8_t)CAN_OK;
+        nBytes = (uint8_t)(p - buff);
+    }
+    return usb_send(buff, nBytes);
+}
+
+/* control record from the device, carrying one status byte */
+static void binary_status(uint8_t status, uint8_t *outData, uint8_t *outSize)
+{
+    const uint8_t record[2] = {SLCAN_BIN_ESCAPE, status};
+
+    *outSize = (uint8_t)(*outSize + cobs_encode(record, sizeof(record), &outData[*outSize]));
+}
+
+/* execute one binary record, the COBS block with its 0x00 delimiter */
+static void binary_decode(uint8_t *inData, uint8_t *inSize, uint8_t *outData, uint8_t *outSize)
+{
+    slcan_message_t message = {0};
+    uint8_t size;
+
+    /* a lone delimiter is padding the host may send to resynchronise */
+    if (*inSize == 1u)
+        return;
+
+    size = cobs_decode(inData, (uint8_t)(*inSize - 1u));
+    if ((size == 1u) && (inData[0] == SLCAN_BIN_ESCAPE))
+    {
+        binaryMode = false;
+        outData[(*outSize)++] = CAN_OK;
+        return;
+    }
+    /* frames are not acknowledged, only failures are reported */
+    if (!binary_unpack(&message, inData, size) || !queue_message(&message))
+        binary_status(CAN_ERROR, outData, outSize);
+}
+
+/* send the responses collected so far if another one might not fit */
+static void reply_room(uint8_t *out, uint8_t *outSize)
+{
+    if (*outSize > (SLCAN_REPLY_MAX - SLCAN_RESPONSE_MAX))
+    {
+        usb_send(out, *outSize);
+        *outSize = 0;
+    }
+}
+
+/* add one byte from the host to the command line, execute it once complete */
+static void receive_byte(uint8_t ch, uint8_t *out, uint8_t *outSize)
+{
+    uint8_t end = binaryMode ? 0u : CAN_OK;
+
+    /* tolerate CR LF line endings */
+    if ((ch == '\n') && (lineSize == 0u) && !binaryMode)
+        return;
+
+    if (lineSize < SLCAN_LINE_MAX)
+        lineBuffer[lineSize++] = ch;
+    else
+        lineOverflow = true;
+
+    if (ch != end)
+        return;
+
+    reply_room(out, outSize);
+    if (lineOverflow && binaryMode)
+    {
+        binary_status(CAN_ERROR, out, outSize);
+    }
+    else if (lineOverflow)
+    {
+        out[(*outSize)++] = CAN_ERROR;
+    }
+    else
+    {
+        uint8_t n = 0;
+        if (binaryMode)
+            binary_decode(lineBuffer, &lineSize, &out[*outSize], &n);
+        else
+            slcan_decode(lineBuffer, &lineSize, &out[*outSize], &n);
+        *outSize += n;
+    }
+    lineSize = 0;
+    lineOverflow = false;
+}
+
+void slcan_receive(const uint8_t *data, uint16_t size)
+{
+    uint8_t out[SLCAN_REPLY_MAX];
+    uint8_t outSize = 0;
+
+    for (uint16_t i = 0; i < size; i++)
+        receive_byte(data[i], out, &outSize);
+
+    if (outSize)
+        usb_send(out, outSize);
+}
+
+/* byte i of a packet that is read in 16-bit words */
+static inline uint8_t packet_byte(const volatile uint16_t *packet, uint16_t i)
+{
+    return (uint8_t)(packet[i >> 1] >> ((i & 1u) << 3));
+}
+
+/* Parse the t, T, r or R command at offset at of the packet straight into
+ * the images of the TX mailbox registers and hand them to can_tx_direct().
+ * Returns the length of the line, CR included, or 0 if it is anything else,
+ * isn't complete in this packet or isn't exactly the frame and the CR; the
+ * line parser takes such lines byte by byte and answers them as ever. */
+static uint16_t transmit_packet(const volatile uint16_t *packet, uint16_t at, uint16_t size,
+                                uint8_t *out, uint8_t *outSize)
+{
+    uint16_t p = (uint16_t)(at + 1u);
+    uint8_t digits;
+    uint8_t invalid = 0;
+    uint8_t dlc;
+    uint32_t id = 0;
+    uint32_t tir;
+    uint32_t data[2] = {0, 0};
+
+    switch (packet_byte(packet, at))
+    {
+    case 't':
+        tir = 0;
+        digits = 3;
+        break;
+    case 'T':
+        tir = CAN_TIR_IDE;
+        digits = 8;
+        break;
+    case 'r':
+        tir = CAN_TIR_RTR;
+        digits = 3;
+        break;
+    case 'R':
+        tir = CAN_TIR_RTR | CAN_TIR_IDE;
+        digits = 8;
+        break;
+    default:
+        return 0;
+    }
+
+    /* identifier, DLC and at least the CR */
+    if ((size - p) < (uint16_t)(digits + 2u))
+        return 0;
+    for (uint8_t i = 0; i < digits; i++)
+    {
+        uint8_t d = hexDecode[packet_byte(packet, p++)];
+        invalid |= d;
+        id = (id << 4) | (uint32_t)d;
+    }
+    dlc = hexDecode[packet_byte(packet, p++)];
+    if ((invalid & 0xF0u) || (dlc > CAN_DLC_MAX) || (id > ((tir & CAN_TIR_IDE) ? CAN_XTD_MASK : CAN_STD_MASK)))
+        return 0;
+
+    /* payload bytes 0..3 go to TDLR, 4..7 to TDHR, lowest byte first */
+    if (!(tir & CAN_TIR_RTR))
+    {
+        if ((size - p) < (uint16_t)(2u * dlc + 1u))
+            return 0;
+        for (uint8_t i = 0; i < dlc; i++)
+        {
+            uint8_t hi = hexDecode[packet_byte(packet, p)];
+            uint8_t lo = hexDecode[packet_byte(packet, (uint16_t)(p + 1u))];
+            invalid |= hi | lo;
+            data[i >> 2] |= (uint32_t)((hi << 4) | lo) << ((i & 3u) << 3);
+            p += 2u;
+        }
+        if (invalid & 0xF0u)
+            return 0;
+    }
+    if (packet_byte(packet, p++) != CAN_OK)
+        return 0;
+
+    tir |= (tir & CAN_TIR_IDE) ? (id << CAN_TIR_EXID_SHIFT) : (id << CAN_TIR_STID_SHIFT);
+    reply_room(out, outSize);
+    if (can_tx_direct(tir, dlc, data[0], data[1]))
+    {
+        out[(*outSize)++] = (tir & CAN_TIR_IDE) ? CAN_AUTOPOLL_XTD : CAN_AUTOPOLL;
+        out[(*outSize)++] = CAN_OK;
+    }
+    else
+    {
+        out[(*outSize)++] = CAN_ERROR;
+    }
+    return (uint16_t)(p - at);
+}
+
+void slcan_receive_packet(const volatile uint16_t *packet, uint16_t size)
+{
+    uint8_t out[SLCAN_REPLY_MAX];
+    uint8_t outSize = 0;
+
+    for (uint16_t i = 0; i < size;)
+    {
+        /* a frame command that starts a line and ends in this packet skips
+         * the line buffer */
+        if ((lineSize == 0u) && !binaryMode)
+        {
+            uint16_t n = transmit_packet(packet, i, size, out, &outSize);
+
+            if (n)
+            {
+                i += n;
+                continue;
+            }
+        }
+        receive_byte(packet_byte(packet, i++), out, &outSize);
+    }
+
+    if (outSize)
+        usb_send(out, outSize);
+}
+
+void slcan_reset(void)
+{
+    lineSize = 0;
+    lineOverflow = false;
+    binaryMode = false;
+    can_periodic_reset();
+    can_burst_stop();
+    can_rx_change_only(false, 0);
+    can_limit_reset();
+}
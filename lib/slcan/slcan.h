@@ -8,6 +8,7 @@
 #ifndef SLCAN_SLCAN_H_
 #define SLCAN_SLCAN_H_
 #include "stdint.h"
+#include "stdbool.h"
 
 /*  -----------  defines  ------------------------------------------------
  */
@@ -18,7 +19,7 @@
  */
 #define CAN_STD_FRAME   0x00000000U     /**< standard frame format (11-bit) */
 #define CAN_XTD_FRAME   0x80000000U     /**< extended frame format (29-bit) */
-#define CAN_ERR_FRAME   0x40000000U     /**< error frame (not supported) */
+#define CAN_ERR_FRAME   0x40000000U     /**< error frame, see below */
 #define CAN_RTR_FRAME   0x20000000U     /**< remote frame */
 /** @} */
 
@@ -29,6 +30,33 @@
 #define CAN_XTD_MASK    0x1FFFFFFFU     /**< highest 29-bit identifier */
 /** @} */
 
+/** @name  CAN Error Frame
+ *  @brief Error classes in the identifier and payload bytes of an error
+ *         frame, as in SocketCAN's linux/can/error.h (the subset bxCAN can
+ *         tell apart)
+ *  @{ */
+#define CAN_ERR_DLC     8U              /**< error frames always carry 8 bytes */
+#define CAN_ERR_CRTL    0x00000004U     /**< controller problems, data[1] */
+#define CAN_ERR_PROT    0x00000008U     /**< protocol violations, data[2] and data[3] */
+#define CAN_ERR_ACK     0x00000020U     /**< received no ACK on transmission */
+#define CAN_ERR_BUSOFF  0x00000040U     /**< bus off */
+#define CAN_ERR_RESTARTED 0x00000100U   /**< controller restarted */
+#define CAN_ERR_CNT     0x00000200U     /**< TX error counter in data[6], RX in data[7] */
+
+#define CAN_ERR_CRTL_RX_OVERFLOW 0x01U  /**< RX buffer overflow */
+#define CAN_ERR_CRTL_RX_WARNING 0x04U   /**< reached warning level for RX errors */
+#define CAN_ERR_CRTL_TX_WARNING 0x08U   /**< reached warning level for TX errors */
+#define CAN_ERR_CRTL_RX_PASSIVE 0x10U   /**< reached error passive status RX */
+#define CAN_ERR_CRTL_TX_PASSIVE 0x20U   /**< reached error passive status TX */
+#define CAN_ERR_CRTL_ACTIVE 0x40U       /**< recovered to error active state */
+
+#define CAN_ERR_PROT_FORM 0x02U         /**< frame format error */
+#define CAN_ERR_PROT_STUFF 0x04U        /**< bit stuffing error */
+#define CAN_ERR_PROT_BIT0 0x08U         /**< unable to send dominant bit */
+#define CAN_ERR_PROT_BIT1 0x10U         /**< unable to send recessive bit */
+#define CAN_ERR_PROT_LOC_CRC_SEQ 0x08U  /**< error in the CRC sequence */
+/** @} */
+
 /** @name  CAN Data Length
  *  @brief CAN payload length and DLC definition
  *  @{ */
@@ -54,7 +82,72 @@
 #define CAN_OK (uint8_t)'\r'
 #define CAN_ERROR (uint8_t)'\a'
 #define CAN_AUTOPOLL (uint8_t)'z'
+#define CAN_AUTOPOLL_XTD (uint8_t)'Z'
+
+/* time stamp modes of the Z command */
+#define SLCAN_TIMESTAMP_OFF 0U /* no time stamp */
+#define SLCAN_TIMESTAMP_MS 1U  /* 4 hex digits, milliseconds 0..59999 */
+#define SLCAN_TIMESTAMP_US 2U  /* 8 hex digits, free-running microseconds */
+
+/** @brief  CAN message (SocketCAN compatible)
+ */
+typedef struct slcan_message_t_
+{                              /* SLCAN message: */
+    uint32_t can_id;           /**< message identifier */
+    uint8_t can_dlc;           /**< data length code (0..8) */
+    uint8_t __pad;             /**< (padding) */
+    uint8_t __res1;            /**< (resvered for CAN FD) */
+    uint8_t __res2;            /**< (resvered for CAN FD) */
+    uint8_t data[CAN_LEN_MAX]; /**< payload (max. 8 data bytes) */
+} slcan_message_t;
+
+/** @name  Command dispatch
+ *  @brief Commands are single characters in the range '@'..DEL
+ *  @{ */
+#define SLCAN_CMD_FIRST 0x40U           /**< first dispatchable command byte */
+#define SLCAN_CMD_RANGE 0x40U           /**< number of dispatchable command bytes */
+/** @} */
+
+/** @brief  Command handler: gets the whole line (CR included), may write
+ *          a response to outData/outSize and returns CAN_OK or CAN_ERROR.
+ */
+typedef uint8_t (*CmdHandler)(uint8_t *inData, uint8_t *inSize, uint8_t *outData, uint8_t *outSize);
+
+/** @brief  Installs the handler for a command byte, NULL restores the
+ *          default BELL answer. Returns false for bytes outside the table.
+ */
+bool slcan_register_command(char cmd, CmdHandler handler);
+
+bool encode_message(const slcan_message_t *message, uint8_t *buffer, uint8_t *nbytes);
+bool decode_message(slcan_message_t *message, const uint8_t *buffer, uint8_t nbytes);
 
 void slcan_decode(uint8_t *inData, uint8_t *inSize, uint8_t *outData, uint8_t *outSize);
+/** @brief  Carries the millisecond count of the Z1 time stamps on to @p now,
+ *          the current microsecond time stamp. Called at least once per
+ *          wrap of the stamps, frames are stamped ms from their distance
+ *          to the last call, so the count doesn't jump back at the wrap.
+ */
+void slcan_clock(uint32_t now);
+/** @brief  Encodes a received frame and sends it to the host.
+ *  @return false if the host link could not take it right now
+ */
+bool slcan_encode(uint32_t id, uint8_t len, const uint8_t *data, uint32_t timestamp);
+
+/** @brief  Feeds raw bytes from the host into the command line parser.
+ *
+ *  Every complete CR-terminated command in @p data is executed and its
+ *  response sent to the host; an incomplete trailing command is kept and
+ *  completed by the next call.
+ */
+void slcan_receive(const uint8_t *data, uint16_t size);
+/** @brief  Like slcan_receive(), for a packet left in the USB packet memory,
+ *          which is read in 16-bit words.
+ *
+ *  Frame commands are parsed out of the packet into the TX mailbox
+ *  registers without a copy, see can_tx_direct().
+ */
+void slcan_receive_packet(const volatile uint16_t *packet, uint16_t size);
+/** @brief  Drops a partially received command line and returns to ASCII mode. */
+void slcan_reset(void);
 
 #endif /* SLCAN_SLCAN_H_ */
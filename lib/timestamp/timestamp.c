@@ -0,0 +1,58 @@
+#include "timestamp.h"
+#include <libopencm3/stm32/rcc.h>
+#include <libopencm3/stm32/timer.h>
+
+/*
+ * Free-running microsecond clock. TIM2 is the one 32-bit timer of the F0, so
+ * it counts the full 32 bits (wrapping after ~71 minutes) without any
+ * overflow interrupt to extend it in software. Compare channels 1 and 2
+ * are two alarms that raise TIM2's interrupt at a given time stamp; the user
+ * of the alarms provides tim2_isr and enables the interrupt in the NVIC.
+ */
+#define TIMESTAMP_TIMER TIM2
+#define TIMESTAMP_APB_HZ 48000000u
+
+static const enum tim_oc_id alarm_oc[TIMESTAMP_ALARMS] = {TIM_OC1, TIM_OC2};
+static const uint32_t alarm_flag[TIMESTAMP_ALARMS] = {TIM_SR_CC1IF, TIM_SR_CC2IF};
+static const uint32_t alarm_irq[TIMESTAMP_ALARMS] = {TIM_DIER_CC1IE, TIM_DIER_CC2IE};
+
+void timestamp_setup(void)
+{
+    rcc_periph_clock_enable(RCC_TIM2);
+
+    timer_set_prescaler(TIMESTAMP_TIMER, (TIMESTAMP_APB_HZ / TIMESTAMP_CLOCK_HZ) - 1u);
+    timer_set_period(TIMESTAMP_TIMER, 0xFFFFFFFFu);
+    // load the prescaler now instead of at the first overflow
+    timer_generate_event(TIMESTAMP_TIMER, TIM_EGR_UG);
+    timer_enable_counter(TIMESTAMP_TIMER);
+}
+
+uint32_t timestamp_now(void)
+{
+    return TIM_CNT(TIMESTAMP_TIMER);
+}
+
+// Raise the TIM2 interrupt when the clock reaches at. A time that already
+// passed only matches after the next wrap, so the caller compares
+// timestamp_now() with it afterwards.
+void timestamp_alarm(uint8_t alarm, uint32_t at)
+{
+    timer_set_oc_value(TIMESTAMP_TIMER, alarm_oc[alarm], at);
+    timer_clear_flag(TIMESTAMP_TIMER, alarm_flag[alarm]);
+    timer_enable_irq(TIMESTAMP_TIMER, alarm_irq[alarm]);
+}
+
+void timestamp_alarm_stop(uint8_t alarm)
+{
+    timer_disable_irq(TIMESTAMP_TIMER, alarm_irq[alarm]);
+    timer_clear_flag(TIMESTAMP_TIMER, alarm_flag[alarm]);
+}
+
+// Clear the compare flag of an enabled alarm in tim2_isr, true if it was set
+bool timestamp_alarm_ack(uint8_t alarm)
+{
+    if (!(TIM_DIER(TIMESTAMP_TIMER) & alarm_irq[alarm]) || !timer_get_flag(TIMESTAMP_TIMER, alarm_flag[alarm]))
+        return false;
+    timer_clear_flag(TIMESTAMP_TIMER, alarm_flag[alarm]);
+    return true;
+}
@@ -0,0 +1,15 @@
+#ifndef TIMESTAMP_H
+#define TIMESTAMP_H
+#include "stdint.h"
+#include "stdbool.h"
+
+#define TIMESTAMP_CLOCK_HZ 1000000u /* one tick per microsecond */
+#define TIMESTAMP_ALARMS 2u         /* compare channels used as alarms */
+
+void timestamp_setup(void);
+uint32_t timestamp_now(void);
+void timestamp_alarm(uint8_t alarm, uint32_t at);
+void timestamp_alarm_stop(uint8_t alarm);
+bool timestamp_alarm_ack(uint8_t alarm);
+
+#endif /* TIMESTAMP_H */
@@ -0,0 +1,434 @@
+/*
+ * gs_usb.c
+ *
+ * Vendor interface compatible with the Linux gs_usb driver (candleLight),
+ * built instead of the CDC-ACM one in usb.c when USB_GS_USB is defined.
+ * Every bulk transfer carries one gs_host_frame_t: frames from the bus and
+ * error frames go out on 0x81, frames to send come in on 0x02 and are
+ * echoed back once they left the mailbox. Frames go through the same CAN
+ * queues as SLCAN, only the encoding differs.
+ */
+#ifdef USB_GS_USB
+#include <string.h>
+#include <libopencm3/cm3/nvic.h>
+#include <libopencm3/usb/usbd.h>
+#include <libopencm3/stm32/st_usbfs.h>
+#include "usb.h"
+#include "gs_usb.h"
+#include "usb_dbuf.h"
+#include "slcan.h"
+#include "can.h"
+#include "led.h"
+#include "timestamp.h"
+
+#define GS_USB_PACKET_SIZE 64u
+#define GS_USB_IDENTIFY_MS 250u /* LED blink period while the host identifies us */
+
+extern uint8_t usbd_control_buffer[128];
+extern volatile uint32_t ticks;
+
+static usbd_device *gs_dev;
+static char gs_serial_no[9];
+
+static bool out_nak = false;		  /* endpoint 0x02 held in NAK for back-pressure */
+
+static bool started = false;	 /* channel started by GS_USB_BREQ_MODE */
+static uint32_t mode_flags = 0;	 /* GS_CAN_FEATURE_* bits of the last start */
+static uint32_t btr = 0;		 /* from GS_USB_BREQ_BITTIMING, 0 until set */
+static bool identify = false;
+static uint32_t identify_tick;
+
+static uint32_t err_tick; /* time of the last error frame, for the rate limit */
+
+static const struct usb_device_descriptor dev = {
+	.bLength = USB_DT_DEVICE_SIZE,
+	.bDescriptorType = USB_DT_DEVICE,
+	.bcdUSB = 0x0200,
+	.bDeviceClass = 0,
+	.bDeviceSubClass = 0,
+	.bDeviceProtocol = 0,
+	.bMaxPacketSize0 = 64,
+	.idVendor = GS_USB_VENDOR_ID,
+	.idProduct = GS_USB_PRODUCT_ID,
+	.bcdDevice = 0x0200,
+	.iManufacturer = 1,
+	.iProduct = 2,
+	.iSerialNumber = 3,
+	.bNumConfigurations = 1,
+};
+
+static const struct usb_endpoint_descriptor gs_endp[] = {{
+	.bLength = USB_DT_ENDPOINT_SIZE,
+	.bDescriptorType = USB_DT_ENDPOINT,
+	.bEndpointAddress = GS_USB_EP_IN,
+	.bmAttributes = USB_ENDPOINT_ATTR_BULK,
+	.wMaxPacketSize = GS_USB_PACKET_SIZE,
+	.bInterval = 0,
+}, {
+	.bLength = USB_DT_ENDPOINT_SIZE,
+	.bDescriptorType = USB_DT_ENDPOINT,
+	.bEndpointAddress = GS_USB_EP_OUT,
+	.bmAttributes = USB_ENDPOINT_ATTR_BULK,
+	.wMaxPacketSize = GS_USB_PACKET_SIZE,
+	.bInterval = 0,
+}};
+
+static const struct usb_interface_descriptor gs_iface[] = {{
+	.bLength = USB_DT_INTERFACE_SIZE,
+	.bDescriptorType = USB_DT_INTERFACE,
+	.bInterfaceNumber = 0,
+	.bAlternateSetting = 0,
+	.bNumEndpoints = 2,
+	.bInterfaceClass = USB_CLASS_VENDOR,
+	.bInterfaceSubClass = 0xFF,
+	.bInterfaceProtocol = 0xFF,
+	.iInterface = 0,
+
+	.endpoint = gs_endp,
+}};
+
+static const struct usb_interface ifaces[] = {{
+	.num_altsetting = 1,
+	.altsetting = gs_iface,
+}};
+
+static const struct usb_config_descriptor config = {
+	.bLength = USB_DT_CONFIGURATION_SIZE,
+	.bDescriptorType = USB_DT_CONFIGURATION,
+	.wTotalLength = 0,
+	.bNumInterfaces = 1,
+	.bConfigurationValue = 1,
+	.iConfiguration = 0,
+	.bmAttributes = 0x80,
+	.bMaxPower = 0x32,
+
+	.interface = ifaces,
+};
+
+static const char *usb_strings[] = {
+	"JeeLabs",
+	"SerPlus gs_usb",
+	gs_serial_no,
+};
+
+// bxCAN limits, the segments are split like in bittiming.c
+static const gs_device_bt_const_t bt_const = {
+	.feature = GS_CAN_FEATURE_HW_TIMESTAMP | GS_CAN_FEATURE_IDENTIFY | GS_CAN_FEATURE_BERR_REPORTING,
+	.fclk_can = 48000000u,
+	.tseg1_min = 1u,
+	.tseg1_max = 16u,
+	.tseg2_min = 1u,
+	.tseg2_max = 8u,
+	.sjw_max = 4u,
+	.brp_min = 1u,
+	.brp_max = 1024u,
+	.brp_inc = 1u,
+};
+
+static const gs_device_config_t device_config = {
+	.icount = 0,
+	.sw_version = 2,
+	.hw_version = 1,
+};
+
+// SocketCAN flags on the wire, CAN_XTD_FRAME and friends inside
+static uint32_t gs_can_id_from_frame(uint32_t id)
+{
+	uint32_t can_id = id & ((id & CAN_XTD_FRAME) ? CAN_XTD_MASK : CAN_STD_MASK);
+
+	if (id & CAN_XTD_FRAME)
+		can_id |= GS_CAN_EFF_FLAG;
+	if (id & CAN_RTR_FRAME)
+		can_id |= GS_CAN_RTR_FLAG;
+	if (id & CAN_ERR_FRAME)
+		can_id |= GS_CAN_ERR_FLAG;
+	return can_id;
+}
+
+static bool gs_bittiming(const gs_device_bittiming_t *bt)
+{
+	uint32_t ts1 = bt->prop_seg + bt->phase_seg1;
+
+	if ((ts1 < bt_const.tseg1_min) || (ts1 > bt_const.tseg1_max) ||
+		(bt->phase_seg2 < bt_const.tseg2_min) || (bt->phase_seg2 > bt_const.tseg2_max) ||
+		(bt->sjw < 1u) || (bt->sjw > bt_const.sjw_max) ||
+		(bt->brp < bt_const.brp_min) || (bt->brp > bt_const.brp_max))
+		return false;
+	btr = ((bt->sjw - 1u) << 24) | ((bt->phase_seg2 - 1u) << 20) | ((ts1 - 1u) << 16) | (bt->brp - 1u);
+	return true;
+}
+
+static void gs_mode(const gs_device_mode_t *mode)
+{
+	if (mode->mode == GS_CAN_MODE_START)
+	{
+		if (btr)
+			can_setup_btr(btr);
+		mode_flags = mode->flags & bt_const.feature;
+		can_err_reporting(true);
+		err_tick = ticks - CAN_ERR_REPORT_MS;
+		started = true;
+	}
+	else
+	{
+		started = false;
+		can_err_reporting(false);
+	}
+}
+
+static enum usbd_request_return_codes gs_usb_control_request(usbd_device *usbd_dev, struct usb_setup_data *req, uint8_t **buf,
+															 uint16_t *len, void (**complete)(usbd_device *usbd_dev, struct usb_setup_data *req))
+{
+	static uint32_t timestamp;
+
+	(void)complete;
+	(void)usbd_dev;
+
+	switch (req->bRequest)
+	{
+	case GS_USB_BREQ_HOST_FORMAT:
+	case GS_USB_BREQ_BERR:
+		// all little endian anyway, bus errors come with the mode flags
+		return USBD_REQ_HANDLED;
+	case GS_USB_BREQ_BITTIMING:
+		if ((*len < sizeof(gs_device_bittiming_t)) || !gs_bittiming((const gs_device_bittiming_t *)*buf))
+			return USBD_REQ_NOTSUPP;
+		return USBD_REQ_HANDLED;
+	case GS_USB_BREQ_MODE:
+		if (*len < sizeof(gs_device_mode_t))
+			return USBD_REQ_NOTSUPP;
+		gs_mode((const gs_device_mode_t *)*buf);
+		return USBD_REQ_HANDLED;
+	case GS_USB_BREQ_BT_CONST:
+		*buf = (uint8_t *)&bt_const;
+		*len = (*len < sizeof(bt_const)) ? *len : sizeof(bt_const);
+		return USBD_REQ_HANDLED;
+	case GS_USB_BREQ_DEVICE_CONFIG:
+		*buf = (uint8_t *)&device_config;
+		*len = (*len < sizeof(device_config)) ? *len : sizeof(device_config);
+		return USBD_REQ_HANDLED;
+	case GS_USB_BREQ_TIMESTAMP:
+		timestamp = timestamp_now();
+		*buf = (uint8_t *)&timestamp;
+		*len = (*len < sizeof(timestamp)) ? *len : sizeof(timestamp);
+		return USBD_REQ_HANDLED;
+	case GS_USB_BREQ_IDENTIFY:
+		if (*len < sizeof(uint32_t))
+			return USBD_REQ_NOTSUPP;
+		identify = (*buf)[0] != 0;
+		identify_tick = ticks;
+		return USBD_REQ_HANDLED;
+	}
+	return USBD_REQ_NOTSUPP;
+}
+
+// One frame to send per transfer, tagged so its completion can be echoed
+static void gs_usb_data_rx_cb(usbd_device *usbd_dev, uint8_t ep)
+{
+	gs_host_frame_t hf;
+	can_frame_t frame = {0};
+	uint16_t len;
+
+	(void)ep;
+	len = usb_dbuf_read(usbd_dev, GS_USB_EP_OUT, &hf, sizeof(hf));
+	if (len == 0)
+		return;
+	usb_stats.out_packets++;
+	usb_stats.out_bytes += len;
+
+	// the echo tag is 16 bits wide, Linux uses echo_id 0..9
+	if ((len < GS_HOST_FRAME_SIZE) || !started || (hf.channel != 0) || (hf.can_dlc > CAN_DLC_MAX) ||
+		(hf.can_id & GS_CAN_ERR_FLAG) || (hf.echo_id >= UINT16_MAX))
+	{
+		can_tx_stats.rejected++;
+		return;
+	}
+
+	frame.id = hf.can_id & ((hf.can_id & GS_CAN_EFF_FLAG) ? CAN_XTD_MASK : CAN_STD_MASK);
+	if (hf.can_id & GS_CAN_EFF_FLAG)
+		frame.id |= CAN_XTD_FRAME;
+	if (hf.can_id & GS_CAN_RTR_FLAG)
+		frame.id |= CAN_RTR_FRAME;
+	frame.dlc = hf.can_dlc;
+	frame.tag = (uint16_t)(hf.echo_id + 1u);
+	memcpy(frame.data, hf.data, sizeof(frame.data));
+	can_tx_enqueue(&frame);
+}
+
+static void gs_usb_data_tx_cb(usbd_device *usbd_dev, uint8_t ep)
+{
+	// the host collected an IN packet, a second one goes next
+	usb_dbuf_in_done(usbd_dev, ep);
+}
+
+static void gs_usb_set_config(usbd_device *usbd_dev, uint16_t wValue)
+{
+	(void)wValue;
+
+	started = false;
+	usbd_ep_setup(usbd_dev, GS_USB_EP_IN, USB_ENDPOINT_ATTR_BULK, GS_USB_PACKET_SIZE, gs_usb_data_tx_cb);
+	usb_dbuf_setup(usbd_dev, GS_USB_EP_IN);
+	usbd_ep_setup(usbd_dev, GS_USB_EP_OUT, USB_ENDPOINT_ATTR_BULK, GS_USB_PACKET_SIZE, gs_usb_data_rx_cb);
+	usb_dbuf_setup(usbd_dev, GS_USB_EP_OUT);
+	if (out_nak)
+	{
+		usbd_ep_nak_set(usbd_dev, GS_USB_EP_OUT, 0);
+		out_nak = false;
+	}
+
+	usbd_register_control_callback(
+		usbd_dev,
+		USB_REQ_TYPE_VENDOR | USB_REQ_TYPE_INTERFACE,
+		USB_REQ_TYPE_TYPE | USB_REQ_TYPE_RECIPIENT,
+		gs_usb_control_request);
+}
+
+void gs_usb_init(void)
+{
+	usb_preinit();
+
+	get_dev_unique_id(gs_serial_no);
+
+	gs_dev = usbd_init(&st_usbfs_v2_usb_driver, &dev, &config,
+					   usb_strings, 3, usbd_control_buffer, sizeof(usbd_control_buffer));
+	usbd_register_set_config_callback(gs_dev, gs_usb_set_config);
+	nvic_enable_irq(NVIC_USB_IRQ);
+}
+
+// Every OUT transfer is one frame, NAK while the CAN TX queue has no room
+static void gs_usb_back_pressure(void)
+{
+	bool full = can_tx_free() == 0;
+
+	if (full != out_nak)
+	{
+		usbd_ep_nak_set(gs_dev, GS_USB_EP_OUT, full);
+		out_nak = full;
+		if (full)
+			usb_stats.out_naks++;
+	}
+}
+
+static void gs_usb_write(gs_host_frame_t *hf, uint32_t timestamp)
+{
+	uint16_t size = GS_HOST_FRAME_SIZE;
+
+	if (mode_flags & GS_CAN_FEATURE_HW_TIMESTAMP)
+	{
+		hf->timestamp_us = timestamp;
+		size = GS_HOST_FRAME_SIZE_TIMESTAMP;
+	}
+	usb_dbuf_write(gs_dev, GS_USB_EP_IN, hf, size);
+	usb_stats.in_packets++;
+	usb_stats.in_bytes += size;
+}
+
+// Error frame, at most one per CAN_ERR_REPORT_MS. Without BERR reporting
+// only the state changes and RX overflows are passed on.
+static bool gs_usb_error(gs_host_frame_t *hf)
+{
+	can_frame_t report;
+	uint32_t timestamp;
+
+	if ((uint32_t)(ticks - err_tick) < CAN_ERR_REPORT_MS)
+		return false;
+	if (!can_err_take(&report, &timestamp))
+		return false;
+	err_tick = ticks;
+	if (!(mode_flags & GS_CAN_FEATURE_BERR_REPORTING))
+	{
+		report.id &= ~(CAN_ERR_PROT | CAN_ERR_ACK);
+		report.data[2] = 0;
+		report.data[3] = 0;
+		if ((report.id & ~(CAN_ERR_FRAME | CAN_ERR_CNT)) == 0u)
+			return false;
+	}
+	hf->echo_id = GS_HOST_FRAME_ECHO_RX;
+	hf->can_id = gs_can_id_from_frame(report.id);
+	hf->can_dlc = report.dlc;
+	memcpy(hf->data, report.data, sizeof(hf->data));
+	gs_usb_write(hf, timestamp);
+	return true;
+}
+
+// Send one packet per pass while the IN endpoint has a free buffer: echoes
+// first so the host gets its TX slots back, then errors, then received frames
+static void gs_usb_forward(void)
+{
+	gs_host_frame_t hf = {0};
+	const can_tx_done_t *done;
+	const can_frame_t *frame;
+
+	if (!usb_dbuf_in_free(gs_dev, GS_USB_EP_IN))
+		return;
+
+	if ((done = can_tx_done_peek()) != NULL)
+	{
+		hf.echo_id = (uint32_t)done->tag - 1u;
+		gs_usb_write(&hf, done->time);
+		can_tx_done_release();
+		return;
+	}
+
+	if (gs_usb_error(&hf))
+		return;
+
+	if ((frame = can_rx_peek()) != NULL)
+	{
+		hf.echo_id = GS_HOST_FRAME_ECHO_RX;
+		hf.can_id = gs_can_id_from_frame(frame->id);
+		hf.can_dlc = frame->dlc;
+		memcpy(hf.data, frame->data, sizeof(hf.data));
+		gs_usb_write(&hf, can_rx_timestamp(frame));
+		can_rx_release();
+	}
+}
+
+// Control requests and host frames are served here, at a priority below
+// the CAN interrupt and above the main loop
+void usb_isr(void)
+{
+	usbd_poll(gs_dev);
+	gs_usb_back_pressure();
+}
+
+void gs_usb_loop(void)
+{
+	// the IN endpoint and the mode are the interrupt's as well; a NAKed OUT
+	// endpoint raises none when the CAN TX queue gets room again, so the
+	// back-pressure is lifted from here
+	nvic_disable_irq(NVIC_USB_IRQ);
+	gs_usb_back_pressure();
+
+	if (started)
+	{
+		gs_usb_forward();
+	}
+	else
+	{
+		// nobody listens while the channel is down
+		while (can_rx_peek() != NULL)
+			can_rx_release();
+		while (can_tx_done_peek() != NULL)
+			can_tx_done_release();
+	}
+	nvic_enable_irq(NVIC_USB_IRQ);
+
+	if (identify && ((uint32_t)(ticks - identify_tick) >= GS_USB_IDENTIFY_MS))
+	{
+		identify_tick = ticks;
+		led_toggle(LED_ACT);
+	}
+}
+
+bool gs_usb_idle(void)
+{
+	if (out_nak && (can_tx_free() != 0))
+		return false;
+	// what waits for the IN endpoint goes on once the host collected a
+	// packet, which is an interrupt
+	if (started && !usb_dbuf_in_free(gs_dev, GS_USB_EP_IN))
+		return true;
+	return (can_tx_done_peek() == NULL) && (can_rx_peek() == NULL);
+}
+#endif /* USB_GS_USB */
@@ -0,0 +1,108 @@
+#ifndef GS_USB_H
+#define GS_USB_H
+#include <stdint.h>
+#include <stdbool.h>
+
+/* candleLight IDs, bound by the Linux gs_usb driver */
+#define GS_USB_VENDOR_ID 0x1D50u
+#define GS_USB_PRODUCT_ID 0x606Fu
+
+#define GS_USB_EP_IN 0x81u
+#define GS_USB_EP_OUT 0x02u
+
+/* vendor requests on the interface, wValue is the channel */
+#define GS_USB_BREQ_HOST_FORMAT 0u
+#define GS_USB_BREQ_BITTIMING 1u
+#define GS_USB_BREQ_MODE 2u
+#define GS_USB_BREQ_BERR 3u
+#define GS_USB_BREQ_BT_CONST 4u
+#define GS_USB_BREQ_DEVICE_CONFIG 5u
+#define GS_USB_BREQ_TIMESTAMP 6u
+#define GS_USB_BREQ_IDENTIFY 7u
+
+#define GS_CAN_MODE_RESET 0u
+#define GS_CAN_MODE_START 1u
+
+/* feature bits of gs_device_bt_const and flags of gs_device_mode */
+#define GS_CAN_FEATURE_HW_TIMESTAMP (1u << 4)
+#define GS_CAN_FEATURE_IDENTIFY (1u << 5)
+#define GS_CAN_FEATURE_BERR_REPORTING (1u << 12)
+
+/* can_id flags, in SocketCAN order */
+#define GS_CAN_EFF_FLAG 0x80000000u
+#define GS_CAN_RTR_FLAG 0x40000000u
+#define GS_CAN_ERR_FLAG 0x20000000u
+
+#define GS_HOST_FRAME_ECHO_RX 0xFFFFFFFFu /* echo_id of frames from the bus */
+
+/** @brief  Frame on the bulk endpoints, little endian
+ */
+typedef struct
+{
+	uint32_t echo_id;	   /**< host tag of a sent frame, GS_HOST_FRAME_ECHO_RX for received ones */
+	uint32_t can_id;	   /**< identifier | GS_CAN_*_FLAG */
+	uint8_t can_dlc;	   /**< data length code (0..8) */
+	uint8_t channel;	   /**< always 0 */
+	uint8_t flags;		   /**< unused for classic CAN */
+	uint8_t reserved;	   /**< (padding) */
+	uint8_t data[8];	   /**< payload */
+	uint32_t timestamp_us; /**< only sent in GS_CAN_FEATURE_HW_TIMESTAMP mode */
+} __attribute__((packed)) gs_host_frame_t;
+
+#define GS_HOST_FRAME_SIZE 20u			 /* without the time stamp */
+#define GS_HOST_FRAME_SIZE_TIMESTAMP 24u /* with it */
+
+/** @brief  GS_USB_BREQ_BITTIMING payload, in time quanta
+ */
+typedef struct
+{
+	uint32_t prop_seg;
+	uint32_t phase_seg1;
+	uint32_t phase_seg2;
+	uint32_t sjw;
+	uint32_t brp;
+} __attribute__((packed)) gs_device_bittiming_t;
+
+/** @brief  GS_USB_BREQ_MODE payload
+ */
+typedef struct
+{
+	uint32_t mode;	/**< GS_CAN_MODE_RESET or GS_CAN_MODE_START */
+	uint32_t flags; /**< GS_CAN_FEATURE_* bits the host wants */
+} __attribute__((packed)) gs_device_mode_t;
+
+/** @brief  GS_USB_BREQ_BT_CONST answer
+ */
+typedef struct
+{
+	uint32_t feature;
+	uint32_t fclk_can;
+	uint32_t tseg1_min;
+	uint32_t tseg1_max;
+	uint32_t tseg2_min;
+	uint32_t tseg2_max;
+	uint32_t sjw_max;
+	uint32_t brp_min;
+	uint32_t brp_max;
+	uint32_t brp_inc;
+} __attribute__((packed)) gs_device_bt_const_t;
+
+/** @brief  GS_USB_BREQ_DEVICE_CONFIG answer
+ */
+typedef struct
+{
+	uint8_t reserved1;
+	uint8_t reserved2;
+	uint8_t reserved3;
+	uint8_t icount; /**< number of channels - 1 */
+	uint32_t sw_version;
+	uint32_t hw_version;
+} __attribute__((packed)) gs_device_config_t;
+
+void gs_usb_init(void);
+void gs_usb_loop(void);
+// True if the main loop has nothing to send until an interrupt: called
+// with interrupts masked before it sleeps
+bool gs_usb_idle(void);
+
+#endif /* GS_USB_H */
@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <string.h>
 #include <libopencm3/stm32/gpio.h>
 #include <libopencm3/stm32/rcc.h>
 #include <libopencm3/cm3/nvic.h>
@@ -7,14 +8,41 @@
 #include <libopencm3/usb/usbd.h>
 #include <libopencm3/usb/cdc.h>
 #include <libopencm3/stm32/st_usbfs.h>
+#include <libopencm3/stm32/desig.h>
 #include "board.h"
 #include "usb.h"
+#include "usb_dbuf.h"
 #include "stddef.h"
 #include "slcan.h"
+#include "can.h"
+#ifdef USE_RING_BUFFER
+#include "spsc.h"
+
+extern struct spsc input_ring, output_ring;
+#endif
 
 /* Buffer to be used for control requests. */
 uint8_t usbd_control_buffer[128];
 
+#ifndef USE_RING_BUFFER
+/* IN packet being filled with encoded frames and responses. */
+static uint8_t in_packet[USB_IN_PACKET_SIZE];
+static uint8_t in_size = 0;
+static uint32_t in_since = 0;	/* ticks when in_packet got its first byte */
+static bool in_zlp = false;		/* last packet was full, host may wait for more */
+static uint8_t in_latency = USB_IN_LATENCY_DEFAULT;
+#endif
+
+/* Room the CAN TX queue needs before another OUT packet is accepted: the
+ * shortest frame command is 6 bytes, plus one carried over from the last
+ * packet. */
+#define USB_OUT_FRAMES_MAX ((64u / 6u) + 1u)
+static bool out_nak = false;	/* endpoint 0x01 held in NAK for back-pressure */
+
+extern volatile uint32_t ticks;
+
+usb_stats_t usb_stats;
+
 static char serial_no[9] = "killbill";
 
 usbd_device *_usbd_dev = 0;
@@ -207,44 +235,66 @@ static void cdcacm_data_rx_cb(usbd_device *usbd_dev, uint8_t ep)
 	(void)ep;
 	(void)usbd_dev;
 #ifdef USE_RING_BUFFER
-	// back pressure: don't read the packet if there's not enough room in ring
-	if ((output_ring.begin - (output_ring.end + 1)) % BUFFER_SIZE <= 64)
+	// back pressure: don't read the packet if there's not enough room in ring.
+	// It stays pending and would take the interrupt again right away, so
+	// that is off until the main loop, which parses the ring, turns it
+	// back on.
+	if (spsc_free(&output_ring) < 64)
+	{
+		nvic_disable_irq(NVIC_USB_IRQ);
 		return;
+	}
 
 	uint8_t buf[64];
-	int len = usbd_ep_read_packet(usbd_dev, 0x01, buf, sizeof buf);
+	uint16_t len = usb_dbuf_read(usbd_dev, 0x01, buf, sizeof buf);
 
 	if (len)
 	{
-		// Retrieve the data from the peripheral.
-		ring_write(&output_ring, buf, len);
-
-		// Enable usart transmit interrupt so it sends out the data.
-		USART_CR1(USART1) |= USART_CR1_TXEIE;
+		usb_stats.out_packets++;
+		usb_stats.out_bytes += len;
+		// Hand the data to the main loop, which runs the SLCAN parser.
+		spsc_write(&output_ring, buf, len);
 	}
 #else
-	uint8_t buf[64];
-	uint8_t out[64];
-	uint8_t outSize = 0;
-	uint8_t len = (uint8_t)usbd_ep_read_packet(usbd_dev, 0x01, buf, 64);
+	// parsed where the peripheral put it, frames go from there into the
+	// TX mailboxes
+	const volatile uint16_t *packet;
+	uint16_t len = usb_dbuf_take(usbd_dev, 0x01, &packet);
 
 	if (len)
 	{
-		slcan_decode(buf, &len, out, &outSize);
-		usbd_ep_write_packet(usbd_dev, 0x82, out, outSize);
+		usb_stats.out_packets++;
+		usb_stats.out_bytes += len;
+		slcan_receive_packet(packet, len);
 	}
 #endif
 }
 
+static void cdcacm_data_tx_cb(usbd_device *usbd_dev, uint8_t ep)
+{
+	// the host collected an IN packet, a second one goes next
+	usb_dbuf_in_done(usbd_dev, ep);
+}
+
 static void cdcacm_set_config(usbd_device *usbd_dev, uint16_t wValue)
 {
 	(void)wValue;
 	(void)usbd_dev;
 
 	usbd_ep_setup(usbd_dev, 0x01, USB_ENDPOINT_ATTR_BULK, 64, cdcacm_data_rx_cb);
-	usbd_ep_setup(usbd_dev, 0x82, USB_ENDPOINT_ATTR_BULK, 64, NULL);
+	usb_dbuf_setup(usbd_dev, 0x01);
+	if (out_nak)
+	{
+		usbd_ep_nak_set(usbd_dev, 0x01, 0);
+		out_nak = false;
+	}
+	usbd_ep_setup(usbd_dev, 0x82, USB_ENDPOINT_ATTR_BULK, 64, cdcacm_data_tx_cb);
+	usb_dbuf_setup(usbd_dev, 0x82);
 	usbd_ep_setup(usbd_dev, 0x83, USB_ENDPOINT_ATTR_INTERRUPT, 16, NULL);
 
+	// drop anything left over from a previous host session
+	slcan_reset();
+
 	usbd_register_control_callback(
 		usbd_dev,
 		USB_REQ_TYPE_CLASS | USB_REQ_TYPE_INTERFACE,
@@ -254,28 +304,15 @@ static void cdcacm_set_config(usbd_device *usbd_dev, uint16_t wValue)
 
 char *get_dev_unique_id(char *s)
 {
-#if defined(STM32F4) || defined(STM32F2)
-#define UNIQUE_SERIAL_R 0x1FFF7A10
-#define FLASH_SIZE_R 0x1fff7A22
-#elif defined(STM32F3)
-#define UNIQUE_SERIAL_R 0x1FFFF7AC
-#define FLASH_SIZE_R 0x1fff77cc
-#elif defined(STM32L1)
-#define UNIQUE_SERIAL_R 0x1ff80050
-#define FLASH_SIZE_R 0x1FF8004C
-#elif defined(STM32F0)
-#define UNIQUE_SERIAL_R 0x1FFFF7AC
-#define FLASH_SIZE_R 0x1FFFF7CC
-#else
-#define UNIQUE_SERIAL_R 0x1FFFF7E8;
-#define FLASH_SIZE_R 0x1ffff7e0
-#endif
-	volatile uint32_t *unique_id_p = (volatile uint32_t *)UNIQUE_SERIAL_R;
-	uint32_t unique_id = *unique_id_p ^		  // was "+" in original BMP
-						 *(unique_id_p + 1) ^ // was "+" in original BMP
-						 *(unique_id_p + 2);
+	uint32_t uid[3];
+	uint32_t unique_id;
 	int i;
 
+	desig_get_unique_id(uid);
+	unique_id = uid[0] ^ // was "+" in original BMP
+				uid[1] ^ // was "+" in original BMP
+				uid[2];
+
 	// Calculated the upper flash limit from the exported data
 	//  in theparameter block
 	// max_address = (*(uint32_t *) FLASH_SIZE_R) <<10;
@@ -314,13 +351,154 @@ void usb_init(void)
 	_usbd_dev = usbd_init(&st_usbfs_v2_usb_driver, &dev, &config,
 						  usb_strings, 3, usbd_control_buffer, sizeof(usbd_control_buffer));
 	usbd_register_set_config_callback(_usbd_dev, cdcacm_set_config);
+	nvic_enable_irq(NVIC_USB_IRQ);
 }
 
-void usb_loop(void)
+// NAK host writes while the CAN TX queue can't take a full packet of frames,
+// so the host blocks instead of having frames rejected
+static void usb_back_pressure(void)
+{
+	bool full = can_tx_free() < USB_OUT_FRAMES_MAX;
+
+	if (full != out_nak)
+	{
+		usbd_ep_nak_set(_usbd_dev, 0x01, full);
+		out_nak = full;
+		if (full)
+			usb_stats.out_naks++;
+	}
+}
+
+#ifndef USB_GS_USB
+// Transfers complete, host packets are parsed and replies queued here, at a
+// priority below the CAN interrupt and above the main loop
+void usb_isr(void)
 {
 	usbd_poll(_usbd_dev);
+	usb_back_pressure();
+}
+#endif
+
+// A NAKed OUT endpoint raises no interrupt when the CAN TX queue gets room
+// again, so the main loop lifts the back-pressure
+void usb_loop(void)
+{
+	nvic_disable_irq(NVIC_USB_IRQ);
+	usb_back_pressure();
+	nvic_enable_irq(NVIC_USB_IRQ);
+}
+
+#ifdef USE_RING_BUFFER
+bool usb_send(uint8_t *data, uint8_t size){
+	if (spsc_free(&input_ring) < size)
+		return false;
+	spsc_write(&input_ring, data, size);
+	return true;
+}
+
+void usb_flush(bool idle)
+{
+	// main() drains input_ring in up to 64-byte packets itself
+	(void)idle;
+}
+
+bool usb_idle(void)
+{
+	if (out_nak && (can_tx_free() >= USB_OUT_FRAMES_MAX))
+		return false;
+	// host commands wait in output_ring for main() to parse them
+	if (spsc_used(&output_ring) != 0)
+		return false;
+	if (!usb_dbuf_in_free(_usbd_dev, 0x82))
+		return true;
+	return (spsc_used(&input_ring) == 0) && (can_rx_depth() == 0);
+}
+#else
+static bool usb_in_flush(void)
+{
+	if (usb_write(in_packet, in_size) != in_size)
+		return false;
+
+	// a full packet doesn't end the transfer on the host side, a later short
+	// or zero-length packet does
+	in_zlp = (in_size == USB_IN_PACKET_SIZE);
+	in_since = ticks;
+	in_size = 0;
+	return true;
+}
+
+bool usb_send(uint8_t *data, uint8_t size){
+	if (size > USB_IN_PACKET_SIZE)
+		return false;
+	if ((size > (USB_IN_PACKET_SIZE - in_size)) && !usb_in_flush())
+		return false;
+
+	if (in_size == 0)
+		in_since = ticks;
+	memcpy(&in_packet[in_size], data, size);
+	in_size += size;
+
+	if (in_size == USB_IN_PACKET_SIZE)
+		usb_in_flush();
+	return true;
 }
 
-void usb_send(uint8_t *data, uint8_t size){
-	usbd_ep_write_packet(_usbd_dev, 0x82, data, size);
+// Whether the packet being filled, or the ZLP after a full one, is to go out.
+// Without a latency a short packet still waits while the host has one to
+// collect, so the frames received meanwhile go out together with it.
+static bool usb_in_due(bool idle)
+{
+	if ((in_size == 0) && !in_zlp)
+		return false;
+	if (in_latency == 0)
+		return idle && usb_dbuf_in_idle(_usbd_dev, 0x82);
+	return (uint32_t)(ticks - in_since) >= in_latency;
+}
+
+void usb_flush(bool idle)
+{
+	if (!usb_in_due(idle))
+		return;
+
+	if (in_size)
+		usb_in_flush();
+	else if (usb_dbuf_in_free(_usbd_dev, 0x82))
+	{
+		usb_write(NULL, 0);
+		in_zlp = false;
+	}
+}
+
+bool usb_idle(void)
+{
+	bool rx_idle = can_rx_depth() == 0;
+
+	if (out_nak && (can_tx_free() >= USB_OUT_FRAMES_MAX))
+		return false;
+	// frames and packets waiting for the IN endpoint go on once the host
+	// collected a packet, which is an interrupt
+	if (!usb_dbuf_in_free(_usbd_dev, 0x82))
+		return true;
+	return rx_idle && !usb_in_due(rx_idle);
+}
+#endif
+
+void usb_set_latency(uint8_t ms)
+{
+#ifndef USE_RING_BUFFER
+	in_latency = ms;
+#else
+	(void)ms;
+#endif
+}
+
+uint16_t usb_write(const uint8_t *data, uint16_t size)
+{
+	if (!usb_dbuf_in_free(_usbd_dev, 0x82))
+		return 0;
+
+	usb_dbuf_write(_usbd_dev, 0x82, data, size);
+	usb_stats.in_packets++;
+	usb_stats.in_bytes += size;
+	return size;
 }
\ No newline at end of file
@@ -1,9 +1,37 @@
 #ifndef USB_H
 #define USB_H
 #include <stdint.h>
+#include <stdbool.h>
+
+#define USB_IN_PACKET_SIZE 64u
+#define USB_IN_LATENCY_DEFAULT 1u /* ms a short IN packet waits for more frames */
+
+/** @brief  USB traffic counters
+ */
+typedef struct
+{
+	uint32_t in_packets;  /**< packets handed to the IN endpoint (ZLPs included) */
+	uint32_t in_bytes;	  /**< bytes sent to the host */
+	uint32_t out_packets; /**< packets read from the OUT endpoint */
+	uint32_t out_bytes;	  /**< bytes received from the host */
+	uint32_t out_naks;	  /**< times the OUT endpoint was held for back-pressure */
+} usb_stats_t;
+
+extern usb_stats_t usb_stats;
 
 void usb_init(void);
 void usb_loop(void);
-void usb_send(uint8_t *data, uint8_t size);
+// The IN endpoint is shared with the USB interrupt, which answers host
+// commands through usb_send(): the main loop calls these three with
+// NVIC_USB_IRQ disabled
+bool usb_send(uint8_t *data, uint8_t size);
+uint16_t usb_write(const uint8_t *data, uint16_t size);
+void usb_flush(bool idle);
+// True if the main loop has nothing to send until an interrupt: called
+// with interrupts masked before it sleeps
+bool usb_idle(void);
+void usb_set_latency(uint8_t ms);
+char *get_dev_unique_id(char *s);
+void usb_preinit(void);
 
 #endif
\ No newline at end of file
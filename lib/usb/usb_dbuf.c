@@ -0,0 +1,186 @@
+/*
+ * usb_dbuf.c
+ *
+ * Double-buffered bulk endpoints for the st_usbfs peripheral (RM0091,
+ * "Double-buffered endpoints"). With EP_KIND set on a bulk endpoint the
+ * BTABLE entry holds two buffers, buffer 0 in the TX and buffer 1 in the RX
+ * slot. DTOG of the endpoint's direction selects the buffer the peripheral
+ * uses next, the other DTOG bit (SW_BUF) the one the firmware owns; when
+ * both point at the same buffer the host is NAKed. The status stays VALID.
+ *
+ * The simulation runs this file against its model of the endpoint
+ * registers and the packet memory.
+ */
+#include <libopencm3/usb/usbd.h>
+#include <libopencm3/stm32/st_usbfs.h>
+#include "usb_dbuf.h"
+
+/* packets written to an IN endpoint and not sent yet, 0..2 */
+static uint8_t in_pending[8];
+/* the second of them is filled but still the firmware's */
+static bool in_prefilled[8];
+
+// BTABLE entry of an endpoint: ADDR_TX, COUNT_TX, ADDR_RX, COUNT_RX
+static volatile uint16_t *btable(uint8_t ep)
+{
+	return (volatile uint16_t *)(USB_PMA_BASE + (*USB_BTABLE_REG & 0xFFF8u) + ep * 8u);
+}
+
+// Flip toggle bits of the endpoint register, and clear the CTR bits in
+// clear; writing 1 to the other CTR bit leaves it alone
+static void ep_write(uint8_t ep, uint16_t toggle, uint16_t clear)
+{
+	uint16_t reg = (uint16_t)*USB_EP_REG(ep);
+
+	*USB_EP_REG(ep) = ((reg & USB_EP_NTOGGLE_MSK) | USB_EP_RX_CTR | USB_EP_TX_CTR | toggle) & ~clear;
+}
+
+// The packet memory is accessed in 16-bit words
+static void pma_write(uint16_t pma, const uint8_t *buf, uint16_t len)
+{
+	volatile uint16_t *p = (volatile uint16_t *)(USB_PMA_BASE + pma);
+
+	for (uint16_t i = 0; i < len; i += 2u)
+		*p++ = (uint16_t)(buf[i] | (((i + 1u) < len) ? (buf[i + 1u] << 8) : 0));
+}
+
+static void pma_read(const volatile uint16_t *p, uint8_t *buf, uint16_t len)
+{
+	for (uint16_t i = 0; i < len; i += 2u)
+	{
+		uint16_t word = *p++;
+
+		buf[i] = (uint8_t)word;
+		if ((i + 1u) < len)
+			buf[i + 1u] = (uint8_t)(word >> 8);
+	}
+}
+
+void usb_dbuf_setup(usbd_device *usbd_dev, uint8_t addr)
+{
+	uint8_t ep = addr & 0x0Fu;
+	volatile uint16_t *bt = btable(ep);
+	uint16_t second = (uint16_t)(USB_DBUF_PMA_SIZE - ep * USB_DBUF_PACKET);
+	uint16_t reg;
+
+	(void)usbd_dev;
+
+	// usbd_ep_setup() left the endpoint's buffer in its own direction's slot
+	// with DTOG cleared, the second one goes into the other slot
+	if (addr & 0x80u)
+	{
+		in_pending[ep] = 0;
+		in_prefilled[ep] = false;
+		bt[2] = second;
+		bt[3] = 0;
+		reg = (uint16_t)*USB_EP_REG(ep);
+		// both buffers empty: SW_BUF equals DTOG_TX, status VALID
+		ep_write(ep, (reg & USB_EP_RX_DTOG) | ((reg & USB_EP_TX_STAT) ^ USB_EP_TX_STAT_VALID), 0);
+	}
+	else
+	{
+		bt[0] = second;
+		bt[1] = bt[3];
+		reg = (uint16_t)*USB_EP_REG(ep);
+		// the peripheral owns buffer 0 first, SW_BUF points at buffer 1
+		ep_write(ep, (reg & USB_EP_TX_DTOG) ^ USB_EP_TX_DTOG, 0);
+	}
+	reg = (uint16_t)*USB_EP_REG(ep);
+	*USB_EP_REG(ep) = (reg & USB_EP_NTOGGLE_MSK) | USB_EP_RX_CTR | USB_EP_TX_CTR | USB_EP_KIND;
+}
+
+bool usb_dbuf_in_free(usbd_device *usbd_dev, uint8_t addr)
+{
+	(void)usbd_dev;
+	return in_pending[addr & 0x0Fu] < 2u;
+}
+
+bool usb_dbuf_in_idle(usbd_device *usbd_dev, uint8_t addr)
+{
+	(void)usbd_dev;
+	return in_pending[addr & 0x0Fu] == 0u;
+}
+
+uint16_t usb_dbuf_write(usbd_device *usbd_dev, uint8_t addr, const void *buf, uint16_t len)
+{
+	uint8_t ep = addr & 0x0Fu;
+	volatile uint16_t *bt = btable(ep);
+	uint8_t sw;
+
+	(void)usbd_dev;
+
+	if (in_pending[ep] >= 2u)
+		return 0;
+	if (len > USB_DBUF_PACKET)
+		len = USB_DBUF_PACKET;
+
+	// fill the firmware's buffer, then hand it over by flipping SW_BUF. While
+	// the peripheral still sends the other one that flip would bring SW_BUF
+	// level with DTOG_TX, which NAKs both; usb_dbuf_in_done() does it then.
+	sw = (*USB_EP_REG(ep) & USB_EP_RX_DTOG) ? 1u : 0u;
+	pma_write(bt[sw * 2u], buf, len);
+	bt[sw * 2u + 1u] = len;
+	if (in_pending[ep]++ == 0u)
+		ep_write(ep, USB_EP_RX_DTOG, 0);
+	else
+		in_prefilled[ep] = true;
+	return len;
+}
+
+void usb_dbuf_in_done(usbd_device *usbd_dev, uint8_t addr)
+{
+	uint8_t ep = addr & 0x0Fu;
+	uint16_t reg = (uint16_t)*USB_EP_REG(ep);
+
+	(void)usbd_dev;
+
+	// The peripheral owns one buffer at most, so CTR_TX stands for a single
+	// packet. DTOG_TX has moved onto SW_BUF, which NAKs until the packet
+	// filled meanwhile is handed over.
+	if (((reg & USB_EP_TX_DTOG) != 0) != ((reg & USB_EP_RX_DTOG) != 0))
+		return;
+	if (in_prefilled[ep])
+	{
+		in_prefilled[ep] = false;
+		in_pending[ep] = 1;
+		ep_write(ep, USB_EP_RX_DTOG, 0);
+	}
+	else
+	{
+		in_pending[ep] = 0;
+	}
+}
+
+uint16_t usb_dbuf_take(usbd_device *usbd_dev, uint8_t addr, const volatile uint16_t **packet)
+{
+	uint8_t ep = addr & 0x0Fu;
+	volatile uint16_t *bt = btable(ep);
+	uint16_t reg = (uint16_t)*USB_EP_REG(ep);
+	uint8_t filled;
+
+	(void)usbd_dev;
+
+	if (!(reg & USB_EP_RX_CTR))
+		return 0;
+
+	// DTOG_RX already moved on to the buffer the peripheral fills next, the
+	// packet is in the other one. Taking it with SW_BUF frees ours, so the
+	// next packet comes in while this one is worked on; the peripheral
+	// leaves it alone until SW_BUF flips again.
+	filled = (reg & USB_EP_RX_DTOG) ? 0u : 1u;
+	ep_write(ep, (((reg & USB_EP_TX_DTOG) ? 1u : 0u) != filled) ? USB_EP_TX_DTOG : 0u, USB_EP_RX_CTR);
+
+	*packet = (const volatile uint16_t *)(USB_PMA_BASE + bt[filled * 2u]);
+	return bt[filled * 2u + 1u] & 0x3FFu;
+}
+
+uint16_t usb_dbuf_read(usbd_device *usbd_dev, uint8_t addr, void *buf, uint16_t len)
+{
+	const volatile uint16_t *packet;
+	uint16_t count = usb_dbuf_take(usbd_dev, addr, &packet);
+
+	if (count > len)
+		count = len;
+	pma_read(packet, buf, count);
+	return count;
+}
@@ -0,0 +1,34 @@
+#ifndef USB_DBUF_H
+#define USB_DBUF_H
+#include <stdint.h>
+#include <stdbool.h>
+#include <libopencm3/usb/usbd.h>
+
+#define USB_DBUF_PMA_SIZE 1024u /* packet memory of the STM32F04x */
+#define USB_DBUF_PACKET 64u		/* size of the second buffer of every endpoint */
+
+/*
+ * Double-buffered bulk endpoints on top of the st_usbfs driver. libopencm3
+ * sets the endpoints up single-buffered; usb_dbuf_setup() switches one over
+ * after usbd_ep_setup() and gives it a second buffer at the top of the
+ * packet memory. From then on the endpoint is only accessed through the
+ * functions below, never usbd_ep_write_packet()/usbd_ep_read_packet().
+ *
+ * IN: the firmware fills one buffer while the host collects the other. The
+ * endpoint's callback has to call usb_dbuf_in_done(), which hands a packet
+ * written meanwhile to the peripheral. usb_dbuf_in_idle() is true once the
+ * host has collected every packet written.
+ * OUT: the peripheral receives the next packet into one buffer while the
+ * firmware holds the other. usb_dbuf_take() leaves the packet there instead
+ * of copying it: it stays valid until the next take or read, and is read in
+ * 16-bit words.
+ */
+void usb_dbuf_setup(usbd_device *usbd_dev, uint8_t addr);
+bool usb_dbuf_in_free(usbd_device *usbd_dev, uint8_t addr);
+bool usb_dbuf_in_idle(usbd_device *usbd_dev, uint8_t addr);
+uint16_t usb_dbuf_write(usbd_device *usbd_dev, uint8_t addr, const void *buf, uint16_t len);
+void usb_dbuf_in_done(usbd_device *usbd_dev, uint8_t addr);
+uint16_t usb_dbuf_read(usbd_device *usbd_dev, uint8_t addr, void *buf, uint16_t len);
+uint16_t usb_dbuf_take(usbd_device *usbd_dev, uint8_t addr, const volatile uint16_t **packet);
+
+#endif /* USB_DBUF_H */
@@ -0,0 +1,167 @@
+/*
+ * stubs.c
+ *
+ * Host replacements for the firmware pieces the portable libraries call into
+ * (lib/can and lib/usb). They only record what was asked of them so the codec
+ * can run on Linux.
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <libopencm3/cm3/nvic.h>
+#include "can.h"
+#include "filter.h"
+#include "periodic.h"
+#include "burst.h"
+#include "change.h"
+#include "usb.h"
+
+volatile can_rx_stats_t can_rx_stats;
+volatile can_tx_stats_t can_tx_stats;
+volatile can_err_stats_t can_err_stats;
+usb_stats_t usb_stats;
+
+uint32_t stub_can_tx_count;
+uint32_t stub_usb_tx_bytes;
+uint8_t stub_usb_tx_last[64];
+uint8_t stub_usb_tx_size;
+can_filter_bank_t stub_filter_banks[CAN_FILTER_BANKS];
+uint8_t stub_filter_banks_used;
+
+bool can_tx_enqueue(const can_frame_t *frame)
+{
+	(void)frame;
+	stub_can_tx_count++;
+	return true;
+}
+
+bool can_tx_direct(uint32_t tir, uint32_t tdtr, uint32_t tdlr, uint32_t tdhr)
+{
+	(void)tir;
+	(void)tdtr;
+	(void)tdlr;
+	(void)tdhr;
+	stub_can_tx_count++;
+	return true;
+}
+
+void can_setup(uint8_t i)
+{
+	(void)i;
+}
+
+void can_setup_btr(uint32_t btr)
+{
+	(void)btr;
+}
+
+uint32_t can_status(void)
+{
+	return 0;
+}
+
+void can_stats_reset(void)
+{
+	memset((void *)&can_rx_stats, 0, sizeof(can_rx_stats));
+	memset((void *)&can_tx_stats, 0, sizeof(can_tx_stats));
+	memset((void *)&can_err_stats, 0, sizeof(can_err_stats));
+}
+
+void can_filter_apply(void)
+{
+	stub_filter_banks_used = can_filter_build(stub_filter_banks, CAN_FILTER_BANKS);
+}
+
+bool usb_send(uint8_t *data, uint8_t size)
+{
+	stub_usb_tx_size = (size < sizeof(stub_usb_tx_last)) ? size : sizeof(stub_usb_tx_last);
+	memcpy(stub_usb_tx_last, data, stub_usb_tx_size);
+	stub_usb_tx_bytes += size;
+	return true;
+}
+
+void usb_set_latency(uint8_t ms)
+{
+	(void)ms;
+}
+
+char *get_dev_unique_id(char *s)
+{
+	memcpy(s, "00000000", 9);
+	return s;
+}
+
+void can_err_reporting(bool enable)
+{
+	(void)enable;
+}
+
+// limit.c is built with the stubs too, its interrupt lock does nothing here
+void nvic_enable_irq(uint8_t irqn)
+{
+	(void)irqn;
+}
+
+void nvic_disable_irq(uint8_t irqn)
+{
+	(void)irqn;
+}
+
+// change.c is portable and built with the stubs, only the interrupt lock is
+// left out
+void can_rx_change_only(bool enable, uint16_t keepalive_ms)
+{
+	can_change_setup(enable, keepalive_ms);
+}
+
+bool can_periodic_set(uint8_t index, const can_frame_t *frame, uint16_t period_ms, uint16_t phase_ms)
+{
+	(void)frame;
+	(void)period_ms;
+	(void)phase_ms;
+	return index < CAN_PERIODIC_MAX;
+}
+
+void can_periodic_clear(uint8_t index)
+{
+	(void)index;
+}
+
+void can_periodic_reset(void)
+{
+}
+
+uint8_t can_periodic_active(void)
+{
+	return 0;
+}
+
+uint32_t can_periodic_late(void)
+{
+	return 0;
+}
+
+bool can_burst_append(const uint8_t *data, uint16_t len)
+{
+	(void)data;
+	return len <= CAN_BURST_SIZE;
+}
+
+void can_burst_clear(void)
+{
+}
+
+bool can_burst_start(uint16_t count)
+{
+	(void)count;
+	return true;
+}
+
+void can_burst_stop(void)
+{
+}
+
+void can_burst_stats(can_burst_stats_t *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+}
@@ -0,0 +1,874 @@
+/*
+ * bxcan.c
+ *
+ *  Model of the bxCAN peripheral (3 TX mailboxes, 2 RX FIFOs of 3 messages,
+ *  14 filter banks) on a virtual bus shared with periodic traffic generators.
+ *  Frames take their exact length on the bus, stuff bits included, and
+ *  pending frames arbitrate by identifier whenever the bus goes idle.
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <libopencm3/stm32/can.h>
+#include "sim.h"
+
+#define CAN_REG_MSR (0x004u / 4u)
+#define CAN_REG_TSR (0x008u / 4u)
+#define CAN_REG_RF0R (0x00Cu / 4u)
+#define CAN_REG_IER (0x014u / 4u)
+#define CAN_REG_ESR (0x018u / 4u)
+#define CAN_REG_BTR (0x01Cu / 4u)
+#define CAN_REG_TI0R (0x180u / 4u) /* TIxR, TDTxR, TDLxR, TDHxR of mailbox x at + 4x */
+#define CAN_REG_COUNT (0x400u / 4u)
+
+/* Reserved bits set in every register with write-1-to-clear flags as the
+ * model hands it out. The firmware never writes them, so a register without
+ * its marker has been written since. */
+#define CANARY_MSR (1u << 31)
+#define CANARY_TSR (1u << 4)
+#define CANARY_RFR (1u << 31)
+
+#define CAN_FIFO_DEPTH 3u
+#define CAN_BANKS 14u
+#define SIM_GEN_MAX 24u
+
+typedef struct
+{
+	sim_frame_t frame;
+	uint8_t fmi;
+	uint64_t at; /* end of frame */
+} rx_slot_t;
+
+typedef struct
+{
+	bool enable;
+	bool scale_32bit;
+	bool id_list_mode;
+	uint8_t fifo;
+	uint32_t fr1;
+	uint32_t fr2;
+} bank_t;
+
+static volatile uint32_t reg[CAN_REG_COUNT];
+
+static struct
+{
+	bool running; /* left initialisation mode */
+	bool loopback;
+	bool silent;
+	uint32_t bit_ns;
+	rx_slot_t fifo[2][CAN_FIFO_DEPTH];
+	uint8_t fifo_count[2];
+	uint32_t fifo_flags[2]; /* FULL, FOVR */
+	sim_frame_t mailbox[3];
+	bool mailbox_pending[3];
+	uint64_t mailbox_since[3];
+	uint32_t mailbox_order[3]; /* request order, for TXFP */
+	uint32_t requests;
+	uint32_t tsr_flags; /* RQCP, TXOK, ALST, TERR */
+	uint32_t msr_flags; /* ERRI */
+	uint32_t esr;
+	uint64_t recover_at; /* end of the bus-off recovery sequence */
+	bank_t bank[CAN_BANKS];
+} can;
+
+typedef struct
+{
+	sim_gen_t gen;
+	uint64_t next;	  /* next release */
+	uint32_t pending; /* released, not yet on the bus */
+	bool active;
+	uint16_t sent;	  /* frames with the current sequence number */
+	uint32_t seq;	  /* the current sequence number */
+} gen_state_t;
+
+static struct
+{
+	gen_state_t gen[SIM_GEN_MAX];
+	uint8_t gen_count;
+	uint32_t seq;
+	bool busy;
+	uint64_t until;	  /* end of the frame on the bus */
+	uint64_t free_at; /* end of the last frame */
+	uint64_t busy_ns;
+	sim_frame_t frame;
+	int8_t mailbox; /* adapter mailbox on the bus, -1 for a generator */
+} bus;
+
+void (*sim_bus_observer)(const sim_frame_t *frame, uint64_t eof, bool from_device);
+
+/* {{{ registers */
+static void publish(void)
+{
+	uint32_t tsr = can.tsr_flags | CANARY_TSR;
+	uint32_t code = 3u;
+
+	for (uint8_t mb = 3u; mb-- > 0;)
+	{
+		if (!can.mailbox_pending[mb])
+		{
+			tsr |= CAN_TSR_TME0 << mb;
+			code = mb;
+		}
+	}
+	if (code < 3u)
+		tsr |= code << CAN_TSR_CODE_SHIFT;
+
+	reg[CAN_REG_MSR] = can.msr_flags | CANARY_MSR | (can.running ? 0u : CAN_MSR_INAK);
+	reg[CAN_REG_TSR] = tsr;
+	for (uint8_t fifo = 0; fifo < 2u; fifo++)
+		reg[CAN_REG_RF0R + fifo] = can.fifo_count[fifo] | can.fifo_flags[fifo] | CANARY_RFR;
+	reg[CAN_REG_ESR] = can.esr;
+}
+
+static void fifo_release(uint8_t fifo)
+{
+	if (can.fifo_count[fifo] == 0)
+		return;
+	memmove(&can.fifo[fifo][0], &can.fifo[fifo][1], sizeof(rx_slot_t) * (CAN_FIFO_DEPTH - 1u));
+	can.fifo_count[fifo]--;
+}
+
+static void mailbox_load(uint8_t mb, uint32_t id, bool ext, bool rtr, uint8_t length, const uint8_t *data)
+{
+	sim_frame_t *frame = &can.mailbox[mb];
+
+	frame->id = id;
+	frame->ext = ext;
+	frame->rtr = rtr;
+	frame->dlc = (length > 8u) ? 8u : length;
+	memset(frame->data, 0, sizeof(frame->data));
+	memcpy(frame->data, data, frame->dlc);
+	can.mailbox_pending[mb] = true;
+	can.mailbox_since[mb] = sim_now;
+	can.mailbox_order[mb] = can.requests++;
+}
+
+// Apply what the firmware wrote to the write-1-to-clear registers, and TXRQ
+// set in the identifier register of an empty mailbox
+void sim_can_settle(void)
+{
+	uint32_t value = reg[CAN_REG_MSR];
+	uint8_t loaded = 0;
+
+	if (!(value & CANARY_MSR))
+		can.msr_flags &= ~(value & (CAN_MSR_ERRI | CAN_MSR_WKUI | CAN_MSR_SLAKI));
+
+	// LEC is the only writable field of ESR
+	value = reg[CAN_REG_ESR];
+	if ((value ^ can.esr) & CAN_ESR_LEC_MASK)
+		can.esr = (can.esr & ~CAN_ESR_LEC_MASK) | (value & CAN_ESR_LEC_MASK);
+
+	value = reg[CAN_REG_TSR];
+	if (!(value & CANARY_TSR))
+	{
+		for (uint8_t mb = 0; mb < 3u; mb++)
+		{
+			uint8_t shift = (uint8_t)(8u * mb);
+
+			// RQCP clears the whole status of its mailbox
+			if (value & (CAN_TSR_RQCP0 << shift))
+				can.tsr_flags &= ~((CAN_TSR_RQCP0 | CAN_TSR_TXOK0 | CAN_TSR_ALST0 | CAN_TSR_TERR0) << shift);
+			if ((value & (CAN_TSR_ABRQ0 << shift)) && can.mailbox_pending[mb] &&
+				!(bus.busy && (bus.mailbox == (int8_t)mb)))
+			{
+				can.mailbox_pending[mb] = false;
+				can.tsr_flags |= CAN_TSR_RQCP0 << shift;
+			}
+		}
+	}
+
+	for (uint8_t fifo = 0; fifo < 2u; fifo++)
+	{
+		value = reg[CAN_REG_RF0R + fifo];
+		if (value & CANARY_RFR)
+			continue;
+		can.fifo_flags[fifo] &= ~(value & (CAN_RF0R_FULL0 | CAN_RF0R_FOVR0));
+		if (value & CAN_RF0R_RFOM0)
+			fifo_release(fifo);
+	}
+
+	for (uint8_t mb = 0; mb < 3u; mb++)
+	{
+		volatile uint32_t *tx = &reg[CAN_REG_TI0R + 4u * mb];
+		uint32_t tir = tx[0];
+		uint8_t data[8];
+
+		if (!(tir & CAN_TIxR_TXRQ))
+			continue;
+		// the hardware clears TXRQ once the mailbox is empty again, the
+		// model at once; the firmware never reads it back
+		tx[0] = tir & ~CAN_TIxR_TXRQ;
+		if (can.mailbox_pending[mb])
+			continue;
+		for (uint8_t i = 0; i < 8u; i++)
+			data[i] = (uint8_t)(tx[2u + i / 4u] >> (8u * (i % 4u)));
+		if (tir & CAN_TIxR_IDE)
+			mailbox_load(mb, tir >> CAN_TIxR_EXID_SHIFT, true, (tir & CAN_TIxR_RTR) != 0,
+						 (uint8_t)(tx[1] & CAN_TDTxR_DLC_MASK), data);
+		else
+			mailbox_load(mb, tir >> CAN_TIxR_STID_SHIFT, false, (tir & CAN_TIxR_RTR) != 0,
+						 (uint8_t)(tx[1] & CAN_TDTxR_DLC_MASK), data);
+		loaded++;
+	}
+
+	publish();
+	// what writing the registers took, like can_transmit()
+	if (loaded)
+		sim_cpu(loaded * SIM_COST_FRAME_NS);
+}
+
+volatile uint32_t *sim_can_reg(uint32_t canport, uint32_t offset)
+{
+	(void)canport;
+	sim_can_settle();
+	return &reg[(offset / 4u) % CAN_REG_COUNT];
+}
+
+bool sim_can_irq_line(void)
+{
+	uint32_t ier;
+	bool line = false;
+
+	sim_can_settle();
+	ier = reg[CAN_REG_IER];
+	if ((ier & CAN_IER_TMEIE) && (can.tsr_flags & (CAN_TSR_RQCP0 | CAN_TSR_RQCP1 | CAN_TSR_RQCP2)))
+		line = true;
+	for (uint8_t fifo = 0; fifo < 2u; fifo++)
+	{
+		// FMPIE, FFIE and FOVIE are three bits apart per FIFO
+		uint32_t shift = 3u * fifo;
+
+		if ((ier & (CAN_IER_FMPIE0 << shift)) && can.fifo_count[fifo])
+			line = true;
+		if ((ier & (CAN_IER_FFIE0 << shift)) && (can.fifo_flags[fifo] & CAN_RF0R_FULL0))
+			line = true;
+		if ((ier & (CAN_IER_FOVIE0 << shift)) && (can.fifo_flags[fifo] & CAN_RF0R_FOVR0))
+			line = true;
+	}
+	if ((ier & CAN_IER_ERRIE) && (can.msr_flags & CAN_MSR_ERRI))
+		line = true;
+	return line;
+}
+/* }}} */
+
+/* {{{ acceptance filter */
+
+// Identifier in the layout of the 32-bit filter registers (and RIxR)
+static uint32_t filter_word32(const sim_frame_t *frame)
+{
+	uint32_t word = frame->ext ? ((frame->id << 3) | (1u << 2)) : (frame->id << 21);
+
+	return word | (frame->rtr ? (1u << 1) : 0u);
+}
+
+// Identifier in the layout of the 16-bit filter registers
+static uint16_t filter_word16(const sim_frame_t *frame)
+{
+	uint32_t stid = frame->ext ? (frame->id >> 18) : frame->id;
+	uint32_t word = (stid & 0x7FFu) << 5;
+
+	if (frame->rtr)
+		word |= 1u << 4;
+	if (frame->ext)
+		word |= (1u << 3) | ((frame->id >> 15) & 0x7u);
+	return (uint16_t)word;
+}
+
+// First matching filter in bank order. The bxCAN prefers 32-bit and list
+// filters over the others when several match; the firmware's banks don't
+// overlap, so the order doesn't matter here.
+static bool filter_match(const sim_frame_t *frame, uint8_t *fifo, uint8_t *fmi)
+{
+	uint8_t number[2] = {0, 0};
+	uint32_t w32 = filter_word32(frame);
+	uint16_t w16 = filter_word16(frame);
+
+	for (uint8_t nr = 0; nr < CAN_BANKS; nr++)
+	{
+		const bank_t *bank = &can.bank[nr];
+		uint8_t base = number[bank->fifo];
+		int8_t hit = -1;
+
+		if (bank->scale_32bit && !bank->id_list_mode)
+		{
+			number[bank->fifo] += 1u;
+			if (((w32 ^ bank->fr1) & bank->fr2 & ~1u) == 0)
+				hit = 0;
+		}
+		else if (bank->scale_32bit)
+		{
+			number[bank->fifo] += 2u;
+			if (((w32 ^ bank->fr1) & ~1u) == 0)
+				hit = 0;
+			else if (((w32 ^ bank->fr2) & ~1u) == 0)
+				hit = 1;
+		}
+		else if (!bank->id_list_mode)
+		{
+			number[bank->fifo] += 2u;
+			if (((w16 ^ bank->fr1) & (bank->fr1 >> 16) & 0xFFFFu) == 0)
+				hit = 0;
+			else if (((w16 ^ bank->fr2) & (bank->fr2 >> 16) & 0xFFFFu) == 0)
+				hit = 1;
+		}
+		else
+		{
+			const uint16_t id[4] = {
+				(uint16_t)bank->fr1, (uint16_t)(bank->fr1 >> 16),
+				(uint16_t)bank->fr2, (uint16_t)(bank->fr2 >> 16)};
+
+			number[bank->fifo] += 4u;
+			for (uint8_t k = 0; (k < 4u) && (hit < 0); k++)
+				if (w16 == id[k])
+					hit = (int8_t)k;
+		}
+
+		if (bank->enable && (hit >= 0))
+		{
+			*fifo = bank->fifo;
+			*fmi = (uint8_t)(base + hit);
+			return true;
+		}
+	}
+	return false;
+}
+
+static void can_deliver(const sim_frame_t *frame, uint64_t eof)
+{
+	uint8_t fifo, fmi;
+	rx_slot_t *slot;
+
+	if (!can.running || !filter_match(frame, &fifo, &fmi))
+		return;
+
+	// not in locked mode: a full FIFO overwrites its newest message
+	if (can.fifo_count[fifo] == CAN_FIFO_DEPTH)
+	{
+		slot = &can.fifo[fifo][CAN_FIFO_DEPTH - 1u];
+		can.fifo_flags[fifo] |= CAN_RF0R_FOVR0;
+	}
+	else
+	{
+		slot = &can.fifo[fifo][can.fifo_count[fifo]++];
+		if (can.fifo_count[fifo] == CAN_FIFO_DEPTH)
+			can.fifo_flags[fifo] |= CAN_RF0R_FULL0;
+	}
+	slot->frame = *frame;
+	slot->fmi = fmi;
+	slot->at = eof;
+	publish();
+}
+/* }}} */
+
+/* {{{ libopencm3 CAN API */
+void can_reset(uint32_t canport)
+{
+	(void)canport;
+	memset(&can, 0, sizeof(can));
+	memset((void *)reg, 0, sizeof(reg));
+	publish();
+}
+
+int can_init(uint32_t canport, bool ttcm, bool abom, bool awum, bool nart,
+			 bool rflm, bool txfp, uint32_t sjw, uint32_t ts1, uint32_t ts2,
+			 uint32_t brp, bool loopback, bool silent)
+{
+	uint32_t tq = 1u + ((ts1 >> CAN_BTR_TS1_SHIFT) + 1u) + ((ts2 >> CAN_BTR_TS2_SHIFT) + 1u);
+
+	(void)canport;
+	(void)ttcm;
+	(void)abom;
+	(void)awum;
+	(void)nart;
+	(void)rflm;
+
+	reg[0] = txfp ? (reg[0] | CAN_MCR_TXFP) : (reg[0] & ~CAN_MCR_TXFP);
+	reg[CAN_REG_BTR] = sjw | ts1 | ts2 | ((brp - 1u) & CAN_BTR_BRP_MASK) |
+					   (loopback ? CAN_BTR_LBKM : 0u) | (silent ? CAN_BTR_SILM : 0u);
+	can.bit_ns = (uint32_t)(((uint64_t)brp * tq * 1000000000u + (SIM_CPU_HZ / 2u)) / SIM_CPU_HZ);
+	can.loopback = loopback;
+	can.silent = silent;
+	can.running = true;
+	publish();
+	return 0;
+}
+
+void can_filter_init(uint32_t nr, bool scale_32bit, bool id_list_mode,
+					 uint32_t fr1, uint32_t fr2, uint32_t fifo, bool enable)
+{
+	if (nr >= CAN_BANKS)
+		return;
+	can.bank[nr].enable = enable;
+	can.bank[nr].scale_32bit = scale_32bit;
+	can.bank[nr].id_list_mode = id_list_mode;
+	can.bank[nr].fifo = (uint8_t)(fifo & 1u);
+	can.bank[nr].fr1 = fr1;
+	can.bank[nr].fr2 = fr2;
+}
+
+void can_filter_id_mask_16bit_init(uint32_t nr, uint16_t id1, uint16_t mask1,
+								   uint16_t id2, uint16_t mask2, uint32_t fifo, bool enable)
+{
+	can_filter_init(nr, false, false, ((uint32_t)mask1 << 16) | id1,
+					((uint32_t)mask2 << 16) | id2, fifo, enable);
+}
+
+void can_filter_id_mask_32bit_init(uint32_t nr, uint32_t id, uint32_t mask,
+								   uint32_t fifo, bool enable)
+{
+	can_filter_init(nr, true, false, id, mask, fifo, enable);
+}
+
+void can_filter_id_list_16bit_init(uint32_t nr, uint16_t id1, uint16_t id2,
+								   uint16_t id3, uint16_t id4, uint32_t fifo, bool enable)
+{
+	can_filter_init(nr, false, true, ((uint32_t)id2 << 16) | id1,
+					((uint32_t)id4 << 16) | id3, fifo, enable);
+}
+
+void can_filter_id_list_32bit_init(uint32_t nr, uint32_t id1, uint32_t id2,
+								   uint32_t fifo, bool enable)
+{
+	can_filter_init(nr, true, true, id1, id2, fifo, enable);
+}
+
+void can_enable_irq(uint32_t canport, uint32_t irq)
+{
+	(void)canport;
+	reg[CAN_REG_IER] |= irq;
+}
+
+void can_disable_irq(uint32_t canport, uint32_t irq)
+{
+	(void)canport;
+	reg[CAN_REG_IER] &= ~irq;
+}
+
+int can_transmit(uint32_t canport, uint32_t id, bool ext, bool rtr,
+				 uint8_t length, uint8_t *data)
+{
+	int mailbox;
+
+	(void)canport;
+	sim_can_settle();
+	for (mailbox = 0; mailbox < 3; mailbox++)
+		if (!can.mailbox_pending[mailbox])
+			break;
+	if (mailbox == 3)
+		return -1;
+
+	mailbox_load((uint8_t)mailbox, id, ext, rtr, length, data);
+	sim_cpu(SIM_COST_FRAME_NS);
+	publish();
+	return mailbox;
+}
+
+bool can_available_mailbox(uint32_t canport)
+{
+	(void)canport;
+	sim_can_settle();
+	return !can.mailbox_pending[0] || !can.mailbox_pending[1] || !can.mailbox_pending[2];
+}
+
+void can_fifo_release(uint32_t canport, uint8_t fifo)
+{
+	(void)canport;
+	sim_can_settle();
+	fifo &= 1u;
+	fifo_release(fifo);
+	// libopencm3 sets RFOM with a read-modify-write, which writes FULL and
+	// FOVR back and so clears them
+	can.fifo_flags[fifo] = 0;
+	publish();
+}
+
+void can_receive(uint32_t canport, uint8_t fifo, bool release, uint32_t *id,
+				 bool *ext, bool *rtr, uint8_t *fmi, uint8_t *length,
+				 uint8_t *data, uint16_t *timestamp)
+{
+	const rx_slot_t *slot;
+
+	sim_can_settle();
+	fifo &= 1u;
+	slot = &can.fifo[fifo][0];
+	*id = slot->frame.id;
+	*ext = slot->frame.ext;
+	*rtr = slot->frame.rtr;
+	*fmi = slot->fmi;
+	*length = slot->frame.dlc;
+	memcpy(data, slot->frame.data, 8u);
+	if (timestamp)
+		*timestamp = can.bit_ns ? (uint16_t)(slot->at / can.bit_ns) : 0u;
+	sim_cpu(SIM_COST_FRAME_NS);
+	if (release)
+		can_fifo_release(canport, fifo);
+}
+/* }}} */
+
+/* {{{ virtual bus */
+
+// Arbitration field as sent on the bus, the lower value wins
+static uint32_t arbitration_key(const sim_frame_t *frame)
+{
+	if (frame->ext)
+		return (((frame->id >> 18) & 0x7FFu) << 21) | (1u << 20) | (1u << 19) |
+			   ((frame->id & 0x3FFFFu) << 1) | (frame->rtr ? 1u : 0u);
+	return ((frame->id & 0x7FFu) << 21) | (frame->rtr ? (1u << 20) : 0u);
+}
+
+static uint16_t crc15(const uint8_t *bits, uint16_t count)
+{
+	uint16_t crc = 0;
+
+	for (uint16_t i = 0; i < count; i++)
+	{
+		bool next = bits[i] ^ ((crc >> 14) & 1u);
+
+		crc = (uint16_t)((crc << 1) & 0x7FFFu);
+		if (next)
+			crc ^= 0x4599u;
+	}
+	return crc;
+}
+
+static uint16_t push_bits(uint8_t *bits, uint16_t n, uint32_t value, uint8_t width)
+{
+	while (width--)
+		bits[n++] = (value >> width) & 1u;
+	return n;
+}
+
+// Length of a frame in bit times: SOF up to the CRC with its stuff bits,
+// CRC delimiter, ACK slot and delimiter, EOF and the intermission
+uint16_t sim_can_frame_bits(const sim_frame_t *frame)
+{
+	uint8_t bits[160];
+	uint16_t n = 0;
+	uint8_t dlc = (frame->dlc > 8u) ? 8u : frame->dlc;
+	uint8_t run = 0, last = 2u;
+	uint16_t stuff = 0;
+
+	n = push_bits(bits, n, 0, 1);
+	if (frame->ext)
+	{
+		n = push_bits(bits, n, frame->id >> 18, 11);
+		n = push_bits(bits, n, 3u, 2); // SRR, IDE
+		n = push_bits(bits, n, frame->id, 18);
+		n = push_bits(bits, n, frame->rtr, 1);
+		n = push_bits(bits, n, 0, 2); // r1, r0
+	}
+	else
+	{
+		n = push_bits(bits, n, frame->id, 11);
+		n = push_bits(bits, n, frame->rtr, 1);
+		n = push_bits(bits, n, 0, 2); // IDE, r0
+	}
+	n = push_bits(bits, n, frame->dlc, 4);
+	if (!frame->rtr)
+		for (uint8_t i = 0; i < dlc; i++)
+			n = push_bits(bits, n, frame->data[i], 8);
+	n = push_bits(bits, n, crc15(bits, n), 15);
+
+	for (uint16_t i = 0; i < n; i++)
+	{
+		if (bits[i] == last)
+			run++;
+		else
+		{
+			last = bits[i];
+			run = 1;
+		}
+		// after five equal bits a complement is inserted, which starts the next run
+		if (run == 5u)
+		{
+			stuff++;
+			last ^= 1u;
+			run = 1;
+		}
+	}
+	return (uint16_t)(n + stuff + 1u + 2u + 7u + 3u);
+}
+
+uint32_t sim_can_bit_ns(void)
+{
+	return can.bit_ns;
+}
+
+uint64_t sim_bus_busy_ns(void)
+{
+	return bus.busy_ns;
+}
+
+uint8_t sim_bus_add_gen(const sim_gen_t *gen, uint64_t start)
+{
+	gen_state_t *state;
+
+	if (bus.gen_count >= SIM_GEN_MAX)
+		return bus.gen_count;
+	state = &bus.gen[bus.gen_count];
+	state->gen = *gen;
+	state->next = start;
+	state->pending = 0;
+	state->active = true;
+	state->sent = 0;
+	return bus.gen_count++;
+}
+
+// Stop releasing frames, the ones already waiting still go out
+void sim_bus_stop_gens(void)
+{
+	for (uint8_t g = 0; g < bus.gen_count; g++)
+		bus.gen[g].active = false;
+}
+
+static bool bus_off(void)
+{
+	return (can.esr & CAN_ESR_BOFF) != 0;
+}
+
+// Set TEC, REC and LEC (0 after a frame went through) and the state flags
+// that follow; ERRI is raised for the flags that become set and for a new
+// error code, as far as IER enables them
+static void esr_update(uint32_t tec, uint32_t rec, uint8_t lec)
+{
+	uint32_t old = can.esr;
+	uint32_t ier = reg[CAN_REG_IER];
+	uint32_t esr = (uint32_t)lec << CAN_ESR_LEC_SHIFT;
+
+	if (tec > 255u)
+	{
+		// bus-off, recovered by ABOM after 128 x 11 recessive bits
+		esr |= CAN_ESR_BOFF;
+		tec = 255u;
+		can.recover_at = sim_now + 128u * 11u * (uint64_t)can.bit_ns;
+	}
+	if (rec > 255u)
+		rec = 255u;
+	if ((tec >= 96u) || (rec >= 96u))
+		esr |= CAN_ESR_EWGF;
+	if ((tec > 127u) || (rec > 127u))
+		esr |= CAN_ESR_EPVF;
+	esr |= (tec << CAN_ESR_TEC_SHIFT) | (rec << CAN_ESR_REC_SHIFT);
+	can.esr = esr;
+
+	uint32_t set = esr & ~old;
+
+	if (((ier & CAN_IER_EWGIE) && (set & CAN_ESR_EWGF)) || ((ier & CAN_IER_EPVIE) && (set & CAN_ESR_EPVF)) ||
+		((ier & CAN_IER_BOFIE) && (set & CAN_ESR_BOFF)) || ((ier & CAN_IER_LECIE) && lec))
+		can.msr_flags |= CAN_MSR_ERRI;
+	publish();
+}
+
+// An error frame on the bus, counted against the adapter as the transmitter
+// (TEC + 8) or as a receiver (REC + 1)
+void sim_can_error(uint8_t lec, bool tx)
+{
+	uint32_t tec = (can.esr & CAN_ESR_TEC_MASK) >> CAN_ESR_TEC_SHIFT;
+	uint32_t rec = (can.esr & CAN_ESR_REC_MASK) >> CAN_ESR_REC_SHIFT;
+
+	sim_can_settle();
+	if (!can.running || bus_off())
+		return;
+	if (tx)
+		tec += 8u;
+	else
+		rec += 1u;
+	esr_update(tec, rec, lec);
+}
+
+// A frame that went through decrements the counter of the adapter's role
+static void bus_success(bool tx)
+{
+	uint32_t tec = (can.esr & CAN_ESR_TEC_MASK) >> CAN_ESR_TEC_SHIFT;
+	uint32_t rec = (can.esr & CAN_ESR_REC_MASK) >> CAN_ESR_REC_SHIFT;
+
+	if (tx && tec)
+		tec--;
+	else if (!tx && (rec > 127u))
+		rec = 127u;
+	else if (!tx && rec)
+		rec--;
+	esr_update(tec, rec, 0);
+}
+
+static void bus_complete(void)
+{
+	bool from_device = bus.mailbox >= 0;
+
+	if (!bus_off())
+		bus_success(from_device);
+	if (from_device)
+	{
+		uint8_t shift = (uint8_t)(8u * bus.mailbox);
+
+		can.mailbox_pending[bus.mailbox] = false;
+		can.tsr_flags |= (CAN_TSR_RQCP0 | CAN_TSR_TXOK0) << shift;
+		if (can.loopback)
+			can_deliver(&bus.frame, bus.until);
+		publish();
+	}
+	else if (!bus_off())
+	{
+		can_deliver(&bus.frame, bus.until);
+	}
+	if (sim_bus_observer)
+		sim_bus_observer(&bus.frame, bus.until, from_device);
+}
+
+// Release generator frames up to a time
+static void bus_release(uint64_t until)
+{
+	for (uint8_t g = 0; g < bus.gen_count; g++)
+	{
+		gen_state_t *state = &bus.gen[g];
+
+		while (state->active && (state->next <= until))
+		{
+			state->pending++;
+			state->next += state->gen.period;
+			if (state->gen.jitter)
+				state->next += sim_random() % state->gen.jitter;
+		}
+	}
+}
+
+// Earliest time some frame is ready to go
+static uint64_t bus_ready(void)
+{
+	uint64_t ready = UINT64_MAX;
+
+	for (uint8_t g = 0; g < bus.gen_count; g++)
+	{
+		if (bus.gen[g].pending)
+			return 0;
+		if (bus.gen[g].active && (bus.gen[g].next < ready))
+			ready = bus.gen[g].next;
+	}
+	if (can.running && !can.silent && !bus_off())
+		for (uint8_t mb = 0; mb < 3u; mb++)
+			if (can.mailbox_pending[mb] && (can.mailbox_since[mb] < ready))
+				ready = can.mailbox_since[mb];
+	return ready;
+}
+
+void sim_bus_advance(uint64_t until)
+{
+	// the bus runs at the adapter's bit rate, it stays idle until one is set
+	if (can.bit_ns == 0)
+		return;
+
+	if (bus_off() && (can.recover_at <= until))
+	{
+		can.esr &= CAN_ESR_LEC_MASK;
+		publish();
+	}
+
+	while (1)
+	{
+		if (bus.busy)
+		{
+			if (bus.until > until)
+				return;
+			bus.busy = false;
+			bus.free_at = bus.until;
+			bus_complete();
+		}
+
+		uint64_t start = bus_ready();
+
+		if (start == UINT64_MAX)
+			return;
+		if (start < bus.free_at)
+			start = bus.free_at;
+		if (start > until)
+			return;
+		bus_release(start);
+
+		// arbitration among everything ready at the start of the frame
+		uint32_t best = UINT32_MAX;
+		int8_t winner_gen = -1, winner_mb = -1;
+
+		for (uint8_t g = 0; g < bus.gen_count; g++)
+		{
+			uint32_t key = arbitration_key(&bus.gen[g].gen.frame);
+
+			if (bus.gen[g].pending && (key < best))
+			{
+				best = key;
+				winner_gen = (int8_t)g;
+			}
+		}
+		// the adapter puts one mailbox up for arbitration: the lowest
+		// identifier, or the oldest request with TXFP. Losing against
+		// another node sets its ALST.
+		int8_t candidate = -1;
+		bool txfp = (reg[0] & CAN_MCR_TXFP) != 0;
+
+		for (uint8_t mb = 0; mb < 3u; mb++)
+		{
+			if (!can.running || can.silent || bus_off() || !can.mailbox_pending[mb] ||
+				(can.mailbox_since[mb] > start))
+				continue;
+			if ((candidate < 0) ||
+				(txfp ? ((int32_t)(can.mailbox_order[mb] - can.mailbox_order[candidate]) < 0)
+					  : (arbitration_key(&can.mailbox[mb]) < arbitration_key(&can.mailbox[candidate]))))
+				candidate = (int8_t)mb;
+		}
+		if (candidate >= 0)
+		{
+			if (arbitration_key(&can.mailbox[candidate]) < best)
+				winner_mb = candidate;
+			else
+				can.tsr_flags |= CAN_TSR_ALST0 << (8u * candidate);
+		}
+
+		if (winner_mb >= 0)
+		{
+			bus.frame = can.mailbox[winner_mb];
+			bus.mailbox = winner_mb;
+		}
+		else if (winner_gen >= 0)
+		{
+			gen_state_t *state = &bus.gen[winner_gen];
+
+			bus.frame = state->gen.frame;
+			// shorter frames have no room for a sequence number and don't
+			// use one up, the numbers of the others stay contiguous
+			if (bus.frame.dlc >= 4u)
+			{
+				if ((state->sent == 0u) || (state->sent >= state->gen.repeat))
+				{
+					state->seq = bus.seq++;
+					state->sent = 0;
+				}
+				state->sent++;
+				bus.frame.data[0] = (uint8_t)state->seq;
+				bus.frame.data[1] = (uint8_t)(state->seq >> 8);
+				bus.frame.data[2] = (uint8_t)(state->seq >> 16);
+				bus.frame.data[3] = (uint8_t)(state->seq >> 24);
+			}
+			state->pending--;
+			bus.mailbox = -1;
+		}
+		else
+		{
+			return;
+		}
+
+		uint64_t length = (uint64_t)sim_can_frame_bits(&bus.frame) * can.bit_ns;
+
+		bus.busy = true;
+		bus.until = start + length;
+		bus.busy_ns += length;
+	}
+}
+/* }}} */
+
+void sim_can_reset(void)
+{
+	memset(&can, 0, sizeof(can));
+	memset(&bus, 0, sizeof(bus));
+	memset((void *)reg, 0, sizeof(reg));
+	publish();
+}
@@ -0,0 +1,12 @@
+/*
+ * Host simulation stand-in for <libopencm3/cm3/cortex.h>
+ */
+#ifndef SIM_CM3_CORTEX_H
+#define SIM_CM3_CORTEX_H
+#include <stdint.h>
+#include <stdbool.h>
+
+void cm_enable_interrupts(void);
+void cm_disable_interrupts(void);
+
+#endif
@@ -0,0 +1,35 @@
+/*
+ * Host simulation stand-in for <libopencm3/cm3/nvic.h>
+ *
+ * Interrupts are delivered by the model in sim/sim.c: a pending, enabled
+ * interrupt runs its handler as soon as the firmware makes it pending or
+ * enables it, and otherwise between two passes of the main loop.
+ */
+#ifndef SIM_CM3_NVIC_H
+#define SIM_CM3_NVIC_H
+#include <stdint.h>
+
+#define NVIC_TIM2_IRQ 15
+#define NVIC_TIM3_IRQ 16
+#define NVIC_TIM14_IRQ 19
+#define NVIC_CEC_CAN_IRQ 30
+#define NVIC_USB_IRQ 31
+#define NVIC_IRQ_COUNT 32
+
+/* system exceptions, numbered from the top of uint8_t like libopencm3 */
+#define NVIC_SYSTICK_IRQ -1
+
+void nvic_enable_irq(uint8_t irqn);
+void nvic_disable_irq(uint8_t irqn);
+uint8_t nvic_get_irq_enabled(uint8_t irqn);
+void nvic_set_pending_irq(uint8_t irqn);
+void nvic_clear_pending_irq(uint8_t irqn);
+void nvic_set_priority(uint8_t irqn, uint8_t priority);
+
+void cec_can_isr(void);
+void usb_isr(void);
+void tim2_isr(void);
+void tim3_isr(void);
+void tim14_isr(void);
+
+#endif
@@ -0,0 +1,8 @@
+/*
+ * Host simulation stand-in for <libopencm3/cm3/scb.h>
+ */
+#ifndef SIM_CM3_SCB_H
+#define SIM_CM3_SCB_H
+#include <stdint.h>
+
+#endif
@@ -0,0 +1,30 @@
+/*
+ * Host simulation stand-in for <libopencm3/cm3/systick.h>
+ *
+ * The counter is derived from the simulated clock, sys_tick_handler() is
+ * called by the model on every reload.
+ */
+#ifndef SIM_CM3_SYSTICK_H
+#define SIM_CM3_SYSTICK_H
+#include <stdint.h>
+
+#define STK_CSR_CLKSOURCE_AHB (1u << 2)
+
+volatile uint32_t *sim_systick_reg(uint32_t offset);
+
+#define STK_CSR (*sim_systick_reg(0x00))
+#define STK_RVR (*sim_systick_reg(0x04))
+#define STK_CVR (*sim_systick_reg(0x08))
+
+void systick_set_clocksource(uint8_t clocksource);
+void systick_set_reload(uint32_t value);
+uint32_t systick_get_reload(void);
+uint32_t systick_get_value(void);
+void systick_counter_enable(void);
+void systick_counter_disable(void);
+void systick_interrupt_enable(void);
+void systick_interrupt_disable(void);
+
+void sys_tick_handler(void);
+
+#endif
@@ -0,0 +1,150 @@
+/*
+ * Host simulation stand-in for <libopencm3/stm32/can.h>
+ *
+ * Register accesses go through sim_can_reg(), which lets the bxCAN model in
+ * sim/bxcan.c apply the side effects of the previous write (rc_w1 flags)
+ * before handing out the register again.
+ */
+#ifndef SIM_STM32_CAN_H
+#define SIM_STM32_CAN_H
+#include <stdint.h>
+#include <stdbool.h>
+
+#define CAN1 0x40006400u
+
+volatile uint32_t *sim_can_reg(uint32_t canport, uint32_t offset);
+
+#define CAN_MCR(can_base) (*sim_can_reg(can_base, 0x000))
+#define CAN_MSR(can_base) (*sim_can_reg(can_base, 0x004))
+#define CAN_TSR(can_base) (*sim_can_reg(can_base, 0x008))
+#define CAN_RF0R(can_base) (*sim_can_reg(can_base, 0x00C))
+#define CAN_RF1R(can_base) (*sim_can_reg(can_base, 0x010))
+#define CAN_IER(can_base) (*sim_can_reg(can_base, 0x014))
+#define CAN_ESR(can_base) (*sim_can_reg(can_base, 0x018))
+#define CAN_BTR(can_base) (*sim_can_reg(can_base, 0x01C))
+
+/* TX mailbox registers */
+#define CAN_MBOX0 0x180
+#define CAN_MBOX1 0x190
+#define CAN_MBOX2 0x1A0
+#define CAN_TIxR(can_base, mbox) (*sim_can_reg(can_base, (mbox) + 0x0))
+#define CAN_TDTxR(can_base, mbox) (*sim_can_reg(can_base, (mbox) + 0x4))
+#define CAN_TDLxR(can_base, mbox) (*sim_can_reg(can_base, (mbox) + 0x8))
+#define CAN_TDHxR(can_base, mbox) (*sim_can_reg(can_base, (mbox) + 0xC))
+
+/* CAN_MCR */
+#define CAN_MCR_TXFP (1u << 2)
+
+/* CAN_MSR */
+#define CAN_MSR_INAK (1u << 0)
+#define CAN_MSR_SLAK (1u << 1)
+#define CAN_MSR_ERRI (1u << 2)
+#define CAN_MSR_WKUI (1u << 3)
+#define CAN_MSR_SLAKI (1u << 4)
+
+/* CAN_TSR */
+#define CAN_TSR_RQCP0 (1u << 0)
+#define CAN_TSR_TXOK0 (1u << 1)
+#define CAN_TSR_ALST0 (1u << 2)
+#define CAN_TSR_TERR0 (1u << 3)
+#define CAN_TSR_ABRQ0 (1u << 7)
+#define CAN_TSR_RQCP1 (1u << 8)
+#define CAN_TSR_TXOK1 (1u << 9)
+#define CAN_TSR_ALST1 (1u << 10)
+#define CAN_TSR_TERR1 (1u << 11)
+#define CAN_TSR_ABRQ1 (1u << 15)
+#define CAN_TSR_RQCP2 (1u << 16)
+#define CAN_TSR_TXOK2 (1u << 17)
+#define CAN_TSR_ALST2 (1u << 18)
+#define CAN_TSR_TERR2 (1u << 19)
+#define CAN_TSR_ABRQ2 (1u << 23)
+#define CAN_TSR_CODE_SHIFT 24
+#define CAN_TSR_CODE_MASK (3u << 24)
+#define CAN_TSR_TME0 (1u << 26)
+#define CAN_TSR_TME1 (1u << 27)
+#define CAN_TSR_TME2 (1u << 28)
+#define CAN_TSR_TME_MASK (7u << 26)
+
+/* CAN_TIxR */
+#define CAN_TIxR_TXRQ (1u << 0)
+#define CAN_TIxR_RTR (1u << 1)
+#define CAN_TIxR_IDE (1u << 2)
+#define CAN_TIxR_EXID_SHIFT 3
+#define CAN_TIxR_STID_SHIFT 21
+
+/* CAN_TDTxR */
+#define CAN_TDTxR_DLC_MASK 0xFu
+
+/* CAN_RF0R, CAN_RF1R */
+#define CAN_RF0R_FMP0_MASK (3u << 0)
+#define CAN_RF0R_FULL0 (1u << 3)
+#define CAN_RF0R_FOVR0 (1u << 4)
+#define CAN_RF0R_RFOM0 (1u << 5)
+#define CAN_RF1R_FMP1_MASK (3u << 0)
+#define CAN_RF1R_FULL1 (1u << 3)
+#define CAN_RF1R_FOVR1 (1u << 4)
+#define CAN_RF1R_RFOM1 (1u << 5)
+
+/* CAN_IER */
+#define CAN_IER_TMEIE (1u << 0)
+#define CAN_IER_FMPIE0 (1u << 1)
+#define CAN_IER_FFIE0 (1u << 2)
+#define CAN_IER_FOVIE0 (1u << 3)
+#define CAN_IER_FMPIE1 (1u << 4)
+#define CAN_IER_FFIE1 (1u << 5)
+#define CAN_IER_FOVIE1 (1u << 6)
+#define CAN_IER_EWGIE (1u << 8)
+#define CAN_IER_EPVIE (1u << 9)
+#define CAN_IER_BOFIE (1u << 10)
+#define CAN_IER_LECIE (1u << 11)
+#define CAN_IER_ERRIE (1u << 15)
+#define CAN_IER_WKUIE (1u << 16)
+#define CAN_IER_SLKIE (1u << 17)
+
+/* CAN_ESR */
+#define CAN_ESR_EWGF (1u << 0)
+#define CAN_ESR_EPVF (1u << 1)
+#define CAN_ESR_BOFF (1u << 2)
+#define CAN_ESR_LEC_SHIFT 4
+#define CAN_ESR_LEC_MASK (7u << 4)
+#define CAN_ESR_TEC_SHIFT 16
+#define CAN_ESR_TEC_MASK (0xFFu << 16)
+#define CAN_ESR_REC_SHIFT 24
+#define CAN_ESR_REC_MASK (0xFFu << 24)
+
+/* CAN_BTR */
+#define CAN_BTR_SILM (1u << 31)
+#define CAN_BTR_LBKM (1u << 30)
+#define CAN_BTR_SJW_SHIFT 24
+#define CAN_BTR_SJW_MASK (3u << 24)
+#define CAN_BTR_TS2_SHIFT 20
+#define CAN_BTR_TS2_MASK (7u << 20)
+#define CAN_BTR_TS1_SHIFT 16
+#define CAN_BTR_TS1_MASK (0xFu << 16)
+#define CAN_BTR_BRP_MASK 0x3FFu
+
+void can_reset(uint32_t canport);
+int can_init(uint32_t canport, bool ttcm, bool abom, bool awum, bool nart,
+			 bool rflm, bool txfp, uint32_t sjw, uint32_t ts1, uint32_t ts2,
+			 uint32_t brp, bool loopback, bool silent);
+void can_filter_init(uint32_t nr, bool scale_32bit, bool id_list_mode,
+					 uint32_t fr1, uint32_t fr2, uint32_t fifo, bool enable);
+void can_filter_id_mask_16bit_init(uint32_t nr, uint16_t id1, uint16_t mask1,
+								   uint16_t id2, uint16_t mask2, uint32_t fifo, bool enable);
+void can_filter_id_mask_32bit_init(uint32_t nr, uint32_t id, uint32_t mask,
+								   uint32_t fifo, bool enable);
+void can_filter_id_list_16bit_init(uint32_t nr, uint16_t id1, uint16_t id2,
+								   uint16_t id3, uint16_t id4, uint32_t fifo, bool enable);
+void can_filter_id_list_32bit_init(uint32_t nr, uint32_t id1, uint32_t id2,
+								   uint32_t fifo, bool enable);
+void can_enable_irq(uint32_t canport, uint32_t irq);
+void can_disable_irq(uint32_t canport, uint32_t irq);
+int can_transmit(uint32_t canport, uint32_t id, bool ext, bool rtr,
+				 uint8_t length, uint8_t *data);
+void can_fifo_release(uint32_t canport, uint8_t fifo);
+void can_receive(uint32_t canport, uint8_t fifo, bool release, uint32_t *id,
+				 bool *ext, bool *rtr, uint8_t *fmi, uint8_t *length,
+				 uint8_t *data, uint16_t *timestamp);
+bool can_available_mailbox(uint32_t canport);
+
+#endif
@@ -0,0 +1,9 @@
+/*
+ * Host simulation stand-in for <libopencm3/stm32/crs.h>
+ */
+#ifndef SIM_STM32_CRS_H
+#define SIM_STM32_CRS_H
+
+void crs_autotrim_usb_enable(void);
+
+#endif
@@ -0,0 +1,10 @@
+/*
+ * Host simulation stand-in for <libopencm3/stm32/desig.h>
+ */
+#ifndef SIM_STM32_DESIG_H
+#define SIM_STM32_DESIG_H
+#include <stdint.h>
+
+void desig_get_unique_id(uint32_t *result);
+
+#endif
@@ -0,0 +1,8 @@
+/*
+ * Host simulation stand-in for <libopencm3/stm32/exti.h>
+ */
+#ifndef SIM_STM32_EXTI_H
+#define SIM_STM32_EXTI_H
+#include <stdint.h>
+
+#endif
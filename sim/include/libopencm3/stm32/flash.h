@@ -0,0 +1,8 @@
+/*
+ * Host simulation stand-in for <libopencm3/stm32/flash.h>
+ */
+#ifndef SIM_STM32_FLASH_H
+#define SIM_STM32_FLASH_H
+#include <stdint.h>
+
+#endif
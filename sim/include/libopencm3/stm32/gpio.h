@@ -0,0 +1,53 @@
+/*
+ * Host simulation stand-in for <libopencm3/stm32/gpio.h>
+ */
+#ifndef SIM_STM32_GPIO_H
+#define SIM_STM32_GPIO_H
+#include <stdint.h>
+
+#define GPIOA 0u
+#define GPIOB 1u
+#define GPIOC 2u
+#define GPIOF 3u
+
+#define GPIO0 (1u << 0)
+#define GPIO1 (1u << 1)
+#define GPIO2 (1u << 2)
+#define GPIO3 (1u << 3)
+#define GPIO4 (1u << 4)
+#define GPIO5 (1u << 5)
+#define GPIO6 (1u << 6)
+#define GPIO7 (1u << 7)
+#define GPIO8 (1u << 8)
+#define GPIO9 (1u << 9)
+#define GPIO10 (1u << 10)
+#define GPIO11 (1u << 11)
+#define GPIO12 (1u << 12)
+#define GPIO13 (1u << 13)
+#define GPIO14 (1u << 14)
+#define GPIO15 (1u << 15)
+
+#define GPIO_MODE_INPUT 0x0
+#define GPIO_MODE_OUTPUT 0x1
+#define GPIO_MODE_AF 0x2
+#define GPIO_MODE_ANALOG 0x3
+
+#define GPIO_PUPD_NONE 0x0
+#define GPIO_PUPD_PULLUP 0x1
+#define GPIO_PUPD_PULLDOWN 0x2
+
+#define GPIO_AF0 0x0
+#define GPIO_AF1 0x1
+#define GPIO_AF2 0x2
+#define GPIO_AF3 0x3
+#define GPIO_AF4 0x4
+#define GPIO_AF5 0x5
+
+void gpio_set(uint32_t gpioport, uint16_t gpios);
+void gpio_clear(uint32_t gpioport, uint16_t gpios);
+void gpio_toggle(uint32_t gpioport, uint16_t gpios);
+uint16_t gpio_get(uint32_t gpioport, uint16_t gpios);
+void gpio_mode_setup(uint32_t gpioport, uint8_t mode, uint8_t pull_up_down, uint16_t gpios);
+void gpio_set_af(uint32_t gpioport, uint8_t alt_func_num, uint16_t gpios);
+
+#endif
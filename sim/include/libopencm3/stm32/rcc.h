@@ -0,0 +1,33 @@
+/*
+ * Host simulation stand-in for <libopencm3/stm32/rcc.h>
+ */
+#ifndef SIM_STM32_RCC_H
+#define SIM_STM32_RCC_H
+#include <stdint.h>
+
+enum rcc_periph_clken
+{
+	RCC_GPIOA,
+	RCC_GPIOB,
+	RCC_GPIOC,
+	RCC_GPIOF,
+	RCC_TIM2,
+	RCC_TIM3,
+	RCC_TIM14,
+	RCC_CAN1,
+	RCC_USB,
+	RCC_CRS,
+};
+
+enum rcc_osc
+{
+	RCC_HSI48,
+	RCC_HSI,
+	RCC_PLL,
+};
+
+void rcc_periph_clock_enable(enum rcc_periph_clken clken);
+void rcc_clock_setup_in_hsi_out_48mhz(void);
+void rcc_set_usbclk_source(enum rcc_osc clk);
+
+#endif
@@ -0,0 +1,49 @@
+/*
+ * Host simulation stand-in for <libopencm3/stm32/st_usbfs.h>
+ *
+ * Endpoint register accesses go through sim_usb_ep_reg(), which lets the
+ * USB model in sim/usbd.c apply the previous write (toggle and rc_w0 bits)
+ * before handing out the register again. The BTABLE and the buffers live in
+ * a model of the 1024-byte packet memory, accessed in 16-bit words.
+ */
+#ifndef SIM_STM32_ST_USBFS_H
+#define SIM_STM32_ST_USBFS_H
+#include <stdint.h>
+
+extern volatile uint32_t sim_usb_bcdr;
+extern volatile uint32_t sim_usb_btable;
+extern volatile uint16_t sim_usb_pma[512];
+
+volatile uint32_t *sim_usb_ep_reg(uint8_t ep);
+
+#define USB_BCDR_REG (&sim_usb_bcdr)
+#define USB_BCDR_DPPU (1u << 15)
+
+#define USB_EP_REG(ep) (sim_usb_ep_reg(ep))
+#define USB_BTABLE_REG (&sim_usb_btable)
+#define USB_PMA_BASE ((uintptr_t)sim_usb_pma)
+
+/* USB_EPnR */
+#define USB_EP_RX_CTR 0x8000u
+#define USB_EP_RX_DTOG 0x4000u
+#define USB_EP_RX_STAT 0x3000u
+#define USB_EP_SETUP 0x0800u
+#define USB_EP_TYPE 0x0600u
+#define USB_EP_KIND 0x0100u
+#define USB_EP_TX_CTR 0x0080u
+#define USB_EP_TX_DTOG 0x0040u
+#define USB_EP_TX_STAT 0x0030u
+#define USB_EP_ADDR 0x000Fu
+
+#define USB_EP_RX_STAT_DISABLED 0x0000u
+#define USB_EP_RX_STAT_STALL 0x1000u
+#define USB_EP_RX_STAT_NAK 0x2000u
+#define USB_EP_RX_STAT_VALID 0x3000u
+#define USB_EP_TX_STAT_DISABLED 0x0000u
+#define USB_EP_TX_STAT_STALL 0x0010u
+#define USB_EP_TX_STAT_NAK 0x0020u
+#define USB_EP_TX_STAT_VALID 0x0030u
+
+#define USB_EP_NTOGGLE_MSK (USB_EP_RX_CTR | USB_EP_SETUP | USB_EP_TYPE | USB_EP_KIND | USB_EP_TX_CTR | USB_EP_ADDR)
+
+#endif
@@ -0,0 +1,55 @@
+/*
+ * Host simulation stand-in for <libopencm3/stm32/timer.h>
+ *
+ * The counters are derived from the simulated clock when read.
+ */
+#ifndef SIM_STM32_TIMER_H
+#define SIM_STM32_TIMER_H
+#include <stdint.h>
+#include <stdbool.h>
+
+#define TIM2 0x40000000u
+#define TIM3 0x40000400u
+#define TIM14 0x40002000u
+
+volatile uint32_t *sim_timer_reg(uint32_t timer_peripheral, uint32_t offset);
+
+#define TIM_CR1(tim) (*sim_timer_reg(tim, 0x00))
+#define TIM_DIER(tim) (*sim_timer_reg(tim, 0x0C))
+#define TIM_SR(tim) (*sim_timer_reg(tim, 0x10))
+#define TIM_EGR(tim) (*sim_timer_reg(tim, 0x14))
+#define TIM_CNT(tim) (*sim_timer_reg(tim, 0x24))
+#define TIM_PSC(tim) (*sim_timer_reg(tim, 0x28))
+#define TIM_ARR(tim) (*sim_timer_reg(tim, 0x2C))
+#define TIM_CCR1(tim) (*sim_timer_reg(tim, 0x34))
+#define TIM_CCR2(tim) (*sim_timer_reg(tim, 0x38))
+
+#define TIM_CR1_CEN (1u << 0)
+#define TIM_DIER_UIE (1u << 0)
+#define TIM_DIER_CC1IE (1u << 1)
+#define TIM_DIER_CC2IE (1u << 2)
+#define TIM_SR_UIF (1u << 0)
+#define TIM_SR_CC1IF (1u << 1)
+#define TIM_SR_CC2IF (1u << 2)
+#define TIM_EGR_UG (1u << 0)
+
+enum tim_oc_id
+{
+	TIM_OC1 = 0,
+	TIM_OC1N,
+	TIM_OC2,
+};
+
+void timer_set_prescaler(uint32_t timer_peripheral, uint32_t value);
+void timer_set_period(uint32_t timer_peripheral, uint32_t period);
+void timer_enable_counter(uint32_t timer_peripheral);
+void timer_disable_counter(uint32_t timer_peripheral);
+void timer_generate_event(uint32_t timer_peripheral, uint32_t event);
+uint32_t timer_get_counter(uint32_t timer_peripheral);
+void timer_set_oc_value(uint32_t timer_peripheral, enum tim_oc_id oc_id, uint32_t value);
+void timer_enable_irq(uint32_t timer_peripheral, uint32_t irq);
+void timer_disable_irq(uint32_t timer_peripheral, uint32_t irq);
+bool timer_get_flag(uint32_t timer_peripheral, uint32_t flag);
+void timer_clear_flag(uint32_t timer_peripheral, uint32_t flag);
+
+#endif
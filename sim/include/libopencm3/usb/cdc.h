@@ -0,0 +1,72 @@
+/*
+ * Host simulation stand-in for <libopencm3/usb/cdc.h>
+ */
+#ifndef SIM_USB_CDC_H
+#define SIM_USB_CDC_H
+#include <stdint.h>
+
+#define CS_INTERFACE 0x24
+#define USB_CDC_TYPE_HEADER 0x00
+#define USB_CDC_TYPE_CALL_MANAGEMENT 0x01
+#define USB_CDC_TYPE_ACM 0x02
+#define USB_CDC_TYPE_UNION 0x06
+
+#define USB_CDC_SUBCLASS_ACM 0x02
+#define USB_CDC_PROTOCOL_AT 0x01
+
+#define USB_CDC_REQ_SET_LINE_CODING 0x20
+#define USB_CDC_REQ_SET_CONTROL_LINE_STATE 0x22
+#define USB_CDC_NOTIFY_SERIAL_STATE 0x20
+
+struct usb_cdc_header_descriptor
+{
+	uint8_t bFunctionLength;
+	uint8_t bDescriptorType;
+	uint8_t bDescriptorSubtype;
+	uint16_t bcdCDC;
+} __attribute__((packed));
+
+struct usb_cdc_call_management_descriptor
+{
+	uint8_t bFunctionLength;
+	uint8_t bDescriptorType;
+	uint8_t bDescriptorSubtype;
+	uint8_t bmCapabilities;
+	uint8_t bDataInterface;
+} __attribute__((packed));
+
+struct usb_cdc_acm_descriptor
+{
+	uint8_t bFunctionLength;
+	uint8_t bDescriptorType;
+	uint8_t bDescriptorSubtype;
+	uint8_t bmCapabilities;
+} __attribute__((packed));
+
+struct usb_cdc_union_descriptor
+{
+	uint8_t bFunctionLength;
+	uint8_t bDescriptorType;
+	uint8_t bDescriptorSubtype;
+	uint8_t bControlInterface;
+	uint8_t bSubordinateInterface0;
+} __attribute__((packed));
+
+struct usb_cdc_notification
+{
+	uint8_t bmRequestType;
+	uint8_t bNotification;
+	uint16_t wValue;
+	uint16_t wIndex;
+	uint16_t wLength;
+} __attribute__((packed));
+
+struct usb_cdc_line_coding
+{
+	uint32_t dwDTERate;
+	uint8_t bCharFormat;
+	uint8_t bParityType;
+	uint8_t bDataBits;
+} __attribute__((packed));
+
+#endif
@@ -0,0 +1,958 @@
+/*
+ * scenario.c
+ *
+ *  Scripted end-to-end runs of the firmware on the simulated bus and USB
+ *  link. Every scenario reports bus load, frames lost between the bus and
+ *  the host (and where), throughput and the latency distribution from the
+ *  end of a frame on the bus to the USB packet that carried it to the host,
+ *  and for host-sent frames from the write to their end on the bus and from
+ *  the end of the USB packet that carried them to their start of frame. The
+ *  host's frames have to reach the bus in the order it wrote them.
+ *
+ *  Built with USB_GS_USB the host speaks gs_usb instead of SLCAN, through
+ *  vendor requests and one frame per bulk transfer, like the Linux driver.
+ *  It then also checks the protocol: probe frames of all kinds have to make
+ *  the round trip unchanged both ways, every echo has to come back for its
+ *  echo_id once the frame was on the bus, and every IN packet has to be a
+ *  well formed gs_host_frame.
+ *
+ *  Build and run with:  pio run -e sim -t exec  (or -e sim_gs_usb)
+ *  Arguments select scenarios by name, the exit status is non-zero when a
+ *  scenario loses more frames than it allows, reorders the host's frames or
+ *  breaks the gs_usb protocol.
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "sim.h"
+#include "slcan.h"
+#include "can.h"
+#include "usb.h"
+#include "busload.h"
+#include "bittiming.h"
+#include "periodic.h"
+#include "burst.h"
+#include "change.h"
+#include "limit.h"
+#ifdef USB_GS_USB
+#include <libopencm3/usb/usbd.h>
+#include "gs_usb.h"
+#endif
+
+#define SIM_SETUP_MS 20u	/* before the traffic starts */
+#define SIM_DRAIN_MS 50u	/* after it stopped, to empty the queues */
+#define SIM_HOST_TX_ID 0x7E0u
+#define SIM_HOST_BUFFER 4096u /* bytes the host tty layer buffers before a write blocks */
+#define SIM_NO_LIMIT UINT32_MAX
+#define SIM_LINE_MAX 32u
+#define SIM_GS_ECHO_SLOTS 10u /* frames the Linux gs_usb driver keeps in flight */
+#define SIM_GS_PROBE 0x80000000u /* echo slot content: a probe, not a sequence number */
+#define SIM_GS_PROBE_MS 5u		 /* time the probes get for their round trip */
+#define SIM_PERIODIC_ID 0x080u /* entry n of the periodic table sends SIM_PERIODIC_ID + n */
+#define SIM_BURST_ID 0x700u	   /* burst record n sends SIM_BURST_ID - n, the reverse of priority */
+
+typedef struct
+{
+	const char *name;
+	const char *setup;		 /* SLCAN commands sent before the traffic starts */
+	uint8_t load;			 /* bus load of the generated traffic, percent */
+	uint8_t ids;			 /* generators, each with its own identifier */
+	bool ext;				 /* every other generator uses a 29-bit identifier */
+	uint8_t dlc;			 /* payload of generated frames, at least 4 for the sequence number */
+	uint32_t host_fps;		 /* frames per second the host writes, 0 for none */
+	uint16_t stall_every_ms; /* the host stops reading IN packets periodically */
+	uint16_t stall_ms;
+	uint16_t duration_ms;
+	uint32_t max_lost; /* frames the scenario may lose on the way to the host */
+	uint16_t error_every_us; /* error frames on the bus, 0 for none */
+	uint8_t error_lec;		 /* bxCAN error code they leave in LEC */
+	bool error_tx;			 /* they hit the adapter's own frames (TEC), not received ones (REC) */
+	uint16_t error_ms;		 /* for this long from the start of the traffic */
+	uint8_t periodic;		 /* entries of the adapter's periodic TX table in use */
+	uint16_t periodic_ms;	 /* their period, phases spread over it */
+	uint8_t burst;			 /* records in the burst buffer, 0 for none */
+	uint16_t burst_repeat;	 /* passes to replay them */
+	uint16_t repeat;		 /* frames each generator sends before its payload changes, 0 for every frame */
+} scenario_t;
+
+static const scenario_t scenarios[] = {
+	{"rx-1M-90", "S8\r", 90, 4, false, 8, 0, 0, 0, 1000, 0, 0, 0, false, 0, 0, 0, 0, 0, 0},
+	{"rx-1M-90-ext", "S8\r", 90, 4, true, 8, 0, 0, 0, 1000, 0, 0, 0, false, 0, 0, 0, 0, 0, 0},
+	{"rx-1M-100-dlc4", "S8\r", 100, 4, false, 4, 0, 0, 0, 1000, SIM_NO_LIMIT, 0, 0, false, 0, 0, 0, 0, 0, 0},
+	{"rx-500k-90", "S6\r", 90, 4, false, 8, 0, 0, 0, 1000, 0, 0, 0, false, 0, 0, 0, 0, 0, 0},
+	{"rx-1M-90-stall", "S8\r", 90, 4, false, 8, 0, 100, 5, 1000, SIM_NO_LIMIT, 0, 0, false, 0, 0, 0, 0, 0, 0},
+	{"rx-1M-90-hiccup", "S8\r", 90, 4, false, 8, 0, 10, 1, 1000, 0, 0, 0, false, 0, 0, 0, 0, 0, 0},
+	{"tx-1M-flood", "S8\r", 0, 0, false, 8, 20000, 0, 0, 1000, SIM_NO_LIMIT, 0, 0, false, 0, 0, 0, 0, 0, 0},
+	{"tx-1M-single", "S8\r", 0, 0, false, 8, 1000, 0, 0, 1000, 0, 0, 0, false, 0, 0, 0, 0, 0, 0},
+	{"rxtx-1M-50", "S8\r", 50, 4, false, 8, 2000, 0, 0, 1000, 0, 0, 0, false, 0, 0, 0, 0, 0, 0},
+	{"err-1M-50-storm", "S8\rE1\r", 50, 4, false, 8, 0, 0, 0, 1000, 0, 20, 1, false, 1000, 0, 0, 0, 0, 0},
+	{"err-1M-50-busoff", "S8\rE1\r", 50, 4, false, 8, 2000, 0, 0, 1000, SIM_NO_LIMIT, 50, 3, true, 100, 0, 0, 0, 0, 0},
+	{"periodic-1M-flood", "S8\r", 0, 0, false, 8, 20000, 0, 0, 1000, SIM_NO_LIMIT, 0, 0, false, 0, 8, 10, 0, 0, 0},
+	{"periodic-1M-50-flood", "S8\r", 50, 4, false, 8, 20000, 0, 0, 1000, SIM_NO_LIMIT, 0, 0, false, 0, 8, 10, 0, 0, 0},
+	{"burst-1M", "S8\r", 0, 0, false, 8, 0, 0, 0, 1000, 0, 0, 0, false, 0, 0, 0, 64, 100, 0},
+	{"burst-1M-50", "S8\r", 50, 4, false, 8, 0, 0, 0, 1000, 0, 0, 0, false, 0, 0, 0, 64, 100, 0},
+	{"cyclic-1M-90", "S8\r", 90, 16, false, 8, 0, 0, 0, 1000, 0, 0, 0, false, 0, 0, 0, 0, 0, 20},
+	{"change-1M-90", "S8\rc1\r", 90, 16, false, 8, 0, 0, 0, 1000, 0, 0, 0, false, 0, 0, 0, 0, 0, 20},
+	{"change-1M-90-keepalive", "S8\rc10019\r", 90, 16, false, 8, 0, 0, 0, 1000, 0, 0, 0, false, 0, 0, 0, 0, 0, 100},
+	{"mixed-1M-70-flood", "S8\r", 70, 8, true, 8, 20000, 0, 0, 1000, 0, 0, 0, false, 0, 8, 10, 0, 0, 0},
+	{"limit-1M-90-stall", "S8\rK000C8080A100\r", 90, 4, false, 8, 0, 100, 5, 1000, SIM_NO_LIMIT, 0, 0, false, 0, 0, 0, 0, 0, 0},
+};
+
+typedef struct
+{
+	uint64_t *eof; /* end of frame of every generated frame, by sequence number */
+	uint8_t *seen;
+	uint32_t frames;
+	uint32_t size;
+	uint32_t *latency; /* ns */
+	uint32_t count;
+} track_t;
+
+static struct
+{
+	track_t rx; /* bus to host */
+	track_t tx; /* host to bus */
+	track_t out; /* eof[] holds the host stream offset past a frame's command
+				  * until the packet carrying it arrives, then its end */
+	uint32_t duplicates;
+	uint32_t host_errors;
+	uint32_t host_acks;
+	uint32_t errors;		/* error frames put on the bus */
+	uint32_t err_reports;	/* error frames the host read */
+	uint32_t err_events;	/* events they stand for */
+	uint32_t err_busoff;
+	uint32_t err_restarted;
+	uint32_t err_passive;
+	uint32_t err_prot;
+	uint16_t gs_in_flight; /* echo_ids waiting for their echo */
+	uint32_t gs_slot[SIM_GS_ECHO_SLOTS]; /* what each carries: a sequence number, or SIM_GS_PROBE | probe */
+	uint8_t probe_bus;	   /* bit n: TX probe n was seen on the bus */
+	uint8_t probe_echo;	   /* bit n: and echoed */
+	uint8_t probe_rx;	   /* bit n: RX probe n reached the host */
+	uint32_t gs_bad;	   /* packets and frames breaking the protocol */
+	const char *gs_first_bad;
+	const scenario_t *sc;
+	track_t periodic;	   /* latency[] holds the intervals between frames of an entry */
+	uint64_t periodic_last[CAN_PERIODIC_MAX];
+	uint8_t burst_records;
+	uint32_t burst_frames;	 /* burst frames seen on the bus */
+	uint32_t burst_disorder; /* of them, frames not following the one before */
+	uint32_t tx_next;		 /* host frame after the latest one seen on the bus */
+	uint32_t tx_disorder;	 /* host frames on the bus after a later one */
+	uint64_t burst_first, burst_last;
+} run;
+
+static void track_grow(track_t *track, uint32_t seq)
+{
+	if (seq < track->size)
+		return;
+
+	uint32_t size = track->size ? track->size : 1024u;
+
+	while (size <= seq)
+		size *= 2u;
+	track->eof = realloc(track->eof, size * sizeof(*track->eof));
+	track->seen = realloc(track->seen, size);
+	track->latency = realloc(track->latency, size * sizeof(*track->latency));
+	if (!track->eof || !track->seen || !track->latency)
+		abort();
+	memset(&track->seen[track->size], 0, size - track->size);
+	track->size = size;
+}
+
+static uint32_t frame_seq(const uint8_t *data)
+{
+	return (uint32_t)data[0] | ((uint32_t)data[1] << 8) | ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+// Time between two frames of the same periodic table entry
+static void periodic_observer(uint8_t entry, uint64_t eof)
+{
+	if (run.periodic_last[entry])
+	{
+		track_grow(&run.periodic, run.periodic.count);
+		run.periodic.latency[run.periodic.count++] = (uint32_t)(eof - run.periodic_last[entry]);
+	}
+	run.periodic_last[entry] = eof;
+}
+
+// Burst frames have to reach the bus in the order of the sequence
+static void burst_observer(const sim_frame_t *frame, uint64_t eof)
+{
+	if (frame->data[0] != (run.burst_frames % run.burst_records))
+		run.burst_disorder++;
+	if (!run.burst_frames)
+		run.burst_first = eof;
+	run.burst_last = eof;
+	run.burst_frames++;
+}
+
+// Frame generator g of a scenario sends, before the sequence number goes in
+static void gen_frame(const scenario_t *sc, uint8_t g, sim_frame_t *frame)
+{
+	*frame = (sim_frame_t){.id = 0x100u + 0x10u * g, .dlc = sc->dlc, .data = {0x34, 0x12, 0, 0, 0x55, 0xAA, 0x55, 0xAA}};
+	if (sc->ext && (g & 1u))
+	{
+		frame->id = 0x18DA0000u + g;
+		frame->ext = true;
+	}
+}
+
+#ifdef USB_GS_USB
+// Frames the host sends before the traffic, to see identifier flags, DLC
+// and payload come out on the bus as written
+static const gs_host_frame_t probe_tx[] = {
+	{.can_id = 0x123u, .can_dlc = 0},
+	{.can_id = 0x7FFu, .can_dlc = 3, .data = {0x01, 0x02, 0x03}},
+	{.can_id = 0x456u | GS_CAN_RTR_FLAG, .can_dlc = 2},
+	{.can_id = 0x1FFFFFFFu | GS_CAN_EFF_FLAG, .can_dlc = 8, .data = {0xFF, 0x00, 0x80, 0x7F, 0x01, 0xFE, 0x55, 0xAA}},
+	{.can_id = 0x00000001u | GS_CAN_EFF_FLAG | GS_CAN_RTR_FLAG, .can_dlc = 0},
+	{.can_id = 0x00ABCDEFu | GS_CAN_EFF_FLAG, .can_dlc = 5, .data = {0xDE, 0xAD, 0xBE, 0xEF, 0x42}},
+};
+
+// and frames of another node the host has to read back the same. They are
+// shorter than a sequence number, so the generators' numbers stay contiguous.
+static const sim_frame_t probe_rx[] = {
+	{.id = 0x321u, .dlc = 2, .data = {0xA5, 0x5A}},
+	{.id = 0x654u, .rtr = true, .dlc = 1},
+	{.id = 0x1ABCDEF0u, .ext = true, .dlc = 3, .data = {0x11, 0x22, 0x33}},
+	{.id = 0x00000042u, .ext = true, .rtr = true, .dlc = 0},
+};
+
+#define PROBES_TX (sizeof(probe_tx) / sizeof(probe_tx[0]))
+#define PROBES_RX (sizeof(probe_rx) / sizeof(probe_rx[0]))
+
+static void gs_bad(const char *what)
+{
+	if (!run.gs_bad++)
+		run.gs_first_bad = what;
+}
+
+static uint32_t gs_can_id(const sim_frame_t *frame)
+{
+	return frame->id | (frame->ext ? GS_CAN_EFF_FLAG : 0u) | (frame->rtr ? GS_CAN_RTR_FLAG : 0u);
+}
+
+static bool gs_same(const gs_host_frame_t *hf, const sim_frame_t *frame)
+{
+	return (hf->can_id == gs_can_id(frame)) && (hf->can_dlc == frame->dlc) &&
+		   (frame->rtr || (memcmp(hf->data, frame->data, frame->dlc) == 0));
+}
+
+// A TX probe leaving the adapter, false for any other frame
+static bool probe_bus_observer(const sim_frame_t *frame)
+{
+	for (uint8_t n = 0; n < PROBES_TX; n++)
+	{
+		if (((probe_tx[n].can_id & CAN_XTD_MASK) != frame->id) ||
+			(((probe_tx[n].can_id & GS_CAN_EFF_FLAG) != 0u) != frame->ext))
+			continue;
+		if (!gs_same(&probe_tx[n], frame))
+			gs_bad("sent frame changed on the way to the bus");
+		else if (run.probe_bus & (1u << n))
+			gs_bad("sent frame repeated on the bus");
+		run.probe_bus |= (uint8_t)(1u << n);
+		return true;
+	}
+	return false;
+}
+#endif /* USB_GS_USB */
+
+static void bus_observer(const sim_frame_t *frame, uint64_t eof, bool from_device)
+{
+	uint32_t seq = frame_seq(frame->data);
+
+#ifdef USB_GS_USB
+	if (from_device && probe_bus_observer(frame))
+		return;
+#endif
+	if (from_device && !frame->ext && ((frame->id - SIM_PERIODIC_ID) < CAN_PERIODIC_MAX))
+	{
+		periodic_observer((uint8_t)(frame->id - SIM_PERIODIC_ID), eof);
+		return;
+	}
+	if (from_device && !frame->ext && ((SIM_BURST_ID - frame->id) < 0x100u))
+	{
+		burst_observer(frame, eof);
+		return;
+	}
+	if (frame->dlc < 4u)
+		return;
+	if (from_device)
+	{
+		// the host write time was stored under the same sequence number
+		if ((seq < run.tx.frames) && !run.tx.seen[seq])
+		{
+			if (seq < run.tx_next)
+				run.tx_disorder++;
+			else
+				run.tx_next = seq + 1u;
+			run.tx.seen[seq] = 1u;
+			run.tx.latency[run.tx.count++] = (uint32_t)(eof - run.tx.eof[seq]);
+		}
+		if ((seq < run.out.frames) && !run.out.seen[seq])
+		{
+			uint64_t sof = eof - (uint64_t)sim_can_frame_bits(frame) * sim_can_bit_ns();
+
+			run.out.seen[seq] = 1u;
+			run.out.latency[run.out.count++] = (uint32_t)(sof - run.out.eof[seq]);
+		}
+		return;
+	}
+	// a repeated payload counts from its first frame
+	if (seq < run.rx.frames)
+		return;
+	track_grow(&run.rx, seq);
+	run.rx.eof[seq] = eof;
+	if (seq >= run.rx.frames)
+		run.rx.frames = seq + 1u;
+}
+
+// Note where the host's command for frame seq ends in the OUT stream
+static void host_out_mark(uint32_t seq)
+{
+	track_grow(&run.out, seq);
+	run.out.eof[seq] = sim_host_written();
+}
+
+// The commands that end in an OUT packet have been delivered with it
+static void host_out_observer(uint64_t delivered, uint64_t at)
+{
+	while ((run.out.frames < run.tx.frames) && (run.out.eof[run.out.frames] <= delivered))
+		run.out.eof[run.out.frames++] = at;
+}
+
+// A received frame, matched to its end on the bus by the sequence number
+static void host_rx(const uint8_t *data, uint8_t dlc, uint64_t at)
+{
+	if (dlc < 4u)
+		return;
+
+	uint32_t seq = frame_seq(data);
+
+	if ((seq >= run.rx.frames) || run.rx.seen[seq])
+	{
+		run.duplicates++;
+		return;
+	}
+	run.rx.seen[seq] = 1u;
+	run.rx.latency[run.rx.count++] = (uint32_t)(at - run.rx.eof[seq]);
+}
+
+// An error frame, the classes are the SocketCAN ones in both protocols
+static void host_err(uint32_t can_id, const uint8_t *data)
+{
+	run.err_reports++;
+	run.err_events += data[5];
+	run.err_busoff += (can_id & CAN_ERR_BUSOFF) != 0;
+	run.err_restarted += (can_id & CAN_ERR_RESTARTED) != 0;
+	run.err_passive += (data[1] & (CAN_ERR_CRTL_RX_PASSIVE | CAN_ERR_CRTL_TX_PASSIVE)) != 0;
+	run.err_prot += (can_id & (CAN_ERR_PROT | CAN_ERR_ACK)) != 0;
+}
+
+// Burst records with falling identifiers, so the mailboxes would reorder
+// them by priority; the first payload byte carries the record number
+static uint16_t burst_records(const scenario_t *sc, uint8_t *buf)
+{
+	uint16_t len = 0;
+
+	for (uint8_t n = 0; n < sc->burst; n++)
+	{
+		uint16_t id = (uint16_t)(SIM_BURST_ID - n);
+
+		buf[len++] = CAN_BURST_ID_STD | 8u;
+		buf[len++] = (uint8_t)id;
+		buf[len++] = (uint8_t)(id >> 8);
+		memset(&buf[len], 0, 8u);
+		buf[len] = n;
+		len += 8u;
+	}
+	return len;
+}
+
+// One pass of main(): the main loop, then WFI while it has nothing to do.
+// The simulation steps on either way, interrupts end the sleep on time.
+static void main_pass(void)
+{
+	main_loop();
+	if (main_idle())
+		sim_sleep(SIM_COST_POLL_NS);
+	else
+		sim_cpu(SIM_COST_POLL_NS);
+	sim_step();
+}
+
+#ifdef USB_GS_USB
+// An echo has to come back once its frame left the adapter, for the slot
+// the frame was sent in. A frame given up on after errors is echoed too.
+static void host_echo(uint32_t echo_id)
+{
+	uint32_t slot;
+	bool sent;
+
+	if ((echo_id >= SIM_GS_ECHO_SLOTS) || !(run.gs_in_flight & (1u << echo_id)))
+	{
+		run.host_errors++;
+		gs_bad("echo_id not in flight");
+		return;
+	}
+	run.gs_in_flight &= (uint16_t)~(1u << echo_id);
+	slot = run.gs_slot[echo_id];
+	if (slot & SIM_GS_PROBE)
+	{
+		run.probe_echo |= (uint8_t)(1u << (slot & ~SIM_GS_PROBE));
+		sent = (run.probe_bus & (1u << (slot & ~SIM_GS_PROBE))) != 0u;
+	}
+	else
+	{
+		run.host_acks++;
+		sent = run.tx.seen[slot] != 0u;
+	}
+	if (!sent && !run.sc->error_tx)
+		gs_bad("echo before the frame was on the bus");
+}
+
+// A received frame has to be one of the RX probes or of the generators',
+// with the identifier, flags, DLC and payload the bus carried
+static bool host_rx_valid(const gs_host_frame_t *hf)
+{
+	sim_frame_t frame;
+
+	for (uint8_t n = 0; n < PROBES_RX; n++)
+	{
+		if ((hf->can_id & ~GS_CAN_RTR_FLAG) != (gs_can_id(&probe_rx[n]) & ~GS_CAN_RTR_FLAG))
+			continue;
+		if (!gs_same(hf, &probe_rx[n]))
+			return false;
+		run.probe_rx |= (uint8_t)(1u << n);
+		return true;
+	}
+	for (uint8_t g = 0; g < run.sc->ids; g++)
+	{
+		gen_frame(run.sc, g, &frame);
+		if (hf->can_id == gs_can_id(&frame))
+			return (hf->can_dlc == frame.dlc) && (memcmp(&hf->data[4], &frame.data[4], frame.dlc - 4u) == 0);
+	}
+	return false;
+}
+
+// Every IN packet is one gs_host_frame_t, with the time stamp host_open()
+// asked for
+static void host_packet_observer(const uint8_t *data, uint16_t size, uint64_t at)
+{
+	gs_host_frame_t hf = {0};
+	uint32_t id_max;
+
+	if (size != GS_HOST_FRAME_SIZE_TIMESTAMP)
+	{
+		run.host_errors++;
+		gs_bad("IN packet of the wrong size");
+		return;
+	}
+	memcpy(&hf, data, sizeof(hf));
+	if ((hf.channel != 0u) || (hf.flags != 0u) || (hf.can_dlc > CAN_DLC_MAX))
+	{
+		gs_bad("bad channel, flags or DLC");
+		return;
+	}
+	if (hf.echo_id != GS_HOST_FRAME_ECHO_RX)
+	{
+		host_echo(hf.echo_id);
+		return;
+	}
+	id_max = (hf.can_id & GS_CAN_EFF_FLAG) ? CAN_XTD_MASK : CAN_STD_MASK;
+	if ((hf.can_id & ~(GS_CAN_EFF_FLAG | GS_CAN_RTR_FLAG | GS_CAN_ERR_FLAG)) > id_max)
+	{
+		gs_bad("identifier out of range");
+		return;
+	}
+	if (hf.can_id & GS_CAN_ERR_FLAG)
+		host_err(hf.can_id, hf.data);
+	else if (!host_rx_valid(&hf))
+		gs_bad("received frame changed on the way to the host");
+	else
+		host_rx(hf.data, hf.can_dlc, at);
+}
+
+// Send a frame in the lowest free echo slot, noting what it carries
+static void host_send(gs_host_frame_t hf, uint32_t slot)
+{
+	hf.echo_id = 0;
+	while (run.gs_in_flight & (1u << hf.echo_id))
+		hf.echo_id++;
+	run.gs_in_flight |= (uint16_t)(1u << hf.echo_id);
+	run.gs_slot[hf.echo_id] = slot;
+	sim_host_write((const uint8_t *)&hf, GS_HOST_FRAME_SIZE);
+}
+
+// The round trip of the probes both ways, before the traffic starts; the
+// RX ones are sent once each by generators that don't come round again
+static void host_probe(void)
+{
+	uint64_t until = sim_now + SIM_MS(SIM_GS_PROBE_MS);
+
+	for (uint8_t n = 0; n < PROBES_TX; n++)
+		host_send(probe_tx[n], SIM_GS_PROBE | n);
+	for (uint8_t n = 0; n < PROBES_RX; n++)
+	{
+		sim_gen_t gen = {.frame = probe_rx[n], .period = SIM_MS(3600000u)};
+
+		sim_bus_add_gen(&gen, sim_now);
+	}
+	while ((sim_now < until) && ((run.probe_echo != (1u << PROBES_TX) - 1u) || (run.probe_rx != (1u << PROBES_RX) - 1u)))
+	{
+		main_pass();
+	}
+}
+
+// Everything the host saw follows the protocol, the probes made it and
+// every frame sent was echoed
+static bool host_check(void)
+{
+	printf("  gs   probes tx %u/%u on the bus, %u echoed  rx %u/%u  in flight %u  protocol errors %u\n",
+		   (unsigned)__builtin_popcount(run.probe_bus), (unsigned)PROBES_TX, (unsigned)__builtin_popcount(run.probe_echo),
+		   (unsigned)__builtin_popcount(run.probe_rx), (unsigned)PROBES_RX,
+		   (unsigned)__builtin_popcount(run.gs_in_flight), run.gs_bad);
+	if ((run.probe_bus != (1u << PROBES_TX) - 1u) || (run.probe_echo != (1u << PROBES_TX) - 1u) ||
+		(run.probe_rx != (1u << PROBES_RX) - 1u))
+		gs_bad("probe lost");
+	if (run.gs_in_flight)
+		gs_bad("frame never echoed");
+	if (run.gs_bad)
+	{
+		printf("  FAIL: %s\n", run.gs_first_bad);
+		return false;
+	}
+	return true;
+}
+
+// What the Linux driver does on "ip link set can0 up type can bitrate ...
+// berr-reporting on": read the limits, set the timing and start the channel.
+// The S digit and E1 of the scenario's SLCAN setup pick the same settings.
+static void host_open(const scenario_t *sc)
+{
+	const uint8_t type_out = USB_REQ_TYPE_VENDOR | USB_REQ_TYPE_INTERFACE;
+	const uint8_t type_in = type_out | USB_REQ_TYPE_IN;
+	gs_device_config_t config;
+	gs_device_bt_const_t bt_const;
+	gs_device_bittiming_t bt = {0};
+	gs_device_mode_t mode = {.mode = GS_CAN_MODE_START, .flags = GS_CAN_FEATURE_HW_TIMESTAMP};
+	uint32_t host_format = 0x0000BEEFu;
+	uint32_t btr = can_btr_table[CAN_1000K];
+
+	for (const char *c = sc->setup; *c; c++)
+	{
+		if ((c[0] == 'S') && (c[1] >= '0') && (c[1] <= '8'))
+			btr = can_btr_table[c[1] - '0'];
+		else if ((c[0] == 'E') && (c[1] == '1'))
+			mode.flags |= GS_CAN_FEATURE_BERR_REPORTING;
+	}
+	bt.prop_seg = 1u;
+	bt.phase_seg1 = CAN_BTR_FIELD_TS1(btr);
+	bt.phase_seg2 = CAN_BTR_FIELD_TS2(btr) + 1u;
+	bt.sjw = CAN_BTR_FIELD_SJW(btr) + 1u;
+	bt.brp = CAN_BTR_FIELD_BRP(btr) + 1u;
+
+	while (!sim_usb_configured())
+	{
+		main_pass();
+	}
+	sim_host_packet_observer = host_packet_observer;
+	sim_host_out_transfer(GS_HOST_FRAME_SIZE);
+	if ((sim_host_control(type_out, GS_USB_BREQ_HOST_FORMAT, 1, (uint8_t *)&host_format, sizeof(host_format)) < 0) ||
+		(sim_host_control(type_in, GS_USB_BREQ_DEVICE_CONFIG, 1, (uint8_t *)&config, sizeof(config)) != sizeof(config)) ||
+		(sim_host_control(type_in, GS_USB_BREQ_BT_CONST, 0, (uint8_t *)&bt_const, sizeof(bt_const)) != sizeof(bt_const)) ||
+		((bt_const.feature & mode.flags) != mode.flags) ||
+		(sim_host_control(type_out, GS_USB_BREQ_BITTIMING, 0, (uint8_t *)&bt, sizeof(bt)) < 0) ||
+		(sim_host_control(type_out, GS_USB_BREQ_MODE, 0, (uint8_t *)&mode, sizeof(mode)) < 0))
+	{
+		printf("%s: gs_usb setup failed\n", sc->name);
+		exit(EXIT_FAILURE);
+	}
+
+	// gs_usb has no requests for them: the setup's 'c' and 'K' lines go
+	// through the SLCAN command handlers, the periodic table is filled as
+	// 'p' would
+	for (const char *c = sc->setup; *c; c = strchr(c, '\r') + 1)
+	{
+		uint8_t line[2u * SIM_LINE_MAX], reply[2u * SIM_LINE_MAX];
+		uint8_t size = (uint8_t)(strchr(c, '\r') + 1 - c), reply_size = 0;
+
+		memcpy(line, c, size);
+		if ((c[0] == 'c') || (c[0] == 'K'))
+			slcan_decode(line, &size, reply, &reply_size);
+	}
+	// a replay holds the host's frames back until it is through
+	host_probe();
+	for (uint8_t n = 0; n < sc->periodic; n++)
+	{
+		can_frame_t frame = {.id = SIM_PERIODIC_ID + n, .dlc = 8, .data = {n}};
+
+		can_periodic_set(n, &frame, sc->periodic_ms, (uint16_t)((sc->periodic_ms * n) / sc->periodic));
+	}
+	if (sc->burst)
+	{
+		uint8_t buf[CAN_BURST_SIZE];
+
+		can_burst_append(buf, burst_records(sc, buf));
+		can_burst_start(sc->burst_repeat);
+	}
+}
+
+static bool host_can_send(void)
+{
+	return run.gs_in_flight != (1u << SIM_GS_ECHO_SLOTS) - 1u;
+}
+
+// Send one frame, stamped with its write time
+static void host_send_frame(void)
+{
+	uint32_t seq = run.tx.frames;
+	gs_host_frame_t hf = {.can_id = SIM_HOST_TX_ID, .can_dlc = 8};
+
+	track_grow(&run.tx, seq);
+	hf.data[0] = (uint8_t)seq;
+	hf.data[1] = (uint8_t)(seq >> 8);
+	hf.data[2] = (uint8_t)(seq >> 16);
+	hf.data[3] = (uint8_t)(seq >> 24);
+	host_send(hf, seq);
+	run.tx.eof[seq] = sim_now;
+	run.tx.frames++;
+	host_out_mark(seq);
+}
+#else
+static void host_observer(const uint8_t *line, uint8_t size, uint64_t at)
+{
+	slcan_message_t message;
+
+	switch (line[0])
+	{
+	case 't':
+	case 'T':
+		if (decode_message(&message, line, size))
+			host_rx(message.data, message.can_dlc, at);
+		return;
+	case 'z':
+	case 'Z':
+		run.host_acks++;
+		return;
+	case '\a':
+		run.host_errors++;
+		return;
+	case 'e':
+		if (decode_message(&message, line, size))
+			host_err(message.can_id, message.data);
+		return;
+	default:
+		return;
+	}
+}
+
+static void host_open(const scenario_t *sc)
+{
+	sim_host_observer = host_observer;
+	sim_host_write((const uint8_t *)sc->setup, (uint32_t)strlen(sc->setup));
+	for (uint8_t n = 0; n < sc->periodic; n++)
+	{
+		char line[2u * SIM_LINE_MAX];
+		int size = snprintf(line, sizeof(line), "p%u%04X%04Xt%03X8%02X00000000000000\r", n, sc->periodic_ms,
+							(sc->periodic_ms * n) / sc->periodic, SIM_PERIODIC_ID + n, n);
+
+		sim_host_write((const uint8_t *)line, (uint32_t)size);
+	}
+	if (sc->burst)
+	{
+		uint8_t buf[CAN_BURST_SIZE];
+		uint16_t len = burst_records(sc, buf);
+		char line[2u * SIM_LINE_MAX];
+
+		// 'HW' takes 30 bytes per line
+		for (uint16_t at = 0; at < len; at += 30u)
+		{
+			int size = sprintf(line, "HW");
+
+			for (uint16_t i = at; (i < len) && (i < at + 30u); i++)
+				size += sprintf(&line[size], "%02X", buf[i]);
+			size += sprintf(&line[size], "\r");
+			sim_host_write((const uint8_t *)line, (uint32_t)size);
+		}
+		sim_host_write((const uint8_t *)line, (uint32_t)sprintf(line, "HR%04X\r", sc->burst_repeat));
+	}
+}
+
+// an application writing at a fixed rate, blocked while the tty is full
+static bool host_can_send(void)
+{
+	return sim_host_pending() < SIM_HOST_BUFFER;
+}
+
+// Queue one frame command on the host side, stamped with its write time
+static void host_send_frame(void)
+{
+	uint32_t seq = run.tx.frames;
+	slcan_message_t message = {.can_id = SIM_HOST_TX_ID | CAN_STD_FRAME, .can_dlc = 8};
+	uint8_t line[SIM_LINE_MAX];
+	uint8_t size;
+
+	track_grow(&run.tx, seq);
+	message.data[0] = (uint8_t)seq;
+	message.data[1] = (uint8_t)(seq >> 8);
+	message.data[2] = (uint8_t)(seq >> 16);
+	message.data[3] = (uint8_t)(seq >> 24);
+	encode_message(&message, line, &size);
+	sim_host_write(line, size);
+	run.tx.eof[seq] = sim_now;
+	run.tx.frames++;
+	host_out_mark(seq);
+}
+#endif /* USB_GS_USB */
+
+static int compare_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static void report_latency(const char *what, track_t *track, uint32_t duration_ms)
+{
+	uint32_t *l = track->latency;
+	uint32_t n = track->count;
+
+	if (n == 0)
+	{
+		printf("  %-4s %8s\n", what, "-");
+		return;
+	}
+	qsort(l, n, sizeof(*l), compare_u32);
+	printf("  %-4s %8.0f fps  latency us  p50 %6.1f  p90 %6.1f  p99 %6.1f  max %6.1f\n",
+		   what, n * 1000.0 / duration_ms, l[n / 2u] / 1000.0, l[(n * 9u) / 10u] / 1000.0,
+		   l[(n * 99u) / 100u] / 1000.0, l[n - 1u] / 1000.0);
+}
+
+// Intervals between the frames of each periodic entry, and how far they are
+// off the period
+static void report_periodic(const scenario_t *sc)
+{
+	uint32_t *l = run.periodic.latency;
+	uint32_t n = run.periodic.count;
+	uint32_t period = (uint32_t)SIM_MS(sc->periodic_ms);
+	uint32_t jitter;
+
+	if (n == 0)
+	{
+		printf("  per  %8s\n", "-");
+		return;
+	}
+	qsort(l, n, sizeof(*l), compare_u32);
+	jitter = ((period - l[0]) > (l[n - 1u] - period)) ? (period - l[0]) : (l[n - 1u] - period);
+	printf("  per  %8u frames  interval us  min %8.1f  p50 %8.1f  max %8.1f  jitter %6.1f  late %u\n",
+		   n + sc->periodic, l[0] / 1000.0, l[n / 2u] / 1000.0, l[n - 1u] / 1000.0, jitter / 1000.0,
+		   can_periodic_late());
+}
+
+// What the adapter reports for the replay next to what the bus saw
+static void report_burst(const scenario_t *sc)
+{
+	can_burst_stats_t stats;
+	uint64_t span = run.burst_last - run.burst_first;
+
+	can_burst_stats(&stats);
+	printf("  burst %u bytes  sent %u of %u  %u fps (bus %.0f fps)  arbitration lost %u  failed %u"
+		   "  out of order %u%s\n",
+		   stats.used, stats.sent, (unsigned)sc->burst * sc->burst_repeat, stats.fps,
+		   span ? (run.burst_frames - 1u) * 1e9 / (double)span : 0.0, stats.arb_lost, stats.failed,
+		   run.burst_disorder, stats.running ? "  (still running)" : "");
+}
+
+// One generator per identifier, sharing the load equally. The payload after
+// the sequence number is a fixed pattern, so the stuff bits of the sample
+// frame used for the rate are close to the real ones.
+static void gens_start(const scenario_t *sc)
+{
+	for (uint8_t g = 0; g < sc->ids; g++)
+	{
+		sim_gen_t gen = {.repeat = sc->repeat};
+
+		gen_frame(sc, g, &gen.frame);
+
+		uint64_t frame_ns = (uint64_t)sim_can_frame_bits(&gen.frame) * sim_can_bit_ns();
+		uint64_t period = (frame_ns * 100u * sc->ids) / sc->load;
+
+		// release times spread +-1/16 of the period around the average
+		gen.period = period - period / 16u;
+		gen.jitter = (uint32_t)(period / 8u);
+		sim_bus_add_gen(&gen, sim_now + (period * g) / sc->ids);
+	}
+}
+
+static bool scenario_run(const scenario_t *sc)
+{
+	uint64_t start, stop, end;
+	uint64_t host_next;
+	uint64_t error_next, error_stop;
+	uint64_t busy, busy_stop = 0;
+	uint16_t load_instant, load_second = 0, load_peak = 0;
+	uint32_t lost;
+	uint32_t in_bytes;
+	double elapsed;
+	bool ok = true;
+	can_change_stats_t change;
+
+	memset(&run, 0, sizeof(run));
+	sim_reset();
+	sim_bus_observer = bus_observer;
+	sim_host_out_observer = host_out_observer;
+	run.burst_records = sc->burst;
+	run.sc = sc;
+	sim_host_stall(SIM_MS(sc->stall_every_ms), SIM_MS(sc->stall_ms));
+
+	main_setup();
+	host_open(sc);
+
+	start = SIM_MS(SIM_SETUP_MS);
+	stop = start + SIM_MS(sc->duration_ms);
+	end = stop + SIM_MS(SIM_DRAIN_MS);
+	host_next = start;
+	error_next = start;
+	error_stop = start + SIM_MS(sc->error_ms);
+
+	while (sim_now < start)
+	{
+		main_pass();
+	}
+	// count from the start of the traffic
+	memset(&sim_cpu_stats, 0, sizeof(sim_cpu_stats));
+	can_stats_reset();
+	memset(&usb_stats, 0, sizeof(usb_stats));
+	memset(&sim_usb_stats, 0, sizeof(sim_usb_stats));
+	busy = sim_bus_busy_ns();
+	if (sc->load)
+		gens_start(sc);
+
+	while (sim_now < end)
+	{
+		if (sim_now >= stop)
+		{
+			if (!busy_stop)
+			{
+				busy_stop = sim_bus_busy_ns();
+				// what the adapter reports for the last second of traffic
+				can_load_get(&load_instant, &load_second, &load_peak);
+			}
+			sim_bus_stop_gens();
+		}
+		else if (sc->host_fps)
+		{
+			// an application writing at a fixed rate, blocked while it can't
+			while ((host_next <= sim_now) && host_can_send())
+			{
+				host_send_frame();
+				host_next += 1000000000u / sc->host_fps;
+			}
+		}
+		while (sc->error_every_us && (error_next <= sim_now) && (error_next < error_stop))
+		{
+			sim_can_error(sc->error_lec, sc->error_tx);
+			run.errors++;
+			error_next += SIM_NS(sc->error_every_us);
+		}
+		main_pass();
+	}
+
+	lost = run.rx.frames - run.rx.count;
+	in_bytes = sim_usb_stats.in_bytes;
+	printf("%s: %u kbit/s\n", sc->name, (unsigned)(1000000u / sim_can_bit_ns()));
+	printf("  bus  load %5.1f%%  frames %7u  to host %7u  lost %5u"
+		   "  (fifo overrun %u, queue full %u, duplicates %u)\n",
+		   (double)(busy_stop - busy) * 100.0 / (double)(stop - start),
+		   run.rx.frames, run.rx.count, lost,
+		   can_rx_stats.overrun[0] + can_rx_stats.overrun[1], can_rx_stats.dropped, run.duplicates);
+	printf("  load reported %5.1f%%  peak %5.1f%%\n", load_second / 10.0, load_peak / 10.0);
+	report_latency("rx", &run.rx, sc->duration_ms);
+	printf("  usb  in %6u packets %7.1f kB/s  out %6u packets  %u NAKs  rx queue high water %u\n",
+		   sim_usb_stats.in_packets, in_bytes / (double)sc->duration_ms, sim_usb_stats.out_packets,
+		   sim_usb_stats.out_naks, can_rx_stats.high_water);
+	elapsed = (double)(sim_now - start);
+	printf("  cpu  main loop %5.1f%%  interrupts %5.1f%%  asleep %5.1f%%\n",
+		   (double)sim_cpu_stats.thread_ns * 100.0 / elapsed, (double)sim_cpu_stats.isr_ns * 100.0 / elapsed,
+		   (elapsed - (double)sim_cpu_stats.thread_ns - (double)sim_cpu_stats.isr_ns) * 100.0 / elapsed);
+	if (sc->host_fps)
+	{
+		report_latency("tx", &run.tx, sc->duration_ms);
+		report_latency("sof", &run.out, sc->duration_ms);
+		printf("  tx   written %u  sent %u  acks %u  errors %u  rejected %u  out of order %u  tx queue high water %u\n",
+			   run.tx.frames, can_tx_stats.sent, run.host_acks, run.host_errors,
+			   can_tx_stats.rejected, run.tx_disorder, can_tx_stats.high_water);
+	}
+
+	if (sc->periodic)
+		report_periodic(sc);
+	if (sc->burst)
+		report_burst(sc);
+	for (uint8_t n = 0; n < CAN_LIMIT_MAX; n++)
+	{
+		can_limit_rule_t rule;
+
+		can_limit_get(n, &rule);
+		if (rule.rate)
+			printf("  limit  rule %u  %u fps  passed %u  suppressed %u\n", n, rule.rate, rule.passed,
+				   rule.suppressed);
+	}
+	can_change_stats(&change);
+	if (change.enabled)
+		printf("  change  cached %u ids  suppressed %u  evicted %u  keep-alive %u ms\n",
+			   change.used, change.suppressed, change.evictions, change.keepalive_ms);
+	if (sc->error_every_us)
+		printf("  err  injected %u  reports %u for %u events  (bus-off %u, restarted %u, passive %u, protocol %u)\n",
+			   run.errors, run.err_reports, run.err_events, run.err_busoff, run.err_restarted,
+			   run.err_passive, run.err_prot);
+
+#ifdef USB_GS_USB
+	ok = host_check();
+#endif
+	if (run.tx_disorder)
+	{
+		printf("  FAIL: %u frames of the host overtaken on the bus\n", run.tx_disorder);
+		ok = false;
+	}
+	if (lost > sc->max_lost)
+	{
+		printf("  FAIL: lost %u frames, at most %u allowed\n", lost, sc->max_lost);
+		ok = false;
+	}
+	return ok;
+}
+
+int main(int argc, char **argv)
+{
+	int failed = 0;
+
+	for (size_t i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++)
+	{
+		bool selected = argc < 2;
+		pid_t pid;
+		int status;
+
+		for (int a = 1; a < argc; a++)
+			if (strcmp(argv[a], scenarios[i].name) == 0)
+				selected = true;
+		if (!selected)
+			continue;
+
+		// the firmware keeps its state in statics, every scenario gets a
+		// fresh copy in its own process
+		fflush(stdout);
+		pid = fork();
+		if (pid == 0)
+			exit(scenario_run(&scenarios[i]) ? EXIT_SUCCESS : EXIT_FAILURE);
+		if ((pid < 0) || (waitpid(pid, &status, 0) < 0) || !WIFEXITED(status) ||
+			(WEXITSTATUS(status) != EXIT_SUCCESS))
+			failed++;
+	}
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
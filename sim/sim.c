@@ -0,0 +1,564 @@
+/*
+ * sim.c
+ *
+ *  Simulated clock, interrupt delivery and the small peripherals (SysTick,
+ *  timers, GPIO, RCC) the firmware touches.
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <libopencm3/cm3/cortex.h>
+#include <libopencm3/cm3/nvic.h>
+#include <libopencm3/cm3/systick.h>
+#include <libopencm3/stm32/crs.h>
+#include <libopencm3/stm32/desig.h>
+#include <libopencm3/stm32/gpio.h>
+#include <libopencm3/stm32/rcc.h>
+#include <libopencm3/stm32/timer.h>
+#include "sim.h"
+
+uint64_t sim_now;
+
+static uint32_t random_state = 1u;
+
+/* cycles of the 48 MHz core clock since the start of the simulation */
+static uint64_t sim_cycles(void)
+{
+	return (sim_now * (SIM_CPU_HZ / 1000000u)) / 1000u;
+}
+
+sim_cpu_stats_t sim_cpu_stats;
+
+static bool sleeping;	/* in sim_sleep(), the time isn't the main loop's */
+static bool preempting; /* in the sim_step() that ends a piece of main loop work */
+
+static bool timer_alarm(uint64_t until, uint64_t *at);
+static bool thread_mode(void);
+
+// The TIM2 compare interrupt preempts the work in progress when it fires.
+// Work of the main loop is preempted by the other interrupts as well, which
+// run when it is done; an interrupt handler keeps them waiting for the next
+// sim_irq_poll().
+void sim_cpu(uint32_t ns)
+{
+	uint64_t at = 0;
+
+	if (!thread_mode())
+		sim_cpu_stats.isr_ns += ns;
+	else if (!sleeping)
+		sim_cpu_stats.thread_ns += ns;
+
+	while (timer_alarm(sim_now + ns, &at))
+	{
+		ns -= (uint32_t)(at - sim_now);
+		sim_now = at;
+		sim_irq_poll();
+	}
+	sim_now += ns;
+
+	if (thread_mode() && !preempting)
+	{
+		preempting = true;
+		sim_step();
+		preempting = false;
+	}
+}
+
+// WFI: the time passes with the core asleep, interrupts wake it up
+void sim_sleep(uint32_t ns)
+{
+	sleeping = true;
+	sim_cpu(ns);
+	sleeping = false;
+}
+
+uint32_t sim_random(void)
+{
+	// xorshift32, the scenarios have to be reproducible
+	random_state ^= random_state << 13;
+	random_state ^= random_state >> 17;
+	random_state ^= random_state << 5;
+	return random_state;
+}
+
+/* {{{ interrupts */
+
+// Handlers the firmware doesn't define, like the libopencm3 vector table
+static void null_handler(void)
+{
+}
+
+void cec_can_isr(void) __attribute__((weak, alias("null_handler")));
+void usb_isr(void) __attribute__((weak, alias("null_handler")));
+void tim2_isr(void) __attribute__((weak, alias("null_handler")));
+void tim3_isr(void) __attribute__((weak, alias("null_handler")));
+void tim14_isr(void) __attribute__((weak, alias("null_handler")));
+void sys_tick_handler(void) __attribute__((weak, alias("null_handler")));
+
+typedef struct
+{
+	void (*handler)(void);
+	bool (*line)(void); /* level of the peripheral request, NULL if none */
+} sim_irq_t;
+
+static bool tim2_irq_line(void);
+
+static const sim_irq_t irq_table[NVIC_IRQ_COUNT] = {
+	[NVIC_TIM2_IRQ] = {tim2_isr, tim2_irq_line},
+	[NVIC_TIM3_IRQ] = {tim3_isr, NULL},
+	[NVIC_TIM14_IRQ] = {tim14_isr, NULL},
+	[NVIC_CEC_CAN_IRQ] = {cec_can_isr, sim_can_irq_line},
+	[NVIC_USB_IRQ] = {usb_isr, sim_usb_irq_line},
+};
+
+static struct
+{
+	bool enabled[NVIC_IRQ_COUNT];
+	bool pending[NVIC_IRQ_COUNT];
+	uint8_t priority[NVIC_IRQ_COUNT];
+	bool masked;
+	bool active; /* a handler runs, handlers don't nest */
+} nvic;
+
+static bool thread_mode(void)
+{
+	return !nvic.active;
+}
+
+static bool irq_requested(uint8_t irqn)
+{
+	if (nvic.pending[irqn])
+		return true;
+	return (irq_table[irqn].line != NULL) && irq_table[irqn].line();
+}
+
+// Run every pending, enabled interrupt, highest priority first. The firmware
+// can't be interrupted halfway through a statement here, so interrupts run
+// when it makes them pending or enables them, and between main loop passes.
+void sim_irq_poll(void)
+{
+	if (nvic.active || nvic.masked)
+		return;
+
+	// a request that stays asserted after its handler ran is taken again, up
+	// to a limit so a firmware bug can't hang the simulation
+	for (uint8_t round = 0; round < 16u; round++)
+	{
+		int8_t next = -1;
+
+		for (uint8_t irqn = 0; irqn < NVIC_IRQ_COUNT; irqn++)
+		{
+			if (!nvic.enabled[irqn] || (irq_table[irqn].handler == NULL) || !irq_requested(irqn))
+				continue;
+			if ((next < 0) || (nvic.priority[irqn] < nvic.priority[next]))
+				next = (int8_t)irqn;
+		}
+		if (next < 0)
+			return;
+
+		nvic.pending[next] = false;
+		nvic.active = true;
+		sim_cpu(SIM_COST_ISR_NS);
+		irq_table[next].handler();
+		sim_can_settle();
+		sim_usb_settle();
+		nvic.active = false;
+	}
+}
+
+void nvic_enable_irq(uint8_t irqn)
+{
+	nvic.enabled[irqn] = true;
+	sim_irq_poll();
+}
+
+void nvic_disable_irq(uint8_t irqn)
+{
+	nvic.enabled[irqn] = false;
+}
+
+uint8_t nvic_get_irq_enabled(uint8_t irqn)
+{
+	return nvic.enabled[irqn];
+}
+
+void nvic_set_pending_irq(uint8_t irqn)
+{
+	nvic.pending[irqn] = true;
+	sim_irq_poll();
+}
+
+void nvic_clear_pending_irq(uint8_t irqn)
+{
+	nvic.pending[irqn] = false;
+}
+
+// SysTick runs from sim_step(), which only ever comes from the main loop,
+// so its priority makes no difference here
+void nvic_set_priority(uint8_t irqn, uint8_t priority)
+{
+	if (irqn < NVIC_IRQ_COUNT)
+		nvic.priority[irqn] = priority;
+}
+
+void cm_enable_interrupts(void)
+{
+	nvic.masked = false;
+	sim_irq_poll();
+}
+
+void cm_disable_interrupts(void)
+{
+	nvic.masked = true;
+}
+/* }}} */
+
+/* {{{ SysTick */
+static struct
+{
+	uint32_t reg[3]; /* CSR, RVR, CVR */
+	bool counting;
+	bool interrupt;
+	uint64_t next; /* time of the next reload */
+} systick;
+
+static uint64_t systick_period(void)
+{
+	return ((uint64_t)(systick.reg[1] + 1u) * 1000000000u) / SIM_CPU_HZ;
+}
+
+volatile uint32_t *sim_systick_reg(uint32_t offset)
+{
+	systick.reg[2] = systick_get_value();
+	return &systick.reg[offset / 4u];
+}
+
+void systick_set_clocksource(uint8_t clocksource)
+{
+	systick.reg[0] = (systick.reg[0] & ~STK_CSR_CLKSOURCE_AHB) | clocksource;
+}
+
+void systick_set_reload(uint32_t value)
+{
+	systick.reg[1] = value & 0x00FFFFFFu;
+}
+
+uint32_t systick_get_reload(void)
+{
+	return systick.reg[1];
+}
+
+uint32_t systick_get_value(void)
+{
+	if (!systick.counting)
+		return systick.reg[2];
+	// down counter, reloaded at every period boundary
+	return systick.reg[1] - (uint32_t)(sim_cycles() % (systick.reg[1] + 1u));
+}
+
+void systick_counter_enable(void)
+{
+	systick.counting = true;
+	systick.next = sim_now - (sim_now % systick_period()) + systick_period();
+}
+
+void systick_counter_disable(void)
+{
+	systick.counting = false;
+}
+
+void systick_interrupt_enable(void)
+{
+	systick.interrupt = true;
+}
+
+void systick_interrupt_disable(void)
+{
+	systick.interrupt = false;
+}
+
+static void systick_advance(void)
+{
+	if (!systick.counting)
+		return;
+	while (systick.next <= sim_now)
+	{
+		systick.next += systick_period();
+		if (systick.interrupt && !nvic.masked)
+		{
+			nvic.active = true;
+			sim_cpu(SIM_COST_ISR_NS);
+			sys_tick_handler();
+			nvic.active = false;
+		}
+	}
+}
+/* }}} */
+
+/* {{{ timers */
+#define SIM_TIMERS 3u
+#define TIM_DIER_OFFSET (0x0Cu / 4u)
+#define TIM_SR_OFFSET (0x10u / 4u)
+#define TIM_CNT_OFFSET (0x24u / 4u)
+#define TIM_PSC_OFFSET (0x28u / 4u)
+#define TIM_ARR_OFFSET (0x2Cu / 4u)
+#define TIM_CCR1_OFFSET (0x34u / 4u)
+#define SIM_TIMER_CC 2u /* compare channels modelled, from channel 1 on */
+
+static struct
+{
+	uint32_t reg[0x40 / 4u];
+	uint64_t epoch;				   /* time the counter was last zero */
+	uint32_t cc_last[SIM_TIMER_CC]; /* counter when each compare was last checked */
+} timers[SIM_TIMERS];
+
+static uint8_t timer_index(uint32_t timer_peripheral)
+{
+	switch (timer_peripheral)
+	{
+	case TIM3:
+		return 1;
+	case TIM14:
+		return 2;
+	default:
+		return 0;
+	}
+}
+
+static uint32_t timer_count(uint8_t t)
+{
+	uint64_t ticks;
+	uint64_t top = (uint64_t)timers[t].reg[TIM_ARR_OFFSET] + 1u;
+
+	if (!(timers[t].reg[0] & TIM_CR1_CEN))
+		return timers[t].reg[TIM_CNT_OFFSET];
+	ticks = ((sim_now - timers[t].epoch) * (SIM_CPU_HZ / 1000000u)) / 1000u;
+	return (uint32_t)((ticks / ((uint64_t)timers[t].reg[TIM_PSC_OFFSET] + 1u)) % top);
+}
+
+// Set CCxIF if the counter went past CCRx since the last look. Only right
+// for a counter that runs through all 32 bits, like TIM2 does here.
+static void timer_compare(uint8_t t)
+{
+	uint32_t count = timer_count(t);
+
+	for (uint8_t cc = 0; cc < SIM_TIMER_CC; cc++)
+	{
+		uint32_t last = timers[t].cc_last[cc];
+
+		if ((timers[t].reg[0] & TIM_CR1_CEN) &&
+			((uint32_t)(timers[t].reg[TIM_CCR1_OFFSET + cc] - last - 1u) < (uint32_t)(count - last)))
+			timers[t].reg[TIM_SR_OFFSET] |= TIM_SR_CC1IF << cc;
+		timers[t].cc_last[cc] = count;
+	}
+}
+
+static bool tim2_irq_line(void)
+{
+	timer_compare(0);
+	return (timers[0].reg[TIM_SR_OFFSET] & timers[0].reg[TIM_DIER_OFFSET] & (TIM_SR_CC1IF | TIM_SR_CC2IF)) != 0;
+}
+
+// Time of the next enabled TIM2 compare match if it comes before until and
+// its interrupt can be taken then
+static bool timer_alarm(uint64_t until, uint64_t *at)
+{
+	uint64_t psc = (uint64_t)timers[0].reg[TIM_PSC_OFFSET] + 1u;
+	uint64_t now_ticks;
+	bool found = false;
+
+	if (nvic.active || nvic.masked || !nvic.enabled[NVIC_TIM2_IRQ] || !(timers[0].reg[0] & TIM_CR1_CEN))
+		return false;
+	timer_compare(0);
+	now_ticks = ((sim_now - timers[0].epoch) * (SIM_CPU_HZ / 1000000u)) / 1000u / psc;
+
+	for (uint8_t cc = 0; cc < SIM_TIMER_CC; cc++)
+	{
+		uint32_t delta = timers[0].reg[TIM_CCR1_OFFSET + cc] - timer_count(0);
+		uint64_t cycles = (now_ticks + delta) * psc;
+		uint64_t match;
+
+		if (!(timers[0].reg[TIM_DIER_OFFSET] & (TIM_DIER_CC1IE << cc)))
+			continue;
+		// a flag already set is taken at the next poll
+		if (timers[0].reg[TIM_SR_OFFSET] & (TIM_SR_CC1IF << cc))
+			return false;
+		match = timers[0].epoch + (cycles * 1000u + (SIM_CPU_HZ / 1000000u) - 1u) / (SIM_CPU_HZ / 1000000u);
+		if ((match >= sim_now) && (match < until) && (!found || (match < *at)))
+		{
+			*at = match;
+			found = true;
+		}
+	}
+	return found;
+}
+
+volatile uint32_t *sim_timer_reg(uint32_t timer_peripheral, uint32_t offset)
+{
+	uint8_t t = timer_index(timer_peripheral);
+
+	timer_compare(t);
+	timers[t].reg[TIM_CNT_OFFSET] = timer_count(t);
+	return &timers[t].reg[offset / 4u];
+}
+
+void timer_set_prescaler(uint32_t timer_peripheral, uint32_t value)
+{
+	timers[timer_index(timer_peripheral)].reg[TIM_PSC_OFFSET] = value & 0xFFFFu;
+}
+
+void timer_set_period(uint32_t timer_peripheral, uint32_t period)
+{
+	timers[timer_index(timer_peripheral)].reg[TIM_ARR_OFFSET] = period;
+}
+
+void timer_enable_counter(uint32_t timer_peripheral)
+{
+	uint8_t t = timer_index(timer_peripheral);
+
+	timers[t].epoch = sim_now;
+	timers[t].reg[0] |= TIM_CR1_CEN;
+}
+
+void timer_disable_counter(uint32_t timer_peripheral)
+{
+	uint8_t t = timer_index(timer_peripheral);
+
+	timers[t].reg[TIM_CNT_OFFSET] = timer_count(t);
+	timers[t].reg[0] &= ~TIM_CR1_CEN;
+}
+
+void timer_generate_event(uint32_t timer_peripheral, uint32_t event)
+{
+	uint8_t t = timer_index(timer_peripheral);
+
+	if (event & TIM_EGR_UG)
+	{
+		timers[t].epoch = sim_now;
+		timers[t].reg[TIM_CNT_OFFSET] = 0;
+	}
+}
+
+uint32_t timer_get_counter(uint32_t timer_peripheral)
+{
+	return timer_count(timer_index(timer_peripheral));
+}
+
+void timer_set_oc_value(uint32_t timer_peripheral, enum tim_oc_id oc_id, uint32_t value)
+{
+	uint8_t t = timer_index(timer_peripheral);
+
+	// only compare matches from now on count
+	timer_compare(t);
+	timers[t].reg[TIM_CCR1_OFFSET + ((oc_id == TIM_OC2) ? 1u : 0u)] = value;
+}
+
+void timer_enable_irq(uint32_t timer_peripheral, uint32_t irq)
+{
+	timers[timer_index(timer_peripheral)].reg[TIM_DIER_OFFSET] |= irq;
+}
+
+void timer_disable_irq(uint32_t timer_peripheral, uint32_t irq)
+{
+	timers[timer_index(timer_peripheral)].reg[TIM_DIER_OFFSET] &= ~irq;
+}
+
+bool timer_get_flag(uint32_t timer_peripheral, uint32_t flag)
+{
+	uint8_t t = timer_index(timer_peripheral);
+
+	timer_compare(t);
+	return (timers[t].reg[TIM_SR_OFFSET] & flag) != 0;
+}
+
+void timer_clear_flag(uint32_t timer_peripheral, uint32_t flag)
+{
+	timers[timer_index(timer_peripheral)].reg[TIM_SR_OFFSET] &= ~flag;
+}
+/* }}} */
+
+/* {{{ GPIO, clocks and the unique ID */
+static uint16_t gpio_odr[4];
+
+void gpio_set(uint32_t gpioport, uint16_t gpios)
+{
+	gpio_odr[gpioport & 3u] |= gpios;
+}
+
+void gpio_clear(uint32_t gpioport, uint16_t gpios)
+{
+	gpio_odr[gpioport & 3u] &= (uint16_t)~gpios;
+}
+
+void gpio_toggle(uint32_t gpioport, uint16_t gpios)
+{
+	gpio_odr[gpioport & 3u] ^= gpios;
+}
+
+uint16_t gpio_get(uint32_t gpioport, uint16_t gpios)
+{
+	return gpio_odr[gpioport & 3u] & gpios;
+}
+
+void gpio_mode_setup(uint32_t gpioport, uint8_t mode, uint8_t pull_up_down, uint16_t gpios)
+{
+	(void)gpioport;
+	(void)mode;
+	(void)pull_up_down;
+	(void)gpios;
+}
+
+void gpio_set_af(uint32_t gpioport, uint8_t alt_func_num, uint16_t gpios)
+{
+	(void)gpioport;
+	(void)alt_func_num;
+	(void)gpios;
+}
+
+void rcc_periph_clock_enable(enum rcc_periph_clken clken)
+{
+	(void)clken;
+}
+
+void rcc_clock_setup_in_hsi_out_48mhz(void)
+{
+}
+
+void rcc_set_usbclk_source(enum rcc_osc clk)
+{
+	(void)clk;
+}
+
+void crs_autotrim_usb_enable(void)
+{
+}
+
+void desig_get_unique_id(uint32_t *result)
+{
+	result[0] = 0x0036001Fu;
+	result[1] = 0x4E4B5009u;
+	result[2] = 0x20373857u;
+}
+/* }}} */
+
+void sim_step(void)
+{
+	systick_advance();
+	sim_bus_advance(sim_now);
+	sim_host_advance(sim_now);
+	sim_irq_poll();
+}
+
+void sim_reset(void)
+{
+	sim_now = 0;
+	random_state = 1u;
+	memset(&nvic, 0, sizeof(nvic));
+	memset(&sim_cpu_stats, 0, sizeof(sim_cpu_stats));
+	memset(&systick, 0, sizeof(systick));
+	memset(timers, 0, sizeof(timers));
+	for (uint8_t t = 0; t < SIM_TIMERS; t++)
+		timers[t].reg[TIM_ARR_OFFSET] = 0xFFFFu;
+	sim_can_reset();
+	sim_usb_reset();
+}
@@ -0,0 +1,127 @@
+/*
+ * sim.h
+ *
+ *  Host simulation of the adapter: the firmware in src/ and lib/ runs
+ *  unchanged against models of the bxCAN, the USB full-speed device and the
+ *  timers, on a simulated clock. The models live in this directory, the
+ *  libopencm3 headers they stand in for in sim/include.
+ */
+#ifndef SIM_H
+#define SIM_H
+#include <stdint.h>
+#include <stdbool.h>
+
+#define SIM_CPU_HZ 48000000u
+#define SIM_NS(us) ((uint64_t)(us) * 1000u)
+#define SIM_MS(ms) ((uint64_t)(ms) * 1000000u)
+
+/* CPU time charged for firmware work, rough Cortex-M0 figures at 48 MHz.
+ * The models add them to the clock as the firmware calls into them. */
+#define SIM_COST_POLL_NS 2000u	/* one pass of the main loop with nothing to do */
+#define SIM_COST_ISR_NS 1000u	/* interrupt entry, exit and flag handling */
+#define SIM_COST_FRAME_NS 2500u /* moving one frame through a bxCAN mailbox */
+#define SIM_COST_BYTE_NS 250u	/* encoding or parsing one SLCAN byte */
+#define SIM_COST_COPY_NS 80u	/* of it, copying a received byte out of packet memory and into the line buffer */
+
+/* USB full-speed bulk timing: a 64-byte packet and its handshake take about
+ * 53 us of the 12 Mbit/s bus, a NAKed token about 3 us */
+#define SIM_USB_BYTE_NS 700u
+#define SIM_USB_PACKET_NS 8000u
+#define SIM_USB_NAK_NS 3000u
+
+/** @brief  Frame on the virtual CAN bus
+ */
+typedef struct
+{
+	uint32_t id;	 /**< 11 or 29 bit identifier */
+	bool ext;		 /**< extended identifier */
+	bool rtr;		 /**< remote request */
+	uint8_t dlc;	 /**< data length code (0..8) */
+	uint8_t data[8]; /**< payload */
+} sim_frame_t;
+
+/** @brief  Periodic traffic source on the virtual CAN bus
+ */
+typedef struct
+{
+	sim_frame_t frame;	/**< frame sent, the first four data bytes carry a sequence number if it has them */
+	uint64_t period;	/**< ns between two frames */
+	uint32_t jitter;	/**< ns of random delay added to each release */
+	uint16_t repeat;	/**< frames sent with each sequence number, 0 or 1 for a new one every frame */
+} sim_gen_t;
+
+/** @brief  Where the simulated CPU time went
+ */
+typedef struct
+{
+	uint64_t thread_ns; /**< main loop */
+	uint64_t isr_ns;	/**< interrupt handlers */
+} sim_cpu_stats_t;
+
+/* simulated time in ns, advanced by sim_cpu() and the main loop */
+extern uint64_t sim_now;
+extern sim_cpu_stats_t sim_cpu_stats;
+
+void sim_reset(void);
+void sim_cpu(uint32_t ns);
+void sim_sleep(uint32_t ns);
+void sim_step(void);
+void sim_irq_poll(void);
+uint32_t sim_random(void);
+
+/* bxCAN and the virtual bus, sim/bxcan.c */
+void sim_can_reset(void);
+bool sim_can_irq_line(void);
+void sim_can_settle(void);
+void sim_bus_advance(uint64_t until);
+uint32_t sim_can_bit_ns(void);
+uint16_t sim_can_frame_bits(const sim_frame_t *frame);
+uint8_t sim_bus_add_gen(const sim_gen_t *gen, uint64_t start);
+void sim_bus_stop_gens(void);
+uint64_t sim_bus_busy_ns(void);
+void sim_can_error(uint8_t lec, bool tx); /* bxCAN LEC code 1..6 */
+
+/* called by the bus for every frame that completes, with the end of frame
+ * time and whether the adapter sent it */
+extern void (*sim_bus_observer)(const sim_frame_t *frame, uint64_t eof, bool from_device);
+
+/* USB device and the host behind it, sim/usbd.c */
+void sim_usb_reset(void);
+bool sim_usb_irq_line(void);
+void sim_usb_settle(void);
+void sim_host_advance(uint64_t until);
+void sim_host_write(const uint8_t *data, uint32_t len);
+uint32_t sim_host_pending(void);
+uint64_t sim_host_written(void); /* bytes written since the reset */
+void sim_host_stall(uint64_t period, uint64_t length);
+void sim_host_out_transfer(uint16_t size); /* one transfer per that many bytes written */
+bool sim_usb_configured(void);
+int sim_host_control(uint8_t type, uint8_t request, uint16_t value, uint8_t *data, uint16_t len);
+
+/** @brief  USB link counters, host side
+ */
+typedef struct
+{
+	uint32_t in_packets;  /**< packets collected from endpoint 0x82 */
+	uint32_t in_bytes;	  /**< bytes collected from endpoint 0x82 */
+	uint32_t out_packets; /**< packets delivered to endpoint 0x01 */
+	uint32_t out_bytes;	  /**< bytes delivered to endpoint 0x01 */
+	uint32_t out_naks;	  /**< OUT tokens answered with NAK */
+} sim_usb_stats_t;
+
+extern sim_usb_stats_t sim_usb_stats;
+
+/* called for every line the host reads, with the time its packet arrived */
+extern void (*sim_host_observer)(const uint8_t *line, uint8_t size, uint64_t at);
+/* called for every IN packet instead, if set */
+extern void (*sim_host_packet_observer)(const uint8_t *data, uint16_t size, uint64_t at);
+/* called for every OUT packet, with the bytes delivered since the reset and
+ * the end of the packet */
+extern void (*sim_host_out_observer)(uint64_t delivered, uint64_t at);
+
+/* the firmware main loop, split in src/main.c so the simulation can drive it */
+void main_setup(void);
+void main_loop(void);
+bool main_idle(void);
+
+#endif /* SIM_H */
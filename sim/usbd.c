@@ -0,0 +1,543 @@
+/*
+ * usbd.c
+ *
+ *  Model of the st_usbfs device behind the libopencm3 usbd API and of the
+ *  host on the other end of the link, CDC-ACM or gs_usb. The host shares
+ *  one full-speed bus between the two bulk endpoints, collects IN packets as
+ *  soon as they are ready (unless it is stalled), and keeps sending OUT
+ *  packets while it has data, retrying after every NAK. usb_dbuf.c runs
+ *  against a model of the endpoint registers and the packet memory: with
+ *  EP_KIND set the peripheral sends from or receives into the buffer DTOG
+ *  of the endpoint's direction selects, and NAKs while SW_BUF, the other
+ *  DTOG bit, points at the same one.
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libopencm3/usb/usbd.h>
+#include <libopencm3/usb/cdc.h>
+#include <libopencm3/stm32/st_usbfs.h>
+#include "sim.h"
+#include "usb_dbuf.h"
+
+#define SIM_EP_PACKET 64u
+#define SIM_LINE_MAX 64u
+#define SIM_PM_TOP 0xC0u /* after the BTABLE and the control endpoint's buffers */
+
+/* Reserved bits set in the endpoint registers and in the TX counts of the
+ * IN endpoint as the model hands them out. The firmware never writes them,
+ * so one without its marker has been written since. */
+#define CANARY_EP (1u << 31)
+#define CANARY_COUNT (1u << 15)
+
+#define EP_TOGGLE (USB_EP_RX_DTOG | USB_EP_RX_STAT | USB_EP_TX_DTOG | USB_EP_TX_STAT)
+#define EP_RC_W0 (USB_EP_RX_CTR | USB_EP_TX_CTR)
+#define EP_RW (USB_EP_TYPE | USB_EP_KIND | USB_EP_ADDR)
+
+struct _usbd_driver
+{
+	uint8_t unused;
+};
+
+struct _usbd_device
+{
+	uint8_t unused;
+};
+
+const usbd_driver st_usbfs_v2_usb_driver;
+volatile uint32_t sim_usb_bcdr;
+volatile uint32_t sim_usb_btable;
+volatile uint16_t sim_usb_pma[512];
+sim_usb_stats_t sim_usb_stats;
+
+void (*sim_host_observer)(const uint8_t *line, uint8_t size, uint64_t at);
+void (*sim_host_packet_observer)(const uint8_t *data, uint16_t size, uint64_t at);
+void (*sim_host_out_observer)(uint64_t delivered, uint64_t at);
+
+typedef enum
+{
+	XFER_NONE,
+	XFER_IN,
+	XFER_OUT,
+} xfer_t;
+
+static usbd_device device;
+static volatile uint32_t ep_reg[8];
+
+static struct
+{
+	bool attached;
+	bool configured;
+	usbd_set_config_callback set_config;
+	usbd_control_callback control;
+	uint8_t control_type;
+	uint8_t control_mask;
+	usbd_endpoint_callback callback[8];
+	uint8_t out_addr; /* the bulk endpoints, 0x01 and 0x82 for CDC */
+	uint8_t in_addr;
+
+	// endpoint registers as the peripheral holds them, and packet memory
+	uint16_t ep[8];
+	uint16_t pm_top;
+	uint32_t charge; /* ns the firmware spent writing IN packets, not charged yet */
+
+	// bulk OUT endpoint, host to device
+	uint8_t out_buf[SIM_EP_PACKET]; /* the packet on the link */
+	uint16_t out_len;
+
+	// bulk IN endpoint, device to host
+	uint64_t in_ready[2]; /* the firmware finished writing buffer 0 or 1 */
+	uint8_t in_sending;	  /* buffer of the packet on the link */
+
+	// host side
+	xfer_t xfer;
+	uint64_t xfer_done;
+	uint64_t link_free;
+	uint8_t *host_out;
+	uint32_t host_out_len;
+	uint32_t host_out_head;
+	uint32_t host_out_size;
+	uint16_t host_out_max; /* longest OUT transfer, 0 for a stream */
+	uint64_t host_written;
+	uint64_t host_delivered;
+	uint64_t stall_period;
+	uint64_t stall_length;
+	uint8_t line[SIM_LINE_MAX];
+	uint8_t line_len;
+} usb;
+
+/* {{{ endpoint registers and packet memory */
+
+// BTABLE entry of an endpoint: ADDR_TX, COUNT_TX, ADDR_RX, COUNT_RX
+static volatile uint16_t *btable(uint8_t ep)
+{
+	return &sim_usb_pma[((sim_usb_btable & 0xFFF8u) + ep * 8u) / 2u];
+}
+
+static void pma_copy_in(uint16_t pma, const uint8_t *buf, uint16_t len)
+{
+	for (uint16_t i = 0; i < len; i += 2u)
+		sim_usb_pma[(pma + i) / 2u] = (uint16_t)(buf[i] | (((i + 1u) < len) ? (buf[i + 1u] << 8) : 0));
+}
+
+static void pma_copy_out(uint16_t pma, uint8_t *buf, uint16_t len)
+{
+	for (uint16_t i = 0; i < len; i++)
+		buf[i] = (uint8_t)(sim_usb_pma[(pma + i) / 2u] >> ((i & 1u) ? 8u : 0u));
+}
+
+// Apply what the firmware wrote since the registers were handed out: the
+// DTOG and STAT bits toggle where a 1 is written, the CTR bits clear where
+// a 0 is. A TX count written means a packet filled, which cost the time to
+// encode it; it is charged once the firmware runs again.
+static void ep_settle(void)
+{
+	for (uint8_t ep = 0; ep < 8u; ep++)
+	{
+		uint32_t value = ep_reg[ep];
+		uint16_t old = usb.ep[ep];
+
+		if (!(value & CANARY_EP))
+			usb.ep[ep] = (uint16_t)((value & EP_RW) | ((old ^ value) & EP_TOGGLE) | (old & value & EP_RC_W0) |
+									(old & USB_EP_SETUP));
+		ep_reg[ep] = usb.ep[ep] | CANARY_EP;
+	}
+
+	if (!usb.in_addr)
+		return;
+	for (uint8_t buf = 0; buf < 2u; buf++)
+	{
+		volatile uint16_t *count = &btable(usb.in_addr & 0x0Fu)[buf * 2u + 1u];
+
+		if (*count & CANARY_COUNT)
+			continue;
+		usb.charge += (*count & 0x3FFu) * SIM_COST_BYTE_NS;
+		usb.in_ready[buf] = sim_now + usb.charge;
+		*count |= CANARY_COUNT;
+	}
+}
+
+// A change of the peripheral's own, on top of what the firmware wrote
+static void ep_update(uint8_t ep, uint16_t clear, uint16_t set, uint16_t toggle)
+{
+	ep_settle();
+	usb.ep[ep] = (uint16_t)(((usb.ep[ep] & ~clear) | set) ^ toggle);
+	ep_reg[ep] = usb.ep[ep] | CANARY_EP;
+}
+
+void sim_usb_settle(void)
+{
+	uint32_t ns;
+
+	ep_settle();
+	ns = usb.charge;
+	usb.charge = 0;
+	if (ns)
+		sim_cpu(ns);
+}
+
+volatile uint32_t *sim_usb_ep_reg(uint8_t ep)
+{
+	sim_usb_settle();
+	return &ep_reg[ep & 7u];
+}
+
+// Which buffer the peripheral sends next, -1 while it NAKs
+static int8_t ep_in_buffer(void)
+{
+	uint16_t reg = usb.ep[usb.in_addr & 0x0Fu];
+
+	if (!usb.in_addr || ((reg & USB_EP_TX_STAT) != USB_EP_TX_STAT_VALID) || !(reg & USB_EP_KIND))
+		return -1;
+	if (((reg & USB_EP_TX_DTOG) != 0) == ((reg & USB_EP_RX_DTOG) != 0))
+		return -1;
+	return (reg & USB_EP_TX_DTOG) ? 1 : 0;
+}
+
+// Which buffer the peripheral receives into next, -1 while it NAKs
+static int8_t ep_out_buffer(void)
+{
+	uint16_t reg = usb.ep[usb.out_addr & 0x0Fu];
+
+	if (!usb.out_addr || ((reg & USB_EP_RX_STAT) != USB_EP_RX_STAT_VALID) || !(reg & USB_EP_KIND))
+		return -1;
+	if (((reg & USB_EP_RX_DTOG) != 0) == ((reg & USB_EP_TX_DTOG) != 0))
+		return -1;
+	return (reg & USB_EP_RX_DTOG) ? 1 : 0;
+}
+/* }}} */
+
+/* {{{ libopencm3 usbd API */
+usbd_device *usbd_init(const usbd_driver *driver, const struct usb_device_descriptor *dev,
+					   const struct usb_config_descriptor *conf, const char *const *strings,
+					   int num_strings, uint8_t *control_buffer, uint16_t control_buffer_size)
+{
+	(void)driver;
+	(void)dev;
+	(void)conf;
+	(void)strings;
+	(void)num_strings;
+	(void)control_buffer;
+	(void)control_buffer_size;
+
+	usb.attached = true;
+	usb.configured = false;
+	return &device;
+}
+
+int usbd_register_set_config_callback(usbd_device *usbd_dev, usbd_set_config_callback callback)
+{
+	(void)usbd_dev;
+	usb.set_config = callback;
+	return 0;
+}
+
+int usbd_register_control_callback(usbd_device *usbd_dev, uint8_t type, uint8_t type_mask,
+								   usbd_control_callback callback)
+{
+	(void)usbd_dev;
+	usb.control = callback;
+	usb.control_type = type;
+	usb.control_mask = type_mask;
+	return 0;
+}
+
+int sim_host_control(uint8_t type, uint8_t request, uint16_t value, uint8_t *data, uint16_t len)
+{
+	struct usb_setup_data req = {.bmRequestType = type, .bRequest = request, .wValue = value, .wLength = len};
+	uint8_t *buf = data;
+
+	if ((usb.control == NULL) || ((type & usb.control_mask) != usb.control_type))
+		return -1;
+	if (usb.control(&device, &req, &buf, &len, NULL) != USBD_REQ_HANDLED)
+		return -1;
+	// IN requests answer from a buffer of the firmware
+	if ((type & USB_REQ_TYPE_IN) && (buf != data))
+		memcpy(data, buf, len);
+	return len;
+}
+
+// The class requests a CDC host sends after SET_CONFIGURATION, a gs_usb
+// device ignores them
+static void host_open(void)
+{
+	struct usb_cdc_line_coding coding = {.dwDTERate = 115200, .bCharFormat = 0, .bParityType = 0, .bDataBits = 8};
+
+	sim_host_control(USB_REQ_TYPE_CLASS | USB_REQ_TYPE_INTERFACE, USB_CDC_REQ_SET_LINE_CODING, 0,
+					 (uint8_t *)&coding, sizeof(coding));
+	sim_host_control(USB_REQ_TYPE_CLASS | USB_REQ_TYPE_INTERFACE, USB_CDC_REQ_SET_CONTROL_LINE_STATE,
+					 3u, NULL, 0); // DTR, RTS
+}
+
+bool sim_usb_configured(void)
+{
+	return usb.configured;
+}
+
+// USB_ISTR flags the firmware hasn't served yet: a transfer completed, or the
+// bus reset that starts the enumeration
+bool sim_usb_irq_line(void)
+{
+	ep_settle();
+	for (uint8_t ep = 0; ep < 8u; ep++)
+		if (usb.ep[ep] & EP_RC_W0)
+			return true;
+	return usb.attached && !usb.configured && (sim_usb_bcdr & USB_BCDR_DPPU);
+}
+
+void usbd_poll(usbd_device *usbd_dev)
+{
+	// enumeration happens once the pull-up is on
+	if (usb.attached && !usb.configured && (sim_usb_bcdr & USB_BCDR_DPPU))
+	{
+		usb.configured = true;
+		if (usb.set_config)
+			usb.set_config(usbd_dev, 1);
+		host_open();
+	}
+
+	// like libopencm3, CTR_TX is cleared before the callback, CTR_RX is left
+	// to it
+	ep_settle();
+	if (usb.in_addr && (usb.ep[usb.in_addr & 0x0Fu] & USB_EP_TX_CTR))
+	{
+		ep_update(usb.in_addr & 0x0Fu, USB_EP_TX_CTR, 0, 0);
+		if (usb.callback[usb.in_addr & 7u])
+			usb.callback[usb.in_addr & 7u](usbd_dev, usb.in_addr);
+	}
+	if (usb.out_addr && (usb.ep[usb.out_addr & 0x0Fu] & USB_EP_RX_CTR))
+	{
+		// the firmware parses the packet where it is, so only the parsing
+		// is charged, not the copy
+		sim_cpu(usb.out_len * (SIM_COST_BYTE_NS - SIM_COST_COPY_NS));
+		if (usb.callback[usb.out_addr & 7u])
+			usb.callback[usb.out_addr & 7u](usbd_dev, usb.out_addr);
+	}
+}
+
+// Buffers from the packet memory, the endpoint NAKing IN tokens and taking
+// OUT packets, DTOG cleared, like libopencm3
+void usbd_ep_setup(usbd_device *usbd_dev, uint8_t addr, uint8_t type, uint16_t max_size,
+				   usbd_endpoint_callback callback)
+{
+	uint8_t ep = addr & 0x0Fu;
+	volatile uint16_t *bt = btable(ep);
+
+	(void)usbd_dev;
+
+	usb.callback[addr & 7u] = callback;
+	// the notification endpoint of CDC is never used
+	if (type != USB_ENDPOINT_ATTR_BULK)
+		return;
+	ep_settle();
+	if (addr & 0x80u)
+	{
+		usb.in_addr = addr;
+		bt[0] = usb.pm_top;
+		bt[1] = CANARY_COUNT;
+		bt[3] = CANARY_COUNT;
+		usb.ep[ep] = ep | USB_EP_TX_STAT_NAK;
+	}
+	else
+	{
+		usb.out_addr = addr;
+		bt[2] = usb.pm_top;
+		bt[3] = 0x8000u | (uint16_t)(((max_size + 31u) / 32u - 1u) << 10); // 32-byte blocks
+		usb.ep[ep] = ep | USB_EP_RX_STAT_VALID;
+	}
+	usb.pm_top = (uint16_t)(usb.pm_top + max_size);
+	ep_reg[ep] = usb.ep[ep] | CANARY_EP;
+}
+
+void usbd_ep_nak_set(usbd_device *usbd_dev, uint8_t addr, uint8_t nak)
+{
+	(void)usbd_dev;
+	if (addr == usb.out_addr)
+		ep_update(addr & 0x0Fu, USB_EP_RX_STAT, nak ? USB_EP_RX_STAT_NAK : USB_EP_RX_STAT_VALID, 0);
+}
+
+void usbd_ep_stall_set(usbd_device *usbd_dev, uint8_t addr, uint8_t stall)
+{
+	(void)usbd_dev;
+	(void)addr;
+	(void)stall;
+}
+/* }}} */
+
+/* {{{ host */
+static bool host_stalled(uint64_t at)
+{
+	return usb.stall_period && ((at % usb.stall_period) < usb.stall_length);
+}
+
+// Split what the host read into SLCAN lines
+static void host_read(const uint8_t *data, uint16_t len, uint64_t at)
+{
+	for (uint16_t i = 0; i < len; i++)
+	{
+		if (usb.line_len < SIM_LINE_MAX)
+			usb.line[usb.line_len++] = data[i];
+		if ((data[i] == '\r') || (data[i] == '\a'))
+		{
+			if (sim_host_observer)
+				sim_host_observer(usb.line, usb.line_len, at);
+			usb.line_len = 0;
+		}
+	}
+}
+
+// The packet is through: the peripheral moves DTOG on to its other buffer
+// and flags the transfer
+static void host_finish(void)
+{
+	if (usb.xfer == XFER_IN)
+	{
+		uint8_t ep = usb.in_addr & 0x0Fu;
+		volatile uint16_t *bt = btable(ep);
+		uint16_t len = bt[usb.in_sending * 2u + 1u] & 0x3FFu;
+		uint8_t data[SIM_EP_PACKET];
+
+		if (len > SIM_EP_PACKET)
+			len = SIM_EP_PACKET;
+		pma_copy_out(bt[usb.in_sending * 2u], data, len);
+		ep_update(ep, 0, USB_EP_TX_CTR, USB_EP_TX_DTOG);
+		sim_usb_stats.in_packets++;
+		sim_usb_stats.in_bytes += len;
+		if (sim_host_packet_observer)
+			sim_host_packet_observer(data, len, usb.xfer_done);
+		else
+			host_read(data, len, usb.xfer_done);
+	}
+	else if (usb.xfer == XFER_OUT)
+	{
+		uint8_t ep = usb.out_addr & 0x0Fu;
+		volatile uint16_t *bt = btable(ep);
+		uint8_t buf;
+
+		ep_settle();
+		buf = (usb.ep[ep] & USB_EP_RX_DTOG) ? 1u : 0u;
+		pma_copy_in(bt[buf * 2u], usb.out_buf, usb.out_len);
+		bt[buf * 2u + 1u] = (uint16_t)((bt[buf * 2u + 1u] & ~0x3FFu) | usb.out_len);
+		ep_update(ep, 0, USB_EP_RX_CTR, USB_EP_RX_DTOG);
+		sim_usb_stats.out_packets++;
+		sim_usb_stats.out_bytes += usb.out_len;
+		usb.host_delivered += usb.out_len;
+		if (sim_host_out_observer)
+			sim_host_out_observer(usb.host_delivered, usb.xfer_done);
+	}
+	usb.xfer = XFER_NONE;
+	usb.link_free = usb.xfer_done;
+}
+
+void sim_host_advance(uint64_t until)
+{
+	while (1)
+	{
+		if (usb.xfer != XFER_NONE)
+		{
+			if (usb.xfer_done > until)
+				return;
+			host_finish();
+		}
+		if (usb.link_free > until)
+			return;
+
+		uint64_t at = usb.link_free;
+		uint32_t pending = usb.host_out_len - usb.host_out_head;
+		int8_t in_buf;
+
+		ep_settle();
+		in_buf = ep_in_buffer();
+		if (usb.configured && (in_buf >= 0) && (usb.in_ready[in_buf] > at))
+		{
+			// a packet still being written goes out once it is complete
+			usb.link_free = usb.in_ready[in_buf];
+			continue;
+		}
+		if (usb.configured && (in_buf >= 0) && !host_stalled(at))
+		{
+			usb.xfer = XFER_IN;
+			usb.in_sending = (uint8_t)in_buf;
+			usb.xfer_done = at + SIM_USB_PACKET_NS +
+							(uint64_t)(btable(usb.in_addr & 0x0Fu)[in_buf * 2u + 1u] & 0x3FFu) * SIM_USB_BYTE_NS;
+		}
+		else if (usb.configured && pending && (ep_out_buffer() < 0))
+		{
+			sim_usb_stats.out_naks++;
+			usb.link_free = at + SIM_USB_NAK_NS;
+		}
+		else if (usb.configured && pending)
+		{
+			uint16_t max = usb.host_out_max ? usb.host_out_max : SIM_EP_PACKET;
+
+			usb.out_len = (uint16_t)((pending < max) ? pending : max);
+			memcpy(usb.out_buf, &usb.host_out[usb.host_out_head], usb.out_len);
+			usb.host_out_head += usb.out_len;
+			usb.xfer = XFER_OUT;
+			usb.xfer_done = at + SIM_USB_PACKET_NS + (uint64_t)usb.out_len * SIM_USB_BYTE_NS;
+		}
+		else
+		{
+			// nothing to move, look again at the next step
+			usb.link_free = until + 1u;
+			return;
+		}
+	}
+}
+
+void sim_host_write(const uint8_t *data, uint32_t len)
+{
+	// compact what has been sent before growing the buffer
+	if (usb.host_out_head)
+	{
+		memmove(usb.host_out, &usb.host_out[usb.host_out_head], usb.host_out_len - usb.host_out_head);
+		usb.host_out_len -= usb.host_out_head;
+		usb.host_out_head = 0;
+	}
+	if (usb.host_out_len + len > usb.host_out_size)
+	{
+		usb.host_out_size = (usb.host_out_len + len) * 2u;
+		usb.host_out = realloc(usb.host_out, usb.host_out_size);
+		if (usb.host_out == NULL)
+			abort();
+	}
+	memcpy(&usb.host_out[usb.host_out_len], data, len);
+	usb.host_out_len += len;
+	usb.host_written += len;
+}
+
+uint32_t sim_host_pending(void)
+{
+	return usb.host_out_len - usb.host_out_head;
+}
+
+uint64_t sim_host_written(void)
+{
+	return usb.host_written;
+}
+
+void sim_host_out_transfer(uint16_t size)
+{
+	usb.host_out_max = size;
+}
+
+void sim_host_stall(uint64_t period, uint64_t length)
+{
+	usb.stall_period = period;
+	usb.stall_length = length;
+}
+/* }}} */
+
+void sim_usb_reset(void)
+{
+	free(usb.host_out);
+	memset(&usb, 0, sizeof(usb));
+	memset(&sim_usb_stats, 0, sizeof(sim_usb_stats));
+	memset((void *)sim_usb_pma, 0, sizeof(sim_usb_pma));
+	for (uint8_t ep = 0; ep < 8u; ep++)
+		ep_reg[ep] = CANARY_EP;
+	usb.pm_top = SIM_PM_TOP;
+	sim_usb_btable = 0;
+	sim_usb_bcdr = 0;
+}
@@ -46,22 +46,49 @@
 #include <libopencm3/stm32/gpio.h>
 #include <libopencm3/stm32/crs.h>
 #include <libopencm3/stm32/timer.h>
+#include <libopencm3/cm3/cortex.h>
 #include <libopencm3/cm3/nvic.h>
 #include <libopencm3/cm3/systick.h>
 #include "ring.h"
+#include "spsc.h"
 #include "board.h"
 #include "slcan.h"
 #include "usb.h"
 #include "can.h"
+#include "timestamp.h"
+#include "busload.h"
+#ifdef USB_GS_USB
+#include "gs_usb.h"
+#endif
 // }}}
 
 // {{{ global variables
 #ifdef USE_RING_BUFFER
-#define BUFFER_SIZE 256u
-struct ring input_ring, output_ring;
+#define BUFFER_SIZE 256u /* must be a power of two */
+struct spsc input_ring, output_ring;
 uint8_t input_ring_buffer[BUFFER_SIZE], output_ring_buffer[BUFFER_SIZE];
 #endif
 volatile uint32_t ticks;
+// }}}
+
+// {{{ interrupt priorities
+// The Cortex-M0 keeps the top two bits of a priority, lower runs first. CAN
+// and TIM2 share the top level: the bxCAN FIFOs hold three frames, and the
+// periodic and burst tables count on neither interrupt preempting the other.
+// USB comes next, so serving the host never makes a FIFO overrun, then
+// SysTick. The main loop encodes frames below all of them.
+#define IRQ_PRIORITY_CAN 0x00u
+#define IRQ_PRIORITY_USB 0x40u
+#define IRQ_PRIORITY_SYSTICK 0x80u
+// }}}
+
+static void irq_setup(void)
+{
+    nvic_set_priority(NVIC_CEC_CAN_IRQ, IRQ_PRIORITY_CAN);
+    nvic_set_priority(NVIC_TIM2_IRQ, IRQ_PRIORITY_CAN);
+    nvic_set_priority(NVIC_USB_IRQ, IRQ_PRIORITY_USB);
+    nvic_set_priority(NVIC_SYSTICK_IRQ, IRQ_PRIORITY_SYSTICK);
+}
 
 static void clock_setup(void)
 {
@@ -92,39 +119,154 @@ static void systick_setup(void)
 void sys_tick_handler(void)
 {
     ++ticks;
+    can_load_tick();
+}
+
+#ifndef USB_GS_USB
+// Encode queued CAN frames and send them to the host. A frame stays queued
+// while the IN endpoint is busy, so nothing is lost as long as the queue has
+// room; can_rx_stats counts what the interrupt had to drop. The USB
+// interrupt is held off for one frame at a time, never longer: the commands
+// it runs may reset the queue, which must not happen between the peek and
+// the release.
+static void can_rx_forward(void)
+{
+    const can_frame_t *frame;
+    bool sent;
+
+    do
+    {
+        nvic_disable_irq(NVIC_USB_IRQ);
+        frame = can_rx_peek();
+        sent = (frame != NULL) && slcan_encode(frame->id, frame->dlc, frame->data, can_rx_timestamp(frame));
+        if (sent)
+            can_rx_release();
+        nvic_enable_irq(NVIC_USB_IRQ);
+    } while (sent);
 }
 
+// Send latched bus errors and state changes as one error frame, at most every
+// CAN_ERR_REPORT_MS so an error storm can't crowd out the data frames. A
+// report the IN endpoint can't take yet is kept for the next pass.
+static void can_err_forward(void)
+{
+    static can_frame_t report;
+    static uint32_t report_stamp;
+    static uint32_t report_tick;
+    static bool report_pending;
+
+    if (!report_pending)
+    {
+        if ((uint32_t)(ticks - report_tick) < CAN_ERR_REPORT_MS)
+            return;
+        if (!can_err_take(&report, &report_stamp))
+            return;
+        report_pending = true;
+        report_tick = ticks;
+    }
+    nvic_disable_irq(NVIC_USB_IRQ);
+    if (slcan_encode(report.id, report.dlc, report.data, report_stamp))
+        report_pending = false;
+    nvic_enable_irq(NVIC_USB_IRQ);
+}
+#endif
+
 void delay_125ms(void)
 {
     for (uint32_t i = 0u; i < 1000000u; i++)
         __asm__("");
 }
 
-int main(void)
+// Bring up the clocks, the time stamp timer, USB and CAN
+void main_setup(void)
 {
     clock_setup();
+    irq_setup();
     systick_setup();
+    timestamp_setup();
     gpio_setup();
 
+#ifdef USE_RING_BUFFER
+    spsc_init(&input_ring, input_ring_buffer, BUFFER_SIZE);
+    spsc_init(&output_ring, output_ring_buffer, BUFFER_SIZE);
+#endif
+#ifdef USB_GS_USB
+    gs_usb_init();
+#else
     usb_init();
-    can_setup(0);
+#endif
+    can_setup(CAN_500K);
 
     delay_125ms();
     gpio_set(PWR_LED_PORT, PWR_LED_PIN);
+}
 
-    while (1)
-    {
-        usb_loop();
-        // usbd_poll(usbd_dev);
+// One pass of the main loop, also called by the host simulation in sim/
+void main_loop(void)
+{
+#ifdef USB_GS_USB
+    gs_usb_loop();
+#else
+    usb_loop();
+    slcan_clock(timestamp_now());
+    can_rx_forward();
+    can_err_forward();
+    nvic_disable_irq(NVIC_USB_IRQ);
+    usb_flush(can_rx_depth() == 0);
+    nvic_enable_irq(NVIC_USB_IRQ);
+#endif
 #ifdef USE_RING_BUFFER
-        // put up to 64 pending bytes into the USB send packet buffer
-        uint8_t buf[64];
-        int len = ring_read(&input_ring, buf, sizeof buf);
-        if (len > 0)
-        {
-            usbd_ep_write_packet(usbd_dev, 0x82, buf, len);
-            // buf[len] = 0;
-        }
+    uint8_t *span;
+    uint32_t len;
+
+    // execute whatever the host has sent so far, straight from the ring
+    len = spsc_read_peek(&output_ring, &span);
+    if (len > 0)
+    {
+        slcan_receive(span, (uint16_t)len);
+        spsc_read_commit(&output_ring, len);
+    }
+
+    // put up to 64 pending bytes into the USB send packet buffer; they
+    // stay in the ring until the endpoint has accepted them
+    len = spsc_read_peek(&input_ring, &span);
+    if (len > 64)
+        len = 64;
+    nvic_disable_irq(NVIC_USB_IRQ);
+    if ((len > 0) && (usb_write(span, (uint16_t)len) == len))
+    {
+        spsc_read_commit(&input_ring, len);
+    }
+    nvic_enable_irq(NVIC_USB_IRQ);
 #endif
+}
+
+// True if the main loop has nothing to do until an interrupt brings more: a
+// received frame, an IN packet the host collected, or the SysTick that a
+// USB latency flush or a rate limited error report waits for
+bool main_idle(void)
+{
+#ifdef USB_GS_USB
+    return gs_usb_idle();
+#else
+    return usb_idle();
+#endif
+}
+
+#ifndef SIMULATION
+int main(void)
+{
+    main_setup();
+
+    while (1)
+    {
+        main_loop();
+        // an interrupt taken after the check still ends the WFI, it only
+        // runs once they are unmasked again
+        cm_disable_interrupts();
+        if (main_idle())
+            __asm__ volatile("wfi");
+        cm_enable_interrupts();
     }
 }
+#endif
@@ -0,0 +1,235 @@
+/*
+ * test_binary.c
+ *
+ *  COBS framing and the binary records of the 'B' mode: encoded blocks have
+ *  no zero before the delimiter and decode to what went in, malformed ones
+ *  are refused, and records round-trip every kind of frame the host may
+ *  send while out-of-range identifiers and stray flags are rejected.
+ *
+ *  Run with:  pio test -e test
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unity.h>
+#include "slcan.h"
+#include "binary.h"
+
+#define COBS_IN_MAX 253u /* cobs_encode() takes less than 254 bytes */
+
+static uint8_t encoded[COBS_IN_MAX + 2u];
+
+void setUp(void)
+{
+    memset(encoded, 0xEE, sizeof(encoded));
+}
+
+void tearDown(void)
+{
+}
+
+/* encode, check the framing, decode in place and compare */
+static void assert_cobs_round_trip(const uint8_t *in, uint8_t size)
+{
+    uint8_t n = cobs_encode(in, size, encoded);
+
+    TEST_ASSERT_EQUAL_UINT8(size + 2u, n);
+    TEST_ASSERT_EQUAL_HEX8(0x00, encoded[n - 1u]);
+    for (uint8_t i = 0; i < n - 1u; i++)
+        TEST_ASSERT_TRUE(encoded[i] != 0u);
+
+    TEST_ASSERT_EQUAL_UINT8(size, cobs_decode(encoded, (uint8_t)(n - 1u)));
+    TEST_ASSERT_EQUAL_MEMORY(in, encoded, size);
+}
+
+static void test_cobs_no_zeros(void)
+{
+    const uint8_t in[] = {0x11, 0x22, 0x33, 0x44};
+    const uint8_t expected[] = {0x05, 0x11, 0x22, 0x33, 0x44, 0x00};
+
+    TEST_ASSERT_EQUAL_UINT8(sizeof(expected), cobs_encode(in, sizeof(in), encoded));
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(expected, encoded, sizeof(expected));
+    assert_cobs_round_trip(in, sizeof(in));
+}
+
+/* zeros at the start, the end, back to back and nothing but zeros */
+static void test_cobs_zero_bytes(void)
+{
+    const uint8_t in[] = {0x00, 0x11, 0x00, 0x00, 0x22, 0x00};
+    const uint8_t expected[] = {0x01, 0x02, 0x11, 0x01, 0x02, 0x22, 0x01, 0x00};
+    const uint8_t zeros[8] = {0};
+
+    TEST_ASSERT_EQUAL_UINT8(sizeof(expected), cobs_encode(in, sizeof(in), encoded));
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(expected, encoded, sizeof(expected));
+    assert_cobs_round_trip(in, sizeof(in));
+    assert_cobs_round_trip(zeros, sizeof(zeros));
+    assert_cobs_round_trip(zeros, 1);
+}
+
+/* the longest input makes the longest run an encoder can write, a code
+ * byte of 0xFE; a decoder has to take the 0xFF run of 254 bytes too, which
+ * has no implicit zero after it */
+static void test_cobs_long_run(void)
+{
+    uint8_t in[COBS_IN_MAX];
+    uint8_t block[255];
+
+    for (uint8_t i = 0; i < COBS_IN_MAX; i++)
+        in[i] = (uint8_t)(i + 1u);
+    TEST_ASSERT_EQUAL_UINT8(COBS_IN_MAX + 2u, cobs_encode(in, COBS_IN_MAX, encoded));
+    TEST_ASSERT_EQUAL_HEX8(0xFE, encoded[0]);
+    assert_cobs_round_trip(in, COBS_IN_MAX);
+
+    // a zero after a long run starts a new block
+    in[COBS_IN_MAX - 1u] = 0u;
+    assert_cobs_round_trip(in, COBS_IN_MAX);
+
+    block[0] = 0xFF;
+    for (uint8_t i = 1; i < 255u; i++)
+        block[i] = i;
+    TEST_ASSERT_EQUAL_UINT8(254, cobs_decode(block, 255));
+    for (uint8_t i = 0; i < 254u; i++)
+        TEST_ASSERT_EQUAL_HEX8(i + 1u, block[i]);
+}
+
+static void test_cobs_malformed(void)
+{
+    uint8_t zero_code[] = {0x03, 0x11, 0x22, 0x00, 0x33};
+    uint8_t zero_first[] = {0x00, 0x11};
+    uint8_t short_run[] = {0x05, 0x11, 0x22, 0x33};
+    uint8_t short_second[] = {0x02, 0x11, 0x04, 0x22, 0x33};
+    uint8_t short_long_run[254];
+
+    TEST_ASSERT_EQUAL_UINT8(0, cobs_decode(zero_code, sizeof(zero_code)));
+    TEST_ASSERT_EQUAL_UINT8(0, cobs_decode(zero_first, sizeof(zero_first)));
+    TEST_ASSERT_EQUAL_UINT8(0, cobs_decode(short_run, sizeof(short_run)));
+    TEST_ASSERT_EQUAL_UINT8(0, cobs_decode(short_second, sizeof(short_second)));
+    memset(short_long_run, 0x11, sizeof(short_long_run));
+    short_long_run[0] = 0xFF;
+    TEST_ASSERT_EQUAL_UINT8(0, cobs_decode(short_long_run, sizeof(short_long_run)));
+}
+
+/* pack, check the layout, then unpack what the host would send */
+static void assert_record_round_trip(const slcan_message_t *message, const uint8_t *expected, uint8_t size)
+{
+    uint8_t record[SLCAN_BIN_RECORD_MAX];
+    slcan_message_t out;
+
+    memset(&out, 0xEE, sizeof(out));
+    TEST_ASSERT_EQUAL_UINT8(size, binary_pack(message, NULL, record));
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(expected, record, size);
+    TEST_ASSERT_TRUE(binary_unpack(&out, record, size));
+    TEST_ASSERT_EQUAL_HEX32(message->can_id, out.can_id);
+    TEST_ASSERT_EQUAL_UINT8(message->can_dlc, out.can_dlc);
+    if (!(message->can_id & CAN_RTR_FRAME))
+        TEST_ASSERT_EQUAL_MEMORY(message->data, out.data, message->can_dlc);
+}
+
+static void test_record_std(void)
+{
+    const slcan_message_t message = {.can_id = CAN_STD_FRAME | 0x7FFu, .can_dlc = 8,
+                                     .data = {0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07}};
+    const uint8_t expected[] = {0x08, 0xFF, 0x07, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07};
+    const slcan_message_t empty = {.can_id = 0x123u, .can_dlc = 0, .data = {0}};
+    const uint8_t expected_empty[] = {0x00, 0x23, 0x01};
+
+    assert_record_round_trip(&message, expected, sizeof(expected));
+    assert_record_round_trip(&empty, expected_empty, sizeof(expected_empty));
+}
+
+static void test_record_xtd(void)
+{
+    const slcan_message_t message = {.can_id = CAN_XTD_FRAME | 0x1FFFFFFFu, .can_dlc = 3, .data = {0xAA, 0x00, 0x55}};
+    const uint8_t expected[] = {0x13, 0xFF, 0xFF, 0xFF, 0x1F, 0xAA, 0x00, 0x55};
+
+    assert_record_round_trip(&message, expected, sizeof(expected));
+}
+
+/* a remote frame has a DLC but no payload */
+static void test_record_rtr(void)
+{
+    const slcan_message_t std = {.can_id = CAN_RTR_FRAME | 0x456u, .can_dlc = 4, .data = {0x11, 0x22, 0x33, 0x44}};
+    const uint8_t expected_std[] = {0x24, 0x56, 0x04};
+    const slcan_message_t xtd = {.can_id = CAN_XTD_FRAME | CAN_RTR_FRAME | 0x00012345u, .can_dlc = 8, .data = {0}};
+    const uint8_t expected_xtd[] = {0x38, 0x45, 0x23, 0x01, 0x00};
+
+    assert_record_round_trip(&std, expected_std, sizeof(expected_std));
+    assert_record_round_trip(&xtd, expected_xtd, sizeof(expected_xtd));
+}
+
+/* the time stamp sits between the identifier and the payload */
+static void test_record_timestamp(void)
+{
+    const slcan_message_t message = {.can_id = 0x001u, .can_dlc = 1, .data = {0x99}};
+    const uint32_t timestamp = 0x12345678u;
+    const uint8_t expected[] = {0x81, 0x01, 0x00, 0x78, 0x56, 0x34, 0x12, 0x99};
+    uint8_t record[SLCAN_BIN_RECORD_MAX];
+    slcan_message_t out;
+
+    TEST_ASSERT_EQUAL_UINT8(sizeof(expected), binary_pack(&message, &timestamp, record));
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(expected, record, sizeof(expected));
+    // the adapter's own records aren't accepted from the host
+    TEST_ASSERT_FALSE(binary_unpack(&out, record, sizeof(expected)));
+}
+
+static void test_unpack_rejects(void)
+{
+    const uint8_t std_over[] = {0x00, 0x00, 0x08};
+    const uint8_t xtd_over[] = {0x10, 0x00, 0x00, 0x00, 0x20};
+    const uint8_t dlc_over[] = {0x09, 0x23, 0x01, 1, 2, 3, 4, 5, 6, 7, 8, 9};
+    const uint8_t error[] = {0x40, 0x23, 0x01};
+    const uint8_t too_long[] = {0x01, 0x23, 0x01, 0x11, 0x22};
+    const uint8_t too_short[] = {0x02, 0x23, 0x01, 0x11};
+    const uint8_t rtr_with_data[] = {0x21, 0x23, 0x01, 0x11};
+    const uint8_t std_max[] = {0x00, 0xFF, 0x07};
+    const uint8_t xtd_max[] = {0x10, 0xFF, 0xFF, 0xFF, 0x1F};
+    slcan_message_t out;
+
+    TEST_ASSERT_FALSE(binary_unpack(&out, std_over, sizeof(std_over)));
+    TEST_ASSERT_FALSE(binary_unpack(&out, xtd_over, sizeof(xtd_over)));
+    TEST_ASSERT_FALSE(binary_unpack(&out, dlc_over, sizeof(dlc_over)));
+    TEST_ASSERT_FALSE(binary_unpack(&out, error, sizeof(error)));
+    TEST_ASSERT_FALSE(binary_unpack(&out, too_long, sizeof(too_long)));
+    TEST_ASSERT_FALSE(binary_unpack(&out, too_short, sizeof(too_short)));
+    TEST_ASSERT_FALSE(binary_unpack(&out, rtr_with_data, sizeof(rtr_with_data)));
+    // an empty record is refused before anything is read
+    TEST_ASSERT_FALSE(binary_unpack(&out, NULL, 0));
+
+    TEST_ASSERT_TRUE(binary_unpack(&out, std_max, sizeof(std_max)));
+    TEST_ASSERT_EQUAL_HEX32(0x7FFu, out.can_id);
+    TEST_ASSERT_TRUE(binary_unpack(&out, xtd_max, sizeof(xtd_max)));
+    TEST_ASSERT_EQUAL_HEX32(CAN_XTD_FRAME | 0x1FFFFFFFu, out.can_id);
+}
+
+/* a whole frame on the wire: record, COBS, delimiter and back */
+static void test_frame_on_the_wire(void)
+{
+    const slcan_message_t message = {.can_id = CAN_XTD_FRAME | 0x00000100u, .can_dlc = 8, .data = {0}};
+    uint8_t record[SLCAN_BIN_RECORD_MAX];
+    uint8_t wire[SLCAN_BIN_FRAME_MAX];
+    slcan_message_t out;
+    uint8_t size = binary_pack(&message, NULL, record);
+    uint8_t n = cobs_encode(record, size, wire);
+
+    TEST_ASSERT_LESS_OR_EQUAL(SLCAN_BIN_FRAME_MAX, n);
+    TEST_ASSERT_EQUAL_UINT8(size, cobs_decode(wire, (uint8_t)(n - 1u)));
+    TEST_ASSERT_TRUE(binary_unpack(&out, wire, size));
+    TEST_ASSERT_EQUAL_HEX32(message.can_id, out.can_id);
+    TEST_ASSERT_EQUAL_MEMORY(message.data, out.data, 8);
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_cobs_no_zeros);
+    RUN_TEST(test_cobs_zero_bytes);
+    RUN_TEST(test_cobs_long_run);
+    RUN_TEST(test_cobs_malformed);
+    RUN_TEST(test_record_std);
+    RUN_TEST(test_record_xtd);
+    RUN_TEST(test_record_rtr);
+    RUN_TEST(test_record_timestamp);
+    RUN_TEST(test_unpack_rejects);
+    RUN_TEST(test_frame_on_the_wire);
+    return UNITY_END();
+}
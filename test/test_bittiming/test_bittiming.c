@@ -0,0 +1,146 @@
+/*
+ * test_bittiming.c
+ *
+ *  Bit timing: the S0..S8 table gives the nominal rates exactly, and the
+ *  calculator either finds register values within 1% of the requested rate
+ *  with every field in range, or refuses the rate when no prescaler and
+ *  quanta split of the 48 MHz clock gets that close.
+ *
+ *  Run with:  pio test -e test
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include <unity.h>
+#include "slcan.h"
+#include "bittiming.h"
+
+void setUp(void)
+{
+}
+
+void tearDown(void)
+{
+}
+
+/* segments in range for the bxCAN: TS1 1..16, TS2 1..8, 8..25 quanta */
+static void assert_btr_fields(uint32_t btr)
+{
+    uint32_t ntq = 3u + CAN_BTR_FIELD_TS1(btr) + CAN_BTR_FIELD_TS2(btr);
+
+    TEST_ASSERT_EQUAL_HEX32(0, btr & ~0x037F03FFu);
+    TEST_ASSERT_GREATER_OR_EQUAL(8, ntq);
+    TEST_ASSERT_LESS_OR_EQUAL(25, ntq);
+}
+
+static uint32_t sample_point(uint32_t btr)
+{
+    uint32_t ntq = 3u + CAN_BTR_FIELD_TS1(btr) + CAN_BTR_FIELD_TS2(btr);
+
+    return (1000u * (2u + CAN_BTR_FIELD_TS1(btr))) / ntq;
+}
+
+static uint32_t rate_error(uint32_t actual, uint32_t bitrate)
+{
+    return (actual > bitrate) ? (actual - bitrate) : (bitrate - actual);
+}
+
+/* whether any prescaler and number of quanta the bxCAN takes gets within
+ * 1% of the rate, by brute force */
+static bool rate_possible(uint32_t bitrate)
+{
+    for (uint32_t ntq = 8; ntq <= 25u; ntq++)
+        for (uint32_t brp = 1; brp <= 1024u; brp++)
+            if (rate_error(CAN_CLOCK_HZ / (brp * ntq), bitrate) * 100u <= bitrate)
+                return true;
+    return false;
+}
+
+static void test_table_rates_exact(void)
+{
+    const uint32_t rates[CAN_1000K + 1u] = {10000, 20000, 50000, 100000, 125000, 250000, 500000, 800000, 1000000};
+
+    for (uint8_t i = 0; i <= CAN_1000K; i++)
+    {
+        assert_btr_fields(can_btr_table[i]);
+        TEST_ASSERT_EQUAL_UINT32(rates[i], can_btr_bitrate(can_btr_table[i]));
+        // within one quantum of the configured sample point
+        TEST_ASSERT_LESS_OR_EQUAL(1000u / 15u, rate_error(sample_point(can_btr_table[i]), CAN_SAMPLE_POINT));
+    }
+}
+
+/* the standard rates and odd ones, each at a few sample points */
+static void test_calc_within_one_percent(void)
+{
+    const uint32_t rates[] = {10000, 20000, 33333, 47619, 50000, 83333, 95238, 100000, 125000,
+                              250000, 400000, 500000, 615384, 666666, 800000, 1000000};
+    const uint16_t points[] = {500, 750, 800, 875, 900};
+
+    for (uint8_t i = 0; i < sizeof(rates) / sizeof(rates[0]); i++)
+    {
+        for (uint8_t k = 0; k < sizeof(points) / sizeof(points[0]); k++)
+        {
+            uint32_t btr = 0xFFFFFFFFu;
+            uint32_t ntq;
+
+            TEST_ASSERT_TRUE(can_btr_calc(rates[i], points[k], &btr));
+            assert_btr_fields(btr);
+            TEST_ASSERT_LESS_OR_EQUAL(rates[i] / 100u, rate_error(can_btr_bitrate(btr), rates[i]));
+            ntq = 3u + CAN_BTR_FIELD_TS1(btr) + CAN_BTR_FIELD_TS2(btr);
+            TEST_ASSERT_LESS_OR_EQUAL(1000u / ntq, rate_error(sample_point(btr), points[k]));
+        }
+    }
+}
+
+/* over the whole range, a rate is accepted exactly when it can be made */
+static void test_calc_accepts_what_is_possible(void)
+{
+    for (uint32_t bitrate = 1000; bitrate <= 8000000u; bitrate += bitrate / 50u)
+    {
+        uint32_t btr = 0;
+        bool found = can_btr_calc(bitrate, 875, &btr);
+
+        TEST_ASSERT_EQUAL(rate_possible(bitrate), found);
+        if (found)
+        {
+            assert_btr_fields(btr);
+            TEST_ASSERT_LESS_OR_EQUAL(bitrate / 100u, rate_error(can_btr_bitrate(btr), bitrate));
+        }
+    }
+}
+
+static void test_calc_rejects(void)
+{
+    uint32_t btr = 0x12345678u;
+
+    TEST_ASSERT_FALSE(can_btr_calc(0, 875, &btr));
+    TEST_ASSERT_FALSE(can_btr_calc(500000, 0, &btr));
+    TEST_ASSERT_FALSE(can_btr_calc(500000, 1000, &btr));
+    TEST_ASSERT_FALSE(can_btr_calc(500000, 1500, &btr));
+    // below 48 MHz / (1024 * 25) and above 48 MHz / 8 with any slack
+    TEST_ASSERT_FALSE(can_btr_calc(1000, 875, &btr));
+    TEST_ASSERT_FALSE(can_btr_calc(1800, 875, &btr));
+    TEST_ASSERT_FALSE(can_btr_calc(5000000, 875, &btr));
+    TEST_ASSERT_FALSE(can_btr_calc(7000000, 875, &btr));
+}
+
+/* 's031C' of a Lawicel adapter: 125 kbit/s at 16 MHz, 16 quanta */
+static void test_sja1000_registers(void)
+{
+    uint32_t btr = can_btr_from_sja1000(0x03, 0x1C);
+
+    TEST_ASSERT_EQUAL_UINT32(125000, can_btr_bitrate(btr));
+    TEST_ASSERT_EQUAL_UINT32(12, CAN_BTR_FIELD_TS1(btr));
+    TEST_ASSERT_EQUAL_UINT32(1, CAN_BTR_FIELD_TS2(btr));
+    TEST_ASSERT_EQUAL_UINT32(1000000, can_btr_bitrate(can_btr_from_sja1000(0x00, 0x14)));
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_table_rates_exact);
+    RUN_TEST(test_calc_within_one_percent);
+    RUN_TEST(test_calc_accepts_what_is_possible);
+    RUN_TEST(test_calc_rejects);
+    RUN_TEST(test_sja1000_registers);
+    return UNITY_END();
+}
@@ -0,0 +1,226 @@
+/*
+ * test_busload.c
+ *
+ *  Frame length: can_frame_bits() works a nibble at a time from tables, so
+ *  it is checked against a plain bit by bit model of the frame, the CRC-15
+ *  and the stuffing over every kind of frame, DLC and a spread of payloads.
+ *
+ *  Run with:  pio test -e test
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include <unity.h>
+#include "slcan.h"
+#include "busload.h"
+
+/* SOF to the end of the CRC, longest case an extended frame with 8 bytes */
+#define REF_BITS_MAX 160u
+
+typedef struct
+{
+    uint8_t bit[REF_BITS_MAX];
+    uint8_t count;
+} ref_frame_t;
+
+void setUp(void)
+{
+}
+
+void tearDown(void)
+{
+}
+
+static void ref_push(ref_frame_t *f, uint32_t value, uint8_t bits)
+{
+    while (bits--)
+        f->bit[f->count++] = (uint8_t)((value >> bits) & 1u);
+}
+
+/* CRC-15 of the reference manual, one bit at a time */
+static uint16_t ref_crc(const ref_frame_t *f)
+{
+    uint16_t crc = 0;
+
+    for (uint8_t i = 0; i < f->count; i++)
+    {
+        bool invert = (f->bit[i] ^ (crc >> 14)) & 1u;
+
+        crc = (uint16_t)((crc << 1) & 0x7FFFu);
+        if (invert)
+            crc ^= 0x4599u;
+    }
+    return crc;
+}
+
+/* after five equal bits a complement goes in, and counts towards the next run */
+static uint8_t ref_stuff(const ref_frame_t *f)
+{
+    uint8_t stuff = 0;
+    uint8_t run = 0;
+    uint8_t last = 2;
+
+    for (uint8_t i = 0; i < f->count; i++)
+    {
+        if (f->bit[i] == last)
+        {
+            run++;
+        }
+        else
+        {
+            last = f->bit[i];
+            run = 1;
+        }
+        if (run == 5u)
+        {
+            stuff++;
+            last ^= 1u;
+            run = 1;
+        }
+    }
+    return stuff;
+}
+
+static uint16_t ref_frame_bits(uint32_t id, uint8_t dlc, const uint8_t *data)
+{
+    ref_frame_t f = {.count = 0};
+    uint8_t rtr = (id & CAN_RTR_FRAME) ? 1u : 0u;
+    uint8_t len = (dlc > 8u) ? 8u : dlc;
+
+    ref_push(&f, 0, 1);
+    if (id & CAN_XTD_FRAME)
+    {
+        ref_push(&f, (id >> 18) & 0x7FFu, 11);
+        ref_push(&f, 1, 1); // SRR
+        ref_push(&f, 1, 1); // IDE
+        ref_push(&f, id & 0x3FFFFu, 18);
+        ref_push(&f, rtr, 1);
+        ref_push(&f, 0, 2); // r1, r0
+    }
+    else
+    {
+        ref_push(&f, id & 0x7FFu, 11);
+        ref_push(&f, rtr, 1);
+        ref_push(&f, 0, 2); // IDE, r0
+    }
+    ref_push(&f, dlc, 4);
+    for (uint8_t i = 0; !rtr && (i < len); i++)
+        ref_push(&f, data[i], 8);
+    ref_push(&f, ref_crc(&f), 15);
+
+    // CRC and ACK delimiters, ACK slot, EOF, intermission
+    return (uint16_t)(f.count + ref_stuff(&f) + 1u + 2u + 7u + 3u);
+}
+
+static uint32_t lfsr = 0xACE1u;
+
+static uint32_t next_random(void)
+{
+    lfsr ^= lfsr << 13;
+    lfsr ^= lfsr >> 17;
+    lfsr ^= lfsr << 5;
+    return lfsr;
+}
+
+static void assert_same(uint32_t id, uint8_t dlc, const uint8_t *data)
+{
+    uint16_t expected = ref_frame_bits(id, dlc, data);
+
+    if (can_frame_bits(id, dlc, data) != expected)
+        TEST_FAIL_MESSAGE("frame bits differ from the bitwise model");
+}
+
+/* by hand: 34 dominant bits from SOF to the CRC take six stuff bits */
+static void test_known_frame(void)
+{
+    TEST_ASSERT_EQUAL_UINT16(19u + 15u + 6u + 13u, can_frame_bits(0x000u, 0, NULL));
+    TEST_ASSERT_EQUAL_UINT16(19u + 15u + 6u + 13u, ref_frame_bits(0x000u, 0, NULL));
+}
+
+/* every 11-bit identifier, with and without RTR, no payload and one byte */
+static void test_all_std_ids(void)
+{
+    const uint8_t one[1] = {0xA5};
+
+    for (uint32_t id = 0; id <= CAN_STD_MASK; id++)
+    {
+        assert_same(id, 0, NULL);
+        assert_same(id, 1, one);
+        assert_same(id | CAN_RTR_FRAME, 3, NULL);
+    }
+}
+
+/* payloads that stuff the most and the least, every DLC, both formats */
+static void test_edge_payloads(void)
+{
+    const uint8_t fill[] = {0x00, 0xFF, 0x55, 0xAA, 0x0F, 0xF0, 0x07, 0x83};
+    const uint32_t ids[] = {0x000u, 0x7FFu, 0x555u, CAN_XTD_FRAME | 0x00000000u,
+                            CAN_XTD_FRAME | 0x1FFFFFFFu, CAN_XTD_FRAME | 0x0AAAAAAAu};
+
+    for (uint8_t i = 0; i < sizeof(ids) / sizeof(ids[0]); i++)
+    {
+        for (uint8_t k = 0; k < sizeof(fill); k++)
+        {
+            uint8_t data[8];
+
+            for (uint8_t b = 0; b < 8u; b++)
+                data[b] = fill[k];
+            for (uint8_t dlc = 0; dlc <= 8u; dlc++)
+            {
+                assert_same(ids[i], dlc, data);
+                assert_same(ids[i] | CAN_RTR_FRAME, dlc, data);
+            }
+        }
+    }
+}
+
+/* a DLC over 8 goes on the wire as it is but carries 8 bytes */
+static void test_dlc_over_eight(void)
+{
+    const uint8_t data[8] = {1, 2, 3, 4, 5, 6, 7, 8};
+
+    for (uint8_t dlc = 9; dlc <= 15u; dlc++)
+    {
+        assert_same(0x123u, dlc, data);
+        assert_same(CAN_XTD_FRAME | 0x1234567u, dlc, data);
+    }
+}
+
+/* random frames, and the stuffing stays within its bounds */
+static void test_random_frames(void)
+{
+    for (uint32_t n = 0; n < 20000u; n++)
+    {
+        uint32_t r = next_random();
+        bool xtd = r & 1u;
+        uint32_t id = next_random() & (xtd ? CAN_XTD_MASK : CAN_STD_MASK);
+        uint8_t dlc = (uint8_t)((r >> 1) % 9u);
+        uint8_t data[8];
+        uint16_t bits;
+        uint16_t plain;
+
+        for (uint8_t b = 0; b < 8u; b++)
+            data[b] = (uint8_t)next_random();
+        if (xtd)
+            id |= CAN_XTD_FRAME;
+        if ((r >> 8) % 8u == 0u)
+            id |= CAN_RTR_FRAME;
+
+        assert_same(id, dlc, data);
+        bits = can_frame_bits(id, dlc, data);
+        plain = (uint16_t)((xtd ? 39u : 19u) + ((id & CAN_RTR_FRAME) ? 0u : 8u * dlc) + 15u + 13u);
+        TEST_ASSERT_GREATER_OR_EQUAL(plain, bits);
+        TEST_ASSERT_LESS_OR_EQUAL(plain + (plain - 13u - 1u) / 4u, bits);
+        TEST_ASSERT_LESS_OR_EQUAL(CAN_FRAME_BITS_MAX, bits);
+    }
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_known_frame);
+    RUN_TEST(test_all_std_ids);
+    RUN_TEST(test_edge_payloads);
+    RUN_TEST(test_dlc_over_eight);
+    RUN_TEST(test_random_frames);
+    return UNITY_END();
+}
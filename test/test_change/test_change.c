@@ -0,0 +1,176 @@
+/*
+ * test_change.c
+ *
+ *  Change-only cache: an unchanged payload is held back until the
+ *  identifier's keep-alive runs out, a changed one always passes, and an
+ *  identifier evicted from a full probe window gets its next frame through
+ *  instead of losing a change.
+ *
+ *  Run with:  pio test -e test
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include <unity.h>
+#include "slcan.h"
+#include "change.h"
+
+#define BASE 0x10000000u /* a time stamp on a tick boundary */
+
+static const uint8_t payload[8] = {0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88};
+static const uint8_t other[8] = {0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x89};
+
+void setUp(void)
+{
+    can_change_setup(true, 0);
+}
+
+void tearDown(void)
+{
+}
+
+static bool pass(uint32_t id, uint32_t now)
+{
+    return can_change_pass(id, 8, payload, now);
+}
+
+static void test_unchanged_suppressed(void)
+{
+    can_change_stats_t stats;
+
+    TEST_ASSERT_TRUE(pass(0x123u, BASE));
+    TEST_ASSERT_FALSE(pass(0x123u, BASE + 1000u));
+    // a payload or DLC that differs passes, and becomes the new reference
+    TEST_ASSERT_TRUE(can_change_pass(0x123u, 8, other, BASE + 2000u));
+    TEST_ASSERT_FALSE(can_change_pass(0x123u, 8, other, BASE + 3000u));
+    TEST_ASSERT_TRUE(can_change_pass(0x123u, 7, other, BASE + 4000u));
+    // bytes past the DLC are not compared
+    TEST_ASSERT_FALSE(can_change_pass(0x123u, 7, payload, BASE + 5000u));
+    // the same number as an extended identifier is another one
+    TEST_ASSERT_TRUE(pass(CAN_XTD_FRAME | 0x123u, BASE + 6000u));
+    // remote frames always pass
+    TEST_ASSERT_TRUE(can_change_pass(CAN_RTR_FRAME | 0x123u, 0, payload, BASE + 7000u));
+    TEST_ASSERT_TRUE(can_change_pass(CAN_RTR_FRAME | 0x123u, 0, payload, BASE + 8000u));
+
+    can_change_stats(&stats);
+    TEST_ASSERT_TRUE(stats.enabled);
+    TEST_ASSERT_EQUAL_UINT8(2, stats.used);
+    TEST_ASSERT_EQUAL_UINT32(3, stats.suppressed);
+    TEST_ASSERT_EQUAL_UINT32(0, stats.evictions);
+}
+
+static void test_disabled_passes_all(void)
+{
+    can_change_setup(false, 0);
+    for (uint8_t i = 0; i < 10u; i++)
+        TEST_ASSERT_TRUE(pass(0x123u, BASE + i));
+}
+
+/* an unchanged frame goes out again once the keep-alive has run, not
+ * earlier, and the period starts over from there */
+static void test_keepalive_expiry(void)
+{
+    can_change_setup(true, 100);
+
+    TEST_ASSERT_TRUE(pass(0x123u, BASE));
+    TEST_ASSERT_FALSE(pass(0x123u, BASE + 50000u));
+    TEST_ASSERT_FALSE(pass(0x123u, BASE + 99999u));
+    TEST_ASSERT_TRUE(pass(0x123u, BASE + 102400u));
+    TEST_ASSERT_FALSE(pass(0x123u, BASE + 150000u));
+    TEST_ASSERT_FALSE(pass(0x123u, BASE + 102400u + 99999u));
+    TEST_ASSERT_TRUE(pass(0x123u, BASE + 204800u));
+}
+
+/* without a keep-alive an unchanged payload never goes out again */
+static void test_no_keepalive(void)
+{
+    TEST_ASSERT_TRUE(pass(0x123u, BASE));
+    for (uint32_t t = 1; t <= 60u; t++)
+        TEST_ASSERT_FALSE(pass(0x123u, BASE + t * 1000000u));
+}
+
+/* the microsecond time stamp wrapping between two frames doesn't hold the
+ * keep-alive back */
+static void test_keepalive_across_wrap(void)
+{
+    can_change_setup(true, 100);
+
+    TEST_ASSERT_TRUE(pass(0x123u, 0xFFFF0000u));
+    TEST_ASSERT_FALSE(pass(0x123u, 0x00000000u));
+    TEST_ASSERT_TRUE(pass(0x123u, 0x00010000u));
+}
+
+/* identifiers whose probe window starts at the same slot, from the
+ * table's Fibonacci hash */
+static uint8_t colliding(uint32_t *ids, uint8_t count)
+{
+    uint8_t found = 0;
+    uint32_t home = (0x100u * 0x9E3779B1u) >> (32u - CAN_CHANGE_BITS);
+
+    for (uint32_t id = 0x100u; (id <= CAN_STD_MASK) && (found < count); id++)
+        if (((id * 0x9E3779B1u) >> (32u - CAN_CHANGE_BITS)) == home)
+            ids[found++] = id;
+    return found;
+}
+
+/* a ninth identifier for a full window evicts the one forwarded longest
+ * ago, whose next frame then passes even though it is unchanged */
+static void test_eviction(void)
+{
+    uint32_t ids[CAN_CHANGE_PROBE + 1u];
+    can_change_stats_t stats;
+
+    TEST_ASSERT_EQUAL_UINT8(CAN_CHANGE_PROBE + 1u, colliding(ids, CAN_CHANGE_PROBE + 1u));
+    for (uint8_t i = 0; i < CAN_CHANGE_PROBE; i++)
+        TEST_ASSERT_TRUE(pass(ids[i], BASE + i * 2048u));
+    // ids[1] is refreshed by a change, ids[0] stays the oldest
+    TEST_ASSERT_TRUE(can_change_pass(ids[1], 8, other, BASE + CAN_CHANGE_PROBE * 2048u));
+
+    TEST_ASSERT_TRUE(pass(ids[CAN_CHANGE_PROBE], BASE + (CAN_CHANGE_PROBE + 1u) * 2048u));
+    can_change_stats(&stats);
+    TEST_ASSERT_EQUAL_UINT32(1, stats.evictions);
+    TEST_ASSERT_EQUAL_UINT8(CAN_CHANGE_PROBE, stats.used);
+
+    // everyone still cached holds back an unchanged frame
+    TEST_ASSERT_FALSE(can_change_pass(ids[1], 8, other, BASE + 100000u));
+    for (uint8_t i = 2; i <= CAN_CHANGE_PROBE; i++)
+        TEST_ASSERT_FALSE(pass(ids[i], BASE + 100000u));
+    // the evicted one gets through, and takes the slot of ids[2] now
+    TEST_ASSERT_TRUE(pass(ids[0], BASE + 100000u));
+    TEST_ASSERT_TRUE(pass(ids[2], BASE + 200000u));
+    can_change_stats(&stats);
+    TEST_ASSERT_EQUAL_UINT32(3, stats.evictions);
+}
+
+/* a frame let through but dropped later is forgotten: the next one with
+ * the same payload goes out, then the cache holds it again */
+static void test_unsent(void)
+{
+    can_change_stats_t stats;
+
+    TEST_ASSERT_TRUE(pass(0x123u, BASE));
+    TEST_ASSERT_TRUE(can_change_pass(0x123u, 8, other, BASE + 1000u));
+    can_change_unsent();
+    TEST_ASSERT_TRUE(can_change_pass(0x123u, 8, other, BASE + 2000u));
+    TEST_ASSERT_FALSE(can_change_pass(0x123u, 8, other, BASE + 3000u));
+
+    // only the frame just let through is taken back
+    TEST_ASSERT_FALSE(can_change_pass(0x123u, 8, other, BASE + 4000u));
+    can_change_unsent();
+    TEST_ASSERT_FALSE(can_change_pass(0x123u, 8, other, BASE + 5000u));
+
+    can_change_stats(&stats);
+    TEST_ASSERT_EQUAL_UINT8(1, stats.used);
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_unchanged_suppressed);
+    RUN_TEST(test_disabled_passes_all);
+    RUN_TEST(test_keepalive_expiry);
+    RUN_TEST(test_no_keepalive);
+    RUN_TEST(test_keepalive_across_wrap);
+    RUN_TEST(test_eviction);
+    RUN_TEST(test_unsent);
+    return UNITY_END();
+}
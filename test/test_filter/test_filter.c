@@ -0,0 +1,287 @@
+/*
+ * test_filter.c
+ *
+ *  Filter bank allocation: the bank images are run through the bxCAN
+ *  acceptance logic, so every requested identifier has to get in, exact
+ *  lists have to stay exact, remote frames have to match like data frames
+ *  and merging to fit the banks may only open up the bits the merged entries
+ *  disagree on.
+ *
+ *  Run with:  pio test -e test
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include <unity.h>
+#include "slcan.h"
+#include "filter.h"
+
+static can_filter_bank_t banks[CAN_FILTER_BANKS];
+static uint8_t used;
+
+void setUp(void)
+{
+    used = 0;
+}
+
+void tearDown(void)
+{
+}
+
+/* identifier in the layout of the 32-bit filter registers */
+static uint32_t filter_word32(uint32_t id)
+{
+    uint32_t rtr = (id & CAN_RTR_FRAME) ? 0x2u : 0u;
+
+    if (id & CAN_XTD_FRAME)
+        return ((id & CAN_XTD_MASK) << 3) | 0x4u | rtr;
+    return ((id & CAN_STD_MASK) << 21) | rtr;
+}
+
+/* identifier in the layout of the 16-bit filter registers */
+static uint32_t filter_word16(uint32_t id)
+{
+    uint32_t rtr = (id & CAN_RTR_FRAME) ? 0x10u : 0u;
+
+    if (id & CAN_XTD_FRAME)
+        return (((id >> 18) & CAN_STD_MASK) << 5) | 0x8u | ((id >> 15) & 0x7u) | rtr;
+    return ((id & CAN_STD_MASK) << 5) | rtr;
+}
+
+/* what the bxCAN does with a frame, per the reference manual */
+static bool bank_accepts(const can_filter_bank_t *bank, uint32_t id)
+{
+    uint32_t w32 = filter_word32(id);
+    uint32_t w16 = filter_word16(id);
+
+    if (bank->scale_32bit && !bank->id_list_mode)
+        return ((w32 ^ bank->fr1) & bank->fr2) == 0u;
+    if (bank->scale_32bit)
+        return (w32 == bank->fr1) || (w32 == bank->fr2);
+    if (!bank->id_list_mode)
+        return (((w16 ^ bank->fr1) & (bank->fr1 >> 16) & 0xFFFFu) == 0u) ||
+               (((w16 ^ bank->fr2) & (bank->fr2 >> 16) & 0xFFFFu) == 0u);
+    return (w16 == (bank->fr1 & 0xFFFFu)) || (w16 == (bank->fr1 >> 16)) ||
+           (w16 == (bank->fr2 & 0xFFFFu)) || (w16 == (bank->fr2 >> 16));
+}
+
+static bool accepted(uint32_t id)
+{
+    for (uint8_t i = 0; i < used; i++)
+        if (bank_accepts(&banks[i], id))
+            return true;
+    return false;
+}
+
+static void allocate(const can_filter_entry_t *list, uint8_t count)
+{
+    used = can_filter_allocate(list, count, banks, CAN_FILTER_BANKS);
+    TEST_ASSERT_LESS_OR_EQUAL(CAN_FILTER_BANKS, used);
+}
+
+static bool entry_matches(const can_filter_entry_t *entry, uint32_t id)
+{
+    return ((id ^ entry->id) & (entry->mask | CAN_XTD_FRAME)) == 0u;
+}
+
+/* every identifier the list asks for gets in; std entries are checked over
+ * the whole 11-bit space */
+static void assert_requested_accepted(const can_filter_entry_t *list, uint8_t count)
+{
+    for (uint32_t id = 0; id <= CAN_STD_MASK; id++)
+        for (uint8_t i = 0; i < count; i++)
+            if (entry_matches(&list[i], id))
+                TEST_ASSERT_TRUE(accepted(id));
+
+    for (uint8_t i = 0; i < count; i++)
+        if (list[i].id & CAN_XTD_FRAME)
+            TEST_ASSERT_TRUE(accepted(list[i].id & (list[i].mask | CAN_XTD_FRAME)));
+}
+
+static uint32_t std_accepted_count(void)
+{
+    uint32_t n = 0;
+
+    for (uint32_t id = 0; id <= CAN_STD_MASK; id++)
+        n += accepted(id);
+    return n;
+}
+
+/* ten exact 11-bit IDs fit 16-bit list banks, nothing else gets in */
+static void test_std_exact_list_is_exact(void)
+{
+    can_filter_entry_t list[10];
+
+    for (uint8_t i = 0; i < 10u; i++)
+        list[i] = (can_filter_entry_t){0x100u + 13u * i, CAN_STD_MASK};
+    allocate(list, 10);
+
+    TEST_ASSERT_EQUAL_UINT8(5, used);
+    assert_requested_accepted(list, 10);
+    TEST_ASSERT_EQUAL_UINT32(10, std_accepted_count());
+    TEST_ASSERT_FALSE(accepted(CAN_XTD_FRAME | 0x100u));
+}
+
+/* exact 29-bit IDs in 32-bit list banks: a flipped bit anywhere is rejected,
+ * and so is the 11-bit ID that shares the register bits */
+static void test_xtd_exact_list_is_exact(void)
+{
+    can_filter_entry_t list[5];
+
+    for (uint8_t i = 0; i < 5u; i++)
+        list[i] = (can_filter_entry_t){CAN_XTD_FRAME | (0x18FEF100u + 0x101u * i), CAN_XTD_MASK};
+    allocate(list, 5);
+
+    TEST_ASSERT_EQUAL_UINT8(5, used);
+    assert_requested_accepted(list, 5);
+    for (uint8_t i = 0; i < 5u; i++)
+    {
+        for (uint8_t bit = 0; bit < 29u; bit++)
+        {
+            uint32_t id = list[i].id ^ (1u << bit);
+            bool requested = false;
+
+            for (uint8_t k = 0; k < 5u; k++)
+                requested |= (id == list[k].id);
+            TEST_ASSERT_EQUAL(requested, accepted(id));
+        }
+    }
+    TEST_ASSERT_EQUAL_UINT32(0, std_accepted_count());
+}
+
+/* std and ext entries, exact and masked, go to their own bank types, and an
+ * odd 16-bit mask bank takes an exact ID in its spare half */
+static void test_std_xtd_mix(void)
+{
+    const can_filter_entry_t list[] = {
+        {0x123u, CAN_STD_MASK},
+        {0x200u, 0x7F0u},
+        {0x300u, 0x700u},
+        {0x400u, 0x7FCu},
+        {0x7FFu, CAN_STD_MASK},
+        {0x055u, CAN_STD_MASK},
+        {CAN_XTD_FRAME | 0x00ABCDEFu, CAN_XTD_MASK},
+        {CAN_XTD_FRAME | 0x1F000000u, 0x1FFF0000u},
+    };
+    uint8_t count = sizeof(list) / sizeof(list[0]);
+    uint32_t expected = 3u + 16u + 256u + 4u;
+
+    allocate(list, count);
+
+    // 32-bit mask, 32-bit list, two 16-bit mask banks of which the second
+    // also holds an exact ID, one 16-bit list
+    TEST_ASSERT_EQUAL_UINT8(5, used);
+    assert_requested_accepted(list, count);
+    TEST_ASSERT_EQUAL_UINT32(expected, std_accepted_count());
+    TEST_ASSERT_TRUE(accepted(CAN_XTD_FRAME | 0x1F00FFFFu));
+    TEST_ASSERT_FALSE(accepted(CAN_XTD_FRAME | 0x1F010000u));
+    TEST_ASSERT_FALSE(accepted(CAN_XTD_FRAME | 0x00ABCDEEu));
+    // the 11-bit entries don't open their IDs to extended frames
+    TEST_ASSERT_FALSE(accepted(CAN_XTD_FRAME | 0x123u));
+    TEST_ASSERT_FALSE(accepted(CAN_XTD_FRAME | (0x123u << 18)));
+}
+
+/* 32 masked 11-bit entries need 16 banks; merging neighbours keeps the
+ * accepted set to exactly the blocks that were asked for */
+static void test_std_merge_stays_in_requested_blocks(void)
+{
+    can_filter_entry_t list[CAN_FILTER_LIST_MAX];
+
+    for (uint8_t i = 0; i < CAN_FILTER_LIST_MAX; i++)
+        list[i] = (can_filter_entry_t){(uint32_t)i << 4, 0x7F0u};
+    allocate(list, CAN_FILTER_LIST_MAX);
+
+    assert_requested_accepted(list, CAN_FILTER_LIST_MAX);
+    TEST_ASSERT_EQUAL_UINT32(CAN_FILTER_LIST_MAX * 16u, std_accepted_count());
+}
+
+/* 32 exact 29-bit IDs need 32 banks, 18 more than there are. They sit in
+ * two clusters far apart, so merging must stay inside a cluster and only
+ * open the low bits the cluster's IDs differ in: as the clusters are whole
+ * aligned blocks, exactly the requested IDs still get in. */
+static void test_xtd_merge_widens_least(void)
+{
+    can_filter_entry_t list[CAN_FILTER_LIST_MAX];
+    const uint32_t base[2] = {0x00012300u, 0x1ABCD000u};
+
+    for (uint8_t i = 0; i < CAN_FILTER_LIST_MAX; i++)
+        list[i] = (can_filter_entry_t){CAN_XTD_FRAME | (base[i & 1u] + (i >> 1)), CAN_XTD_MASK};
+    allocate(list, CAN_FILTER_LIST_MAX);
+
+    TEST_ASSERT_EQUAL_UINT8(CAN_FILTER_BANKS, used);
+    assert_requested_accepted(list, CAN_FILTER_LIST_MAX);
+    // nothing outside the 16 IDs of each cluster
+    for (uint8_t c = 0; c < 2u; c++)
+    {
+        for (uint8_t bit = 4; bit < 29u; bit++)
+            for (uint32_t low = 0; low < 16u; low++)
+                TEST_ASSERT_FALSE(accepted(CAN_XTD_FRAME | ((base[c] + low) ^ (1u << bit))));
+    }
+}
+
+/* every bank type lets the remote frame of an ID in exactly when it lets
+ * the data frame in */
+static void test_remote_frames_match_like_data(void)
+{
+    const can_filter_entry_t list[] = {
+        {0x123u, CAN_STD_MASK},
+        {0x200u, 0x7F0u},
+        {0x300u, 0x700u},
+        {0x400u, 0x7FCu},
+        {0x7FFu, CAN_STD_MASK},
+        {0x055u, CAN_STD_MASK},
+        {CAN_XTD_FRAME | 0x00ABCDEFu, CAN_XTD_MASK},
+        {CAN_XTD_FRAME | 0x1F000000u, 0x1FFF0000u},
+    };
+    uint8_t count = sizeof(list) / sizeof(list[0]);
+
+    allocate(list, count);
+
+    // 32-bit mask, 32-bit list, two 16-bit mask banks of which the second
+    // also holds an exact ID, one 16-bit list
+    TEST_ASSERT_EQUAL_UINT8(5, used);
+    for (uint32_t id = 0; id <= CAN_STD_MASK; id++)
+        TEST_ASSERT_EQUAL(accepted(id), accepted(id | CAN_RTR_FRAME));
+    for (uint8_t i = 0; i < count; i++)
+    {
+        for (uint8_t bit = 0; bit < 29u; bit++)
+        {
+            uint32_t id = (list[i].id | CAN_XTD_FRAME) ^ (1u << bit);
+
+            TEST_ASSERT_EQUAL(accepted(id), accepted(id | CAN_RTR_FRAME));
+        }
+    }
+    TEST_ASSERT_TRUE(accepted(0x123u | CAN_RTR_FRAME));
+    TEST_ASSERT_TRUE(accepted(0x055u | CAN_RTR_FRAME));
+    TEST_ASSERT_TRUE(accepted(CAN_XTD_FRAME | CAN_RTR_FRAME | 0x00ABCDEFu));
+    TEST_ASSERT_FALSE(accepted(CAN_XTD_FRAME | CAN_RTR_FRAME | 0x00ABCDEEu));
+}
+
+/* more exact 11-bit IDs than two banks hold are folded into masks over the
+ * bits they differ in, never over bits they all share */
+static void test_std_over_capacity_keeps_shared_bits(void)
+{
+    can_filter_entry_t list[CAN_FILTER_LIST_MAX];
+
+    for (uint8_t i = 0; i < CAN_FILTER_LIST_MAX; i++)
+        list[i] = (can_filter_entry_t){0x400u | ((uint32_t)i << 3) | 0x5u, 0x7FFu};
+    used = can_filter_allocate(list, CAN_FILTER_LIST_MAX, banks, 2);
+
+    TEST_ASSERT_LESS_OR_EQUAL(2, used);
+    assert_requested_accepted(list, CAN_FILTER_LIST_MAX);
+    for (uint32_t id = 0; id <= CAN_STD_MASK; id++)
+        if (accepted(id))
+            TEST_ASSERT_EQUAL_HEX32(0x405u, id & 0x407u);
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_std_exact_list_is_exact);
+    RUN_TEST(test_xtd_exact_list_is_exact);
+    RUN_TEST(test_std_xtd_mix);
+    RUN_TEST(test_std_merge_stays_in_requested_blocks);
+    RUN_TEST(test_xtd_merge_widens_least);
+    RUN_TEST(test_std_over_capacity_keeps_shared_bits);
+    RUN_TEST(test_remote_frames_match_like_data);
+    return UNITY_END();
+}
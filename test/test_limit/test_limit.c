@@ -0,0 +1,157 @@
+/*
+ * test_limit.c
+ *
+ *  RX rate limiter: a rule passes its burst back to back, then one frame
+ *  per period, also when the microsecond time stamp wraps in between; over
+ *  the limit every decimate-th frame still passes, and frames no rule
+ *  matches are never touched.
+ *
+ *  Run with:  pio test -e test
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include <unity.h>
+#include "slcan.h"
+#include "limit.h"
+
+void setUp(void)
+{
+    can_limit_reset();
+}
+
+void tearDown(void)
+{
+}
+
+static void set_rule(uint8_t index, uint32_t id, uint32_t mask, uint16_t rate, uint8_t burst, uint8_t decimate)
+{
+    const can_limit_rule_t rule = {.id = id, .mask = mask, .rate = rate, .burst = burst, .decimate = decimate};
+
+    TEST_ASSERT_TRUE(can_limit_set(index, &rule));
+}
+
+/* frames passed out of count sent at now, now + step, ... */
+static uint16_t pass_count(uint32_t id, uint32_t now, uint32_t step, uint16_t count)
+{
+    uint16_t passed = 0;
+
+    for (uint16_t i = 0; i < count; i++, now += step)
+        passed += can_limit_pass(id, now);
+    return passed;
+}
+
+/* 100 frames/s with a burst of 3: three back to back, then one per 10 ms */
+static void test_burst_then_rate(void)
+{
+    can_limit_rule_t rule;
+
+    set_rule(0, 0x100u, CAN_STD_MASK, 100, 3, 0);
+
+    TEST_ASSERT_EQUAL_UINT16(3, pass_count(0x100u, 5000000u, 0, 10));
+    TEST_ASSERT_FALSE(can_limit_pass(0x100u, 5000000u + 9999u));
+    TEST_ASSERT_TRUE(can_limit_pass(0x100u, 5000000u + 10000u));
+    TEST_ASSERT_FALSE(can_limit_pass(0x100u, 5000000u + 10001u));
+    // one second at 1 kHz gets the rate and nothing more
+    TEST_ASSERT_EQUAL_UINT16(100, pass_count(0x100u, 5020000u, 1000, 1000));
+
+    can_limit_get(0, &rule);
+    TEST_ASSERT_EQUAL_UINT32(3u + 1u + 100u, rule.passed);
+    TEST_ASSERT_EQUAL_UINT32(7u + 2u + 900u, rule.suppressed);
+    TEST_ASSERT_EQUAL_UINT32(rule.suppressed, can_limit_suppressed());
+}
+
+/* a pause refills the bucket up to the burst, never beyond */
+static void test_refill_capped_at_burst(void)
+{
+    set_rule(0, 0x100u, CAN_STD_MASK, 1000, 4, 0);
+
+    TEST_ASSERT_EQUAL_UINT16(4, pass_count(0x100u, 1000000u, 0, 8));
+    TEST_ASSERT_EQUAL_UINT16(2, pass_count(0x100u, 1002000u, 0, 8));
+    TEST_ASSERT_EQUAL_UINT16(4, pass_count(0x100u, 3000000u, 0, 8));
+}
+
+/* the time stamp wraps every 71.6 minutes; the credit earned across the
+ * wrap is the real time that went by */
+static void test_refill_across_wrap(void)
+{
+    set_rule(0, 0x100u, CAN_STD_MASK, 1000, 8, 0);
+
+    TEST_ASSERT_EQUAL_UINT16(8, pass_count(0x100u, 0xFFFFF000u, 0, 16));
+    // 0x1000 + 0x800 us later: 6 periods of 1 ms
+    TEST_ASSERT_EQUAL_UINT16(6, pass_count(0x100u, 0x00000800u, 0, 16));
+    TEST_ASSERT_EQUAL_UINT16(1, pass_count(0x100u, 0x00000800u + 1000u, 0, 16));
+
+    // drained again just before the next wrap, 1024 us across it earn one
+    TEST_ASSERT_EQUAL_UINT16(8, pass_count(0x100u, 0xFFFFFE00u, 0, 16));
+    TEST_ASSERT_EQUAL_UINT16(1, pass_count(0x100u, 0x00000200u, 0, 16));
+}
+
+/* over the limit one in decimate passes, counting from the first dropped */
+static void test_decimate(void)
+{
+    can_limit_rule_t rule;
+    uint8_t pattern[12];
+
+    set_rule(0, 0x100u, CAN_STD_MASK, 1, 1, 4);
+
+    TEST_ASSERT_TRUE(can_limit_pass(0x100u, 1000000u));
+    for (uint8_t i = 0; i < sizeof(pattern); i++)
+        pattern[i] = can_limit_pass(0x100u, 1000000u + i);
+    for (uint8_t i = 0; i < sizeof(pattern); i++)
+        TEST_ASSERT_EQUAL_UINT8((i % 4u) == 3u, pattern[i]);
+
+    can_limit_get(0, &rule);
+    TEST_ASSERT_EQUAL_UINT32(1u + 3u, rule.passed);
+    TEST_ASSERT_EQUAL_UINT32(9, rule.suppressed);
+
+    // a decimation of 0 drops everything over the limit
+    set_rule(0, 0x100u, CAN_STD_MASK, 1, 1, 0);
+    TEST_ASSERT_EQUAL_UINT16(1, pass_count(0x100u, 1000000u, 1, 200));
+}
+
+/* masks, extended identifiers, the remote flag and table order */
+static void test_matching(void)
+{
+    set_rule(0, 0x100u, 0x7F0u, 1, 1, 0);
+    set_rule(1, CAN_XTD_FRAME | 0x100u, CAN_XTD_MASK, 1, 2, 0);
+    set_rule(2, 0x000u, 0x000u, 1, 3, 0);
+    TEST_ASSERT_EQUAL_HEX8(0x07, can_limit_active());
+
+    // 0x100..0x10F share rule 0, the remote flag takes no part
+    TEST_ASSERT_TRUE(can_limit_pass(0x105u, 1000000u));
+    TEST_ASSERT_FALSE(can_limit_pass(0x10Fu | CAN_RTR_FRAME, 1000000u));
+    // any other 11-bit ID falls to the catch-all rule 2
+    TEST_ASSERT_EQUAL_UINT16(3, pass_count(0x110u, 1000000u, 0, 5));
+    // extended IDs only match rules for extended ones
+    TEST_ASSERT_EQUAL_UINT16(2, pass_count(CAN_XTD_FRAME | 0x100u, 1000000u, 0, 5));
+    TEST_ASSERT_EQUAL_UINT16(5, pass_count(CAN_XTD_FRAME | 0x101u, 1000000u, 0, 5));
+
+    // a rate of 0 removes the rule
+    set_rule(2, 0x000u, 0x000u, 0, 0, 0);
+    TEST_ASSERT_EQUAL_HEX8(0x03, can_limit_active());
+    TEST_ASSERT_EQUAL_UINT16(5, pass_count(0x110u, 1000000u, 0, 5));
+}
+
+static void test_set_rejects(void)
+{
+    const can_limit_rule_t no_burst = {.id = 0x100u, .mask = CAN_STD_MASK, .rate = 10, .burst = 0};
+    can_limit_rule_t rule;
+
+    TEST_ASSERT_FALSE(can_limit_set(CAN_LIMIT_MAX, &no_burst));
+    TEST_ASSERT_FALSE(can_limit_set(0, &no_burst));
+    TEST_ASSERT_EQUAL_HEX8(0, can_limit_active());
+    can_limit_get(CAN_LIMIT_MAX, &rule);
+    TEST_ASSERT_EQUAL_UINT16(0, rule.rate);
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_burst_then_rate);
+    RUN_TEST(test_refill_capped_at_burst);
+    RUN_TEST(test_refill_across_wrap);
+    RUN_TEST(test_decimate);
+    RUN_TEST(test_matching);
+    RUN_TEST(test_set_rejects);
+    return UNITY_END();
+}
@@ -0,0 +1,238 @@
+/*
+ * test_slcan.c
+ *
+ *  SLCAN frame codec: encode_message() writes what the Lawicel protocol
+ *  and the Linux slcan driver expect, decode_message() takes it back and
+ *  refuses lines with a non hex digit, an identifier out of range, a DLC
+ *  over 8 or too few characters, in any field.
+ *
+ *  Run with:  pio test -e test
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unity.h>
+#include "slcan.h"
+
+#define LINE_MAX 32u
+
+extern uint8_t stub_usb_tx_last[64];
+extern uint8_t stub_usb_tx_size;
+
+static slcan_message_t message;
+
+void setUp(void)
+{
+    memset(&message, 0xEE, sizeof(message));
+}
+
+void tearDown(void)
+{
+}
+
+static bool decode(const char *line)
+{
+    return decode_message(&message, (const uint8_t *)line, (uint8_t)strlen(line));
+}
+
+static void assert_encodes(const slcan_message_t *in, const char *expected)
+{
+    uint8_t line[LINE_MAX];
+    uint8_t size = 0;
+
+    TEST_ASSERT_TRUE(encode_message(in, line, &size));
+    TEST_ASSERT_EQUAL_UINT8(strlen(expected), size);
+    TEST_ASSERT_EQUAL_STRING_LEN(expected, line, size);
+}
+
+static void test_encode(void)
+{
+    const slcan_message_t std = {.can_id = 0x123u, .can_dlc = 2, .data = {0xAB, 0xCD}};
+    const slcan_message_t xtd = {.can_id = CAN_XTD_FRAME | 0x1FFFFFFFu, .can_dlc = 8,
+                                 .data = {0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77}};
+    const slcan_message_t rtr = {.can_id = CAN_RTR_FRAME | 0x7FFu, .can_dlc = 4, .data = {0x11}};
+    const slcan_message_t xtd_rtr = {.can_id = CAN_XTD_FRAME | CAN_RTR_FRAME | 0x00000001u, .can_dlc = 0};
+
+    assert_encodes(&std, "t1232ABCD\r");
+    assert_encodes(&xtd, "T1FFFFFFF80011223344556677\r");
+    assert_encodes(&rtr, "r7FF4\r");
+    assert_encodes(&xtd_rtr, "R000000010\r");
+}
+
+/* a DLC over 8 is sent as 8 with 8 bytes */
+static void test_encode_dlc_clamped(void)
+{
+    const slcan_message_t over = {.can_id = 0x001u, .can_dlc = 15, .data = {1, 2, 3, 4, 5, 6, 7, 8}};
+
+    assert_encodes(&over, "t00180102030405060708\r");
+}
+
+/* every kind of frame and DLC comes back as it was encoded */
+static void test_round_trip(void)
+{
+    const uint32_t ids[] = {0x000u, 0x7FFu, CAN_RTR_FRAME | 0x555u, CAN_XTD_FRAME | 0x00000000u,
+                            CAN_XTD_FRAME | 0x1FFFFFFFu, CAN_XTD_FRAME | CAN_RTR_FRAME | 0x0ABCDEF1u};
+
+    for (uint8_t i = 0; i < sizeof(ids) / sizeof(ids[0]); i++)
+    {
+        for (uint8_t dlc = 0; dlc <= CAN_DLC_MAX; dlc++)
+        {
+            slcan_message_t in = {.can_id = ids[i], .can_dlc = dlc,
+                                  .data = {0x00, 0xFF, 0x5A, 0xA5, 0x01, 0x10, 0x7E, 0xE7}};
+            uint8_t line[LINE_MAX];
+            uint8_t size = 0;
+
+            TEST_ASSERT_TRUE(encode_message(&in, line, &size));
+            TEST_ASSERT_TRUE(decode_message(&message, line, size));
+            TEST_ASSERT_EQUAL_HEX32(in.can_id, message.can_id);
+            TEST_ASSERT_EQUAL_UINT8(dlc, message.can_dlc);
+            if (!(in.can_id & CAN_RTR_FRAME))
+                TEST_ASSERT_EQUAL_MEMORY(in.data, message.data, dlc);
+        }
+    }
+}
+
+/* error frames go out as 'e', the class in three digits and always eight
+ * bytes of detail, and are read back the same */
+static void test_error_frame(void)
+{
+    const slcan_message_t err = {.can_id = CAN_ERR_FRAME | CAN_ERR_PROT | CAN_ERR_CNT, .can_dlc = 8,
+                                 .data = {0x00, 0x04, 0x08, 0x00, 0x00, 0x00, 0x7F, 0x80}};
+    uint8_t line[LINE_MAX];
+    uint8_t size = 0;
+
+    TEST_ASSERT_TRUE(encode_message(&err, line, &size));
+    TEST_ASSERT_EQUAL_CHAR('e', line[0]);
+    TEST_ASSERT_EQUAL_CHAR('8', line[4]);
+    TEST_ASSERT_EQUAL_UINT8(1u + 3u + 1u + 16u + 1u, size);
+    TEST_ASSERT_TRUE(decode_message(&message, line, size));
+    TEST_ASSERT_EQUAL_HEX32(err.can_id, message.can_id);
+    TEST_ASSERT_EQUAL_UINT8(8, message.can_dlc);
+    TEST_ASSERT_EQUAL_MEMORY(err.data, message.data, 8);
+
+    TEST_ASSERT_TRUE(decode("e0048000400000000007F\r"));
+    TEST_ASSERT_EQUAL_HEX32(CAN_ERR_FRAME | CAN_ERR_CRTL, message.can_id);
+    TEST_ASSERT_FALSE(decode("e80080000000000000000\r"));
+    TEST_ASSERT_FALSE(decode("e004\r"));
+}
+
+/* upper and lower case digits, and a time stamp after the payload */
+static void test_decode_accepts(void)
+{
+    TEST_ASSERT_TRUE(decode("t7ff2aBcD\r"));
+    TEST_ASSERT_EQUAL_HEX32(0x7FFu, message.can_id);
+    TEST_ASSERT_EQUAL_HEX8(0xAB, message.data[0]);
+    TEST_ASSERT_EQUAL_HEX8(0xCD, message.data[1]);
+
+    TEST_ASSERT_TRUE(decode("t1231AA1234\r"));
+    TEST_ASSERT_EQUAL_UINT8(1, message.can_dlc);
+
+    TEST_ASSERT_TRUE(decode("r1238\r"));
+    TEST_ASSERT_EQUAL_HEX32(CAN_RTR_FRAME | 0x123u, message.can_id);
+    TEST_ASSERT_EQUAL_UINT8(8, message.can_dlc);
+}
+
+/* a non hex digit in the identifier, the DLC or the payload, among them
+ * the bytes hexDecode maps to 0xFF at both ends of the table */
+static void test_decode_invalid_digit(void)
+{
+    TEST_ASSERT_FALSE(decode("t12G0\r"));
+    TEST_ASSERT_FALSE(decode("t\xFF" "230\r"));
+    TEST_ASSERT_FALSE(decode_message(&message, (const uint8_t *)"t12\x00" "0\r", 6));
+    TEST_ASSERT_FALSE(decode("T1234567 0\r"));
+    TEST_ASSERT_FALSE(decode("T\xFF" "12345670\r"));
+    TEST_ASSERT_FALSE(decode("t123g\r"));
+    TEST_ASSERT_FALSE(decode("t1232AB:D\r"));
+    TEST_ASSERT_FALSE(decode("t1232AB\xFF" "D\r"));
+    TEST_ASSERT_FALSE(decode("T123456782\xFF" "BCD\r"));
+}
+
+/* the first digit of an 11-bit identifier may be 0..7, a 29-bit one 0..1 */
+static void test_decode_id_range(void)
+{
+    TEST_ASSERT_TRUE(decode("t7FF0\r"));
+    TEST_ASSERT_FALSE(decode("t8000\r"));
+    TEST_ASSERT_FALSE(decode("tFFF0\r"));
+    TEST_ASSERT_FALSE(decode("r8000\r"));
+    TEST_ASSERT_TRUE(decode("T1FFFFFFF0\r"));
+    TEST_ASSERT_EQUAL_HEX32(CAN_XTD_FRAME | 0x1FFFFFFFu, message.can_id);
+    TEST_ASSERT_FALSE(decode("T200000000\r"));
+    TEST_ASSERT_FALSE(decode("TFFFFFFFF0\r"));
+    TEST_ASSERT_FALSE(decode("R200000000\r"));
+}
+
+static void test_decode_dlc_range(void)
+{
+    TEST_ASSERT_TRUE(decode("t12380011223344556677\r"));
+    TEST_ASSERT_FALSE(decode("t1239001122334455667788\r"));
+    TEST_ASSERT_FALSE(decode("t123F001122334455667788\r"));
+    TEST_ASSERT_FALSE(decode("r1239\r"));
+    TEST_ASSERT_FALSE(decode("T1234567890011223344556677\r"));
+}
+
+/* the line has to hold the identifier, the DLC, the payload and the CR */
+static void test_decode_short_line(void)
+{
+    TEST_ASSERT_FALSE(decode(""));
+    TEST_ASSERT_FALSE(decode("t"));
+    TEST_ASSERT_FALSE(decode("t12"));
+    TEST_ASSERT_FALSE(decode("t123\r"));
+    TEST_ASSERT_FALSE(decode("t1230"));
+    TEST_ASSERT_FALSE(decode("t1232AB\r"));
+    TEST_ASSERT_FALSE(decode("t1232ABC\r"));
+    TEST_ASSERT_FALSE(decode("t1232ABCD"));
+    TEST_ASSERT_TRUE(decode("t1232ABCD\r"));
+    TEST_ASSERT_FALSE(decode("T1234567\r"));
+    TEST_ASSERT_FALSE(decode("T123456780"));
+    TEST_ASSERT_FALSE(decode("R123456781"));
+    TEST_ASSERT_TRUE(decode("R123456781\r"));
+}
+
+static void test_decode_unknown_command(void)
+{
+    TEST_ASSERT_FALSE(decode("x1230\r"));
+    TEST_ASSERT_FALSE(decode("E1230\r"));
+}
+
+static void assert_sent(const char *expected)
+{
+    TEST_ASSERT_EQUAL_UINT8(strlen(expected), stub_usb_tx_size);
+    TEST_ASSERT_EQUAL_STRING_LEN(expected, stub_usb_tx_last, stub_usb_tx_size);
+}
+
+/* the Z1 millisecond stamp runs on across the wrap of the 32-bit microsecond
+ * clock (4294967.296 ms, 34967 modulo 60000), also for a frame stamped just
+ * before the wrap but encoded after it */
+static void test_timestamp_ms_across_wrap(void)
+{
+    const uint8_t data[1] = {0};
+
+    slcan_receive((const uint8_t *)"Z1\r", 3);
+    slcan_clock(0u);
+    slcan_clock(0xFFFFFC18u);
+    TEST_ASSERT_TRUE(slcan_encode(0x123u, 0, data, 0xFFFFFF00u));
+    assert_sent("t12308897\r");
+    slcan_clock(0x00000100u);
+    TEST_ASSERT_TRUE(slcan_encode(0x123u, 0, data, 0xFFFFFF80u));
+    assert_sent("t12308897\r");
+    TEST_ASSERT_TRUE(slcan_encode(0x123u, 0, data, 0x000004B0u));
+    assert_sent("t12308898\r");
+    slcan_receive((const uint8_t *)"Z0\r", 3);
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_encode);
+    RUN_TEST(test_encode_dlc_clamped);
+    RUN_TEST(test_round_trip);
+    RUN_TEST(test_error_frame);
+    RUN_TEST(test_decode_accepts);
+    RUN_TEST(test_decode_invalid_digit);
+    RUN_TEST(test_decode_id_range);
+    RUN_TEST(test_decode_dlc_range);
+    RUN_TEST(test_decode_short_line);
+    RUN_TEST(test_decode_unknown_command);
+    RUN_TEST(test_timestamp_ms_across_wrap);
+    return UNITY_END();
+}